@@ -0,0 +1,71 @@
+/* Copyright 2023 Google LLC
+ *
+ * Use of this source code is governed by a BSD-style
+ * license that can be found in the LICENSE file or at
+ * https://developers.google.com/open-source/licenses/bsd */
+
+/* The twrite benchmark of ./build bench for the Javascript engine, run with
+ * node after cpp -P. Each stream file named on the command line is written to
+ * the engine like the C benchmark in session.c does it, and the results are
+ * printed in the same format. */
+
+#include "tm.js"
+#include "third_party/st/tmeng"
+
+#define BENCHCHUNK 4096
+#define BENCHMINNS 300000000
+
+/* The engine calls these, but only the browser draws or has a clipboard. */
+function Xsetcolor(trm, pi, rgb)		{}
+function Xicontitl(deq, off)			{}
+function Xsettitle(deq, off)			{}
+function Xbell(trm)				{}
+function Xsetpointermotion(set)			{}
+function Xosc52copy(trm, deq, byti)		{}
+function Xprint(deq)				{}
+function Ttywriteraw(trm, dq, of, sz)		{}
+function Now(ms) { fld(ms,0) = 0; fld(ms,1) = 0; }
+
+function benchstream(stream, s)
+{
+	var dqs = [], of, chn, ci, t, byts, ns, st;
+
+	for (of = 0; of < s.length; of += chn) {
+		chn = Math.min(BENCHCHUNK, s.length - of);
+		while (chn > BENCHCHUNK / 2 && of + chn < s.length
+		       && 0x80 == (s[of + chn] & 0xc0))
+			chn--;
+
+		dqs.push(deqmk());
+		for (ci = 0; ci < chn; ci++)
+			dqs[dqs.length-1] = deqpushbyt(dqs[dqs.length-1],
+						       s[of + ci]);
+	}
+
+	for (ns = byts = 0; ns < BENCHMINNS; byts += s.length) {
+		t = term_new();
+		tnew(t, 80, 25);
+		term(t,sbbuf) = deqmk();
+
+		st = performance.now();
+		for (ci = 0; ci < dqs.length; ci++) {
+			twrite(t, dqs[ci], -1, 0);
+			deqclear(term(t,sbbuf));
+		}
+		ns += (performance.now() - st) * 1e6;
+
+		term_fre(t);
+		tmfree(t);
+	}
+
+	console.log(`js.twrite.${stream} ${byts} ${(ns / byts).toFixed(3)} ` +
+		    (byts * 1e3 / ns).toFixed(1));
+
+	dqs.forEach(tmfree);
+}
+
+process.argv.slice(2).forEach(function(pth)
+{
+	benchstream(require('path').basename(pth),
+		    new Uint8Array(require('fs').readFileSync(pth)));
+});
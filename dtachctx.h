@@ -10,9 +10,11 @@
 #include "outstreams.h"
 #include "third_party/dtach/dtach.h"
 #include <unistd.h>
+#include <time.h>
 
 struct client;
 struct subproc_args;
+struct termglobs;
 
 typedef struct dtach_ctx {
 	struct client *cls;
@@ -21,6 +23,29 @@ typedef struct dtach_ctx {
 
 	struct pty the_pty;
 
+	/* Generation of the terminal state the client holds, so the master can
+	   send only what changed, or 0 if the client has none. */
+	unsigned stgen;
+
+	/* Maximum updates per second to request damage mode, or 0. */
+	unsigned dmgfps;
+
+	/* If set, the \W escape with the settings of the websocket on stdin,
+	   and the attaching process hands the websocket to the master rather
+	   than relaying its data. */
+	char *wshandoff;
+
+	/* If set, the socket of a master serving many terminals, which a new
+	   master hands its terminal to rather than serving it itself, and the
+	   query string of settings for the terminal. See termnew. */
+	char *hostpath, *hostflags;
+
+	/* Globals of the terminal while another terminal's are in use, or 0 */
+	struct termglobs *tg;
+
+	/* When the subproc last wrote to the terminal */
+	time_t lastact;
+
 	/* Indicates a client has attached at some point. */
 	unsigned firstatch	: 1;
 
@@ -35,4 +60,9 @@ typedef struct dtach_ctx {
    array. */
 void print_atch_clis(Dtachctx dc, struct fdbuf *b);
 
+/* Like print_atch_clis, but each client is an object with its endpoint ID
+   (endpnt), how many bytes have been written to it (wrote), and how many are
+   waiting to be (queued). */
+void print_cli_stats(Dtachctx dc, struct fdbuf *b);
+
 #endif
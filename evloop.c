@@ -0,0 +1,281 @@
+/* Copyright 2023 Google LLC
+ *
+ * Use of this source code is governed by a BSD-style
+ * license that can be found in the LICENSE file or at
+ * https://developers.google.com/open-source/licenses/bsd */
+
+#include "evloop.h"
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#if defined(__linux__)
+#define EVL_EPOLL 1
+#include <sys/epoll.h>
+#elif defined(__APPLE__) || defined(__FreeBSD__) || defined(__OpenBSD__) \
+   || defined(__NetBSD__) || defined(__DragonFly__)
+#define EVL_KQUEUE 1
+#include <sys/event.h>
+#include <time.h>
+#else
+#include <poll.h>
+#endif
+
+/* Self-pipe written to by the SIGCHLD handler. This is global since a signal
+   handler cannot be given any context. Its address is also used as the dat of
+   the read end. */
+static int chldpipe[2] = {-1, -1};
+
+struct evloop {
+#if EVL_EPOLL || EVL_KQUEUE
+	int fd;
+#else
+	struct pollfd *pfd;
+	void **pdat;
+	unsigned pcnt, pcap;
+#endif
+
+	void *chlddat;
+	unsigned watchchld : 1;
+};
+
+static void onchld(int sig)
+{
+	int ern = errno;
+
+	write(chldpipe[1], "", 1);
+	errno = ern;
+}
+
+static void cloexecnonblock(int fd)
+{
+	if (0 > fcntl(fd, F_SETFD, FD_CLOEXEC)
+	||  0 > fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK))
+		err(1, "fcntl on self-pipe");
+}
+
+/* Translates the registered dat into the one to return to the caller. */
+static void *evdat(Evloop el, void *dat)
+{
+	char b[64];
+
+	if (dat != chldpipe) return dat;
+
+	while (0 < read(chldpipe[0], b, sizeof(b))) {}
+	return el->chlddat;
+}
+
+#if EVL_EPOLL
+
+Evloop evl_new(void)
+{
+	Evloop el = calloc(1, sizeof(*el));
+
+	el->fd = epoll_create1(EPOLL_CLOEXEC);
+	if (0 > el->fd) err(1, "epoll_create1");
+	return el;
+}
+
+void evl_want(Evloop el, int fd, int fl, void *dat)
+{
+	struct epoll_event ev = {0};
+
+	if (!fl) {
+		if (0 > epoll_ctl(el->fd, EPOLL_CTL_DEL, fd, 0)
+		    && errno != ENOENT)
+			err(1, "epoll_ctl del fd %d", fd);
+		return;
+	}
+
+	ev.events = (fl & EVL_R ? EPOLLIN : 0) | (fl & EVL_W ? EPOLLOUT : 0);
+	ev.data.ptr = dat;
+
+	if (!epoll_ctl(el->fd, EPOLL_CTL_MOD, fd, &ev)) return;
+	if (errno != ENOENT || 0 > epoll_ctl(el->fd, EPOLL_CTL_ADD, fd, &ev))
+		err(1, "epoll_ctl fd %d", fd);
+}
+
+int evl_wait(Evloop el, struct evlev *evs, int evcap, int timeoutms)
+{
+	struct epoll_event evb[64];
+	int n, i;
+
+	if (evcap > sizeof(evb) / sizeof(*evb))
+		evcap = sizeof(evb) / sizeof(*evb);
+
+	n = epoll_wait(el->fd, evb, evcap, timeoutms);
+
+	for (i = 0; i < n; i++) {
+		evs[i].dat = evdat(el, evb[i].data.ptr);
+		evs[i].fl = (evb[i].events & EPOLLOUT ? EVL_W : 0)
+			  | (evb[i].events & ~EPOLLOUT ? EVL_R : 0);
+	}
+
+	return n;
+}
+
+static void closebackend(Evloop el) { close(el->fd); }
+
+#elif EVL_KQUEUE
+
+Evloop evl_new(void)
+{
+	Evloop el = calloc(1, sizeof(*el));
+
+	el->fd = kqueue();
+	if (0 > el->fd) err(1, "kqueue");
+	if (0 > fcntl(el->fd, F_SETFD, FD_CLOEXEC)) err(1, "fcntl kqueue");
+	return el;
+}
+
+static void kqchange(Evloop el, int fd, int filt, int on, void *dat)
+{
+	struct kevent kc;
+
+	EV_SET(&kc, fd, filt, on ? EV_ADD | EV_ENABLE : EV_DELETE, 0, 0, dat);
+	if (0 > kevent(el->fd, &kc, 1, 0, 0, 0) && (on || errno != ENOENT))
+		err(1, "kevent fd %d", fd);
+}
+
+void evl_want(Evloop el, int fd, int fl, void *dat)
+{
+	kqchange(el, fd, EVFILT_READ,	fl & EVL_R, dat);
+	kqchange(el, fd, EVFILT_WRITE,	fl & EVL_W, dat);
+}
+
+int evl_wait(Evloop el, struct evlev *evs, int evcap, int timeoutms)
+{
+	struct kevent evb[64];
+	struct timespec ts, *tsp = 0;
+	int n, i, j, cnt;
+
+	if (evcap > sizeof(evb) / sizeof(*evb))
+		evcap = sizeof(evb) / sizeof(*evb);
+	if (timeoutms >= 0) {
+		ts.tv_sec = timeoutms / 1000;
+		ts.tv_nsec = timeoutms % 1000 * 1000000L;
+		tsp = &ts;
+	}
+
+	n = kevent(el->fd, 0, 0, evb, evcap, tsp);
+
+	/* Read and write readiness of an fd arrive as separate events. Merge
+	   them so the caller sees each dat once. */
+	for (i = cnt = 0; i < n; i++) {
+		for (j = 0; j < cnt; j++)
+			if (evs[j].dat == evb[i].udata) break;
+		if (j == cnt) {
+			evs[cnt].dat = evb[i].udata;
+			evs[cnt++].fl = 0;
+		}
+		evs[j].fl |= evb[i].filter == EVFILT_WRITE ? EVL_W : EVL_R;
+	}
+	for (j = 0; j < cnt; j++) evs[j].dat = evdat(el, evs[j].dat);
+
+	return n < 0 ? n : cnt;
+}
+
+static void closebackend(Evloop el) { close(el->fd); }
+
+#else
+
+Evloop evl_new(void) { return calloc(1, sizeof(struct evloop)); }
+
+void evl_want(Evloop el, int fd, int fl, void *dat)
+{
+	unsigned i;
+
+	for (i = 0; i < el->pcnt; i++)
+		if (el->pfd[i].fd == fd) break;
+
+	if (!fl) {
+		if (i == el->pcnt) return;
+		el->pcnt--;
+		el->pfd[i] = el->pfd[el->pcnt];
+		el->pdat[i] = el->pdat[el->pcnt];
+		return;
+	}
+
+	if (i == el->pcnt) {
+		if (el->pcnt == el->pcap) {
+			el->pcap = el->pcap ? el->pcap * 2 : 16;
+			el->pfd = realloc(el->pfd, el->pcap * sizeof(*el->pfd));
+			el->pdat = realloc(el->pdat,
+					   el->pcap * sizeof(*el->pdat));
+		}
+		el->pcnt++;
+	}
+
+	el->pfd[i].fd = fd;
+	el->pfd[i].events = (fl & EVL_R ? POLLIN : 0)
+			  | (fl & EVL_W ? POLLOUT : 0);
+	el->pdat[i] = dat;
+}
+
+int evl_wait(Evloop el, struct evlev *evs, int evcap, int timeoutms)
+{
+	unsigned i;
+	int n, cnt;
+
+	n = poll(el->pfd, el->pcnt, timeoutms);
+	if (n <= 0) return n;
+
+	for (i = cnt = 0; i < el->pcnt && cnt < evcap; i++) {
+		if (!el->pfd[i].revents) continue;
+
+		evs[cnt].dat = evdat(el, el->pdat[i]);
+		evs[cnt++].fl = (el->pfd[i].revents & POLLOUT ? EVL_W : 0)
+			      | (el->pfd[i].revents & ~POLLOUT ? EVL_R : 0);
+	}
+
+	return cnt;
+}
+
+static void closebackend(Evloop el)
+{
+	free(el->pfd);
+	free(el->pdat);
+}
+
+#endif
+
+void evl_watchchld(Evloop el, void *dat)
+{
+	struct sigaction sa = {0};
+
+	if (chldpipe[0] < 0) {
+		if (0 > pipe(chldpipe)) err(1, "pipe for SIGCHLD");
+		cloexecnonblock(chldpipe[0]);
+		cloexecnonblock(chldpipe[1]);
+	}
+
+	el->chlddat = dat;
+	el->watchchld = 1;
+	evl_want(el, chldpipe[0], EVL_R, chldpipe);
+
+	sa.sa_handler = onchld;
+	sa.sa_flags = SA_RESTART | SA_NOCLDSTOP;
+	sigemptyset(&sa.sa_mask);
+	if (0 > sigaction(SIGCHLD, &sa, 0)) err(1, "sigaction SIGCHLD");
+
+	onchld(SIGCHLD);
+}
+
+void evl_fre(Evloop el)
+{
+	if (!el) return;
+
+	if (el->watchchld) {
+		signal(SIGCHLD, SIG_DFL);
+		close(chldpipe[0]);
+		close(chldpipe[1]);
+		chldpipe[0] = chldpipe[1] = -1;
+	}
+
+	closebackend(el);
+	free(el);
+}
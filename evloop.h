@@ -0,0 +1,49 @@
+/* Copyright 2023 Google LLC
+ *
+ * Use of this source code is governed by a BSD-style
+ * license that can be found in the LICENSE file or at
+ * https://developers.google.com/open-source/licenses/bsd */
+
+#ifndef EVLOOP_H
+#define EVLOOP_H
+
+/* Waits for readiness on a set of file descriptors. Uses epoll on Linux, kqueue
+ * on the BSDs and macOS, and poll(2) elsewhere. Interest is registered
+ * incrementally, so the cost of waiting does not depend on how many fds are
+ * idle. */
+typedef struct evloop *Evloop;
+
+/* Flags for evl_want and evlev.fl */
+#define EVL_R 1
+#define EVL_W 2
+
+/* A ready fd as reported by evl_wait. fl is a combination of EVL_R and EVL_W.
+ * Hang-ups and errors are reported as EVL_R so the owner sees them on read. */
+struct evlev {
+	void *dat;
+	int fl;
+};
+
+Evloop evl_new(void);
+
+/* Closes the kernel resources of el and frees it. If evl_watchchld was called,
+ * resets the SIGCHLD disposition to the default. Useful in a forked child which
+ * should not share the loop of its parent. */
+void evl_fre(Evloop el);
+
+/* Sets the events to wait for on fd. dat is returned by evl_wait when fd is
+ * ready. fl of 0 removes fd from el, which must be done before closing fd. */
+void evl_want(Evloop el, int fd, int fl, void *dat);
+
+/* Installs a SIGCHLD handler which makes evl_wait report an EVL_R event with
+ * the given dat when a child process changes state. The caller should then
+ * reap children with waitpid and WNOHANG. An event is reported on the first
+ * wait in case a child exited before this was called. */
+void evl_watchchld(Evloop el, void *dat);
+
+/* Waits up to timeoutms milliseconds, or indefinitely if it is -1, for events.
+ * Stores at most evcap of them in evs, with at most one entry for each fd.
+ * Returns the number of events stored, or -1 with errno set. */
+int evl_wait(Evloop el, struct evlev *evs, int evcap, int timeoutms);
+
+#endif
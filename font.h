@@ -4,7 +4,20 @@
  * license that can be found in the LICENSE file or at
  * https://developers.google.com/open-source/licenses/bsd */
 
-#include "outstreams.h"
+#include <stddef.h>
 
 int fontcnt(void);
-void servefnt(struct wrides *de, int fi);
+
+/* Returns the data of the font at index fi, which is *sz bytes long. */
+const char *fontdat(int fi, size_t *sz);
+
+/* The pixels of the glyphs of a font with code points pgno << 8 through
+   pgno << 8 | 0xff, as described in procfnt in ./build. */
+struct fontpg {
+	int pgno;
+	const char *dat;
+	size_t sz;
+};
+
+/* Returns the pages of the font at index fi, and sets *cnt to their count. */
+const struct fontpg *fontpgs(int fi, int *cnt);
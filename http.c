@@ -9,10 +9,17 @@
 #include "shared.h"
 
 #include <sys/stat.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <stdio.h>
+#include <time.h>
+#include <zlib.h>
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
 #include <openssl/pem.h>
 #include <openssl/sha.h>
 #include <openssl/evp.h>
@@ -49,7 +56,10 @@ static int consumereqln(const char *pref)
 
 	while (isws(*reqcr)) { reqcr++; llen--; }
 
-	if (strcmp("connection:", pref) && strcmp("upgrade:", pref)) return 1;
+	if (	strcmp("connection:", pref)
+	    &&	strcmp("upgrade:", pref)
+	    &&	strcmp("sec-websocket-extensions:", pref)
+	    &&	strcmp("accept-encoding:", pref)) return 1;
 
 	for (hdrc = reqcr; *hdrc; hdrc++) lcase(hdrc);
 
@@ -67,12 +77,68 @@ static int hastok(const char *tk)
 		if (!*c) return 0;
 		if (!strncmp(c, tk, tkl)) {
 			after = c[tkl];
-			if (after == ',' || after == ' ' || !after) return 1;
+			if (after == ',' || after == ' ' || after == ';' || !after)
+				return 1;
 		}
 		c++;
 	}
 }
 
+static char *trimws(char *s)
+{
+	char *e;
+
+	while (isws(*s)) s++;
+	for (e = s + strlen(s); e != s && isws(e[-1]); e--) {}
+	*e = 0;
+
+	return s;
+}
+
+/* Picks the first permessage-deflate offer in a sec-websocket-extensions
+   header whose parameters we can honor. */
+static void negdeflate(Httpreq *rq)
+{
+	char *offr, *offsav, *prm, *prmsav;
+	int bits, reset, ok, n;
+
+	if (!rq->wsdeflok || rq->wsdeflbits) return;
+
+	for (	offr = strtok_r(reqcr, ",", &offsav);
+		offr;
+		offr = strtok_r(0, ",", &offsav)) {
+
+		prm = strtok_r(offr, ";", &prmsav);
+		if (!prm || strcmp(trimws(prm), "permessage-deflate")) continue;
+
+		bits = 15;
+		reset = 0;
+		ok = 1;
+		while ((prm = strtok_r(0, ";", &prmsav))) {
+			prm = trimws(prm);
+			n = -1;
+			sscanf(prm, "server_max_window_bits=%d%n", &bits, &n);
+
+			/* zlib does not support 8-bit windows for raw
+			   deflate, so decline in that case. */
+			if (n == strlen(prm))
+				ok &= bits >= 9 && bits <= 15;
+			else if (!strcmp(prm, "server_no_context_takeover"))
+				reset = 1;
+			/* These only restrict the client, so there is nothing
+			   for us to do. */
+			else if (strcmp(prm, "client_no_context_takeover") &&
+				 strncmp(prm, "client_max_window_bits", 22))
+				ok = 0;
+		}
+		if (!ok) continue;
+
+		rq->wsdeflbits = bits;
+		rq->wsdeflreset = reset;
+		return;
+	}
+}
+
 #define CHALLKEYLEN 16
 #define SHA1SZ 20
 
@@ -162,6 +228,10 @@ void http_read_req(FILE *src, Httpreq *rq, struct wrides *respout)
 	int connectionupgr = 0, goodwsver = 0, upgradews = 0, wsconds = -1;
 	struct fdbuf respbuf = {0};
 
+	/* A worker reads more than one request, so do not use the key of an
+	   earlier one. */
+	*acceptkey = 0;
+
 	if (!readreqln(src)) goto badreq;
 
 	if (	consumereqln("PUT ")
@@ -223,6 +293,24 @@ void http_read_req(FILE *src, Httpreq *rq, struct wrides *respout)
 			if (!procwskeyhdr(reqcr, respout)) goto seterr;
 			continue;
 		}
+		if (consumereqln("sec-websocket-extensions:")) {
+			negdeflate(rq);
+			continue;
+		}
+		if (consumereqln("accept-encoding:")) {
+			if (hastok("gzip")) rq->acceptgz = 1;
+			continue;
+		}
+		if (consumereqln("if-none-match:")) {
+			strncpy(rq->ifnonematch, reqcr,
+				sizeof(rq->ifnonematch) - 1);
+			continue;
+		}
+		if (consumereqln("if-modified-since:")) {
+			strncpy(rq->ifmodsince, reqcr,
+				sizeof(rq->ifmodsince) - 1);
+			continue;
+		}
 	}
 
 	wsconds = (upgradews		? 1 : 0)
@@ -241,6 +329,16 @@ void http_read_req(FILE *src, Httpreq *rq, struct wrides *respout)
 				"Sec-WebSocket-Accept: ", -1);
 
 	fdb_apnd(&respbuf, acceptkey, -1);
+	if (rq->wsdeflbits) {
+		fdb_apnd(&respbuf, "\r\nSec-WebSocket-Extensions: "
+				   "permessage-deflate", -1);
+		if (rq->wsdeflreset)
+			fdb_apnd(&respbuf, "; server_no_context_takeover", -1);
+		if (rq->wsdeflbits != 15) {
+			fdb_apnd(&respbuf, "; server_max_window_bits=", -1);
+			fdb_itoa(&respbuf, rq->wsdeflbits);
+		}
+	}
 	fdb_apnd(&respbuf, "\r\n\r\n", -1);
 	full_write(respout, respbuf.bf, respbuf.len);
 	goto cleanup;
@@ -282,7 +380,16 @@ static void resettmpfile(FILE **f)
 	*f = tmpfile();
 }
 
-static void resphdr(struct wrides *de, int code, char hdr, size_t contlength)
+/* Pass as the length to resphdrx for a chunked body */
+#define CHUNKED ((size_t) -1)
+
+/* Size of the chunks of a chunked body, other than the last */
+#define CHUNKSZ (16 * 1024)
+
+/* Writes the response header. xhdrs, if not null, are more header lines to
+   send, each ending in \r\n. */
+static void resphdrx(struct wrides *de, int code, char hdr, size_t contlength,
+		     const char *xhdrs)
 {
 	struct fdbuf b = {de, 512};
 	const char *codest, *contype;
@@ -291,11 +398,14 @@ static void resphdr(struct wrides *de, int code, char hdr, size_t contlength)
 	switch (code) {
 	default: abort();
 		case 200: xfdeny=1; codest="200 OK";
+	break;	case 304: xfdeny=0; codest="304 Not Modified";
 	break;	case 400: xfdeny=0; codest="400 Bad Request";
 	break;	case 403: xfdeny=0; codest="403 Forbidden";
 	break;	case 404: xfdeny=0; codest="404 Not Found";
 	break;	case 405: xfdeny=0; codest="405 Method Not Allowed";
 	break;	case 500: xfdeny=0; codest="500 Internal Server Error";
+	break;	case 502: xfdeny=0; codest="502 Bad Gateway";
+	break;	case 504: xfdeny=0; codest="504 Gateway Timeout";
 	}
 
 	switch (hdr) {
@@ -305,6 +415,7 @@ static void resphdr(struct wrides *de, int code, char hdr, size_t contlength)
 	break;	case 'c': utf8=1; contype="text/css";
 	break;	case 'j': utf8=1; contype="application/javascript";
 	break;	case 'f': utf8=0; contype="application/x-wermfont";
+	break;	case 'w': utf8=0; contype="application/wasm";
 	}
 
 	fdb_apnd(&b, "HTTP/1.1 ", -1);
@@ -317,40 +428,374 @@ static void resphdr(struct wrides *de, int code, char hdr, size_t contlength)
 	fdb_apnd(&b, contype, -1);
 	if (utf8) fdb_apnd(&b, "; charset=utf-8", -1);
 	fdb_apnd(&b, "\r\n", -1);
-	fdb_apnd(&b, "Content-Length: ", -1);
-	fdb_itoa(&b, contlength);
-	fdb_apnd(&b, "\r\n\r\n", -1);
+	if (xhdrs) fdb_apnd(&b, xhdrs, -1);
+
+	/* A 304 describes the body the client already has, so leave out the
+	   length rather than say it is empty. */
+	if (contlength == CHUNKED)
+		fdb_apnd(&b, "Transfer-Encoding: chunked\r\n", -1);
+	else if (code != 304) {
+		fdb_apnd(&b, "Content-Length: ", -1);
+		fdb_itoa(&b, contlength);
+		fdb_apnd(&b, "\r\n", -1);
+	}
+	fdb_apnd(&b, "\r\n", -1);
 
 	fdb_finsh(&b);
 }
 
-void resp_static(struct wrides *de, char hdr, const char *path)
+static void resphdr(struct wrides *de, int code, char hdr, size_t contlength)
+{
+	resphdrx(de, code, hdr, contlength, 0);
+}
+
+/* Bodies at least this large are not kept in memory by resp_static, but sent
+   straight from the file. */
+#define ASSETMAX (1 << 20)
+
+/* Bodies smaller than this are not worth gzipping. */
+#define GZIPMIN 256
+
+/* Responses kept by resp_cached and resp_static. */
+static struct asset {
+	char *key, hdr;
+
+	/* Identity of the file the body was made from, if hassrc */
+	dev_t dev;
+	ino_t ino;
+	off_t srcsz;
+	struct timespec mtim;
+	unsigned hassrc : 1;
+
+	/* gz is the gzipped body, or null if it has not been made yet or
+	   would not be smaller. */
+	unsigned gztried : 1;
+	unsigned char *b, *gz;
+	size_t sz, gzsz;
+
+	/* Header value of the ETag without the quotes, and of the
+	   Last-Modified time if hassrc */
+	char etag[17], lastmod[32];
+
+	struct asset *next;
+} *assets;
+
+static int samesrc(const struct asset *a, const struct stat *src)
+{
+	if (!src) return !a->hassrc;
+
+	return	a->hassrc
+	&&	a->dev == src->st_dev
+	&&	a->ino == src->st_ino
+	&&	a->srcsz == src->st_size
+	&&	a->mtim.tv_sec == src->st_mtim.tv_sec
+	&&	a->mtim.tv_nsec == src->st_mtim.tv_nsec;
+}
+
+static struct asset *findasset(const char *key)
+{
+	struct asset *a;
+
+	for (a = assets; a; a = a->next) if (!strcmp(a->key, key)) return a;
+	return 0;
+}
+
+/* FNV-1a, which is enough to tell versions of the same asset apart. */
+static void mketag(char *etag, const void *b_, size_t sz, const char *salt)
+{
+	const unsigned char *b = b_;
+	unsigned long long h = 0xcbf29ce484222325ULL;
+
+	while (sz--) h = (h ^ *b++) * 0x100000001b3ULL;
+	while (*salt) h = (h ^ (unsigned char) *salt++) * 0x100000001b3ULL;
+	sprintf(etag, "%016llx", h);
+}
+
+void resp_etag(char *etag, const void *b, size_t sz) { mketag(etag, b, sz, ""); }
+
+static void mklastmod(char *lm, size_t lmsz, time_t t)
+{
+	struct tm tm;
+
+	if (!gmtime_r(&t, &tm)) { *lm = 0; return; }
+	strftime(lm, lmsz, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+}
+
+static void gzipasset(struct asset *a)
+{
+	z_stream zs = {0};
+	uLong cap;
+
+	a->gztried = 1;
+	if (a->sz < GZIPMIN) return;
+	if (Z_OK != deflateInit2(&zs, Z_BEST_COMPRESSION, Z_DEFLATED, 31, 9,
+				 Z_DEFAULT_STRATEGY))
+		return;
+
+	cap = deflateBound(&zs, a->sz) + 32;
+	a->gz = malloc(cap);
+	zs.next_in = a->b;
+	zs.avail_in = a->sz;
+	zs.next_out = a->gz;
+	zs.avail_out = cap;
+
+	if (Z_STREAM_END != deflate(&zs, Z_FINISH) || zs.total_out >= a->sz) {
+		free(a->gz);
+		a->gz = 0;
+	}
+	else a->gzsz = zs.total_out;
+
+	deflateEnd(&zs);
+}
+
+/* Returns whether the If-None-Match value inm has etag with the suffix tagsuf,
+   comparing weakly, as is done for that header. An ETag cut off at the end of
+   a truncated value has no closing quote, so it does not match. */
+static int inmhas(const char *inm, const char *etag, const char *tagsuf)
+{
+	size_t el = strlen(etag), sl = strlen(tagsuf), tl;
+	const char *t;
+
+	for (;;) {
+		inm += strspn(inm, " \t,");
+		if (!*inm) return 0;
+		tl = strcspn(inm, " \t,");
+		t = inm;
+		inm += tl;
+
+		if (tl == 1 && *t == '*') return 1;
+		if (tl > 2 && !strncmp(t, "W/", 2)) { t += 2; tl -= 2; }
+
+		if (	tl == el + sl + 2
+		&&	t[0] == '"' && t[tl-1] == '"'
+		&&	!strncmp(t + 1, etag, el)
+		&&	!strncmp(t + 1 + el, tagsuf, sl))
+			return 1;
+	}
+}
+
+/* Appends the validator and cache headers of a response whose ETag is etag and
+   tagsuf, which tells apart the encodings of one body, and returns whether the
+   client already has it. */
+static int cachehdrs(struct fdbuf *h, const Httpreq *rq, const char *etag,
+		     const char *tagsuf, const char *lastmod)
+{
+	const char *q = rq->query;
+
+	fdb_apnd(h, "ETag: \"", -1);
+	fdb_apnd(h, etag, -1);
+	fdb_apnd(h, tagsuf, -1);
+	fdb_apnd(h, "\"\r\n", -1);
+	if (*lastmod) {
+		fdb_apnd(h, "Last-Modified: ", -1);
+		fdb_apnd(h, lastmod, -1);
+		fdb_apnd(h, "\r\n", -1);
+	}
+
+	if (!strncmp(q, "h=", 2) && !strcmp(q + 2, etag))
+		fdb_apnd(h, "Cache-Control: public, max-age=31536000, "
+			    "immutable\r\n", -1);
+	else
+		fdb_apnd(h, "Cache-Control: no-cache\r\n", -1);
+
+	if (*rq->ifnonematch) return inmhas(rq->ifnonematch, etag, tagsuf);
+
+	return *lastmod && !strcasecmp(rq->ifmodsince, lastmod);
+}
+
+static void respasset(struct wrides *de, const Httpreq *rq, struct asset *a)
+{
+	struct fdbuf h = {0};
+	const unsigned char *b = a->b;
+	size_t sz = a->sz;
+	int gz;
+
+	if (rq->acceptgz && !a->gztried) gzipasset(a);
+	gz = rq->acceptgz && a->gz;
+
+	fdb_apnd(&h, "Vary: Accept-Encoding\r\n", -1);
+	if (cachehdrs(&h, rq, a->etag, gz ? "-gz" : "", a->lastmod)) {
+		fdb_apnc(&h, 0);
+		resphdrx(de, 304, a->hdr, 0, (char *) h.bf);
+		fdb_finsh(&h);
+		return;
+	}
+
+	if (gz) {
+		fdb_apnd(&h, "Content-Encoding: gzip\r\n", -1);
+		b = a->gz;
+		sz = a->gzsz;
+	}
+	fdb_apnc(&h, 0);
+
+	resphdrx(de, 200, a->hdr, sz, (char *) h.bf);
+	if (!rq->head) full_write(de, b, sz);
+	fdb_finsh(&h);
+}
+
+void resp_cached(struct wrides *de, const Httpreq *rq, char hdr,
+		 const char *key, const struct stat *src, const void *b,
+		 size_t sz)
 {
-	int sfd, ern, redn;
-	char *fullp=0, buf[4096];
+	struct asset *a = findasset(key);
+
+	if (a) {
+		free(a->b);
+		free(a->gz);
+	}
+	else {
+		a = calloc(1, sizeof(*a));
+		a->key = strdup(key);
+		a->next = assets;
+		assets = a;
+	}
+
+	a->hdr = hdr;
+	a->b = malloc(sz ? sz : 1);
+	memcpy(a->b, b, sz);
+	a->sz = sz;
+	a->gz = 0;
+	a->gzsz = a->gztried = 0;
+	mketag(a->etag, b, sz, "");
+
+	a->hassrc = !!src;
+	*a->lastmod = 0;
+	if (src) {
+		a->dev = src->st_dev;
+		a->ino = src->st_ino;
+		a->srcsz = src->st_size;
+		a->mtim = src->st_mtim;
+		mklastmod(a->lastmod, sizeof(a->lastmod), src->st_mtime);
+	}
+
+	respasset(de, rq, a);
+}
+
+int resp_fromcache(struct wrides *de, const Httpreq *rq, const char *key,
+		   const struct stat *src)
+{
+	struct asset *a = findasset(key);
+
+	if (!a || !samesrc(a, src)) return 0;
+	respasset(de, rq, a);
+	return 1;
+}
+
+void resp_uncache(const char *key)
+{
+	struct asset **ap, *a;
+
+	for (ap = &assets; *ap; ap = &(*ap)->next) {
+		if (strcmp((*ap)->key, key)) continue;
+
+		a = *ap;
+		*ap = a->next;
+		free(a->key);
+		free(a->b);
+		free(a->gz);
+		free(a);
+		return;
+	}
+}
+
+/* Sends a file too large to keep in memory, using sendfile if possible. */
+static void respbig(struct wrides *de, const Httpreq *rq, char hdr, int sfd,
+		    const struct stat *sb)
+{
+	struct fdbuf h = {0};
+	char etag[17], lastmod[32], idt[64], buf[4096];
+	off_t at = 0;
+	ssize_t redn;
+
+	snprintf(idt, sizeof(idt), "%llx-%llx-%lld.%ld",
+		 (unsigned long long) sb->st_ino,
+		 (unsigned long long) sb->st_size,
+		 (long long) sb->st_mtim.tv_sec, (long) sb->st_mtim.tv_nsec);
+	mketag(etag, "", 0, idt);
+	mklastmod(lastmod, sizeof(lastmod), sb->st_mtime);
+
+	if (cachehdrs(&h, rq, etag, "", lastmod)) {
+		fdb_apnc(&h, 0);
+		resphdrx(de, 304, hdr, 0, (char *) h.bf);
+		fdb_finsh(&h);
+		return;
+	}
+	fdb_apnc(&h, 0);
+	resphdrx(de, 200, hdr, sb->st_size, (char *) h.bf);
+	fdb_finsh(&h);
+	if (rq->head) return;
+
+	/* If the body falls short of its Content-Length, the connection can
+	   carry no more responses. */
+#ifdef __linux__
+	while (!de->escannot && at < sb->st_size) {
+		redn = sendfile(de->fd, sfd, &at, sb->st_size - at);
+		if (0 < redn) continue;
+		if (0 > redn && errno == EINTR) continue;
+		if (0 > redn && !at) break;
+
+		if (0 > redn) perror("sendfile static");
+		de->broken = 1;
+		return;
+	}
+	if (at) return;
+#endif
+
+	while (at < sb->st_size && !de->broken) {
+		redn = sb->st_size - at;
+		redn = read(sfd, buf, redn < sizeof(buf) ? redn : sizeof(buf));
+
+		if (0<redn)	{ full_write(de, buf, redn); at += redn; }
+		if (!redn)	break;
+		if (0>redn && errno!=EINTR) { perror("read static"); break; }
+	}
+	if (at < sb->st_size) de->broken = 1;
+}
+
+void resp_static(struct wrides *de, const Httpreq *rq, char hdr,
+		 const char *path)
+{
+	int sfd, ern;
+	ssize_t redn;
+	char *fullp=0, *fb=0;
 	const char *eop;
 	struct stat sb;
 	struct fdbuf erb = {0};
+	off_t got = 0;
 
 	/* We are not checking for "/../" in path because path should be part of
 	   a hard-coded whitelist, and if not, it will not be able to access any
 	   file not already accessible with `cat <path>` in a shell. */
 	xasprintf(&fullp, "%s/%s", getenv("WERMSRCDIR"), path);
 
+	sfd = -1;
+	if (0>stat(fullp, &sb))	{ eop = "op: stat\n"; goto dumperr; }
+	if (resp_fromcache(de, rq, path, &sb)) goto cleanup;
+
 	sfd = open(fullp, O_RDONLY);
 	if (0>sfd)		{ eop = "op: open\n"; goto dumperr; }
 	if (0>fstat(sfd, &sb))	{ eop = "op: stat\n"; goto dumperr; }
 
-	resphdr(de, 200, hdr, sb.st_size);
+	if (sb.st_size >= ASSETMAX) {
+		respbig(de, rq, hdr, sfd, &sb);
+		goto cleanup;
+	}
 
-	for (;;) {
-		redn = read(sfd, buf, sizeof(buf));
+	fb = malloc(sb.st_size + 1);
+	while (got < sb.st_size) {
+		redn = read(sfd, fb + got, sb.st_size - got);
 
-		if (!redn)	goto cleanup;
-		if (0<redn)	full_write(de, buf, redn);
+		if (!redn)	break;
+		if (0<redn)	got += redn;
 		if (0>redn && errno!=EINTR) { perror("read static"); exit(1); }
 	}
 
+	/* If the file was shortened while reading it, do not keep what was
+	   read under the old stat. */
+	if (got == sb.st_size)	resp_cached(de, rq, hdr, path, &sb, fb, got);
+	else			resp_dynamc(de, hdr, 200, fb, got);
+	goto cleanup;
+
 dumperr:
 	ern = errno;
 
@@ -368,6 +813,8 @@ dumperr:
 
 cleanup:
 	if (sfd >= 0) close(sfd);
+	free(fullp);
+	free(fb);
 }
 
 void resp_dynamc(struct wrides *de, char hdr, int code, void *b, size_t sz)
@@ -376,11 +823,20 @@ void resp_dynamc(struct wrides *de, char hdr, int code, void *b, size_t sz)
 	full_write(de, b, sz);
 }
 
+void resp_chunked(struct wrides *de, char hdr, int code, struct fdbuf *b)
+{
+	resphdrx(de, code, hdr, CHUNKED, 0);
+	*b = (struct fdbuf){de, CHUNKSZ, .chunked = 1};
+}
+
 void test_http(void)
 {
 	struct wrides de = {1, "httpresp"};
 	FILE *src = tmpfile();
 	Httpreq rq;
+	struct stat sb;
+	struct fdbuf chb;
+	char big[4096];
 
 	puts("TRIVIAL RESOURCE AND BLANK QUERY");
 	memset(&rq, 0, sizeof(rq));
@@ -424,6 +880,32 @@ void test_http(void)
 	dumpreq(&rq);
 	resettmpfile(&src);
 
+	puts("WEBSOCKET UPGRADE: PERMESSAGE-DEFLATE");
+	memset(&rq, 0, sizeof(rq));
+	rq.wsdeflok = 1;
+	fputs("GET / HTTP/1.1\r\nConnection: Upgrade\r\nUpgrade: websocket\r\nSec-WebSocket-Version: 13\r\nSec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\nSec-WebSocket-Extensions: permessage-deflate; client_max_window_bits\r\n\r\n", src);
+	fseek(src, 0, SEEK_SET);
+	http_read_req(src, &rq, &de);
+	dumpreq(&rq);
+	resettmpfile(&src);
+
+	puts("WEBSOCKET UPGRADE: PERMESSAGE-DEFLATE, SKIP UNSUPPORTED OFFERS");
+	memset(&rq, 0, sizeof(rq));
+	rq.wsdeflok = 1;
+	fputs("GET / HTTP/1.1\r\nConnection: Upgrade\r\nUpgrade: websocket\r\nSec-WebSocket-Version: 13\r\nSec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\nSec-WebSocket-Extensions: x-webkit-deflate-frame, permessage-deflate; server_max_window_bits=8, Permessage-Deflate; Server_Max_Window_Bits=10; server_no_context_takeover\r\n\r\n", src);
+	fseek(src, 0, SEEK_SET);
+	http_read_req(src, &rq, &de);
+	dumpreq(&rq);
+	resettmpfile(&src);
+
+	puts("WEBSOCKET UPGRADE: PERMESSAGE-DEFLATE NOT ALLOWED");
+	memset(&rq, 0, sizeof(rq));
+	fputs("GET / HTTP/1.1\r\nConnection: Upgrade\r\nUpgrade: websocket\r\nSec-WebSocket-Version: 13\r\nSec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\nSec-WebSocket-Extensions: permessage-deflate\r\n\r\n", src);
+	fseek(src, 0, SEEK_SET);
+	http_read_req(src, &rq, &de);
+	dumpreq(&rq);
+	resettmpfile(&src);
+
 	puts("UNSUPPORTED METHOD POST");
 	memset(&rq, 0, sizeof(rq));
 	fputs("POST /?termid=x.y HTTP/1.1\r\n\r\n", src);
@@ -456,5 +938,66 @@ void test_http(void)
 	dumpreq(&rq);
 	resettmpfile(&src);
 
+	puts("CACHED RESPONSE: ETAG");
+	memset(&rq, 0, sizeof(rq));
+	fputs("GET /tcache HTTP/1.1\r\n\r\n", src);
+	fseek(src, 0, SEEK_SET);
+	http_read_req(src, &rq, &de);
+	resp_cached(&de, &rq, 't', "/tcache", 0, "cached body\n", 12);
+	resettmpfile(&src);
+
+	puts("CACHED RESPONSE: IF-NONE-MATCH");
+	memset(&rq, 0, sizeof(rq));
+	fputs("GET /tcache HTTP/1.1\r\n"
+	      "If-None-Match: \"19ebe14a65a7bcc9\"\r\n\r\n", src);
+	fseek(src, 0, SEEK_SET);
+	http_read_req(src, &rq, &de);
+	if (!resp_fromcache(&de, &rq, "/tcache", 0)) puts("not in cache");
+	resettmpfile(&src);
+
+	puts("CACHED RESPONSE: IF-NONE-MATCH LISTS");
+	printf("list: %d, weak: %d, star: %d, other encoding: %d, cut off: %d\n",
+	       inmhas("\"1\", \"19ebe14a65a7bcc9\"", "19ebe14a65a7bcc9", ""),
+	       inmhas("W/\"19ebe14a65a7bcc9-gz\"", "19ebe14a65a7bcc9", "-gz"),
+	       inmhas(" *", "19ebe14a65a7bcc9", ""),
+	       inmhas("\"19ebe14a65a7bcc9-gz\"", "19ebe14a65a7bcc9", ""),
+	       inmhas("\"19ebe14a65a7bcc9", "19ebe14a65a7bcc9", ""));
+
+	puts("CACHED RESPONSE: CONTENT-HASHED URL");
+	memset(&rq, 0, sizeof(rq));
+	fputs("GET /tcache?h=19ebe14a65a7bcc9 HTTP/1.1\r\n\r\n", src);
+	fseek(src, 0, SEEK_SET);
+	http_read_req(src, &rq, &de);
+	if (!resp_fromcache(&de, &rq, "/tcache", 0)) puts("not in cache");
+	resettmpfile(&src);
+
+	puts("CACHED RESPONSE: MISSING OR CHANGED SOURCE");
+	memset(&rq, 0, sizeof(rq));
+	memset(&sb, 0, sizeof(sb));
+	printf("missing: %d\n", resp_fromcache(&de, &rq, "/nothere", 0));
+	printf("changed: %d\n", resp_fromcache(&de, &rq, "/tcache", &sb));
+	resp_uncache("/tcache");
+	printf("uncached: %d\n", resp_fromcache(&de, &rq, "/tcache", 0));
+
+	puts("CACHED RESPONSE: GZIP");
+	memset(&rq, 0, sizeof(rq));
+	fputs("HEAD /tgz HTTP/1.1\r\n"
+	      "Accept-Encoding: deflate, GZIP;q=1.0\r\n\r\n", src);
+	fseek(src, 0, SEEK_SET);
+	http_read_req(src, &rq, &de);
+	memset(big, 'z', sizeof(big));
+	resp_cached(&de, &rq, 't', "/tgz", 0, big, sizeof(big));
+	resettmpfile(&src);
+
+	puts("CHUNKED RESPONSE");
+	resp_chunked(&de, 't', 200, &chb);
+	fdb_apnd(&chb, "first part, ", -1);
+	fdb_apnd(&chb, "second part", -1);
+	fdb_finsh(&chb);
+
+	puts("CHUNKED RESPONSE: EMPTY");
+	resp_chunked(&de, 'j', 200, &chb);
+	fdb_finsh(&chb);
+
 	fclose(src);
 }
@@ -7,6 +7,7 @@
 #include "outstreams.h"
 
 #include <stdio.h>
+#include <sys/stat.h>
 
 typedef struct {
 	char resource[32];
@@ -28,6 +29,27 @@ typedef struct {
 
 	/* Indicates the client added keep-alive to the Connection header. */
 	unsigned keepaliv : 1;
+
+	/* Set by the caller to allow negotiating the permessage-deflate
+	   websocket extension (RFC 7692). */
+	unsigned wsdeflok : 1;
+
+	/* Set if the server must reset its compression context after each
+	   message, because the client asked for server_no_context_takeover. */
+	unsigned wsdeflreset : 1;
+
+	/* If non-zero, permessage-deflate was negotiated, and this is the
+	   maximum LZ77 window size, in bits, for compressing server messages. */
+	unsigned char wsdeflbits;
+
+	/* Set if the client accepts gzip content encoding. */
+	unsigned acceptgz : 1;
+
+	/* Values of the If-None-Match and If-Modified-Since headers, truncated
+	   if they are too long. A browser sends one or two ETags, so this only
+	   loses ones which could not match anything we send. */
+	char ifnonematch[128];
+	char ifmodsince[32];
 } Httpreq;
 
 /* Process request header from |src|.
@@ -35,19 +57,51 @@ typedef struct {
 void http_read_req(FILE *src, Httpreq *rq, struct wrides *errresp);
 
 /* resp_static sends a full http response to the given fd. path is relative to
-   WERMSRCDIR.
+   WERMSRCDIR. The file is kept in memory until it changes, so that the
+   response can be sent as resp_cached does.
 
    resp_dynamc writes an http response to fd from a block of memory with the
    given status code.
 
+   resp_cached sends b like resp_dynamc does with status 200, and keeps a copy
+   under key. This lets the response carry an ETag. Requests which already
+   have it get 304 Not Modified, and clients which accept gzip get a gzipped
+   body. A query of h=<etag> marks the URL as content-hashed, so the response
+   is cached by the browser as immutable. src is the stat of the file b was
+   made from, or null if b never changes in the life of the process.
+
+   resp_fromcache sends the copy under key, if there is one and it was made
+   from src as it is now. If it does, it returns 1.
+
+   resp_uncache frees the copy under key, if there is one.
+
    Types of headers (hdr):
 	t - plain text
 	h - html
 	c - css
 	j - js
-	f - ttf */
-void resp_static(struct wrides *de, char hdr, const char *path);
+	f - ttf
+	w - wasm */
+void resp_static(struct wrides *de, const Httpreq *rq, char hdr,
+		 const char *path);
 void resp_dynamc(struct wrides *de, char hdr, int code, void *b, size_t sz);
+void resp_cached(struct wrides *de, const Httpreq *rq, char hdr,
+		 const char *key, const struct stat *src, const void *b,
+		 size_t sz);
+int resp_fromcache(struct wrides *de, const Httpreq *rq, const char *key,
+		   const struct stat *src);
+void resp_uncache(const char *key);
+
+/* Writes to etag the ETag resp_cached gives the sz bytes at b, as 16 hex digits
+   and a null, so a URL for them can be content-hashed with h=<etag>. */
+void resp_etag(char *etag, const void *b, size_t sz);
+
+/* Writes the header of a response whose length is not known in advance, and
+   sets up b so that its contents are sent as the body each time it fills up,
+   using chunked transfer encoding. The response is complete when b is finished
+   with fdb_finsh. This keeps the memory used for a large body constant, and
+   the client can show the body as it arrives. */
+void resp_chunked(struct wrides *de, char hdr, int code, struct fdbuf *b);
 
 /* Exercises http functionality and writes test output to stdout, to be compared
    with golden test data. */
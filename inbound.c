@@ -11,114 +11,432 @@
 #include <stdlib.h>
 #include <errno.h>
 #include <stdio.h>
+#include <zlib.h>
 
-static unsigned char buf[512];
-static unsigned bfi, bfsz;
 static unsigned char pongmsg[2] = {0x8a, 0x00};
 
-static void mkeaval(int c)
+/* Most a compressed message may inflate to, as a few kilobytes of it can
+   otherwise expand to any amount of memory. */
+#define INFLMAX (16 << 20)
+
+struct wsin {
+	/* Header of the frame being read, of which hdrn bytes are in hdr */
+	unsigned char hdr[14];
+	unsigned hdrn;
+
+	/* Part of the payload not read yet, and the mask applied to it */
+	uint64_t left;
+	unsigned char mask[4];
+	unsigned maskof;
+
+	/* Opcode and FIN bit of the frame being read */
+	int op, fin;
+
+	/* State for messages compressed with permessage-deflate, which are
+	   marked with RSV1 on their first frame. The context is kept between
+	   messages unless the client resets it, which it can do without
+	   telling us. */
+	z_stream infl;
+	char inflinit, msgcomp;
+
+	/* Bytes the current message has inflated to so far */
+	size_t inflmsg;
+
+	/* Unmasked payload of compressed frames, before it is inflated */
+	struct fdbuf scr;
+};
+
+struct wsin *wsin_new(void) { return calloc(1, sizeof(struct wsin)); }
+
+void wsin_fre(struct wsin *wi)
 {
-	ssize_t redn;
-	unsigned bleft = bfsz - bfi;
+	if (!wi) return;
+	if (wi->inflinit) inflateEnd(&wi->infl);
+	fdb_finsh(&wi->scr);
+	free(wi);
+}
 
-	if (c > sizeof(buf)) abort();
+static int inflwrite(struct wsin *wi, struct fdbuf *out,
+		     const unsigned char *b, unsigned sz)
+{
+	unsigned char ob[4096];
+	int zr;
 
-	if (bleft >= c) return;
+	if (!wi->inflinit) {
+		if (Z_OK != inflateInit2(&wi->infl, -15)) {
+			fprintf(stderr, "inflateInit2: %s\n", wi->infl.msg);
+			return -1;
+		}
+		wi->inflinit = 1;
+	}
 
-	bfsz = bleft;
-	memmove(buf, buf+bfi, bfsz);
-	bfi = 0;
+	wi->infl.next_in = (unsigned char *) b;
+	wi->infl.avail_in = sz;
 
 	do {
-		redn=read(0, buf + bfsz, sizeof(buf) - bfsz);
-		if (0 > redn) {
-			if (errno == EAGAIN) continue;
-			perror("read stdin mid-frame");
-			abort();
+		wi->infl.next_out = ob;
+		wi->infl.avail_out = sizeof(ob);
+
+		zr = inflate(&wi->infl, Z_SYNC_FLUSH);
+		if (zr != Z_OK && zr != Z_BUF_ERROR) {
+			fprintf(stderr, "inflate inbound: %s\n", wi->infl.msg);
+			return -1;
+		}
+
+		wi->inflmsg += sizeof(ob) - wi->infl.avail_out;
+		if (wi->inflmsg > INFLMAX) {
+			fprintf(stderr, "inflated message over %d bytes\n",
+				INFLMAX);
+			return -1;
 		}
-		if (!redn) abort();
-		bfsz += redn;
+
+		fdb_apnd(out, ob, sizeof(ob) - wi->infl.avail_out);
+	} while (!wi->infl.avail_out);
+
+	return 0;
+}
+
+/* XORs n bytes of src with the mask, starting at byte *of of it, into dst.
+   Works a 64-bit word at a time, which the compiler can widen to vector
+   registers, since pastes arrive as large frames. */
+static void unmask(unsigned char *dst, const unsigned char *src, size_t n,
+		   const unsigned char mask[4], unsigned *of)
+{
+	unsigned char mb[8];
+	uint64_t m, w;
+	size_t i;
+
+	for (i = 0; i < 8; i++) mb[i] = mask[(*of + i) & 3];
+	memcpy(&m, mb, 8);
+
+	for (i = 0; i + 8 <= n; i += 8) {
+		memcpy(&w, src + i, 8);
+		w ^= m;
+		memcpy(dst + i, &w, 8);
 	}
-	while (bfsz < c);
+	for (; i < n; i++) dst[i] = src[i] ^ mb[i & 7];
+
+	*of = (*of + n) & 3;
 }
 
-static unsigned char *forceinby(int c)
+/* Returns how long the header in wi->hdr is, as far as can be told from the
+   bytes of it read so far. */
+static unsigned hdrlen(const struct wsin *wi)
 {
-	mkeaval(c);
-	bfi += c;
-	return buf + bfi - c;
+	unsigned n = 2 + 4;
+
+	if (wi->hdrn < 2) return 2;
+
+	switch (wi->hdr[1] & 0x7f) {
+	case 126: return n + 2;
+	case 127: return n + 8;
+	default: return n;
+	}
 }
 
-void fwrd_inbound_frames(int sock)
+/* Called once the header is complete. */
+static int begnframe(struct wsin *wi)
 {
-	unsigned char mask[4];
-	uint64_t datalen;
-	uint32_t datalen32;
-	uint16_t datalen16;
-	int unmaski, datpart, unmaskof;
-	unsigned char *bfc;
+	const unsigned char *hc = wi->hdr + 2;
+	uint64_t len;
+	uint32_t len32;
+	uint16_t len16;
+	int i;
 
-	if (bfi != bfsz) abort();
+	wi->op = wi->hdr[0] & 0x0f;
+	wi->fin = wi->hdr[0] & 0x80;
 
-	do {
-		bfc = forceinby(1);
+	/* Only the first frame of a message says if it is compressed */
+	if (wi->op == 1 || wi->op == 2) {
+		wi->msgcomp = !!(wi->hdr[0] & 0x40);
+		wi->inflmsg = 0;
+	}
+
+	len = wi->hdr[1] & 0x7f;
+	if (len == 126) {
+		memcpy(&len16, hc, 2);
+		len = ntohs(len16);
+		hc += 2;
+	}
+	else if (len == 127) {
+		memcpy(&len32, hc, 4);
+		len = ntohl(len32);
+		len <<= 32;
+		memcpy(&len32, hc + 4, 4);
+		len |= ntohl(len32);
+		hc += 8;
+	}
+
+	for (i = 0; i < 4; i++) wi->mask[i] = hc[i];
+	wi->maskof = 0;
+	wi->left = len;
+
+	return 0;
+}
+
+/* Called once the payload is complete. Returns what wsin_feed does. */
+static int endframe(struct wsin *wi, struct fdbuf *out, struct fdbuf *pongs)
+{
+	wi->hdrn = 0;
 
-		/* We don't care whether continuation or FIN */
-		*bfc &= 0x7f;
+	switch (wi->op) {
+	default: return 0; /* pong, or reserved code */
+	case 8:
+		/* The client is closing, so answer and stop reading. */
+		wsin_closefr(pongs, 1000);
+		return 1;
+	case 0: case 1: case 2:
+		/* Restore the tail which the sender removed from the end of
+		   the compressed message. */
+		if (wi->fin && wi->msgcomp)
+			return inflwrite(wi, out,
+					 (unsigned char *) "\0\0\xff\xff", 4);
+		return 0;
+	case 9:
+		/* pinged, so respond with pong */
+		fdb_apnd(pongs, pongmsg, sizeof(pongmsg));
+		return 0;
+	}
+}
 
-		switch (*bfc) {
-		default: break; /* close, pong, or reserved code */
-		case 0: case 1: case 2:
-			/* data */
+int wsin_feed(struct wsin *wi, const unsigned char *b, size_t len,
+	      struct fdbuf *out, struct fdbuf *pongs)
+{
+	size_t part;
+	int data, r;
 
-			/* Payload len */
-			bfc = forceinby(1);
-			datalen = *bfc & 0x7f;
+	while (len) {
+		if (wi->hdrn < hdrlen(wi)) {
+			wi->hdr[wi->hdrn++] = *b++;
+			len--;
 
 			/* Should always send mask */
-			if (!(*bfc & 0x80)) abort();
-
-			/* Client should not send large frames that require
-			 * extended payload length. */
-			if (datalen == 126) {
-				memcpy(&datalen16, forceinby(2), 2);
-
-				datalen = ntohs(datalen16);
-			}
-			else if (datalen == 127) {
-				memcpy(&datalen32, forceinby(4), 4);
-				datalen = ntohl(datalen32);
-				datalen <<= 32;
-
-				memcpy(&datalen32, forceinby(4), 4);
-				datalen |= ntohl(datalen32);
-			}
-
-			/* Read the mask */
-			memcpy(mask, forceinby(4), 4);
-
-			unmaskof = 0;
-			while (datalen) {
-				datpart = sizeof(buf);
-				if (datpart > datalen) datpart = datalen;
-
-				bfc = forceinby(datpart);
-				for (unmaski = 0; unmaski < datpart; unmaski++) {
-					bfc[unmaski] ^= mask[unmaskof++];
-					unmaskof &= 3;
-				}
-
-				full_write(&(struct wrides){sock}, bfc, datpart);
-
-				datalen -= datpart;
-			}
-		break;
-		case 9:
-			/* pinged, so respond with pong */
-			full_write(&(struct wrides){1},
-				   pongmsg, sizeof(pongmsg));
-		break;
+			if (wi->hdrn == 2 && !(wi->hdr[1] & 0x80)) return -1;
+
+			if (wi->hdrn < hdrlen(wi)) continue;
+
+			if (begnframe(wi)) return -1;
+			if (!wi->left && (r = endframe(wi, out, pongs)))
+				return r;
+			continue;
 		}
+
+		part = len;
+		if (part > wi->left) part = wi->left;
+
+		data = wi->op == 0 || wi->op == 1 || wi->op == 2;
+		if (data && !wi->msgcomp) {
+			unmask(fdb_room(out, part), b, part, wi->mask,
+			       &wi->maskof);
+			out->len += part;
+		}
+		else if (data) {
+			wi->scr.len = 0;
+			unmask(fdb_room(&wi->scr, part), b, part, wi->mask,
+			       &wi->maskof);
+			if (inflwrite(wi, out, wi->scr.bf, part)) return -1;
+		}
+
+		b += part;
+		len -= part;
+		wi->left -= part;
+		if (!wi->left && (r = endframe(wi, out, pongs))) return r;
+	}
+
+	return 0;
+}
+
+void wsin_closefr(struct fdbuf *b, unsigned code)
+{
+	unsigned char fr[] = {0x88, 2, code >> 8, code};
+
+	fdb_apnd(b, fr, sizeof(fr));
+}
+
+/* Ends the connection to a client which broke the protocol, telling it why. */
+static _Noreturn void wsprotoerr(void)
+{
+	struct fdbuf b = {0};
+
+	fprintf(stderr, "bad websocket data from client\n");
+	wsin_closefr(&b, 1002);
+	full_write(&(struct wrides){1}, b.bf, b.len);
+	exit(1);
+}
+
+void fwrd_inbound_frames(int sock)
+{
+	static struct wsin *wi;
+	static unsigned char buf[64 * 1024];
+	struct wrides sockde = {sock}, stdoutde = {1};
+	struct fdbuf out = {0}, pongs = {0};
+	ssize_t redn;
+	int r;
+
+	if (!wi) wi = wsin_new();
+
+	redn = read(0, buf, sizeof(buf));
+	if (0 > redn) {
+		if (errno == EAGAIN || errno == EINTR) return;
+		perror("read stdin");
+		exit(1);
+	}
+	if (!redn) exit(0);
+
+	r = wsin_feed(wi, buf, redn, &out, &pongs);
+	if (r < 0) wsprotoerr();
+
+	/* Everything from this read goes to the master in one write. */
+	if (out.len)	full_write(&sockde, out.bf, out.len);
+	if (pongs.len)	full_write(&stdoutde, pongs.bf, pongs.len);
+
+	fdb_finsh(&out);
+	fdb_finsh(&pongs);
+	if (r) exit(0);
+}
+
+/* Appends a masked client frame with the given first header byte and len
+ * bytes of payload to b. */
+static void maskedbin(struct fdbuf *b, unsigned char b0, const void *plv,
+		      size_t len)
+{
+	static const unsigned char mask[] = {0x37, 0xfa, 0x21, 0x3d};
+	const unsigned char *pl = plv;
+	size_t i;
+
+	fdb_apnc(b, b0);
+	if (len < 126)
+		fdb_apnc(b, 0x80 | len);
+	else {
+		fdb_apnc(b, 0x80 | 126);
+		fdb_apnc(b, len >> 8);
+		fdb_apnc(b, len);
+	}
+	fdb_apnd(b, mask, 4);
+	for (i = 0; i < len; i++) fdb_apnc(b, pl[i] ^ mask[i % 4]);
+}
+
+static void maskedframe(struct fdbuf *b, unsigned char b0, const char *pl)
+{
+	maskedbin(b, b0, pl, strlen(pl));
+}
+
+/* Appends a text message of len bytes of pl, compressed as a client would with
+ * permessage-deflate, to b. */
+static void deflframe(struct fdbuf *b, const void *pl, size_t len)
+{
+	z_stream zs = {0};
+	struct fdbuf z = {0};
+
+	if (Z_OK != deflateInit2(&zs, 9, Z_DEFLATED, -15, 8,
+				 Z_DEFAULT_STRATEGY))
+		abort();
+	zs.next_in = (unsigned char *) pl;
+	zs.avail_in = len;
+	do {
+		zs.next_out = fdb_room(&z, 4096);
+		zs.avail_out = 4096;
+		deflate(&zs, Z_SYNC_FLUSH);
+		z.len += 4096 - zs.avail_out;
+	} while (!zs.avail_out);
+	deflateEnd(&zs);
+
+	/* The sender leaves out the empty block which ends the flush */
+	maskedbin(b, 0xc1, z.bf, z.len - 4);
+	fdb_finsh(&z);
+}
+
+static void feedbytes(const struct fdbuf *in, size_t step, const char *expct)
+{
+	struct wsin *wi = wsin_new();
+	struct fdbuf out = {0}, pongs = {0};
+	size_t of, n;
+	int res = 0;
+
+	for (of = 0; !res && of < in->len; of += n) {
+		n = in->len - of < step ? in->len - of : step;
+		res = wsin_feed(wi, in->bf + of, n, &out, &pongs);
 	}
-	while (bfi < bfsz);
+
+	if (expct)
+		printf("step=%zu res=%d matches=%d pongs:", step, res,
+		       out.len == strlen(expct)
+		       && !memcmp(out.bf, expct, out.len));
+	else
+		printf("step=%zu res=%d out=(%.*s) pongs:", step, res,
+		       (int) out.len, out.bf);
+	for (n = 0; n < pongs.len; n++) printf(" %02x", pongs.bf[n]);
+	putchar('\n');
+
+	fdb_finsh(&out);
+	fdb_finsh(&pongs);
+	wsin_fre(wi);
+}
+
+void test_inbound(void)
+{
+	struct fdbuf in = {0};
+	char paste[301], *bomb;
+	unsigned i;
+
+	printf("TEST INBOUND\n");
+
+	/* A text message in two fragments with a ping between them. */
+	maskedframe(&in, 0x01, "hello, ");
+	maskedframe(&in, 0x89, "");
+	maskedframe(&in, 0x80, "world");
+	maskedframe(&in, 0x82, "!");
+
+	feedbytes(&in, in.len, 0);
+	feedbytes(&in, 1, 0);
+	feedbytes(&in, 5, 0);
+
+	/* Client frames must be masked. */
+	fdb_apnd(&in, "\x81\x02xy", 4);
+	feedbytes(&in, 3, 0);
+	in.len = 0;
+
+	/* A paste long enough to be unmasked a word at a time, arriving in
+	   pieces which do not line up with the words or the mask. */
+	memset(paste, 0, sizeof(paste));
+	for (i = 0; i < sizeof(paste) - 1; i++) paste[i] = 'a' + i % 23;
+	maskedframe(&in, 0x81, paste);
+	feedbytes(&in, in.len, paste);
+	feedbytes(&in, 7, paste);
+	feedbytes(&in, 13, paste);
+	in.len = 0;
+
+	/* Nothing is read after a close frame, which is answered. */
+	maskedframe(&in, 0x81, "bye");
+	maskedframe(&in, 0x88, "\x03\xe8");
+	maskedframe(&in, 0x81, "ignored");
+	feedbytes(&in, in.len, 0);
+	feedbytes(&in, 3, 0);
+	in.len = 0;
+
+	/* Compressed messages inflate, up to a limit. */
+	deflframe(&in, "squeezed", 8);
+	feedbytes(&in, in.len, 0);
+	feedbytes(&in, 3, 0);
+	in.len = 0;
+
+	bomb = calloc(1, INFLMAX + 2);
+	memset(bomb, 'z', INFLMAX);
+	deflframe(&in, bomb, INFLMAX);
+	printf("%d bytes compressed under 64k: %d\n", INFLMAX,
+	       in.len < 65536);
+	feedbytes(&in, in.len, bomb);
+	in.len = 0;
+	bomb[INFLMAX] = 'z';
+	deflframe(&in, bomb, INFLMAX + 1);
+	feedbytes(&in, in.len, bomb);
+	in.len = 0;
+	free(bomb);
+
+	wsin_closefr(&in, 1002);
+	printf("close frame:");
+	for (i = 0; i < in.len; i++) printf(" %02x", in.bf[i]);
+	putchar('\n');
+
+	fdb_finsh(&in);
 }
@@ -9,3 +9,24 @@
 /* Forwards stdin, interpreted as websocket frames, to the given socket as
  * unframed data, otherwise uninterpreted. */
 void fwrd_inbound_frames(int sock);
+
+/* State of the frames read from a websocket, which can arrive in pieces of any
+ * size. */
+struct wsin;
+struct wsin *wsin_new(void);
+void wsin_fre(struct wsin *wi);
+
+/* Parses len bytes read from the websocket, which may begin and end partway
+ * through a frame. Appends the unmasked and inflated payload of data messages
+ * to out, and a pong frame to pongs for each ping. A close frame is answered
+ * with one appended to pongs, and the rest of b is not read. Returns -1 if the
+ * client broke the protocol or sent a message which inflates to too much, 1 if
+ * it sent a close frame, or 0. */
+int wsin_feed(struct wsin *wi, const unsigned char *b, size_t len,
+	      struct fdbuf *out, struct fdbuf *pongs);
+
+/* Appends to b a close frame with the given status code, such as 1002 for a
+ * protocol error. */
+void wsin_closefr(struct fdbuf *b, unsigned code);
+
+void test_inbound(void);
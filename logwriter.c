@@ -0,0 +1,443 @@
+/* Copyright 2023 Google LLC
+ *
+ * Use of this source code is governed by a BSD-style
+ * license that can be found in the LICENSE file or at
+ * https://developers.google.com/open-source/licenses/bsd */
+
+#include "logwriter.h"
+#include "outstreams.h"
+#include "shared.h"
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+
+/* Every this many bytes of plain log, a line is appended to the log's .idx
+   sidecar with the byte offset, line number and time at that point, all in
+   decimal and separated by spaces. The first entry is at offset 0. */
+#define LOGIDXGAP (64 * 1024)
+
+/* The writer writes a log once this much of it is batched, or once output has
+   waited this long. */
+#define LOGBATCH (256 * 1024)
+#define LOGFLUSHMS 1000
+
+/* If the writer falls this far behind, the master waits for it rather than
+   queueing more. */
+#define LOGQMAX (16 << 20)
+
+time_t (*logw_clock)(time_t *) = time;
+
+static struct logst {
+	char *path;
+	struct wrides de, idxde;
+	struct fdbuf bf, idxbf;
+	unsigned long long off, lns, idxat;
+	time_t born;
+	unsigned segn;
+} lgs[LOGW_CNT];
+
+static struct logwcfg cfg;
+
+/* Master side: pipe to the writer, and output it has not taken yet. The pipe
+   is left open if the writer goes away, since the caller may still be waiting
+   on it. */
+static struct logwctx lw = {-1};
+
+/* Picks up the size and line count of a log that is being appended to, by
+   counting the lines after the last index entry. */
+static void resume(struct logst *l)
+{
+	char bf[4096], *ln;
+	off_t lsz, isz, at;
+	ssize_t got, i;
+	unsigned long long of = 0, lns = 0;
+
+	lsz = lseek(l->de.fd, 0, SEEK_END);
+	l->off = lsz > 0 ? lsz : 0;
+	if (!l->idxde.fd) return;
+
+	isz = lseek(l->idxde.fd, 0, SEEK_END);
+	if (lsz <= 0) {
+		/* An index left over from a log that was removed. */
+		if (isz > 0 && ftruncate(l->idxde.fd, 0)) perror("ftruncate");
+		return;
+	}
+
+	at = isz > 80 ? isz - 80 : 0;
+	got = isz > 0 ? pread(l->idxde.fd, bf, isz - at, at) : 0;
+	if (got > 1) {
+		bf[got - 1] = 0;
+		ln = strrchr(bf, '\n');
+		if (2 != sscanf(ln ? ln + 1 : bf, "%llu %llu", &of, &lns)
+		||  of > (unsigned long long) lsz)
+			of = lns = 0;
+	}
+
+	for (at = of; 0 < (got = pread(l->de.fd, bf, sizeof(bf), at));
+	     at += got)
+		for (i = 0; i < got; i++) lns += bf[i] == '\n';
+
+	l->lns = lns;
+	l->idxat = isz > 0 ? of + LOGIDXGAP : 0;
+}
+
+static int opnapnd(const char *path)
+{
+	int fd = open(path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+
+	if (fd >= 0) return fd;
+	warn("open %s", path);
+	return 0;
+}
+
+static void opnseg(struct logst *l)
+{
+	char *ip;
+
+	l->de.fd = opnapnd(l->path);
+	if (l->de.fd && l - lgs == LOGW_PLAIN) {
+		xasprintf(&ip, "%s.idx", l->path);
+		l->idxde.fd = opnapnd(ip);
+		free(ip);
+	}
+
+	l->off = l->lns = l->idxat = 0;
+	l->born = logw_clock(0);
+	if (l->de.fd) resume(l);
+}
+
+void logw_open(int lg, const char *path, const struct logwcfg *c)
+{
+	struct logst *l = lgs + lg;
+
+	cfg = *c;
+	free(l->path);
+	memset(l, 0, sizeof(*l));
+	l->path = strdup(path);
+	l->bf = (struct fdbuf){&l->de, LOGBATCH};
+	l->idxbf = (struct fdbuf){&l->idxde, 4096};
+	opnseg(l);
+}
+
+static void flush1(struct logst *l)
+{
+	if (l->de.fd)		full_write(&l->de, l->bf.bf, l->bf.len);
+	if (l->idxde.fd)	full_write(&l->idxde, l->idxbf.bf, l->idxbf.len);
+	l->bf.len = l->idxbf.len = 0;
+}
+
+void logw_flush(void)
+{
+	int lg;
+
+	for (lg = 0; lg < LOGW_CNT; lg++) flush1(lgs + lg);
+}
+
+static void close1(struct logst *l)
+{
+	flush1(l);
+	if (l->de.fd)		close(l->de.fd);
+	if (l->idxde.fd)	close(l->idxde.fd);
+	l->de.fd = l->idxde.fd = 0;
+}
+
+void logw_close(void)
+{
+	int lg;
+
+	for (lg = 0; lg < LOGW_CNT; lg++) {
+		close1(lgs + lg);
+		fdb_finsh(&lgs[lg].bf);
+		fdb_finsh(&lgs[lg].idxbf);
+		free(lgs[lg].path);
+	}
+	memset(lgs, 0, sizeof(lgs));
+}
+
+static int exists(const char *pth)
+{
+	struct stat st;
+
+	return !stat(pth, &st);
+}
+
+/* Compresses the segment at seg into seg.gz and removes seg. On an error, seg
+   is left as it is. */
+static void gzipseg(const char *seg)
+{
+	char *zp, mode[4], bf[65536];
+	gzFile z = 0;
+	int in, zfd, ok;
+	ssize_t got;
+
+	in = open(seg, O_RDONLY | O_CLOEXEC);
+	if (in < 0) { warn("open %s", seg); return; }
+
+	xasprintf(&zp, "%s.gz", seg);
+	snprintf(mode, sizeof(mode), "w%d", cfg.zlvl);
+	zfd = open(zp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	if (zfd >= 0 && !(z = gzdopen(zfd, mode))) close(zfd);
+	ok = !!z;
+	while (ok && 0 < (got = read(in, bf, sizeof(bf))))
+		ok = gzwrite(z, bf, got) == got;
+	if (ok && got < 0) ok = 0;
+	if (z && gzclose(z) != Z_OK) ok = 0;
+	close(in);
+
+	if (!ok)		{ warnx("cannot compress %s", seg); unlink(zp); }
+	else if (unlink(seg))	warn("unlink %s", seg);
+	free(zp);
+}
+
+/* Closes the current segment of l as <path>.<n>, where n is one more than that
+   of the last closed segment, and starts a new one at path. */
+static void rotate(struct logst *l)
+{
+	char *seg, *gz, *ip, *sip;
+
+	close1(l);
+
+	for (;;) {
+		xasprintf(&seg, "%s.%u", l->path, ++l->segn);
+		xasprintf(&gz, "%s.gz", seg);
+		if (!exists(seg) && !exists(gz)) break;
+		free(seg);
+		free(gz);
+	}
+	free(gz);
+
+	if (rename(l->path, seg)) warn("rename %s", l->path);
+	else if (l - lgs == LOGW_PLAIN) {
+		xasprintf(&ip, "%s.idx", l->path);
+		xasprintf(&sip, "%s.idx", seg);
+		if (rename(ip, sip) && errno != ENOENT) warn("rename %s", ip);
+		free(ip);
+		free(sip);
+	}
+	if (cfg.zlvl) gzipseg(seg);
+	free(seg);
+
+	opnseg(l);
+}
+
+void logw_put(int lg, const void *b, size_t n)
+{
+	struct logst *l = lgs + lg;
+	const char *s = b, *e = s + n;
+	char ent[80];
+	time_t now;
+
+	if (!l->path || !n) return;
+
+	now = logw_clock(0);
+	if (l->off && (	(cfg.segsz && l->off + n > cfg.segsz) ||
+			(cfg.segsec && now - l->born >= cfg.segsec)))
+		rotate(l);
+	if (!l->de.fd) return;
+
+	if (l->idxde.fd && l->off >= l->idxat) {
+		snprintf(ent, sizeof(ent), "%llu %llu %lld\n",
+			 l->off, l->lns, (long long) now);
+		fdb_apnd(&l->idxbf, ent, -1);
+		l->idxat = l->off + LOGIDXGAP;
+	}
+
+	if (l->idxde.fd)
+		while ((s = memchr(s, '\n', e - s))) { l->lns++; s++; }
+	l->off += n;
+	fdb_apnd(&l->bf, b, n);
+}
+
+/* Reads frames of a one-byte log number, a 4-byte length and that many bytes
+   of output until the master closes the pipe. */
+static _Noreturn void writermain(int rd)
+{
+	struct pollfd pf = {rd, POLLIN};
+	struct fdbuf in = {0};
+	unsigned char rb[65536];
+	long long due = -1, left;
+	ssize_t got;
+	uint32_t ln;
+	size_t at;
+
+	for (;;) {
+		left = due < 0 ? -1 : due - nowms();
+		if (due >= 0 && left <= 0) {
+			logw_flush();
+			due = -1;
+			continue;
+		}
+		if (0 > poll(&pf, 1, left)) {
+			if (errno == EINTR) continue;
+			break;
+		}
+		if (!pf.revents) continue;
+
+		got = read(rd, rb, sizeof(rb));
+		if (got < 0 && errno == EINTR) continue;
+		if (got <= 0) break;
+
+		fdb_apnd(&in, rb, got);
+		for (at = 0; in.len - at >= 5; at += 5 + ln) {
+			memcpy(&ln, in.bf + at + 1, 4);
+			if (in.len - at - 5 < ln) break;
+			if (in.bf[at] < LOGW_CNT)
+				logw_put(in.bf[at], in.bf + at + 5, ln);
+		}
+		memmove(in.bf, in.bf + at, in.len - at);
+		in.len -= at;
+
+		if (due < 0) due = nowms() + LOGFLUSHMS;
+	}
+
+	logw_close();
+	_exit(0);
+}
+
+/* Sends the rest of the queue when the master exits. */
+static void drain(void)
+{
+	if (lw.wrfd < 0) return;
+	fcntl(lw.wrfd, F_SETFL, fcntl(lw.wrfd, F_GETFL) & ~O_NONBLOCK);
+	logw_pump();
+}
+
+int logw_start(const char *const paths[LOGW_CNT], const struct logwcfg *c)
+{
+	static int drainset;
+	int pp[2], fd, lg;
+	long fdmax;
+	pid_t pid;
+
+	if (pipe(pp)) { warn("pipe for log writer"); return -1; }
+
+	pid = fork();
+	if (pid < 0) {
+		warn("fork log writer");
+		close(pp[0]);
+		close(pp[1]);
+		return -1;
+	}
+	if (!pid) {
+		/* Hold no fds of the master, so sockets and the pty are seen as
+		   closed when the master closes them. */
+		fdmax = sysconf(_SC_OPEN_MAX);
+		if (fdmax < 0 || fdmax > 65536) fdmax = 65536;
+		for (fd = 3; fd < fdmax; fd++) if (fd != pp[0]) close(fd);
+
+		/* stdin and stdout may be a client's connection. */
+		fd = open("/dev/null", O_RDWR | O_CLOEXEC);
+		if (fd >= 0) {
+			dup2(fd, 0);
+			dup2(fd, 1);
+			if (fd > 1) close(fd);
+		}
+
+		/* Outlive the master only long enough to write what it sent. */
+		signal(SIGCHLD, SIG_DFL);
+		signal(SIGHUP, SIG_IGN);
+		signal(SIGINT, SIG_IGN);
+		signal(SIGTERM, SIG_IGN);
+
+		for (lg = 0; lg < LOGW_CNT; lg++)
+			if (paths[lg]) logw_open(lg, paths[lg], c);
+		writermain(pp[0]);
+	}
+
+	close(pp[0]);
+	lw.wrfd = pp[1];
+	if (0 > fcntl(lw.wrfd, F_SETFD, FD_CLOEXEC)
+	||  0 > fcntl(lw.wrfd, F_SETFL, fcntl(lw.wrfd, F_GETFL) | O_NONBLOCK))
+		warn("fcntl on log writer pipe");
+#ifdef F_SETPIPE_SZ
+	fcntl(lw.wrfd, F_SETPIPE_SZ, 1 << 20);
+#endif
+	if (!drainset++) atexit(drain);
+
+	return 0;
+}
+
+int logw_active(void) { return lw.wrfd >= 0; }
+
+void logw_send(int lg, const void *b, size_t n)
+{
+	unsigned char hd[5];
+	uint32_t ln = n;
+
+	if (lw.wrfd < 0 || lw.wrgone || !n) return;
+
+	hd[0] = lg;
+	memcpy(hd + 1, &ln, 4);
+	fdb_apnd(&lw.q, hd, 5);
+	fdb_apnd(&lw.q, b, n);
+	logw_pump();
+}
+
+void logw_pump(void)
+{
+	struct pollfd pf;
+	ssize_t w;
+	size_t at = 0;
+
+	while (at < lw.q.len) {
+		w = write(lw.wrfd, lw.q.bf + at, lw.q.len - at);
+		if (w > 0) {
+			at += w;
+			continue;
+		}
+		if (errno == EINTR) continue;
+		if (errno == EAGAIN) {
+			if (lw.q.len - at <= LOGQMAX) break;
+			pf = (struct pollfd){lw.wrfd, POLLOUT};
+			poll(&pf, 1, -1);
+			continue;
+		}
+
+		warn("log writer is gone, no longer logging");
+		lw.wrgone = 1;
+		at = lw.q.len;
+	}
+
+	if (!at) return;
+	memmove(lw.q.bf, lw.q.bf + at, lw.q.len - at);
+	lw.q.len -= at;
+}
+
+int logw_pending(void) { return lw.q.len ? lw.wrfd : -1; }
+
+void logw_stop(void)
+{
+	drain();
+	if (lw.wrfd >= 0) close(lw.wrfd);
+	fdb_finsh(&lw.q);
+	lw = (struct logwctx){-1};
+}
+
+void logw_swap(struct logwctx *save, const struct logwctx *load)
+{
+	*save = lw;
+	lw = *load;
+}
+
+void logw_dump(FILE *f)
+{
+	int lg;
+
+	for (lg = 0; lg < LOGW_CNT; lg++) {
+		if (!lgs[lg].path) continue;
+		fprintf(f, "log %d: off=%llu lns=%llu idxat=%llu segn=%u "
+			   "batched=%u\n",
+			lg, lgs[lg].off, lgs[lg].lns, lgs[lg].idxat,
+			lgs[lg].segn, lgs[lg].bf.len);
+	}
+}
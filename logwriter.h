@@ -0,0 +1,91 @@
+/* Copyright 2023 Google LLC
+ *
+ * Use of this source code is governed by a BSD-style
+ * license that can be found in the LICENSE file or at
+ * https://developers.google.com/open-source/licenses/bsd */
+
+#ifndef LOGWRITER_H
+#define LOGWRITER_H
+
+#include <stddef.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "outstreams.h"
+
+/* Scrollback logs are written by a child of the master process, so a slow disk
+ * does not hold up the terminal. The master queues output for the writer in
+ * memory and sends it over a pipe without blocking. The writer batches what it
+ * receives into large writes, keeps the index of the plain log (see LOGIDXGAP),
+ * and rotates the logs into numbered and optionally gzipped segments. */
+
+/* The logs that can be written. */
+#define LOGW_PLAIN	0
+#define LOGW_RAW	1
+#define LOGW_CNT	2
+
+struct logwcfg {
+	/* Start a new segment once the current one reaches this many bytes, or
+	   has been written to for this many seconds. 0 means no limit. */
+	unsigned long long segsz;
+	long segsec;
+
+	/* gzip level of closed segments, 0 to leave them uncompressed */
+	int zlvl;
+};
+
+/* Forks the writer for the logs at the given paths, each of which may be null
+ * to not write that log. The writer exits when the master does, after writing
+ * everything it was sent. Returns 0 on success. */
+int logw_start(const char *const paths[LOGW_CNT], const struct logwcfg *cfg);
+
+/* Returns 1 if logw_start has succeeded, so logs should be sent with
+ * logw_send. */
+int logw_active(void);
+
+/* Queues n bytes of output for the given log. */
+void logw_send(int lg, const void *b, size_t n);
+
+/* Sends as much queued output to the writer as the pipe will take.
+ * logw_pending returns the pipe fd if output is left to send, for the caller
+ * to wait for it to be writable, or -1 if nothing is queued. */
+void logw_pump(void);
+int logw_pending(void);
+
+/* Sends the rest of the queued output, blocking if needed, and closes the pipe
+ * so the writer finishes up and exits. logw_start can be called again after. */
+void logw_stop(void);
+
+/* What the master side keeps for the logs of one terminal. A process serving
+ * several terminals keeps one of these for each, and swaps it in with
+ * logw_swap before sending output for that terminal. wrfd is -1 in one which
+ * has not been started. */
+struct logwctx {
+	int wrfd;
+	struct fdbuf q;
+	int wrgone;
+};
+void logw_swap(struct logwctx *save, const struct logwctx *load);
+
+/* The rest is the writer side, which can also be used in-process. */
+
+/* Opens the log at path for writing. */
+void logw_open(int lg, const char *path, const struct logwcfg *cfg);
+
+/* Adds output to a log, rotating it first if it is due. */
+void logw_put(int lg, const void *b, size_t n);
+
+/* Writes the batched output of every log. */
+void logw_flush(void);
+
+/* Closes every log. */
+void logw_close(void);
+
+/* Prints the position and batch size of each open log to f. */
+void logw_dump(FILE *f);
+
+/* Source of the times in the index and used for rotation. Can be replaced for
+ * testing. */
+extern time_t (*logw_clock)(time_t *);
+
+#endif
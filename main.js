@@ -2,6 +2,7 @@
 #include "tm.js"
 #include "third_party/st/tmeng"
 #include "third_party/st/tmengui"
+#include "tmcli.js"
 
 window["extended_macros"] = {}
 
@@ -21,26 +22,25 @@ function Now(ms)
 	fld(ms,1) = n & 0x7fffffff;
 }
 
-function Xosc52copy(trm, deq, byti)
+function Xosc52copy(trm, deq, byti) { osc52copy(deqtostring(deq, byti)); }
+
+function osc52copy(b64)
 {
 	var s = new TextDecoder().decode(new Uint8Array(
-		atob(deqtostring(deq, byti))
+		atob(b64)
 			.split('')
 			.map(function(ch) { return ch.charCodeAt(0); })));
 	navigator.clipboard.writeText(s);
 }
 
-var	t, tel, gl, gwid, ghei, cops, ftd, ftx, vbu, shpr, dw, dh,
+var	t, tel, gl, gwid, ghei, cops, ftd, ftx, ftndx, ftpx, ftpgs, ftxoff,
+	ftyoff, ftmbit, vbu, shpr, dw, dh,
 	fontfgrgb,
 	fontbgrgb,
 	selecting, mdownstam,
-	cli0,
-	tex0,
-	mask,
 	clicoor,
 	clipixw,
 	clipixh,
-	celpxsz,
 	texpxsz,
 	log_matching,
 	log_send,
@@ -52,12 +52,14 @@ var	t, tel, gl, gwid, ghei, cops, ftd, ftx, vbu, shpr, dw, dh,
 	term_ready,
 	sock,
 	pend_send = [],
-	pend_display = [],
 	pend_escape = '', termid,
+	histcbs = [],
 	params, dead_key_hist, keep_row_ttl, row_ttl, locked_ttl, host,
 	repeat_cnt, repsignal, repeat_boxes = [], macro_map,
 	barrier_dig = [], barrdiv, font_key,
-	got_key_up = false, matching = [], macro_winpos, notitout;
+	got_key_up = false, matching = [], macro_winpos, notitout,
+	lat_keyat, lat_seq = 0, lat_pend = new Map(), lat_hist, lat_cnt = 0,
+	lat_div, wrkr;
 
 function notice(str)
 {
@@ -73,6 +75,7 @@ function notice(str)
 			x < str.length ? str.charCodeAt(x) : 0x20;
 		Xdrawglyph(t, scra, x++, 0);
 	}
+	instflush();
 
 	if (notitout) window.clearTimeout(notitout);
 	notitout = window.setTimeout(function()
@@ -94,6 +97,7 @@ function imposetsize()
 	if (!rc || !cc) return;
 
 	tresize(t, cc, rc);
+	if (wrkr) wrkr.postMessage({rsz: [cc, rc]});
 	signal(	'\\w'				+
 		rc.toString().padStart(4, '0')	+
 		cc.toString().padStart(4, '0')	);
@@ -151,38 +155,248 @@ function term_canv()
 var	deffg = defaultpalette(DEFAULTFG),
 	defbg = defaultpalette(DEFAULTBG);
 
-function unpackclr(c, rv)
+/* Glyphs and rectangles are not drawn as they come, but queued as instances of
+ * the one quad in vbu, and drawn in order by a single drawArraysInstanced in
+ * instflush. Each instance keeps what the shaders need of a cell, copied from
+ * scr when queued since the cursor and notice reuse the same scratch cell:
+ *
+ *	x, y, w, h	pixel rectangle of the cell on the canvas
+ *	tx, ty		atlas position of the glyph
+ *	mask		bit of the glyph in the atlas, or ~rune if it has none
+ *	mode		GLYPH_MODE, after toggling ATTR_REVERSE for selection
+ *	fg, bg		GLYPH_FG and GLYPH_BG, looked up in paltx by the shader
+ *	rv		MODE_REVERSE of the terminal, 0 for rectangles
+ */
+#define INST_ELCNT	12
+
+var	inst = new Int32Array(INST_ELCNT * 1024), instn = 0, instbu, paltx,
+	paltlut = new Int32Array(PALETTESIZ);
+
+function instget()
 {
-	var ci;
+	var o = instn++ * INST_ELCNT, n;
 
-	if (rv) {
-		if	(c == DEFAULTBG) { c = DEFAULTFG; rv = 0 }
-		else if	(c == DEFAULTFG) { c = DEFAULTBG; rv = 0 }
+	if (o + INST_ELCNT > inst.length) {
+		n = new Int32Array(inst.length * 2);
+		n.set(inst);
+		inst = n;
 	}
 
-	if (!IS_TRUECOL(c)) {
-		ci = c;
+	return o;
+}
 
-		c = fld(term(t,palt),c);
+/* Copies the palette to paltx, with the font's colors in place of the
+ * default foreground and background unless the palette changed them. */
+function paltupload()
+{
+	var p = term(t,palt), i;
 
-		if (ci == DEFAULTFG && c == deffg) c = fontfgrgb;
-		if (ci == DEFAULTBG && c == defbg) c = fontbgrgb;
+	for (i = 0; i < PALETTESIZ; i++) paltlut[i] = fld(p,i);
+	if (paltlut[DEFAULTFG] == deffg) paltlut[DEFAULTFG] = fontfgrgb;
+	if (paltlut[DEFAULTBG] == defbg) paltlut[DEFAULTBG] = fontbgrgb;
 
-		if (rv) c=~c;
-	}
+	gl.activeTexture(gl.TEXTURE1);
+	gl.bindTexture(gl.TEXTURE_2D, paltx);
+	gl.texSubImage2D(gl.TEXTURE_2D, 0, 0, 0, PALETTESIZ, 1,
+			 gl.RED_INTEGER, gl.INT, paltlut);
+	gl.activeTexture(gl.TEXTURE0);
+}
+
+function instflush()
+{
+	if (!instn || !shpr) return;
+
+	paltupload();
 
-	return [(c >> 16	& 0xff) / 0xff,
-		(c >> 8		& 0xff) / 0xff,
-		(c		& 0xff) / 0xff];
+	gl.bindBuffer(gl.ARRAY_BUFFER, instbu);
+	gl.bufferData(gl.ARRAY_BUFFER, inst, gl.DYNAMIC_DRAW,
+		      0, instn * INST_ELCNT);
+	gl.drawArraysInstanced(gl.TRIANGLE_FAN, 0, 4, instn);
+	gl.bindBuffer(gl.ARRAY_BUFFER, null);
+
+	instn = 0;
 }
 
 var unkcops = new Map();
 
+/* Returns where the next glyph goes in the texture, as kept in cops, or
+   undefined if the texture is full. Glyphs are laid out in rows, and the rows
+   in one bit of each pixel, then the next bit. */
+function ftalloc(wide)
+{
+	var gwidedwid = gwid << wide, copd;
+
+	if (ftd < ftxoff + gwidedwid) {
+		ftxoff = 0;
+		ftyoff += ghei;
+		if (ftyoff + ghei > ftd) {
+			ftyoff = 0;
+			ftmbit++;
+		}
+	}
+	if (ftmbit > 7) return undefined;
+
+	copd =	wide<<31	|
+		ftmbit<<28	|
+		ftyoff<<14	|
+		ftxoff;
+	ftxoff += gwidedwid;
+
+	return copd;
+}
+
+/* ORs the glyph at copd, whose rows of bits start at b[bi], into its place in
+   ftpx, and returns the index of the byte after it. */
+function ftputgl(copd, b, bi)
+{
+	var	bit = 0, x, y,
+		w = gwid << (copd >>> 31),
+		m = 1 << (copd >>> 28 & 0x0007),
+		yoff = copd >>> 14 & 0x3fff,
+		xoff = copd >>> 00 & 0x3fff;
+
+	for (y = 0; y < ghei; y++)
+	for (x = 0; x < w; x++, bit++) {
+		if (!(b[bi + (bit >> 3)] & 0x80 >> (bit & 7))) continue;
+		ftpx[(yoff + y) * ftd + xoff + x] |= m;
+	}
+
+	return bi + (bit + 7 >> 3);
+}
+
+/* Uploads rows y0 to y1 of ftpx to ftx and redraws with them. */
+function ftupload(y0, y1)
+{
+	if (y0 >= y1) return;
+
+	gl.bindTexture(gl.TEXTURE_2D, ftx);
+	gl.texSubImage2D(gl.TEXTURE_2D, 0, 0, y0, ftd, y1 - y0,
+			 gl.RED_INTEGER, gl.UNSIGNED_BYTE,
+			 ftpx.subarray(y0 * ftd, y1 * ftd));
+	redraw(t);
+}
+
+/* Fetches the pixels of page pgno of the font, whose glyphs are drawn blank
+   until they come. */
+function fetchfontpg(pgno)
+{
+	var pgs = ftpgs, pg = pgs.get(pgno), fr = new XMLHttpRequest();
+
+	pg.st = 1;
+	fr.open('GET', `/${ftndx}.${pgno.toString(16)}.wermfont?h=${pg.etag}`,
+		true);
+	fr.responseType = 'arraybuffer';
+
+	fr.onload = function(ev)
+	{
+		var b, bi = 0, y0 = ftd, y1 = 0;
+
+		if (pgs !== ftpgs) return;
+		if (fr.status != 200 || !fr.response) {
+			console.error('could not load font page', pgno);
+			return;
+		}
+
+		b = new Uint8Array(fr.response);
+		pg.cops.forEach(function(cop)
+		{
+			var copd = cops.get(cop), yoff = copd >>> 14 & 0x3fff;
+
+			bi = ftputgl(copd, b, bi);
+			y0 = Math.min(y0, yoff);
+			y1 = Math.max(y1, yoff + ghei);
+		});
+		ftupload(y0, y1);
+	};
+	fr.send(null);
+}
+
+/* Code points the font lacks, which are drawn as unknown until the server
+   rasterises them from its TrueType font, if it has one (see ttf.c). They are
+   asked for TTFBATCH at a time, and added to the texture after the font's own
+   glyphs. */
+#define TTFBATCH 256
+
+var ttfq = [], ttfsched = 0, ttfok = 1;
+
+function unkcop(cop)
+{
+	console.log(	`unknown cop: 0x${cop.toString(16)}, ` +
+			`i.e. ${String.fromCodePoint(cop)}`);
+}
+
+function ttfask(cop)
+{
+	if (!ttfok) return unkcop(cop);
+
+	ttfq.push(cop);
+	if (ttfsched) return;
+	ttfsched = 1;
+	setTimeout(fetchttf, 0);
+}
+
+function fetchttf()
+{
+	var	pgs = ftpgs, fr = new XMLHttpRequest(),
+		want = ttfq.splice(0, TTFBATCH);
+
+	ttfsched = 0;
+	if (!want.length) return;
+
+	fr.open('GET', `/glyphs?glw=${gwid}&glh=${ghei}&glcops=` + want.map(
+		function(cop)
+		{
+			return (cop | (charwi(cop) == 2) << 23).toString(16);
+		}).join(','), true);
+	fr.responseType = 'arraybuffer';
+
+	fr.onload = function(ev)
+	{
+		var b, bi = 0, y0 = ftd, y1 = 0, cop, copd;
+
+		if (pgs !== ftpgs) return;
+		if (fr.status != 200 || !fr.response) {
+			ttfok = 0;
+			want.forEach(unkcop);
+			ttfq.splice(0).forEach(unkcop);
+			return;
+		}
+
+		b = new Uint8Array(fr.response);
+		while (bi < b.length) {
+			cop	= b[bi++]<<16
+				| b[bi++]<<8
+				| b[bi++];
+			if (cop & 0x400000) {
+				unkcop(cop & 0x1fffff);
+				continue;
+			}
+
+			copd = ftalloc((cop & 0x800000) && 1);
+			cop &= 0x1fffff;
+			if (copd === undefined) {
+				console.log('font texture full, not adding', cop);
+				ttfq.length = 0;
+				break;
+			}
+
+			bi = ftputgl(copd, b, bi);
+			cops.set(cop, copd);
+			y0 = Math.min(y0, copd >>> 14 & 0x3fff);
+			y1 = Math.max(y1, (copd >>> 14 & 0x3fff) + ghei);
+		}
+		ftupload(y0, y1);
+
+		if (ttfq.length) fetchttf();
+	};
+	fr.send(null);
+}
+
 function Xdrawglyph(trm, scri, c, r)
 {
-	var cel, copd, wide, xoff, yoff, rv, eglymod,
+	var copd, wide, xoff, yoff, eglymod, o,
 		scr = term(trm,scr),
-		cop = fld(scr,scri), copcou, mbit, maskval;
+		cop = fld(scr,scri), copcou, mbit, maskval, pg;
 
 	if (!cop) return;
 
@@ -190,38 +404,36 @@ function Xdrawglyph(trm, scri, c, r)
 	if (copd === undefined) {
 		copcou = unkcops.get(cop) || 0;
 		unkcops.set(cop, 1+copcou);
-		if (!copcou)
-			console.log(	`unknown cop: 0x${cop.toString(16)}, ` +
-					`i.e. ${String.fromCodePoint(cop)}`);
+		if (!copcou) ttfask(cop);
 		maskval = cop == 0x20 || cop == 0x3000 ? 256 : ~cop;
 		wide = charwi(cop);
 		xoff = yoff = 0;
 	} else {
 		wide = copd >>> 31 ? 2 : 1;
 		mbit = copd >>> 28 & 0x0007;
-		yoff = copd >>> 14 & 0x7fff;
-		xoff = copd >>> 00 & 0x7fff;
+		yoff = copd >>> 14 & 0x3fff;
+		xoff = copd >>> 00 & 0x3fff;
 
 		maskval = 1 << mbit;
+		pg = ftpgs.get(cop >> 8);
+		if (pg && !pg.st) fetchfontpg(cop >> 8);
 	}
 
-	rv = term(trm,mode) & MODE_REVERSE;
-
 	eglymod = fld(scr,scri+GLYPH_MODE);
 	if (selected(trm, c, r)) eglymod ^= ATTR_REVERSE;
 
-	gl.uniform1i	(mask,		maskval);
-	gl.uniform1i	(glymode,	eglymod);
-	gl.uniform2f	(cli0,		-1 + c*gwid*clipixw,
-					+1 - r*ghei*clipixh);
-	gl.uniform2f	(celpxsz,	gwid * wide,
-					ghei);
-	gl.uniform2f	(tex0,		xoff, yoff);
-	gl.uniform3fv	(fgcolor,	unpackclr(fld(scr,scri+GLYPH_FG), rv));
-	gl.uniform3fv	(bgcolor,	unpackclr(fld(scr,scri+GLYPH_BG), rv));
-
-	gl.bindBuffer(gl.ARRAY_BUFFER, vbu);
-	gl.drawArrays(gl.TRIANGLE_FAN, 0, 4);
+	o = instget();
+	inst[o+ 0] = c * gwid;
+	inst[o+ 1] = r * ghei;
+	inst[o+ 2] = gwid * wide;
+	inst[o+ 3] = ghei;
+	inst[o+ 4] = xoff;
+	inst[o+ 5] = yoff;
+	inst[o+ 6] = maskval;
+	inst[o+ 7] = eglymod;
+	inst[o+ 8] = fld(scr,scri+GLYPH_FG);
+	inst[o+ 9] = fld(scr,scri+GLYPH_BG);
+	inst[o+10] = term(trm,mode) & MODE_REVERSE;
 }
 
 function Xdrawline(trm, x1, y1, x2)
@@ -234,20 +446,26 @@ function Xdrawline(trm, x1, y1, x2)
 
 function Xdrawrect(col, x, y, w, h)
 {
-	if (!gl) return;
+	var o;
 
-	gl.uniform1i	(glymode,	0);
-	gl.uniform1i	(mask,		0);
-	gl.uniform2f	(cli0,		-1 + x*clipixw,
-					+1 - y*clipixh);
-	gl.uniform2f	(celpxsz,	w, h);
-	gl.uniform3fv	(bgcolor,	unpackclr(col));
+	if (!gl) return;
 
-	gl.bindBuffer(gl.ARRAY_BUFFER, vbu);
-	gl.drawArrays(gl.TRIANGLE_FAN, 0, 4);
+	o = instget();
+	inst[o+ 0] = x;
+	inst[o+ 1] = y;
+	inst[o+ 2] = w;
+	inst[o+ 3] = h;
+	inst[o+ 4] = inst[o+ 5] = inst[o+ 6] = inst[o+ 7] = 0;
+	inst[o+ 8] = inst[o+ 9] = col;
+	inst[o+10] = 0;
 }
 
-function Xfinishdraw(trm)	{ gl.flush(); updaterepboxs(0, 1, 0, 0); }
+function Xfinishdraw(trm)
+{
+	instflush();
+	gl.flush();
+	updaterepboxs(0, 1, 0, 0);
+}
 
 function Xximspot(trm, cx, cy)	{ /*console.log('Xximspot', trm, cx, cy);*/}
 
@@ -455,6 +673,15 @@ wermcfg.basic_git_macros = 1;
 wermcfg.basic_vim_macros = 1;
 // END basic_vim_macros
 
+// BEGIN lattrace
+// Set this to truthy to trace the latency of key presses, from the key event to
+// the painting of the terminal output that follows. The time is split into
+// stages, shown as histograms in the top-right corner. The histograms are also
+// sent to the server now and then, which writes them to the dtach log if the
+// dtachlog=1 arg is given.
+wermcfg.lattrace = 0;
+// END lattrace
+
 function sanit(s)
 {
 	var e = [], c, ci;
@@ -628,19 +855,205 @@ function loadauxjs(spec)
 	}]);
 }
 
-function display(s)
+/* Paints an update from the server in damage mode, which is made by dmgbuild
+   in session.c, rather than running the terminal output through twrite. */
+function loaddmg(b)
 {
-	var next_esc, pend_i, c, pend_remain, nli, escpylo, coldex,
-		esclen, toesc;
+	var w = new Int32Array(b.slice().buffer), i, y, x, n, mode;
+
+	if (w[0] != term(t,row) || w[1] != term(t,col)) tresize(t, w[1], w[0]);
+
+	curs_x(term(t,curs))	= w[2];
+	curs_y(term(t,curs))	= w[3];
+	mode			= term(t,mode);
+	term(t,mode)		= w[4] & ~MODE_FOCUSED | mode & MODE_FOCUSED;
+	term(t,cursor)		= w[5];
+	if ((mode ^ term(t,mode)) & MODE_REVERSE) tfulldirt(t);
+
+	for (i = 6; i < w.length; ) {
+		y = w[i++];
+		x = w[i++];
+		n = w[i++];
+
+		if (y < 0) {
+			jsobj(term(t,palt)).set(w.subarray(i, i + n), x);
+			i += n;
+			tfulldirt(t);
+			continue;
+		}
 
-	function pend(di) { return pend_display[pend_i + di]; }
-	function is_utf_trail(di) {
-		if (0x80 == (pend(di) & 0xc0)) return true;
-		console.warn('not a utf8 trailing byte in print data');
-		tputc(t, ORD('?'));
-		draw(t);
-		return false;
+		n *= GLYPH_ELCNT;
+		jsobj(term(t,scr)).set(w.subarray(i, i + n),
+				       term_cellf(t, y, x));
+		i += n;
+		fld(term(t,dirty), y) = 1;
+	}
+
+	showsoon();
+}
+
+/* Handles a control message from the server, such as \\@title:foo, where nm is
+   "title" and pylo is "foo". */
+function ctlmsg(nm, pylo)
+{
+	switch (nm) {
+	case 'stbin':
+		inqdrain();
+		loadstate(unb64(pylo));
+		showsoon();
+	break;	case 'dmg':
+		inqdrain();
+		loaddmg(unb64(pylo));
+	break;	case 'title':
+		row_ttl = pylo;
+		locked_ttl = !!row_ttl;
+		set_title();
+	break;	case 'auxjs':
+		loadauxjs(pylo);
+	break;	case 'hist':
+		gothist(pylo);
+	break;	case 'lat':
+		latgot(pylo);
+	break;	case 'appendid':
+		termid += pylo;
+		history.replaceState(
+			{}, '', '/?termid=' + termid);
+	break;	default:
+		console.warn('unknown control message', nm);
+	}
+}
+
+/* Asks the server for up to cnt lines of the session's history starting at line
+   number from, or the newest lines if from is negative. cb gets the number of
+   the oldest line the server has, one past the newest, the number of the first
+   line returned, and the lines. This lets aux.js page history lazily. */
+function fetchhist(from, cnt, cb)
+{
+	var hx = from < 0 ? 'ffffffffffff' : from.toString(16).padStart(12, '0');
+
+	histcbs.push(cb);
+	signal('\\y' + hx + Math.min(cnt, 0xffff).toString(16).padStart(4, '0'));
+}
+
+function gothist(pylo)
+{
+	var	coldex = pylo.indexOf(':'),
+		rng = pylo.substring(0, coldex).split(',').map(Number),
+		lns = new TextDecoder().decode(unb64(pylo.substring(coldex+1))),
+		cb = histcbs.shift();
+
+	lns = lns.split('\n');
+	lns.pop();
+	if (cb) cb(rng[0], rng[1], rng[2], lns);
+}
+
+function unb64(s)
+{
+	return Uint8Array.from(atob(s), function(c) { return c.charCodeAt(0) });
+}
+
+var inqsched = 0;
+
+/* Writes all of inq, for when what comes next must not pass the output queued
+   before it. */
+function inqdrain()
+{
+	while (term_ready && inqshow(inqn)) {}
+}
+
+function showframe()
+{
+	var st = performance.now();
+
+	inqsched = 0;
+	while (inqshow(INQSLICE)) {
+		if (document.hidden || performance.now() - st < INQFRAMEMS)
+			continue;
+
+		/* The rest waits for the next frame. */
+		if (inqn) showsoon();
+		break;
+	}
+
+	showdrawn();
+}
+
+/* Has the queued output written and the terminal drawn in the next frame. A tab
+   in the background gets no frames, so it is done in a timeout instead. */
+function showsoon()
+{
+	if (!term_ready || inqsched) return;
+
+	inqsched = 1;
+	if (document.hidden)	setTimeout(showframe, 0);
+	else			requestAnimationFrame(showframe);
+}
+
+/* Draws what changed on the terminal and updates the title to match. */
+function showdrawn()
+{
+	draw(t);
+
+	if (locked_ttl || keep_row_ttl) return;
+
+	set_title();
+	keep_row_ttl = setTimeout(function()
+	{
+		keep_row_ttl = null;
+		set_title();
+	}, 2000);
+}
+
+/* Handles a binary frame from the server. The first byte is a tag: 'o' for raw
+   terminal output, 's' for the terminal state, 'd' for a damage mode update,
+   or '@' for a control message like "title:foo". */
+function displaybin(b)
+{
+	var i, s;
+
+	if (log_display) console.log('displaybin:', b);
+
+	if (b[0] == ORD('@')) {
+		s = new TextDecoder().decode(b.subarray(1));
+		i = s.indexOf(':');
+		ctlmsg(s.substring(0, i), s.substring(i+1));
+		return;
+	}
+
+	if (b[0] == ORD('s')) {
+		if (wrkr) {
+			wrkr.postMessage({s: b.subarray(1)});
+			return;
+		}
+		inqdrain();
+		loadstate(b.subarray(1));
+		showsoon();
+		return;
 	}
+	if (b[0] == ORD('d')) {
+		inqdrain();
+		loaddmg(b.subarray(1));
+		return;
+	}
+
+	if (b[0] != ORD('o')) {
+		console.warn('unknown binary frame tag', b[0]);
+		return;
+	}
+
+	if (wrkr)	wrkr.postMessage({o: b.subarray(1)});
+	else		inqput(b.subarray(1));
+	showsoon();
+}
+
+var utf8enc = new TextEncoder();
+
+/* Handles text from the server, which is printable ASCII with other bytes sent
+   as \\xx hex escapes and control messages as \\@name:payload. Newlines only
+   end escapes, the server adding them as it likes. */
+function display(s)
+{
+	var i, c, nli = -1, coldex, b;
 
 	function hex_val(i)
 	{
@@ -660,149 +1073,81 @@ function display(s)
 		pend_escape = '';
 	}
 
-	while (true) {
-		next_esc = s.indexOf('\\');
-		if (next_esc === -1) next_esc = s.length;
-		/* |toesc| check below is to not allow empty strings
-		   onto pend_display, as we would otherwise be unable to
-		   interpret utf-8 multibyte chars later on, as these
-		   must be contiguous byte values in the array. We don't
-		   want dtach and related stuff to become utf-8 aware so
-		   we handle that awkardness here. */
-		if (next_esc > 0) {
-			toesc = s.substr(0, next_esc)
-				.replaceAll('\n', '');
-			if (toesc) pend_display.push(toesc);
-			s = s.substr(next_esc);
-		}
-
-		if (!s) break;
-
-		nli = s.indexOf('\n');
-		if (nli == -1) {
-			// Escape may be incomplete, since we haven't
-			// received a full line from the server.
-			pend_escape = s;
-			break;
-		}
-
-		if (s.startsWith('\\@')) {
-			coldex = s.indexOf(':');
-			escpylo = s.substring(coldex+1, nli);
-			esclen = nli + 1;
-		} else esclen = 3;
-
-		if (s.startsWith('\\@state:')) {
-			escpylo		= JSON.parse(escpylo);
-			bufsa		= escpylo.bs;
-			bufsfreehead	= escpylo.fh;
-			t		= escpylo.t;
-			term4cli();
-			topr		= deqmk();
-			bufsa.forEach(function(a, ai)
-			{
-				if (typeof a == 'object')
-					bufsa[ai] = new Int32Array(a);
-			});
-		}
-		else if (s.startsWith('\\@title:')) {
-			row_ttl = escpylo;
-			locked_ttl = !!row_ttl;
-			set_title();
-		}
-		else if (s.startsWith('\\@auxjs:')) {
-			loadauxjs(escpylo);
-		}
-		else if (s.startsWith('\\@appendid:')) {
-			termid += escpylo;
-			history.replaceState(
-				{}, '', '/?termid=' + termid);
-		}
-		else
-			pend_display.push(hex_val(1) * 16 + hex_val(2));
-
-		s = s.substr(esclen);
-	}
-
-	if (!term_ready) return;
-
-	for (pend_i = 0; pend_i < pend_display.length; pend_i++) {
-		if (typeof pend(0) === 'string') {
-			topr = deqpshutf8(topr, pend(0), -1);
-			continue;
-		}
-
-		if (pend(0) < 0x80) {
-			topr = deqpushbyt(topr, pend(0));
+	for (i = 0; i < s.length; i++) {
+		c = s.charCodeAt(i);
+		if (c == ORD('\n')) continue;
+		if (c >= 0x80) {
+			c = s.codePointAt(i);
+			if (c > 0xffff) i++;
+			inqput(utf8enc.encode(String.fromCodePoint(c)));
 			continue;
 		}
-
-		c = 0;
-		pend_remain = pend_display.length - pend_i;
-		if (pend_remain < 2) break;
-		if (!is_utf_trail(1)) continue;
-		c += pend(1) & ~0xc0;
-
-		if (0xc0 == (pend(0) & 0xe0)) {
-			c += (pend(0) & ~0xe0) << 6;
-			topr = deqpushcop(topr, c);
-			pend_i+=1;
+		if (c != ORD('\\')) {
+			inqputbyt(c);
 			continue;
 		}
 
-		c <<= 6;
-		if (pend_remain < 3) break;
-		if (!is_utf_trail(2)) continue;
-		c += pend(2) & ~0xc0;
-
-		if (0xe0 == (pend(0) & 0xf0)) {
-			c += (pend(0) & ~0xf0) << 12;
-			topr = deqpushcop(topr, c);
-			pend_i+=2;
-			continue;
+		// Escape may be incomplete, since we haven't
+		// received a full line from the server.
+		if (nli < i) nli = s.indexOf('\n', i);
+		if (nli == -1) {
+			pend_escape = s.substring(i);
+			break;
 		}
 
-		c <<= 6;
-		if (pend_remain < 4) break;
-		if (!is_utf_trail(3)) continue;
-		c += pend(3) & ~0xc0;
-
-		if (0xf0 == (pend(0) & 0xf8)) {
-			c += (pend(0) & ~0xf8) << 18;
-			topr = deqpushcop(topr, c);
-			pend_i+=3;
-			continue;
+		if (s.charCodeAt(i+1) == ORD('@')) {
+			coldex = s.indexOf(':', i);
+			ctlmsg(s.substring(i+2, coldex), s.substring(coldex+1, nli));
+			i = nli;
+		} else {
+			inqputbyt(hex_val(i+1) * 16 + hex_val(i+2));
+			i += 2;
 		}
-
-		console.warn('not a valid utf8 sequence');
-		topr = deqpushbyt(topr, ORD('?'));
 	}
 
-	twrite(t, topr, -1, 0);
-	draw(t);
-	deqclear(topr);
-
-	pend_display = pend_display.slice(pend_i);
-
-	if (locked_ttl || keep_row_ttl) return;
+	if (wrkr && inqn) {
+		b = new Uint8Array(inqn);
+		inqtake(b, inqn);
+		wrkr.postMessage({o: b});
+	}
+	showsoon();
+}
 
-	set_title();
-	keep_row_ttl = setTimeout(function()
+/* Starts the worker of wrkr.js to run the terminal emulator, so the terminal
+   here is only written to by the updates it sends back. */
+function startwrkr()
+{
+	wrkr = new Worker('/wrkr');
+	wrkr.onmessage = function(e)
 	{
-		keep_row_ttl = null;
-		set_title();
-	}, 2000);
+		var m = e.data;
+
+		if (m.dmg)			loaddmg(new Uint8Array(m.dmg));
+		else if (m.stgen !== undefined)	stgen = m.stgen;
+		else if (m.osc52 !== undefined)	osc52copy(m.osc52);
+	};
+	wrkr.postMessage({rsz: [term(t,col), term(t,row)]});
 }
 
 function prepare_sock()
 {
 	sock = new WebSocket(
-		location.origin.replace(/^http/, 'ws') + '/' + location.search);
+		location.origin.replace(/^http/, 'ws') + '/' +
+		(location.search ? location.search + '&' : '?') + 'wsbin=1' +
+		(stgen ? '&stgen=' + stgen : ''));
+	sock.binaryType = 'arraybuffer';
 	/* signalsize implicitly sends pending sends that have
 	   accumulated while disconnected. */
 	sock.onopen = function() { signal('\\i' + endptid()); imposetsize() };
 
 	sock.onmessage = function(e) {
+		if (typeof e.data != 'string') {
+			if (log_packin)
+				console.log(`packet in ${e.data.byteLength} `
+					    + 'byte(s)', [e.data]);
+			displaybin(new Uint8Array(e.data));
+			return;
+		}
 		if (log_packin)
 			console.log(`packet in ${e.data.length} chr(s)`,
 				    [e.data]);
@@ -816,10 +1161,130 @@ function prepare_sock()
 	};
 }
 
+/* Stages of a key's latency, as traced if wermcfg.lattrace is set:
+	key:	from the key event to sending the key
+	kbd:	from the key reaching the master to its write to the pty
+	shell:	from then to the subproc writing output
+	net:	the rest of the round trip, such as the network both ways
+	paint:	from the timings arriving to the next frame being painted
+   A histogram has a bucket for each doubling of the time from 0.25 ms, the last
+   for anything longer. */
+#define LAT_BKTS 12
+#define LAT_REPEVERY 64
+var LAT_STAGES = ['key', 'kbd', 'shell', 'net', 'paint'];
+
+function latbound(bi) { return 0.25 * 2 ** bi; }
+
+/* Stamps s, the first signal sent for a key, so the server sends back the
+   timings of the key in a \\@lat message. */
+function latstamp(s)
+{
+	lat_seq = (lat_seq + 1) % 0x100000000;
+	lat_pend.set(lat_seq, [lat_keyat, performance.now()]);
+	return s + '\\L' + lat_seq.toString(16).padStart(8, '0');
+}
+
+function latgot(pylo)
+{
+	var	f = pylo.split(','), id = parseInt(f[0], 16),
+		p = lat_pend.get(id), got = performance.now(),
+		kbd = f[1] / 1000, shell = f[2] / 1000;
+
+	/* The server only traces the last key stamped, so no timings will come
+	   for the ones before it. */
+	lat_pend.forEach(function(v, pid)
+	{
+		if (pid <= id) lat_pend.delete(pid);
+	});
+
+	if (!p) return;
+
+	requestAnimationFrame(function()
+	{
+		latadd([p[1] - p[0], kbd, shell, got - p[1] - kbd - shell,
+			performance.now() - got]);
+	});
+}
+
+/* Adds the milliseconds of each stage of a key to the histograms. */
+function latadd(ms)
+{
+	var si, bi;
+
+	if (!lat_hist) lat_hist = LAT_STAGES.map(function()
+	{
+		return new Array(LAT_BKTS).fill(0);
+	});
+
+	for (si = 0; si < ms.length; si++) {
+		for (bi = 0; bi < LAT_BKTS-1 && ms[si] >= latbound(bi); bi++) {}
+		lat_hist[si][bi]++;
+	}
+
+	lat_cnt++;
+	latshow();
+
+	if (lat_cnt % LAT_REPEVERY) return;
+	signal('\\l' + LAT_STAGES.map(function(nm, si)
+	{
+		return nm + ':' + lat_hist[si].join(',');
+	}).join(';') + '\n');
+}
+
+/* Shows the histograms in an overlay, each with the bucket bound the median and
+   90th percentile fall under. */
+function latshow()
+{
+	var s, bars = ' \u2581\u2582\u2583\u2584\u2585\u2586\u2587\u2588';
+
+	if (!lat_div) {
+		lat_div = document.createElement('div');
+		s = lat_div.style;
+		s.position = 'fixed';
+		s.top = '0';
+		s.right = '0';
+		s.padding = '4pt';
+		s.whiteSpace = 'pre';
+		s.fontFamily = 'monospace';
+		s.fontSize = '9pt';
+		s.color = 'white';
+		s.backgroundColor = 'rgba(0, 0, 0, 0.7)';
+		s.pointerEvents = 'none';
+		document.body.appendChild(lat_div);
+	}
+
+	function pct(h, f)
+	{
+		var bi, sum = 0, want = f * lat_cnt;
+
+		for (bi = 0; bi < LAT_BKTS-1; bi++) {
+			sum += h[bi];
+			if (sum >= want) return '<' + latbound(bi);
+		}
+		return '>' + latbound(LAT_BKTS-2);
+	}
+
+	lat_div.innerText = `key latency (ms) over ${lat_cnt} keys\n` +
+		LAT_STAGES.map(function(nm, si)
+	{
+		var h = lat_hist[si], top = Math.max.apply(null, h);
+
+		return nm.padEnd(6) + h.map(function(n)
+		{
+			return bars[Math.ceil(n / top * (bars.length-1))];
+		}).join('') + ` p50 ${pct(h, .5)} p90 ${pct(h, .9)}`;
+	}).join('\n');
+}
+
 function signal(s)
 {
 	var s;
 
+	if (lat_keyat) {
+		s = latstamp(s);
+		lat_keyat = 0;
+	}
+
 	pend_send.push(s);
 	if (sock.readyState >	WebSocket.OPEN) prepare_sock();
 	if (sock.readyState !=	WebSocket.OPEN) return;
@@ -1062,11 +1527,16 @@ function set_font(ndx)
 	fr.onload = function(ev)
 	{
 		var	ab = fr.response, bar, gcon, bi = 0, cop, wide, fg, bg,
-			mbit = 0, xoff = 0, yoff = 0, gwidedwid, 	vshdr,
+			pgcon, pgno, pg,				vshdr,
 									fshdr;
 		if (!ab) { console.error('could not load font data'); return; }
 
 		cops = new Map();
+		ftpgs = new Map();
+		ftndx = ndx;
+		ftxoff = ftyoff = ftmbit = 0;
+		unkcops = new Map();
+		ttfq.length = 0;
 
 		bar = new Uint8Array(ab);
 		gwid	= bar[bi++];
@@ -1091,27 +1561,31 @@ function set_font(ndx)
 			wide = (cop &	0x800000) && 1	;
 			cop &= ~	0x800000	;
 
-			gwidedwid = gwid << wide;
-			if (ftd < xoff + gwidedwid) {
-				xoff = 0;
-				yoff += ghei;
-				if (yoff + ghei > ftd) {
-					yoff = 0;
-					mbit++;
-				}
-			}
-			cops.set(cop,	wide<<31 |
-					mbit<<28 |
-					yoff<<14 |
-					xoff);
-			xoff += gwidedwid;
+			cops.set(cop, ftalloc(wide));
+
+			pg = ftpgs.get(cop >> 8);
+			if (!pg) ftpgs.set(cop >> 8, pg = {cops: [], st: 0});
+			pg.cops.push(cop);
 		}
 
-		bar = bar.subarray(bi);
-		if (bar.length != ftd * ftd) {
-			console.log(	'texture data wrong sz=%d, ftd=%d:',
-					bar.length, ftd);
+		/* The page list, whose pages fetchfontpg loads as they are
+		   drawn */
+		pgcon	= bar[bi++]<<8
+			| bar[bi++];
+		while (pgcon--) {
+			pgno	= bar[bi++]<<8
+				| bar[bi++];
+			pg = ftpgs.get(pgno);
+			pg.etag = String.fromCharCode.apply(
+				null, bar.subarray(bi, bi + 16));
+			bi += 16;
 		}
+		if (bi != bar.length) {
+			console.log(	'font header wrong sz=%d, read=%d:',
+					bar.length, bi);
+		}
+
+		ftpx = new Uint8Array(ftd * ftd);
 		ftx = gl.createTexture();
 
 		gl.pixelStorei(gl.UNPACK_ALIGNMENT, 1);
@@ -1125,7 +1599,7 @@ function set_font(ndx)
 			/*(must be 0) border=*/	0, 
 			/*format=*/		gl.RED_INTEGER,
 			/*type=*/		gl.UNSIGNED_BYTE,
-			bar,
+			ftpx,
 		);
 		gl.texParameteri(
 			gl.TEXTURE_2D,gl.TEXTURE_MIN_FILTER,gl.NEAREST);
@@ -1140,18 +1614,50 @@ function set_font(ndx)
 precision mediump float;
 
 in	vec2	clicoor;
-uniform	vec2	cli0;
+in	ivec4	celrect;
+in	ivec4	celtex;
+in	ivec4	celclr;
 uniform	vec2	cliclsz;
-uniform vec2	celpxsz;
-uniform	vec2	tex0;
 uniform float	texpxsz;
+uniform	highp	isampler2D palt;
 out 	vec2	texcoor;
+flat out vec2	celpxsz;
+flat out vec2	tex0;
+flat out int	mask;
+flat out int	glymode;
+flat out vec3	fgcolor;
+flat out vec3	bgcolor;
+
+vec3 unpackclr(int c, int rv)
+{
+	if (rv != 0) {
+		if	(c == DEFAULTBG) { c = DEFAULTFG; rv = 0; }
+		else if	(c == DEFAULTFG) { c = DEFAULTBG; rv = 0; }
+	}
+
+	if (0 == IS_TRUECOL(c)) {
+		c = texelFetch(palt, ivec2(c, 0), 0).r;
+		if (rv != 0) c = ~c;
+	}
+
+	return vec3(c >> 16 & 0xff, c >> 8 & 0xff, c & 0xff) / 255.0;
+}
 
 void main()
 {
-	vec2	celloff = clicoor * celpxsz;
+	vec2	celloff;
+
+	celpxsz		= vec2(celrect.zw);
+	tex0		= vec2(celtex.xy);
+	mask		= celtex.z;
+	glymode		= celtex.w;
+	fgcolor		= unpackclr(celclr.x, celclr.z);
+	bgcolor		= unpackclr(celclr.y, celclr.z);
+
+	celloff		= clicoor * celpxsz;
 
-	gl_Position	= vec4(	celloff * cliclsz + cli0, 0, 1);
+	gl_Position	= vec4(	(celloff + vec2(celrect.xy)) * cliclsz
+				+ vec2(-1, 1), 0, 1);
 
 	texcoor		=	celloff * texpxsz + tex0 * texpxsz;
 }
@@ -1160,14 +1666,14 @@ void main()
 `#version 300 es
 precision mediump float;
 
-uniform int	glymode;
-uniform	int	mask;
-uniform vec3	bgcolor;
-uniform vec3	fgcolor;
-uniform	vec2	tex0;
+flat in	int	glymode;
+flat in	int	mask;
+flat in	vec3	bgcolor;
+flat in	vec3	fgcolor;
+flat in	vec2	tex0;
 in	vec2	texcoor;
 out	vec4	fragColor;
-uniform vec2	celpxsz;
+flat in	vec2	celpxsz;
 uniform float	texpxsz;
 
 uniform	lowp	usampler2D tex;
@@ -1257,15 +1763,25 @@ void main()
 		gl.useProgram			(shpr);
 
 		clicoor	= gl.getAttribLocation	(shpr, "clicoor");
-		bgcolor = gl.getUniformLocation	(shpr, "bgcolor");
-		fgcolor = gl.getUniformLocation	(shpr, "fgcolor");
-		glymode = gl.getUniformLocation	(shpr, "glymode");
 		texpxsz = gl.getUniformLocation	(shpr, "texpxsz");
 		cliclsz	= gl.getUniformLocation	(shpr, "cliclsz");
-		celpxsz	= gl.getUniformLocation	(shpr, "celpxsz");
-		tex0	= gl.getUniformLocation	(shpr, "tex0");
-		cli0	= gl.getUniformLocation	(shpr, "cli0");
-		mask	= gl.getUniformLocation	(shpr, "mask");
+
+		gl.uniform1i(gl.getUniformLocation(shpr, "tex"),	0);
+		gl.uniform1i(gl.getUniformLocation(shpr, "palt"),	1);
+
+		if (!paltx) {
+			paltx = gl.createTexture();
+			gl.activeTexture(gl.TEXTURE1);
+			gl.bindTexture(gl.TEXTURE_2D, paltx);
+			gl.texImage2D(gl.TEXTURE_2D, 0, gl.R32I,
+				      PALETTESIZ, 1, 0,
+				      gl.RED_INTEGER, gl.INT, paltlut);
+			gl.texParameteri(gl.TEXTURE_2D,
+					 gl.TEXTURE_MIN_FILTER, gl.NEAREST);
+			gl.texParameteri(gl.TEXTURE_2D,
+					 gl.TEXTURE_MAG_FILTER, gl.NEAREST);
+			gl.activeTexture(gl.TEXTURE0);
+		}
 
 		vbu = gl.createBuffer();
 		gl.bindBuffer(	gl.ARRAY_BUFFER, vbu);
@@ -1285,6 +1801,21 @@ void main()
 					/*stride	*/ 0		,
 					/*offset	*/ 0		);
 
+		if (!instbu) instbu = gl.createBuffer();
+		gl.bindBuffer(	gl.ARRAY_BUFFER, instbu);
+		["celrect", "celtex", "celclr"].forEach(function(nm, i)
+		{
+			var loc = gl.getAttribLocation(shpr, nm);
+
+			gl.enableVertexAttribArray(	loc);
+			gl.vertexAttribIPointer(	loc			,
+					/*size		*/ 4			,
+					/*type		*/ gl.INT		,
+					/*stride	*/ INST_ELCNT * 4	,
+					/*offset	*/ i * 16		);
+			gl.vertexAttribDivisor(		loc, 1);
+		});
+
 		gl.bindBuffer(	gl.ARRAY_BUFFER, null);
 		readywindow();
 		adjust();
@@ -1601,7 +2132,7 @@ function process_mkey(e)
 
 function sporkeydown(e)
 {
-	var ce;
+	var ce, sent;
 
 	if (log_keys) console.log('scrollport key:', e);
 
@@ -1616,7 +2147,10 @@ function sporkeydown(e)
 		push_dead_key_hist(ce);
 		dead_key_hist.splice(0, 2);
 
-		if (!process_key_down(ce)) return;
+		lat_keyat = wermcfg.lattrace && e.timeStamp;
+		sent = process_key_down(ce);
+		lat_keyat = 0;
+		if (!sent) return;
 	}
 	e.stopPropagation();
 	e.preventDefault();
@@ -1667,6 +2201,7 @@ window.onload = function()
 	prepare_sock();
 	params = new URLSearchParams(window.location.search);
 	termid = params.get('termid');
+	if (params.get('wrkr')) startwrkr();
 	dead_key_hist = ['?', 'x', '?', 'x'];
 	display('');
 
@@ -13,10 +13,29 @@
 #include <stdint.h>
 #include <sys/uio.h>
 #include <arpa/inet.h>
+#include <zlib.h>
 
 #include "outstreams.h"
 #include "shared.h"
 
+static void fdb_flush(struct fdbuf *b)
+{
+	char hd[20];
+
+	if (!b->chunked) {
+		full_write(b->de, b->bf, b->len);
+		return;
+	}
+
+	/* A zero-length chunk would end the body early. */
+	if (!b->len) return;
+
+	sprintf(hd, "%x\r\n", b->len);
+	full_write(b->de, hd, -1);
+	full_write(b->de, b->bf, b->len);
+	full_write(b->de, "\r\n", 2);
+}
+
 void fdb_apnd(struct fdbuf *b, const void *buf_, ssize_t len)
 {
 	const unsigned char *buf = buf_;
@@ -32,7 +51,7 @@ void fdb_apnd(struct fdbuf *b, const void *buf_, ssize_t len)
 	while (len) {
 		if (b->cap == b->len) {
 			if (b->de) {
-				full_write(b->de, b->bf, b->len);
+				fdb_flush(b);
 				b->len = 0;
 				continue;
 			}
@@ -53,6 +72,26 @@ void fdb_apnd(struct fdbuf *b, const void *buf_, ssize_t len)
 	}
 }
 
+unsigned char *fdb_room(struct fdbuf *b, size_t n)
+{
+	if (!b->cap) b->cap = 64;
+
+	if (b->de && b->len && b->cap - b->len < n) {
+		fdb_flush(b);
+		b->len = 0;
+	}
+
+	if (b->cap - b->len < n) {
+		b->cap += b->cap / 2;
+		if (b->cap - b->len < n) b->cap = b->len + n;
+		b->bf = realloc(b->bf, b->cap);
+	}
+	else if (!b->bf)
+		b->bf = malloc(b->cap);
+
+	return b->bf + b->len;
+}
+
 void fdb_apnc(struct fdbuf *b, int c_)
 {
 	char c = c_;
@@ -65,16 +104,18 @@ static void fullwriannot(struct wrides *de, const unsigned char *br, size_t sz)
 	struct wrides basde = {de->fd};
 	struct fdbuf eb = {&basde};
 	char esc[5];
+	unsigned char c;
 
 	fdb_apnd(&eb, de->escannot, -1);
 	fdb_apnd(&eb, "[", -1);
 
 	while (sz--) {
-		esc[0] = *br++;
+		c = *br++;
+		esc[0] = c;
 		esc[1] = 0;
 
-		if (*esc == '\\') strcpy(esc, "\\\\");
-		else if (*esc < ' ') sprintf(esc, "\\%03o", *esc);
+		if (c == '\\') strcpy(esc, "\\\\");
+		else if (c < ' ' || c > '~') sprintf(esc, "\\%03o", c);
 
 		fdb_apnd(&eb, esc, -1);
 	}
@@ -85,11 +126,13 @@ static void fullwriannot(struct wrides *de, const unsigned char *br, size_t sz)
 
 void fdb_finsh(struct fdbuf *b)
 {
-	if (b->len && b->de) full_write(b->de, b->bf, b->len);
+	if (b->len && b->de) fdb_flush(b);
+	if (b->chunked && b->de) full_write(b->de, "0\r\n\r\n", -1);
 
 	free(b->bf);
 	b->bf = 0;
 	b->len = b->cap = 0;
+	b->chunked = 0;
 }
 
 static int hexdig(int v)
@@ -166,6 +209,49 @@ void fdb_itoa(struct fdbuf *b, long long i)
 	while (bc != bf);
 }
 
+static const char b64dig[] =
+	"ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+void fdb_b64(struct fdbuf *b, const void *dat, size_t len)
+{
+	const unsigned char *d = dat;
+	unsigned long v;
+
+	for (; len >= 3; len -= 3, d += 3) {
+		v = d[0] << 16 | d[1] << 8 | d[2];
+		fdb_apnc(b, b64dig[v >> 18]);
+		fdb_apnc(b, b64dig[v >> 12 & 63]);
+		fdb_apnc(b, b64dig[v >> 6 & 63]);
+		fdb_apnc(b, b64dig[v & 63]);
+	}
+	if (!len) return;
+
+	v = d[0] << 16 | (len > 1 ? d[1] << 8 : 0);
+	fdb_apnc(b, b64dig[v >> 18]);
+	fdb_apnc(b, b64dig[v >> 12 & 63]);
+	fdb_apnc(b, len > 1 ? b64dig[v >> 6 & 63] : '=');
+	fdb_apnc(b, '=');
+}
+
+void fdb_unb64(struct fdbuf *b, const char *s, size_t len)
+{
+	const char *dp;
+	unsigned long v = 0;
+	int bits = 0;
+
+	while (len--) {
+		dp = strchr(b64dig, *s++);
+		if (!dp || !*dp) continue;
+
+		v = v << 6 | (dp - b64dig);
+		bits += 6;
+		if (bits < 8) continue;
+
+		bits -= 8;
+		fdb_apnc(b, v >> bits);
+	}
+}
+
 void full_write(struct wrides *de, const void *buf_, ssize_t sz)
 {
 	ssize_t writn;
@@ -190,12 +276,225 @@ void full_write(struct wrides *de, const void *buf_, ssize_t sz)
 		}
 		else {
 			perror("full_write");
-			if (errno != EINTR) return;
+			if (errno != EINTR) { de->broken = 1; return; }
 		}
 	} while (sz);
 }
 
-void write_wbsoc_frame(const void *buf, ssize_t len)
+static void iovq_add(struct iovq *q, struct fdbuf *src, size_t of,
+		     size_t len)
+{
+	struct iovqp *l = q->cnt ? q->p + q->cnt - 1 : 0;
+
+	if (!len) return;
+
+	/* Extend the last piece if this one follows on from it. */
+	if (l && l->src == src && l->of + l->len == of) {
+		l->len += len;
+		return;
+	}
+
+	if (q->cnt == q->cap) {
+		q->cap = q->cap ? q->cap * 2 : 8;
+		q->p = realloc(q->p, q->cap * sizeof(*q->p));
+	}
+	q->p[q->cnt++] = (struct iovqp){src, of, len};
+}
+
+void iovq_cpy(struct iovq *q, const void *b, size_t len)
+{
+	iovq_add(q, 0, q->own.len, len);
+	fdb_apnd(&q->own, b, len);
+}
+
+void iovq_ref(struct iovq *q, struct fdbuf *src, size_t of, size_t len)
+{
+	iovq_add(q, src, of, len);
+}
+
+int iovq_pending(const struct iovq *q) { return q->hd < q->cnt; }
+
+size_t iovq_left(const struct iovq *q)
+{
+	size_t left = 0;
+	unsigned pi;
+
+	for (pi = q->hd; pi < q->cnt; pi++) left += q->p[pi].len;
+
+	return left - (q->hd < q->cnt ? q->hdof : 0);
+}
+
+ssize_t iovq_write(struct iovq *q, int fd)
+{
+	struct iovec v[64];
+	struct iovqp *pc;
+	unsigned vc;
+	size_t of;
+	ssize_t writn, left;
+
+	for (vc = 0; vc < 64 && q->hd + vc < q->cnt; vc++) {
+		pc = q->p + q->hd + vc;
+		of = vc ? 0 : q->hdof;
+
+		v[vc].iov_base = (pc->src ? pc->src : &q->own)->bf + pc->of + of;
+		v[vc].iov_len = pc->len - of;
+	}
+	if (!vc) return 0;
+
+	writn = writev(fd, v, vc);
+	if (writn <= 0) return writn;
+
+	for (left = writn; left; ) {
+		pc = q->p + q->hd;
+		if (left < pc->len - q->hdof) {
+			q->hdof += left;
+			break;
+		}
+		left -= pc->len - q->hdof;
+		q->hd++;
+		q->hdof = 0;
+	}
+
+	return writn;
+}
+
+void iovq_reset(struct iovq *q)
+{
+	q->own.len = 0;
+	q->cnt = q->hd = 0;
+	q->hdof = 0;
+}
+
+void iovq_fre(struct iovq *q)
+{
+	fdb_finsh(&q->own);
+	free(q->p);
+	memset(q, 0, sizeof(*q));
+}
+
+/* Writes everything in q to the blocking fd. */
+static void iovq_drain(struct iovq *q, int fd)
+{
+	ssize_t writn;
+
+	while (iovq_pending(q)) {
+		writn = iovq_write(q, fd);
+		if (writn < 0 && errno == EINTR) continue;
+		if (writn <= 0) {
+			perror("writev websocket frames");
+			abort();
+		}
+	}
+}
+
+/* State of the frames sent over one websocket. */
+struct wbsoc {
+	/* permessage-deflate state */
+	struct {
+		z_stream zs;
+		struct fdbuf out;
+		unsigned minsz;
+		unsigned on : 1, reset : 1;
+	} defl;
+
+	/* State of the decoder of client output into binary frames. st is 0
+	   between escapes, '\\' after a backslash, 'x' after the first of two
+	   hex digits (kept in hi), and '@' inside a control message. fr is the
+	   frame being built, whose first byte is the tag. */
+	struct {
+		int st, hi;
+		struct fdbuf fr;
+	} rout;
+
+	unsigned bin : 1;
+};
+
+/* The websocket on stdout */
+static struct wbsoc stdws;
+
+static void wsdeflate(struct wbsoc *ws, int lvl, unsigned minsz, int winbits,
+		      int reset)
+{
+	if (ws->defl.on) deflateEnd(&ws->defl.zs);
+	memset(&ws->defl.zs, 0, sizeof(ws->defl.zs));
+	ws->defl.on = 0;
+
+	if (!lvl) return;
+
+	/* The settings can come from the client, so send uncompressed
+	   messages rather than fail for ones zlib does not take. */
+	if (Z_OK != deflateInit2(&ws->defl.zs, lvl, Z_DEFLATED, -winbits, 8,
+				 Z_DEFAULT_STRATEGY)) {
+		warnx("deflateInit2: %s", ws->defl.zs.msg ? ws->defl.zs.msg
+							   : "bad settings");
+		return;
+	}
+
+	ws->defl.on = 1;
+	ws->defl.minsz = minsz;
+	ws->defl.reset = reset;
+}
+
+void wbsoc_deflate(int lvl, unsigned minsz, int winbits, int reset)
+{
+	wsdeflate(&stdws, lvl, minsz, winbits, reset);
+}
+
+struct wbsoc *wbsoc_new(int bin, int lvl, unsigned minsz, int winbits,
+			int reset)
+{
+	struct wbsoc *ws = calloc(1, sizeof(*ws));
+
+	ws->bin = !!bin;
+	wsdeflate(ws, lvl, minsz, winbits, reset);
+	return ws;
+}
+
+void wbsoc_fre(struct wbsoc *ws)
+{
+	if (!ws) return;
+
+	wsdeflate(ws, 0, 0, 0, 0);
+	fdb_finsh(&ws->defl.out);
+	fdb_finsh(&ws->rout.fr);
+	free(ws);
+}
+
+/* Compresses one message into ws->defl.out as RFC 7692 describes. */
+static void deflmsg(struct wbsoc *ws, const void *buf, size_t len)
+{
+	unsigned char chunk[4096];
+	unsigned char *tl;
+	struct fdbuf *o = &ws->defl.out;
+	z_stream *zs = &ws->defl.zs;
+
+	o->len = 0;
+	zs->next_in = (unsigned char *) buf;
+	zs->avail_in = len;
+
+	do {
+		zs->next_out = chunk;
+		zs->avail_out = sizeof(chunk);
+		if (Z_STREAM_ERROR == deflate(zs, Z_SYNC_FLUSH))
+			errx(1, "deflate: %s", zs->msg);
+		fdb_apnd(o, chunk, sizeof(chunk) - zs->avail_out);
+	} while (!zs->avail_out);
+
+	/* Drop the empty block that ends a sync flush, which the receiver
+	   will add back. */
+	tl = o->bf + o->len - 4;
+	if (o->len >= 4 && !memcmp(tl, "\0\0\xff\xff", 4))
+		o->len -= 4;
+
+	if (ws->defl.reset) deflateReset(zs);
+}
+
+/* Writes a websocket frame with the given opcode to de, or queues it on oq if
+   oq is not null. If src is set, buf lies within src's buffer, and is queued by
+   reference unless it is compressed. If de->escannot is set, the opcode is
+   printed and the payload is written in annotated form rather than framed. */
+static void wbsocframe(struct wbsoc *ws, struct wrides *de, struct iovq *oq,
+		       struct fdbuf *src, int op, const void *buf, ssize_t len)
 {
 	unsigned char headr[14];
 	struct iovec v[2], *vc;
@@ -208,8 +507,24 @@ void write_wbsoc_frame(const void *buf, ssize_t len)
 	/* Perhaps send a ping if len is 0? */
 	if (!len) return;
 
-	/* Send as a single text data frame. */
-	headr[0] = 0x81;
+	if (!oq && de->escannot) {
+		printf("frame %#x: ", op);
+		full_write(de, buf, len);
+		return;
+	}
+
+	/* Send as a single, final data frame. */
+	headr[0] = 0x80 | op;
+
+	if (ws->defl.on && len >= ws->defl.minsz) {
+		deflmsg(ws, buf, len);
+		buf = ws->defl.out.bf;
+		len = ws->defl.out.len;
+
+		/* RSV1 marks a compressed message. */
+		headr[0] |= 0x40;
+		src = 0;
+	}
 
 	v[0].iov_base = headr;
 	if (len <= 125) {
@@ -223,7 +538,7 @@ void write_wbsoc_frame(const void *buf, ssize_t len)
 		v[0].iov_len = 4;
 	}
 	else {
-		headr[2] = 127;
+		headr[1] = 127;
 		len4 = htonl(len >> 32);
 		memcpy(headr + 2, &len4, 4);
 		len4 = htonl(len);
@@ -234,13 +549,22 @@ void write_wbsoc_frame(const void *buf, ssize_t len)
 	v[1].iov_base = (void *) buf;
 	v[1].iov_len = len;
 
+	if (oq) {
+		iovq_cpy(oq, v[0].iov_base, v[0].iov_len);
+		if (src)
+			iovq_ref(oq, src, (unsigned char *) buf - src->bf, len);
+		else
+			iovq_cpy(oq, v[1].iov_base, v[1].iov_len);
+		return;
+	}
+
 	vc = v;
 
 	writn = 0;
 	for (;;) {
 		vc->iov_len -= writn;
 
-		writn = writev(1, vc, v+2 - vc);
+		writn = writev(de->fd, vc, v+2 - vc);
 		if (writn < 0) {
 			if (writn == EINTR) continue;
 			perror("writev websocket frame");
@@ -255,33 +579,196 @@ void write_wbsoc_frame(const void *buf, ssize_t len)
 	}
 }
 
-void _Noreturn exit_msg(const char *flags, const char *msg, int code)
+void write_wbsoc_frame(const void *buf, ssize_t len)
+{
+	wbsocframe(&stdws, &(struct wrides){1}, 0, 0, 1, buf, len);
+}
+
+void wbsoc_setbin(int on) { stdws.bin = !!on; }
+
+static int hexval(int c)
+{
+	if (c >= '0' && c <= '9') return c - '0';
+	if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+	return -1;
+}
+
+/* Control messages whose payload is base64 in the client output, so they can
+   share the line-oriented control message syntax, but are sent raw in their own
+   frame with the given tag. */
+static const struct { char nm[8], tag; } rawctl[] = {
+	{"@stbin:",	's'},	/* terminal state */
+	{"@dmg:",	'd'},	/* damage mode update */
+};
+
+static void routflush(struct wbsoc *ws, struct wrides *de, struct iovq *oq)
+{
+	struct fdbuf rb = {0}, *fr = &ws->rout.fr;
+	size_t ri, nl;
+
+	for (ri = 0; fr->len && ri < sizeof(rawctl) / sizeof(*rawctl); ri++) {
+		nl = strlen(rawctl[ri].nm);
+		if (fr->len < nl || memcmp(fr->bf, rawctl[ri].nm, nl))
+			continue;
+
+		fdb_apnc(&rb, rawctl[ri].tag);
+		fdb_unb64(&rb, (char *) fr->bf + nl, fr->len - nl);
+		wbsocframe(ws, de, oq, 0, 2, rb.bf, rb.len);
+		fdb_finsh(&rb);
+		fr->len = 0;
+	}
+
+	if (fr->len > 1) wbsocframe(ws, de, oq, 0, 2, fr->bf, fr->len);
+	fr->len = 0;
+}
+
+static void routout(struct wbsoc *ws, const void *b, size_t sz)
+{
+	if (!ws->rout.fr.len) fdb_apnc(&ws->rout.fr, 'o');
+	fdb_apnd(&ws->rout.fr, b, sz);
+}
+
+static void routbin(struct wbsoc *ws, struct wrides *de, struct iovq *oq,
+		    const unsigned char *b, size_t sz)
+{
+	const unsigned char *run;
+	unsigned char byt;
+	int v;
+
+	while (sz) {
+		switch (ws->rout.st) {
+		case 0:
+			for (run = b; sz && *b != '\\' && *b != '\n'; sz--)
+				b++;
+			if (b != run) routout(ws, run, b - run);
+			if (!sz) break;
+
+			if (*b == '\\') ws->rout.st = '\\';
+			b++;
+			sz--;
+			break;
+
+		case '\\':
+			ws->rout.st = 0;
+			v = hexval(*b);
+
+			if (*b == '@') {
+				routflush(ws, de, oq);
+				fdb_apnc(&ws->rout.fr, '@');
+				ws->rout.st = '@';
+			}
+			else if (v >= 0) {
+				ws->rout.hi = v;
+				ws->rout.st = 'x';
+			}
+			else {
+				/* Not an escape this decoder knows about, so
+				   pass it along as-is. */
+				routout(ws, "\\", 1);
+				routout(ws, b, 1);
+			}
+			b++;
+			sz--;
+			break;
+
+		case 'x':
+			v = hexval(*b++);
+			sz--;
+			byt = v < 0 ? '?' : ws->rout.hi << 4 | v;
+			routout(ws, &byt, 1);
+			ws->rout.st = 0;
+			break;
+
+		case '@':
+			for (run = b; sz && *b != '\n'; sz--) b++;
+			fdb_apnd(&ws->rout.fr, run, b - run);
+			if (!sz) break;
+
+			b++;
+			sz--;
+			routflush(ws, de, oq);
+			ws->rout.st = 0;
+		}
+	}
+
+	/* A partial control message is kept until its newline arrives. */
+	if (ws->rout.st != '@') routflush(ws, de, oq);
+}
+
+void write_wbsoc_rout(const void *buf, ssize_t len)
+{
+	static struct iovq q;
+
+	if (len < 0) len = strlen(buf);
+
+	if (!stdws.bin) {
+		write_wbsoc_frame(buf, len);
+		return;
+	}
+
+	/* Send all the frames at once. */
+	routbin(&stdws, 0, &q, buf, len);
+	iovq_drain(&q, 1);
+	if (q.own.cap > 64 * 1024)	iovq_fre(&q);
+	else				iovq_reset(&q);
+}
+
+void wbsoc_qrout(struct wbsoc *ws, struct iovq *q, struct fdbuf *src,
+		 size_t of, size_t len)
+{
+	if (ws->bin)	routbin(ws, 0, q, src->bf + of, len);
+	else		wbsocframe(ws, 0, q, src, 1, src->bf + of, len);
+}
+
+void fmt_exit_msg(struct fdbuf *b, const char *flags, const char *msg,
+		  int code)
 {
-	struct fdbuf b = {0};
 	char iserr = !!strchr(flags, 'e');
 
 	/* Show white text on red (error) or black text on cyan (notice). */
-	fdb_routs(&b, "\033[", -1);
-	if (iserr)	fdb_routs(&b, "97;48;2;200;0;0", -1);
-	else		fdb_routs(&b, "30;48;2;0;255;255", -1);
-	fdb_routs(&b, ";1m ", -1);
+	fdb_routs(b, "\033[", -1);
+	if (iserr)	fdb_routs(b, "97;48;2;200;0;0", -1);
+	else		fdb_routs(b, "30;48;2;0;255;255", -1);
+	fdb_routs(b, ";1m ", -1);
 
-	fdb_routs(&b, msg, -1);
-	if (code != -1) fdb_itoa(&b, code);
+	fdb_routs(b, msg, -1);
+	if (code != -1) fdb_itoa(b, code);
 
 	/* Reset colors in case a new master process is started in the same
 	 * browser window. */
-	fdb_routs(&b, " \033[0m\r\n", -1);
-	fdb_apnc(&b, '\n');
+	fdb_routs(b, " \033[0m\r\n", -1);
+	fdb_apnc(b, '\n');
+}
+
+void _Noreturn exit_msg(const char *flags, const char *msg, int code)
+{
+	struct fdbuf b = {0};
 
-	write_wbsoc_frame(b.bf, b.len);
-	exit(iserr);
+	fmt_exit_msg(&b, flags, msg, code);
+	write_wbsoc_rout(b.bf, b.len);
+	exit(!!strchr(flags, 'e'));
 }
 
 void test_outstreams(void)
 {
+	static const char longmsg[] =
+		"Leeeeeengthy message which compresses well, and better the "
+		"second time, since the compression context is kept from the "
+		"first time it was sent......................................";
+	unsigned char frm[256], infl[256];
+	int pip[2], redn;
+	z_stream zs;
+
+	/* Chunks of client output, which may end in the middle of escapes. */
+	static const char *binchunks[] = {
+		"abc\\0a\n\\@title:x\\y\n", "def\\", "e", "2\\@sta", "te:{}",
+		"\n\\5c\\s1",
+	};
+
 	struct wrides de = {1};
-	struct fdbuf b = {&de, 32};
+	struct fdbuf b = {&de, 32}, src = {0};
+	struct iovq q = {0};
+	struct wbsoc *qws;
 	int i;
 
 	printf("TEST OUTSTREAMS\n");
@@ -339,4 +826,91 @@ void test_outstreams(void)
 	b.cap = 16;
 	for (i = 0; i < 50; i++) fdb_apnd(&b, i & 1 ? "abc" : "123", i % 3);
 	fdb_finsh(&b);
+
+	de.escannot = "chunked";
+	b = (struct fdbuf){&de, 10, .chunked = 1};
+	fdb_apnd(&b, "abcdefghijklmnopqrstuvwxyz", -1);
+	fdb_finsh(&b);
+	printf("chunked is reset: %u\n", b.chunked);
+
+	printf("binary frames\n");
+	de.escannot = "bin";
+	for (i = 0; i < sizeof(binchunks) / sizeof(*binchunks); i++)
+		routbin(&stdws, &de, 0, (const unsigned char *) binchunks[i],
+			strlen(binchunks[i]));
+
+	printf("deflated frames\n");
+	if (0 > pipe(pip)) err(1, "pipe");
+	wbsoc_deflate(6, 16, 15, 0);
+	wbsocframe(&stdws, &(struct wrides){pip[1]}, 0, 0, 2, "tiny", 4);
+	for (i = 0; i < 2; i++) wbsocframe(&stdws, &(struct wrides){pip[1]}, 0,
+					   0, 1, longmsg, strlen(longmsg));
+	wbsoc_deflate(0, 0, 0, 0);
+	close(pip[1]);
+
+	memset(&zs, 0, sizeof(zs));
+	if (Z_OK != inflateInit2(&zs, -15)) errx(1, "inflateInit2");
+	while (2 == read(pip[0], frm, 2)) {
+		redn = 0;
+		if (frm[1] != (frm[1] & 0x7f)) abort();
+		while (redn < frm[1]) redn += read(pip[0], frm+2+redn,
+						    frm[1]-redn);
+		/* A message that is mostly a back-reference to the previous
+		   one shows that the compression context was kept. */
+		printf("op=%d rsv1=%d wire<16=%d: ", frm[0] & 0xf,
+		       !!(frm[0] & 0x40), frm[1] < 16);
+		if (!(frm[0] & 0x40)) {
+			printf("%.*s\n", frm[1], frm+2);
+			continue;
+		}
+		memcpy(frm + 2 + frm[1], "\0\0\xff\xff", 4);
+		zs.next_in = frm + 2;
+		zs.avail_in = frm[1] + 4;
+		zs.next_out = infl;
+		zs.avail_out = sizeof(infl);
+		if (Z_OK != inflate(&zs, Z_SYNC_FLUSH)) errx(1, "inflate");
+		printf("%.*s\n", (int) (sizeof(infl) - zs.avail_out), infl);
+	}
+	inflateEnd(&zs);
+	close(pip[0]);
+
+	printf("level zlib does not take\n");
+	fflush(stdout);
+	if (0 > pipe(pip)) err(1, "pipe");
+	wbsoc_deflate(10, 0, 15, 0);
+	wbsocframe(&stdws, &(struct wrides){pip[1]}, 0, 0, 1, longmsg,
+		   strlen(longmsg));
+	wbsoc_deflate(0, 0, 0, 0);
+	close(pip[1]);
+	if (2 == read(pip[0], frm, 2))
+		printf("op=%d rsv1=%d\n", frm[0] & 0xf, !!(frm[0] & 0x40));
+	close(pip[0]);
+
+	printf("queued frames\n");
+	if (0 > pipe(pip)) err(1, "pipe");
+	fdb_apnd(&src, "0123456789", -1);
+	iovq_cpy(&q, "<", 1);
+	iovq_ref(&q, &src, 2, 3);
+	iovq_ref(&q, &src, 5, 2);
+	iovq_cpy(&q, ">", 1);
+
+	/* The queue refers to src by offset, so it can still grow. */
+	for (i = 0; i < 100; i++) fdb_apnd(&src, "..........", -1);
+	printf("pieces=%u ", q.cnt);
+
+	qws = wbsoc_new(0, 0, 0, 0, 0);
+	wbsoc_qrout(qws, &q, &src, 7, 3);
+	printf("with frame=%u written=%zd:", q.cnt, iovq_write(&q, pip[1]));
+	printf(" pending=%d\n", iovq_pending(&q));
+	close(pip[1]);
+	while (0 < (redn = read(pip[0], frm, sizeof(frm))))
+		for (i = 0; i < redn; i++)
+			printf(frm[i] > ' ' && frm[i] < 0x7f ? "%c" : "\\x%02x",
+			       frm[i]);
+	putchar('\n');
+	close(pip[0]);
+
+	wbsoc_fre(qws);
+	iovq_fre(&q);
+	fdb_finsh(&src);
 }
@@ -23,6 +23,9 @@ struct wrides {
 	 * Intended for more readable test output.
 	 */
 	const char *escannot;
+
+	/* Set if a write failed, so some bytes written to fd were lost. */
+	unsigned broken : 1;
 };
 
 /* Comprises a file descriptor and a buffer which is pending a write to it.
@@ -34,6 +37,11 @@ struct fdbuf {
 
 	/* Automatically allocated on any append operation if unset. */
 	unsigned char *bf;
+
+	/* If set, each flush is written to de as one chunk of an HTTP body with
+	 * Transfer-Encoding: chunked, and fdb_finsh ends the body. See
+	 * resp_chunked. */
+	unsigned chunked : 1;
 };
 
 /* Appends bytes to the end of the buffer and flushes it if it becomes full.
@@ -45,8 +53,14 @@ void fdb_apnd(struct fdbuf *b, const void *buf_, ssize_t len);
  */
 void fdb_apnc(struct fdbuf *b, int c_);
 
+/* Makes room for n more bytes at the end of the buffer, flushing it first if
+ * `de` is set and growing it if needed, and returns where they go. The caller
+ * fills them in and adds n to len. */
+unsigned char *fdb_room(struct fdbuf *b, size_t n);
+
 /* Flushes the buffer if it is not empty and `de` is set. Then frees the
- * buffer. */
+ * buffer. If the buffer is chunked, also writes the last chunk, so the buffer
+ * must be finished exactly once. */
 void fdb_finsh(struct fdbuf *b);
 
 /* Copies a byte to the buffer if it can be sent raw to the client for output.
@@ -63,6 +77,13 @@ void fdb_routs(struct fdbuf *b, const char *s, ssize_t len);
    can be parsed as JSON. */
 void fdb_json(struct fdbuf *b, const char *s, ssize_t len);
 
+/* Appends len bytes of dat to b encoded as base64, with padding. */
+void fdb_b64(struct fdbuf *b, const void *dat, size_t len);
+
+/* Decodes base64 in s and appends the bytes to b. Characters which are not part
+   of the base64 alphabet, including padding, are skipped. */
+void fdb_unb64(struct fdbuf *b, const char *s, size_t len);
+
 /* Converts a number to a string and appends it to b. Escaping is not necessary
    if this is used for terminal output to the client. */
 void fdb_itoa(struct fdbuf *b, long long i);
@@ -71,9 +92,88 @@ void fdb_itoa(struct fdbuf *b, long long i);
  * buf_ as a null-terminated string. */
 void full_write(struct wrides *de, const void *buf_, ssize_t len);
 
-/* Writes data in buffer as a websocket data frame to stdout. */
+/* Output for a file descriptor, queued as pieces which are written with
+ * writev, so a frame header and its payload, or many frames, take one syscall.
+ * A piece is either bytes copied into the queue's own buffer, or a range of an
+ * fdbuf the caller owns. Ranges are kept as offsets, so the fdbuf may still be
+ * appended to, but the bytes in the range must not change until the queue is
+ * written or reset. */
+struct iovq {
+	struct fdbuf own;
+
+	/* src is 0 if the piece is in own */
+	struct iovqp {
+		struct fdbuf *src;
+		size_t of, len;
+	} *p;
+	unsigned cnt, cap;
+
+	/* The first piece not completely written, and how much of it is */
+	unsigned hd;
+	size_t hdof;
+};
+
+/* Queues a copy of len bytes of b. */
+void iovq_cpy(struct iovq *q, const void *b, size_t len);
+
+/* Queues len bytes of src starting at of, without copying them. */
+void iovq_ref(struct iovq *q, struct fdbuf *src, size_t of, size_t len);
+
+/* Returns 1 if some queued output has not been written. */
+int iovq_pending(const struct iovq *q);
+
+/* Returns the number of queued bytes which have not been written. */
+size_t iovq_left(const struct iovq *q);
+
+/* Writes as much queued output to fd as one writev call will, and returns what
+ * writev does. Returns 0 if nothing is pending. */
+ssize_t iovq_write(struct iovq *q, int fd);
+
+/* Drops everything queued. iovq_reset keeps the memory for reuse, while
+ * iovq_fre releases it. */
+void iovq_reset(struct iovq *q);
+void iovq_fre(struct iovq *q);
+
+/* Writes data in buffer as a websocket text frame to stdout. */
 void write_wbsoc_frame(const void *buf, ssize_t len);
 
+/* Writes client output, as produced by fdb_routs and the \@ control messages,
+ * to stdout as websocket data. Normally this is a single text frame with buf
+ * unmodified. If binary mode is on, the escapes are decoded and the output is
+ * sent as binary frames, each beginning with a tag byte:
+ *
+ * 'o' - the rest of the frame is raw terminal output
+ * '@' - the rest of the frame is a control message, like "title:foo" for the
+ *       \@title:foo line in text mode
+ *
+ * buf may end in the middle of an escape, as decoder state is kept between
+ * calls. */
+void write_wbsoc_rout(const void *buf, ssize_t len);
+
+/* Turns binary mode of write_wbsoc_rout on or off. */
+void wbsoc_setbin(int on);
+
+/* Compresses websocket data frames of at least minsz bytes which are sent after
+ * this call, as negotiated with the permessage-deflate extension. lvl is the
+ * zlib compression level, and 0 turns compression off. winbits is the maximum
+ * window size allowed by the client. If reset is set, no compression context is
+ * kept between messages. */
+void wbsoc_deflate(int lvl, unsigned minsz, int winbits, int reset);
+
+/* State of the websocket data sent on a connection other than stdout, which
+ * is set up like wbsoc_setbin and wbsoc_deflate set up that of stdout. */
+struct wbsoc;
+struct wbsoc *wbsoc_new(int bin, int lvl, unsigned minsz, int winbits,
+			int reset);
+void wbsoc_fre(struct wbsoc *ws);
+
+/* Converts len bytes of client output in src, starting at of, to websocket
+ * frames as write_wbsoc_rout does, but queues the frames on q rather than
+ * writing them to stdout. Uncompressed text frames refer to src rather than
+ * copying it. */
+void wbsoc_qrout(struct wbsoc *ws, struct iovq *q, struct fdbuf *src,
+		 size_t of, size_t len);
+
 /* Formats and escapes a message for output to stdout as websocket data.
  * code is concatenated on the end of the message, if it is not -1.
  * flags can be any number of these characters in a string:
@@ -82,6 +182,10 @@ void write_wbsoc_frame(const void *buf, ssize_t len);
  */
 void _Noreturn exit_msg(const char *flags, const char *msg, int code);
 
+/* Appends the message exit_msg sends to b as client output. */
+void fmt_exit_msg(struct fdbuf *b, const char *flags, const char *msg,
+		  int code);
+
 void test_outstreams(void);
 
 #endif
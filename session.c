@@ -8,12 +8,15 @@
 #include "shared.h"
 #include "font.h"
 #include "outstreams.h"
+#include "inbound.h"
 #include "test/raw/data.h"
 #include <md4c-html.h>
 #include "wts.h"
 #include "http.h"
 #include "spawner.h"
 #include "dtachctx.h"
+#include "logwriter.h"
+#include "ttf.h"
 #include "tm.c"
 #include "third_party/st/plat.h"
 #include "third_party/st/tmeng"
@@ -36,8 +39,14 @@
 #include <err.h>
 #include <stdarg.h>
 #include <dirent.h>
-
-static char *argv0, *termid, *logview, *sblvl, *dtachlog;
+#include <poll.h>
+#include <signal.h>
+#include <zlib.h>
+
+static char *argv0, *termid, *logview, *sblvl, *dtachlog, *wsbin, *wsdefl,
+	*wsdeflmin, *stgen, *dmgfps, *histkb, *hfrom, *hcnt,
+	*logsegkb, *logsegh, *logz, *httpwrk, *atchproc, *onemaster, *wrkr,
+	*glw, *glh, *glcops;
 static const char *qs;
 
 static size_t argv0sz;
@@ -84,45 +93,186 @@ void Ttywriteraw(int trm, int dq, int of, int sz)
 	fdb_routs(&therout, deqtostring(dq, of), sz);
 }
 
+static void dmgsweep(void);
+static void fonthdr(struct fdbuf *b, int fni);
+static void serveauxjs(struct wrides *de, const Httpreq *rq);
+
+/* Lines as they are written to the plain log, kept in memory so clients can
+   page through them without reading the log. Capped at histkb KiB. */
+static struct {
+	/* Line bytes, circular. Line n+1 starts right after line n. */
+	char *bf;
+	uint32_t bcap, bhd, blen;
+
+	/* Where each line is in bf, circular */
+	struct { uint32_t of, ln; } *ls;
+	uint32_t lcap, lhd, lcnt;
+
+	/* Number of the oldest line kept, counting from the session start */
+	uint64_t first;
+
+	unsigned off : 1;
+} hist;
+
+/* Newest lines are requested with this as the first line number */
+#define HISTNEWEST 0xffffffffffffULL
+
+static void histdrop(void)
+{
+	hist.blen -= hist.ls[hist.lhd].ln;
+	hist.bhd = (hist.bhd + hist.ls[hist.lhd].ln) % hist.bcap;
+	hist.lhd = (hist.lhd + 1) % hist.lcap;
+	hist.lcnt--;
+	hist.first++;
+}
+
+static void histadd(const char *s, uint32_t n)
+{
+	uint32_t of, fit;
+	int kb;
+
+	if (hist.off) return;
+	if (!hist.bcap) {
+		kb = histkb ? atoi(histkb) : 1024;
+		if (kb <= 0) { hist.off = 1; return; }
+
+		hist.bcap = MIN(kb, 1 << 21) * 1024;
+		hist.lcap = hist.bcap / 16;
+		hist.bf = malloc(hist.bcap);
+		hist.ls = malloc(hist.lcap * sizeof(*hist.ls));
+		if (!hist.bf || !hist.ls) err(1, "malloc history");
+	}
+
+	if (n > hist.bcap / 4) n = hist.bcap / 4;
+	while (hist.lcnt && (	hist.blen + n > hist.bcap ||
+				hist.lcnt == hist.lcap))
+		histdrop();
+
+	of = (hist.bhd + hist.blen) % hist.bcap;
+	fit = MIN(n, hist.bcap - of);
+	memcpy(hist.bf + of, s, fit);
+	memcpy(hist.bf, s + fit, n - fit);
+
+	hist.ls[(hist.lhd + hist.lcnt) % hist.lcap].of = of;
+	hist.ls[(hist.lhd + hist.lcnt) % hist.lcap].ln = n;
+	hist.lcnt++;
+	hist.blen += n;
+}
+
+/* Adds each \n-terminated line in s to the history. */
+static void histlines(const char *s, size_t n)
+{
+	const char *e;
+
+	while ((e = memchr(s, '\n', n))) {
+		histadd(s, e - s);
+		n -= e - s + 1;
+		s = e + 1;
+	}
+}
+
+/* Sends up to cnt history lines starting at line from, as
+	\\@hist:<oldest>,<end>,<first>:<base64 of lines>
+   where lines are \n-terminated, oldest is the number of the oldest line kept,
+   end is one past the newest, and first is the first line sent. */
+static void hist4cli(struct fdbuf *o, uint64_t from, unsigned cnt)
+{
+	uint64_t end = hist.first + hist.lcnt, to, li;
+	struct fdbuf tx = {0};
+	uint32_t of, ln, fit;
+	char hd[80];
+
+	if (from == HISTNEWEST) from = end > cnt ? end - cnt : 0;
+	if (from < hist.first) from = hist.first;
+	to = MIN(from + cnt, end);
+
+	for (li = from; li < to; li++) {
+		of = hist.ls[(hist.lhd + (li - hist.first)) % hist.lcap].of;
+		ln = hist.ls[(hist.lhd + (li - hist.first)) % hist.lcap].ln;
+		fit = MIN(ln, hist.bcap - of);
+		fdb_apnd(&tx, hist.bf + of, fit);
+		fdb_apnd(&tx, hist.bf, ln - fit);
+		fdb_apnc(&tx, '\n');
+	}
+
+	snprintf(hd, sizeof(hd), "\\@hist:%llu,%llu,%llu:",
+		 (unsigned long long) hist.first, (unsigned long long) end,
+		 (unsigned long long) (from < to ? from : end));
+	fdb_apnd(o, hd, -1);
+	fdb_b64(o, tx.bf, tx.len);
+	fdb_apnc(o, '\n');
+	fdb_finsh(&tx);
+}
+
+static long long nowns(void)
+{
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts)) err(1, "clock_gettime");
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* What the terminal has cost so far, as reported by the \P escape. ptyrd is
+   the bytes of subproc output, twrns the time the engine spent on it, logb the
+   bytes sent to the logs, and dumps the number of state dumps for clients,
+   which took dumpns in all and dumpmaxns at most. Times are in nanoseconds. */
+static struct {
+	unsigned long long ptyrd, twrns, logb, dumps, dumpns, dumpmaxns;
+} perfc;
+
+/* Sends output to a log, through the log writer if there is one. */
+static void writelog(struct wrides *de, int lg, const void *b, size_t n)
+{
+	perfc.logb += n;
+	if (logw_active())	logw_send(lg, b, n);
+	else			full_write(de, b, n);
+}
+
 struct fdbuf therout;
+
+/* Deque each write to the terminal is decoded into */
+static int ttyd;
+
 void process_tty_out(void *buf, ssize_t len)
 {
-	static int d;
 	int sbbuf;
+	size_t sbn;
+	long long st;
 
 	if (len < 0) len = strlen(buf);
+	perfc.ptyrd += len;
 
-	if (wts.writerawlg) full_write(&wts.rawlogde, buf, len);
+	if (wts.writerawlg) writelog(&wts.rawlogde, LOGW_RAW, buf, len);
 
 	if (!wts.t) {
 		wts.t = term_new();
 		tnew(wts.t, 80, 25);
-		if (wts.writelg) term(wts.t,sbbuf) = deqmk();
+		term(wts.t,sbbuf) = deqmk();
 	}
-	d = deqsetutf8(d ? d:deqmk(), buf, len);
-	twrite(wts.t, d, -1, 0);
+	ttyd = deqsetutf8(ttyd ? ttyd : deqmk(), buf, len);
+	st = nowns();
+	twrite(wts.t, ttyd, -1, 0);
+	perfc.twrns += nowns() - st;
+	dmgsweep();
 
 	fdb_routs(&therout, buf, len);
 	fdb_apnc(&therout, '\n');
 
-	if (wts.writelg) {
-		sbbuf = term(wts.t,sbbuf);
-		if (deqsiz(sbbuf)) {
-			full_write(&wts.logde,	deqtostring(sbbuf, 0),
-						deqbytsiz(sbbuf));
-			deqclear(sbbuf);
-		}
+	sbbuf = term(wts.t,sbbuf);
+	if ((sbn = deqbytsiz(sbbuf))) {
+		if (wts.writelg)
+			writelog(&wts.logde, LOGW_PLAIN,
+				 deqtostring(sbbuf, 0), sbn);
+		histlines(deqtostring(sbbuf, 0), sbn);
+		deqclear(sbbuf);
 	}
 }
 
-static void recounttitl(struct wrides *de)
+static void recounttitl(struct fdbuf *b)
 {
-	struct fdbuf b = {.de = de};
-
-	fdb_apnd(&b, "\\@title:", -1);
-	if (wts.clnttl) fdb_apnd(&b, wts.ttl, ttl_len());
-	fdb_apnc(&b, '\n');
-	fdb_finsh(&b);
+	fdb_apnd(b, "\\@title:", -1);
+	if (wts.clnttl) fdb_apnd(b, wts.ttl, ttl_len());
+	fdb_apnc(b, '\n');
 }
 
 static int parsequeryarg(const char *pref, char **dest)
@@ -170,8 +320,40 @@ static void checktid(void)
 	}
 }
 
+static const struct qryarg {
+	const char *pref;
+	char **dest;
+} qryargs[] = {
+	{"termid=",	&termid		},
+	{"logview=",	&logview	},
+	{"sblvl=",	&sblvl		},
+	{"dtachlog=",	&dtachlog	},
+	{"wsbin=",	&wsbin		},
+	{"wsdefl=",	&wsdefl		},
+	{"wsdeflmin=",	&wsdeflmin	},
+	{"stgen=",	&stgen		},
+	{"dmgfps=",	&dmgfps		},
+	{"histkb=",	&histkb		},
+	{"hfrom=",	&hfrom		},
+	{"hcnt=",	&hcnt		},
+	{"logsegkb=",	&logsegkb	},
+	{"logsegh=",	&logsegh	},
+	{"logz=",	&logz		},
+	{"httpwrk=",	&httpwrk	},
+	{"atchproc=",	&atchproc	},
+	{"onemaster=",	&onemaster	},
+	{"glw=",	&glw		},
+	{"glh=",	&glh		},
+	{"glcops=",	&glcops		},
+	/* Only read by main.js */
+	{"wrkr=",	&wrkr		},
+};
+#define QRYARGCNT (sizeof(qryargs) / sizeof(*qryargs))
+
 static void processquerystr(const char *fullqs)
 {
+	const struct qryarg *qa;
+
 	if (!fullqs) return;
 	qs = fullqs;
 
@@ -179,10 +361,9 @@ static void processquerystr(const char *fullqs)
 		if (*qs == '&') qs++;
 		if (!*qs) break;
 
-		if (parsequeryarg("termid=",	&termid		)) continue;
-		if (parsequeryarg("logview=",	&logview	)) continue;
-		if (parsequeryarg("sblvl=",	&sblvl		)) continue;
-		if (parsequeryarg("dtachlog=",	&dtachlog	)) continue;
+		for (qa = qryargs; qa != qryargs + QRYARGCNT; qa++)
+			if (parsequeryarg(qa->pref, qa->dest)) break;
+		if (qa != qryargs + QRYARGCNT) continue;
 
 		fprintf(stderr,
 			"invalid query string arg at char pos %zu in '%s'\n",
@@ -192,6 +373,28 @@ static void processquerystr(const char *fullqs)
 	}
 }
 
+/* Sets the query arg globals back to what they were at the first request, so
+   a worker serving many requests does not carry the args of one into the
+   next. */
+static void qryreset(void)
+{
+	static char *dflt[QRYARGCNT];
+	static int saved;
+	size_t qi;
+
+	for (qi = 0; qi < QRYARGCNT; qi++) {
+		if (!saved) {
+			dflt[qi] = *qryargs[qi].dest
+				 ? strdup(*qryargs[qi].dest) : 0;
+			continue;
+		}
+
+		free(*qryargs[qi].dest);
+		*qryargs[qi].dest = dflt[qi] ? strdup(dflt[qi]) : 0;
+	}
+	saved = 1;
+}
+
 static void cdhome(void)
 {
 	const char *home;
@@ -248,9 +451,47 @@ static void appenddir(char **p, int nmb)
 	if (mkdir(*p, 0700) && errno != EEXIST) err(1, "cannot create %s", *p);
 }
 
-static int opnforlog(const struct tm *tim, const char *suff)
+/* Adds the log path to state_dir()/logmap/<termid> unless it is already the
+   last path listed there. The map holds one path per line from oldest to
+   newest, so tools can find a session's logs without searching every day's
+   directory. */
+static void maplog(const char *fn)
 {
+	char *mf, *bf;
+	size_t n = strlen(fn) + 1;
+	off_t sz, at;
 	int fd;
+
+	xasprintf(&mf, "%s/logmap", state_dir());
+	if (mkdir(mf, 0700) && errno != EEXIST) err(1, "cannot create %s", mf);
+	free(mf);
+
+	xasprintf(&mf, "%s/logmap/%s", state_dir(), termid);
+	fd = open(mf, O_RDWR | O_CREAT | O_APPEND, 0600);
+	if (fd < 0) { warn("open %s", mf); free(mf); return; }
+	free(mf);
+
+	bf = malloc(n + 1);
+	sz = lseek(fd, 0, SEEK_END);
+	at = sz > (off_t) n ? sz - n - 1 : 0;
+	if (	sz >= (off_t) n
+	&&	pread(fd, bf, sz - at, at) == sz - at
+	&&	(at == sz - (off_t) n || *bf == '\n')
+	&&	!memcmp(bf + (sz - at - n), fn, n - 1))
+		goto done;
+
+	memcpy(bf, fn, n - 1);
+	bf[n - 1] = '\n';
+	if (write(fd, bf, n) != (ssize_t) n) warn("write log map");
+
+done:
+	free(bf);
+	close(fd);
+}
+
+/* Returns the path of the log of this session started at tim. */
+static char *logpath(const struct tm *tim, const char *suff)
+{
 	char *dir, *fn;
 
 	dir = strdup(state_dir());
@@ -260,20 +501,20 @@ static int opnforlog(const struct tm *tim, const char *suff)
 
 	xasprintf(&fn, "%s/%s%s", dir, termid, suff);
 	free(dir);
-
-	fd = open(fn, O_WRONLY | O_CREAT | O_APPEND, 0600);
-	if (fd < 0) {
-		warn("open %s", fn);
-		fd = 0;
-	}
-	free(fn);
-	return fd;
+	return fn;
 }
 
 void open_logs(void)
 {
 	time_t now;
 	struct tm tim;
+	char *paths[LOGW_CNT] = {0};
+	struct logwcfg cfg = {
+		.segsz = logsegkb ? strtoull(logsegkb, 0, 10) * 1024 : 0,
+		.segsec = logsegh ? atol(logsegh) * 3600 : 0,
+		.zlvl = logz ? MAX(0, MIN(atoi(logz), 9)) : 6,
+	};
+	int lg;
 
 	now = time(NULL);
 	if (!localtime_r(&now, &tim)) err(1, "cannot get time");
@@ -284,12 +525,20 @@ void open_logs(void)
 
 	if (strchr(sblvl, 'p')) {
 		wts.writelg = 1;
-		wts.logde.fd = opnforlog(&tim, "");
+		paths[LOGW_PLAIN] = logpath(&tim, "");
+		maplog(paths[LOGW_PLAIN]);
 	}
 	if (strchr(sblvl, 'r')) {
 		wts.writerawlg = 1;
-		wts.rawlogde.fd = opnforlog(&tim, ".raw");
+		paths[LOGW_RAW] = logpath(&tim, ".raw");
+	}
+
+	if ((wts.writelg || wts.writerawlg) &&
+	    logw_start((const char *const *) paths, &cfg)) {
+		warnx("not saving scrollback logs");
+		wts.writelg = wts.writerawlg = 0;
 	}
+	for (lg = 0; lg < LOGW_CNT; lg++) free(paths[lg]);
 }
 
 static Dtachctx prepfordtach(void)
@@ -313,6 +562,8 @@ static Dtachctx prepfordtach(void)
 	fdb_finsh(&sp);
 
 	dc->isephem = !termid;
+	if (stgen) dc->stgen = strtoul(stgen, 0, 10);
+	if (dmgfps) dc->dmgfps = MAX(0, MIN(atoi(dmgfps), 1000));
 
 	if (!dtachlog) return dc;
 
@@ -378,8 +629,216 @@ static void newsessinhtml(struct iterprofspec *spc, char k, const void *nmarg)
 	}
 }
 
+/* Profile files as last read, so iterprofs need not read them again until
+   they change. A dir is listed again when its stat changes, and a file read
+   again when its stat does. This is checked at most every PROFCHECKMS, which
+   keeps profile dirs on slow network filesystems off the path of attaching.
+   inotify is not used as it misses changes made by other NFS clients. */
+#define PROFCHECKMS 1000
+
+struct proffile {
+	struct proffile *next;
+	char *grp;
+
+	/* Whether it could be read, and its stat and contents when it was */
+	unsigned ok : 1;
+	struct stat st;
+	char *b;
+	size_t sz;
+};
+
+struct profdir {
+	struct profdir *next;
+	char *path;
+
+	/* Whether it was listed, and its stat when it was */
+	unsigned listed : 1, ok : 1;
+	struct stat st;
+	struct proffile *files;
+};
+
+static struct {
+	char *ppaths;
+	struct profdir *dirs;
+	long long checked;
+
+	/* Changes each time a profile dir or file changes */
+	unsigned gen;
+} profc;
+
+/* What iterprofs last output for each kind of iterprofspec, at profc.gen. */
+static struct profout {
+	unsigned gen, kind;
+	char *termid;
+	int namematc;
+	struct fdbuf b;
+} profouts[3];
+
+static int profstchg(const struct stat *a, const struct stat *b)
+{
+	return	a->st_ino		!= b->st_ino
+	||	a->st_dev		!= b->st_dev
+	||	a->st_size		!= b->st_size
+	||	a->st_mtim.tv_sec	!= b->st_mtim.tv_sec
+	||	a->st_mtim.tv_nsec	!= b->st_mtim.tv_nsec;
+}
+
+static void proffilefre(struct proffile *f)
+{
+	free(f->grp);
+	free(f->b);
+	free(f);
+}
+
+static void profcfre(void)
+{
+	struct profdir *d;
+	struct proffile *f;
+	int oi;
+
+	while ((d = profc.dirs)) {
+		profc.dirs = d->next;
+		while ((f = d->files)) {
+			d->files = f->next;
+			proffilefre(f);
+		}
+		free(d->path);
+		free(d);
+	}
+	free(profc.ppaths);
+	memset(&profc, 0, sizeof(profc));
+
+	for (oi = 0; oi < 3; oi++) {
+		free(profouts[oi].termid);
+		fdb_finsh(&profouts[oi].b);
+	}
+	memset(profouts, 0, sizeof(profouts));
+}
+
+static void profread(struct proffile *f, const char *dir)
+{
+	struct fdbuf b = {0};
+	char *ffn, rb[4096];
+	FILE *pff;
+	size_t redn;
+
+	free(f->b);
+	f->b = 0;
+	f->sz = 0;
+	f->ok = 0;
+	memset(&f->st, 0, sizeof(f->st));
+	profc.gen++;
+
+	xasprintf(&ffn, "%s/%s", dir, f->grp);
+	pff = fopen(ffn, "r");
+	if (!pff) {
+		perror("fopen for profile");
+		fprintf(stderr, "prpath=%s group=%s\n", ffn, f->grp);
+		free(ffn);
+		return;
+	}
+
+	fstat(fileno(pff), &f->st);
+	while ((redn = fread(rb, 1, sizeof(rb), pff))) fdb_apnd(&b, rb, redn);
+	if (ferror(pff)) perror("getc for profile def file");
+
+	f->ok = 1;
+	f->b = (char *) b.bf;
+	f->sz = b.len;
+	fclose(pff);
+	free(ffn);
+}
+
+/* Lists d again, keeping the files which are still there. */
+static void proflist(struct profdir *d)
+{
+	struct proffile *old = d->files, **ot, **tl = &d->files, *f;
+	struct dirent *den;
+	DIR *pd;
+
+	fprintf(stderr, "reading profile dir at: %s\n", d->path);
+	d->files = 0;
+	d->listed = 1;
+	d->ok = 0;
+	profc.gen++;
+
+	pd = opendir(d->path);
+	if (!pd)	perror("opendir");
+	else		d->ok = !fstat(dirfd(pd), &d->st);
+
+	while (pd) {
+		errno = 0;
+		den = readdir(pd);
+		if (!den) {
+			if (errno) perror("readdir");
+			break;
+		}
+
+		for (ot = &old; *ot; ot = &(*ot)->next)
+			if (!strcmp((*ot)->grp, den->d_name)) break;
+		if ((f = *ot))	*ot = f->next;
+		else		(f = calloc(1, sizeof(*f)))->grp =
+					strdup(den->d_name);
+
+		f->next = 0;
+		*tl = f;
+		tl = &f->next;
+	}
+	if (pd) closedir(pd);
+
+	while ((f = old)) {
+		old = f->next;
+		proffilefre(f);
+	}
+}
+
+/* Makes profc hold the profiles on ppaths as they are now, or as they were at
+   most PROFCHECKMS ago. */
+static void profcheck(const char *ppaths)
+{
+	char *pps, *tkn, *savepp, *ppitr, *ffn;
+	struct profdir *d, **tl;
+	struct proffile *f;
+	struct stat st;
+	long long now = nowms();
+
+	if (profc.ppaths && !strcmp(profc.ppaths, ppaths)) {
+		if (now - profc.checked < PROFCHECKMS) return;
+	}
+	else {
+		profcfre();
+		profc.ppaths = strdup(ppaths);
+
+		pps = strdup(ppaths);
+		tl = &profc.dirs;
+		for (ppitr = pps; ; ppitr = NULL) {
+			if (!(tkn = strtok_r(ppitr, ":", &savepp))) break;
+			*tl = calloc(1, sizeof(**tl));
+			(*tl)->path = strdup(tkn);
+			tl = &(*tl)->next;
+		}
+		free(pps);
+	}
+	profc.checked = now;
+
+	for (d = profc.dirs; d; d = d->next) {
+		if (!d->listed)				proflist(d);
+		else if (stat(d->path, &st))		{ if (d->ok) proflist(d); }
+		else if (!d->ok || profstchg(&st, &d->st))	proflist(d);
+
+		for (f = d->files; f; f = f->next) {
+			if (f->grp[0] == '.') continue;
+
+			xasprintf(&ffn, "%s/%s", d->path, f->grp);
+			if (!f->st.st_ino || stat(ffn, &st) || profstchg(&st, &f->st))
+				profread(f, d->path);
+			free(ffn);
+		}
+	}
+}
+
 static int proflines(
-	const char *grpname, const char *prffn, struct iterprofspec *spc)
+	const char *grpname, const struct proffile *pf, struct iterprofspec *spc)
 {
 	const char *cmpname;
 	int lineno = 0, namematc = 0, namerr = 0;
@@ -387,13 +846,9 @@ static int proflines(
 	char fld, eofield, namemat, err = 0, startedjs;
 	char begunprenam, c;
 	struct fdbuf nmbuf = {0};
-	FILE *pff = fopen(prffn, "r");
+	size_t bi = 0;
 
-	if (!pff) {
-		perror("fopen for profile");
-		fprintf(stderr, "prpath=%s group=%s\n", prffn, grpname);
-		return 0;
-	}
+	if (!pf->ok) return 0;
 
 	newsessinhtml(spc, 's', grpname);
 
@@ -411,12 +866,7 @@ static int proflines(
 			lineno++;
 		}
 
-		clearerr(pff);
-		c = getc(pff);
-		if (c == EOF && ferror(pff)) {
-			perror("getc for profile def file");
-			break;
-		}
+		c = bi < pf->sz ? pf->b[bi++] : EOF;
 		eofield = c == '\n' || c == EOF || c == '\t';
 
 		switch (fld) {
@@ -487,17 +937,14 @@ static int proflines(
 	newsessinhtml(spc, 'e', 0);
 
 	fdb_finsh(&nmbuf);
-	fclose(pff);
 
 	return namematc;
 }
 
-static void iterprofs(const char *ppaths_, struct iterprofspec *spc)
+static int iterprofsgen(struct iterprofspec *spc)
 {
-	DIR *pd;
-	char *ppaths = strdup(ppaths_), *tkn, *savepp, *ppitr, *ffn = 0;
-
-	struct dirent *den;
+	struct profdir *d;
+	struct proffile *f;
 	int namematc = 0;
 
 	/* "--" prefix to sort this category first. This hack can be removed
@@ -506,46 +953,55 @@ static void iterprofs(const char *ppaths_, struct iterprofspec *spc)
 	newsessinhtml(spc, 'b', 0);
 	newsessinhtml(spc, 'e', 0);
 
-	for (ppitr = ppaths; ; ppitr = NULL) {
-		if (!(tkn = strtok_r(ppitr, ":", &savepp))) break;
-		fprintf(stderr, "reading profile dir at: %s\n", tkn);
-
-		pd = opendir(tkn);
-		if (!pd) {
-			perror("opendir");
+	for (d = profc.dirs; d; d = d->next)
+	for (f = d->files; f; f = f->next) {
+		if (f->grp[0] == '.') {
+			if (spc->diaglog)
+				fprintf(stderr, "  skipped file '%s'\n",
+					f->grp);
 			continue;
 		}
 
-		for (;;) {
-			errno = 0;
-			den = readdir(pd);
-			if (!den) {
-				if (errno) perror("readdir");
-				break;
-			}
-
-			free(ffn);
-			xasprintf(&ffn, "%s/%s", tkn, den->d_name);
-
-			if (den->d_name[0] == '.') {
-				if (spc->diaglog)
-					fprintf(stderr,
-						"  skipped file '%s'\n",
-						den->d_name);
-				continue;
-			}
+		if (spc->diaglog) fprintf(stderr, "  group %s\n", f->grp);
 
-			if (spc->diaglog)
-				fprintf(stderr, "  group %s\n", den->d_name);
+		namematc += proflines(f->grp, f, spc);
+	}
 
-			namematc += proflines(den->d_name, ffn, spc);
-		}
+	return namematc;
+}
 
-		closedir(pd);
+/* Outputs what spc asks for of the profiles on ppaths. An output of a kind
+   made from the same profiles for the same termid is sent again as it was. */
+static void iterprofs(const char *ppaths, struct iterprofspec *spc)
+{
+	struct iterprofspec gs = *spc;
+	struct profout *po = 0;
+	const char *tid = termid ? termid : "";
+	unsigned kind = spc->newsessin | spc->sendauxjs << 1
+				       | spc->sendpream << 2;
+	int namematc;
+
+	profcheck(ppaths);
+
+	/* The new session list is the same for any termid. */
+	if (spc->newsessin)	{ po = profouts + 0; tid = ""; }
+	else if (spc->sendauxjs)  po = profouts + 1;
+	else if (spc->sendpream)  po = profouts + 2;
+
+	if (!po) namematc = iterprofsgen(spc);
+	else if (po->gen == profc.gen && po->kind == kind
+					&& !strcmp(po->termid, tid))
+		namematc = po->namematc;
+	else {
+		po->b.len = 0;
+		gs.sigb = &po->b;
+		namematc = po->namematc = iterprofsgen(&gs);
+		po->gen = profc.gen;
+		po->kind = kind;
+		free(po->termid);
+		po->termid = strdup(tid);
 	}
-
-	free(ppaths);
-	free(ffn);
+	if (po) fdb_apnd(spc->sigb, po->b.bf, po->b.len);
 
 	if (namematc || !termid || !*termid) return;
 
@@ -570,189 +1026,1061 @@ static const char *profpath(void)
 	return profpathsavd=p;
 }
 
-static void tmstate4cli(struct wrides *de)
+/* Runs argv[0], with its stdout appended to b. query is put in QUERY_STRING.
+   Returns 0 if it exits with status 0. */
+static int runcgi(struct fdbuf *b, char *const argv[], const char *query)
 {
-	struct tmobj *o0, *o1;
-	int *f0, *f1;
-	struct fdbuf sigb = {de, .cap = 1024};
+	int p[2], ws;
+	pid_t cpid;
+	ssize_t redn;
+	unsigned char inb[4096];
 
-	if (!wts.t) return;
+	if (0>pipe(p))			{ perror("pipe cgi"	); exit(1); }
+	if (0>(cpid=fork()))		{ perror("fork cgi"	); exit(1); }
+	if (!cpid && 0>dup2(p[1], 1))	{ perror("dup p1"	); exit(1); }
+	if (0>close(p[1]))		{ perror("close p1"	); exit(1); }
 
-	fdb_apnd(&sigb, "\\@state:{\"bs\":[", -1);
-	o0 = tmobjs.objel;
-	o1 = tmobjs.objel+tmobjs.capac;
-	for (;;) {
-		if (o0==o1) break;
-		if (o0!=tmobjs.objel) fdb_apnc(&sigb, ',');
-		if (!o0->fs) { fdb_itoa(&sigb, o0->fct); goto nexo; }
-
-		f0 = o0->fs;
-		f1 = o0->fs + o0->fct;
-		fdb_apnc(&sigb, '[');
-		for (;;) {
-			if (f0==f1) break;
-			if (f0!=o0->fs) fdb_apnc(&sigb, ',');
-			fdb_itoa(&sigb, *f0++);
-		}
-		fdb_apnc(&sigb, ']');
+	if (!cpid) {
+		close(p[0]);
+
+		setenv("QUERY_STRING", query, 1);
+		execvp(argv[0], argv);
+		perror("exec for external cgi");
+		exit(1);
+	}
 
-	nexo:
-		o0++;
+	for (;;) {
+		redn = read(p[0], inb, sizeof(inb));
+		if (!redn)	break;
+		if (0<redn)	fdb_apnd(b, inb, redn);
+		if (0>redn && errno != EINTR)	{ perror("read"); break; }
 	}
+	close(p[0]);
 
-	fdb_apnd(&sigb, "],\"fh\":", -1);
-	fdb_itoa(&sigb, tmobjs.bufsfreehead);
-	fdb_apnd(&sigb, ",\"t\":", -1);
-	fdb_itoa(&sigb, wts.t);
-	fdb_apnd(&sigb, "}\n", -1);
+	while (0>waitpid(cpid, &ws, 0))
+		if (errno != EINTR) { perror("waitpid"); return -1; }
 
-	fdb_finsh(&sigb);
+	return redn || !WIFEXITED(ws) || WEXITSTATUS(ws) ? -1 : 0;
 }
 
-static void simpdump4cl(struct wrides *de)
+/* Folds the stat of path into st, which starts zeroed, so that st changes if
+   any file folded into it is changed, created or removed. st_mtim is left as
+   the newest of the mtimes, so it is still usable as a Last-Modified time. */
+static void foldstat(struct stat *st, const char *path)
 {
-	struct fdbuf sigb = {de};
-	if (!wts.t) return;
-	fdb_apnd(&sigb, MODE_ALTSCREEN & term(wts.t,mode) ? "\\s2":"\\s1", -1);
-	fdb_finsh(&sigb);
+	struct stat sb;
+	uint64_t h = st->st_ino;
+
+	if (0>stat(path, &sb)) memset(&sb, 0, sizeof(sb));
+
+	h = (h ^ sb.st_dev) * 0x100000001b3ULL;
+	h = (h ^ sb.st_ino) * 0x100000001b3ULL;
+	h = (h ^ sb.st_mtim.tv_nsec) * 0x100000001b3ULL;
+	st->st_ino = h;
+	st->st_size += sb.st_size;
+
+	if (	sb.st_mtim.tv_sec > st->st_mtim.tv_sec
+	    ||	(	sb.st_mtim.tv_sec == st->st_mtim.tv_sec
+		 &&	sb.st_mtim.tv_nsec > st->st_mtim.tv_nsec))
+		st->st_mtim = sb.st_mtim;
 }
 
-static void profinfo4cli(struct wrides *de)
+static const char *jspath(void)
 {
-	struct fdbuf sigb = {de};
-	iterprofs(profpath(), &((struct iterprofspec){
-		.sigb = &sigb,
-		.sendauxjs = 1,
-		.diaglog = 1,
-	}));
-	fdb_finsh(&sigb);
+	static char *def;
+	const char *p = getenv("WERMJSPATH");
+
+	if (p) return p;
+	if (!def) xasprintf(&def, "%s/js:%s/.config/werm/js",
+			    getenv("WERMSRCDIR"), getenv("HOME"));
+	return def;
 }
 
-void send_pream(int fd)
+/* Calls fn with the path of each file which may make up the aux.js for the
+   comma-separated names in spec, in the order their contents are taken. */
+static void iterauxjs(const char *jsp, const char *spec,
+		      void (*fn)(void *ctx, const char *full), void *ctx)
 {
-	struct fdbuf ob = {&(struct wrides){fd}};
+	const char *nm, *nme, *dr, *dre;
+	char *full;
 
-	if (logview) {
-		fdb_apnd(&ob, ". $WERMSRCDIR/util/logview ", -1);
-		fdb_apnd(&ob, logview, -1);
-		fdb_apnd(&ob, "\r", -1);
-	}
-	else {
-		iterprofs(profpath(), &((struct iterprofspec){
-			.sigb = &ob,
-			.sendpream = 1,
-			.diaglog = 1,
-		}));
-	}
+	for (nm = spec; *nm; nm = *nme ? nme+1 : nme) {
+		nme = strchrnul(nm, ',');
+		if (nme == nm) continue;
 
-	fdb_finsh(&ob);
+		for (dr = jsp; *dr; dr = *dre ? dre+1 : dre) {
+			dre = strchrnul(dr, ':');
+
+			xasprintf(&full, "%.*s/%.*s.js",
+				  (int) (dre-dr), dr, (int) (nme-nm), nm);
+			fn(ctx, full);
+			free(full);
+		}
+	}
 }
 
-static void linetitl(struct fdbuf *o)
+/* Appends the contents of the file at path to b. Returns 0 on success. */
+static int apndfile(struct fdbuf *b, const char *path)
 {
-	int td = deqmk(), y = curs_y(term(wts.t,curs));
+	char inb[4096];
+	ssize_t redn;
+	int fd = open(path, O_RDONLY);
+
+	if (0>fd) { perror("open aux js"); return -1; }
 
 	for (;;) {
-		td = tpushlinestr(wts.t, td, y);
-		if (--y < 0 || deqbytsiz(td)) break;
+		redn = read(fd, inb, sizeof(inb));
+		if (0<redn)	fdb_apnd(b, inb, redn);
+		if (0<redn || (0>redn && errno == EINTR)) continue;
+
+		if (redn) perror("read aux js");
+		close(fd);
+		return redn ? -1 : 0;
 	}
-	fdb_json(o, deqtostring(td, 0), deqbytsiz(td));
-	tmfree(td);
 }
 
-/* Array with elements:
-	0: print_atch_clis() array
-	1: termid string
-	2: title string */
-static void atchstatejson(Dtachctx dc, struct wrides *cliutd)
-{
-	struct fdbuf hbuf = {cliutd};
+struct auxjsgen {
+	struct stat stamp;
+	int dyn;
 
-	fdb_apnc(&hbuf, '[');
+	struct fdbuf *out;
+	const char *query;
+	int err;
+};
 
-	print_atch_clis(dc, &hbuf);
-	fdb_apnc(&hbuf, ',');
-	fdb_json(&hbuf, termid ? termid : "", -1);
-	fdb_apnc(&hbuf, ',');
-	if (wts.clnttl)	fdb_json(&hbuf, wts.ttl, ttl_len());
-	else		linetitl(&hbuf);
+static void auxjsstamp(void *ctx, const char *full)
+{
+	struct auxjsgen *g = ctx;
 
-	fdb_apnd(&hbuf, "]\n", -1);
-	fdb_finsh(&hbuf);
+	foldstat(&g->stamp, full);
+	if (!access(full, X_OK)) g->dyn = 1;
 }
 
-static void fwdlinetobuf(int fd, struct fdbuf *ob)
+static void auxjscat(void *ctx, const char *full)
 {
-	int rdn;
-	char buf[512];
-
-	for (;;) {
-		rdn = read(fd, buf, sizeof(buf));
-
-		if (rdn < 0) {
-			if (errno == EINTR) continue;
-			perror("read line from socket");
-			break;
-		}
+	struct auxjsgen *g = ctx;
+	char *fullc;
 
-		fdb_apnd(ob, buf, rdn);
-		if (buf[rdn-1] == '\n') break;
+	if (!access(full, X_OK)) {
+		fullc = strdup(full);
+		if (runcgi(g->out, (char *[]){fullc, 0}, g->query)) g->err = 1;
+		free(fullc);
+	}
+	else if (!access(full, F_OK)) {
+		if (apndfile(g->out, full)) g->err = 1;
 	}
 }
 
-static void atchsesnlis(struct wrides *de)
+/* Builds the aux.js for the names in spec into b. Returns 1 if it must not be
+   cached, because some part of it came from running an executable, or could
+   not be read. */
+static int buildauxjs(struct fdbuf *b, const char *jsp, const char *spec,
+		      struct stat *stamp)
 {
-	DIR *skd;
-	struct dirent *sken;
-	char *spth = 0;
-	int sc, firs = 1;
-	struct fdbuf rb = {0};
-
-	if (!(skd = opendir(socksdir()))) {
-		perror("opendir: socks");
-		puts("error opening socks directory");
-		exit(1);
-	}
+	struct auxjsgen g = {.out = b, .query = spec};
 
-	fdb_apnc(&rb, '[');
-	for (;;) {
-		errno = 0;
-		sken = readdir(skd);
-		if (!sken) {
-			if (errno) perror("readdir: socks");
-			break;
-		}
+	iterauxjs(jsp, spec, auxjsstamp, &g);
+	iterauxjs(jsp, spec, auxjscat, &g);
+	*stamp = g.stamp;
 
-		if (strncmp(sken->d_name, "prs%", 4) &&
-		    strncmp(sken->d_name, "eph%", 4))
-			continue;
+	return g.dyn || g.err;
+}
 
-		xasprintf(&spth, "%s/%s", socksdir(), sken->d_name);
-		sc = connect_uds_as_client(spth);
-		free(spth);
-		if (sc < 0) continue;
+/* aux.js bodies kept by a process. The query is the cache key, and clients may
+   send any query, so only this many of the last ones made are kept. */
+#define AUXJSCACHED 32
 
-		if (!firs) fdb_apnc(&rb, ',');
-		firs = 0;
+static struct {
+	char *keys[AUXJSCACHED];
+	unsigned next;
+} auxjsc;
 
-		full_write(&(struct wrides){sc}, "\\A", -1);
-		fwdlinetobuf(sc, &rb);
-		close(sc);
-	}
+/* Notes that key is in the cache, evicting the oldest aux.js if it is full. */
+static void auxjskeep(const char *key)
+{
+	char **k;
+	unsigned i;
 
-	fdb_apnc(&rb, ']');
-	resp_dynamc(de, 'j', 200, rb.bf, rb.len);
-	fdb_finsh(&rb);
+	for (i = 0; i < AUXJSCACHED; i++)
+		if (auxjsc.keys[i] && !strcmp(auxjsc.keys[i], key)) return;
 
-	closedir(skd);
+	k = auxjsc.keys + auxjsc.next++ % AUXJSCACHED;
+	if (*k) resp_uncache(*k);
+	free(*k);
+	*k = strdup(key);
 }
 
-static void writetosubproccore(
-	/* Where to send output for the process; this is raw keyboard input. */
+/* Hashes of each tmobjs slot as of the last state sent to a client, so the next
+   client which holds that generation can be sent only the slots that differ. */
+static struct {
+	uint32_t gen, capac;
+	uint64_t *hs;
+} stbase;
+
+static uint64_t tmobjhash(struct tmobj *o)
+{
+	uint64_t h = 0xcbf29ce484222325ULL;
+	const unsigned char *b, *e;
+
+	h = (h ^ (uint32_t) o->fct) * 0x100000001b3ULL;
+	if (!o->fs) return h;
+
+	b = (void *) o->fs;
+	e = (void *) (o->fs + o->fct);
+	while (b != e) h = (h ^ *b++) * 0x100000001b3ULL;
+
+	return h;
+}
+
+static void fdb_i32le(struct fdbuf *b, int32_t v)
+{
+	uint32_t u = v;
+
+	fdb_apnc(b, u);
+	fdb_apnc(b, u >> 8);
+	fdb_apnc(b, u >> 16);
+	fdb_apnc(b, u >> 24);
+}
+
+/* Sends the tmobjs heap as little-endian int32 words:
+
+	0: format version (1)
+	1: generation of this state
+	2: generation this is a delta against, or 0 for a full snapshot
+	3: slot count
+	4: bufsfreehead
+	5: term object ID
+
+   followed by a record for each slot that differs from the base generation:
+   the slot index, then its fct, then the fields if fct is not negative. A
+   negative fct marks a free slot, as in tmobjs.objel. A full snapshot has a
+   record for every slot. */
+static void tmstate4cli(struct fdbuf *sigb, uint32_t basegen)
+{
+	struct fdbuf sb = {0};
+	struct tmobj *o;
+	uint32_t i, oldcap;
+	uint64_t h;
+	long long st, took;
+
+	if (!wts.t) return;
+	st = nowns();
+
+	if (basegen != stbase.gen) basegen = 0;
+	oldcap = basegen ? stbase.capac : 0;
+
+	if (stbase.capac != tmobjs.capac) {
+		stbase.hs = realloc(stbase.hs, tmobjs.capac * sizeof(*stbase.hs));
+		if (!stbase.hs) err(1, "realloc state hashes");
+		stbase.capac = tmobjs.capac;
+	}
+
+	if (!stbase.gen) stbase.gen = time(0) ^ getpid() << 16;
+	if (!++stbase.gen) stbase.gen++;
+
+	fdb_i32le(&sb, 1);
+	fdb_i32le(&sb, stbase.gen);
+	fdb_i32le(&sb, basegen);
+	fdb_i32le(&sb, tmobjs.capac);
+	fdb_i32le(&sb, tmobjs.bufsfreehead);
+	fdb_i32le(&sb, wts.t);
+
+	for (i = 0; i < tmobjs.capac; i++) {
+		o = tmobjs.objel + i;
+		h = tmobjhash(o);
+		if (i < oldcap && h == stbase.hs[i]) continue;
+		stbase.hs[i] = h;
+
+		fdb_i32le(&sb, i);
+		fdb_i32le(&sb, o->fct);
+		if (o->fs) fdb_apnd(&sb, o->fs, o->fct * sizeof(*o->fs));
+	}
+
+	fdb_apnd(sigb, "\\@stbin:", -1);
+	fdb_b64(sigb, sb.bf, sb.len);
+	fdb_apnc(sigb, '\n');
+
+	fdb_finsh(&sb);
+
+	took = nowns() - st;
+	perfc.dumps++;
+	perfc.dumpns += took;
+	if (perfc.dumpmaxns < took) perfc.dumpmaxns = took;
+}
+
+static void simpdump4cl(struct fdbuf *sigb)
+{
+	if (!wts.t) return;
+	fdb_apnd(sigb, MODE_ALTSCREEN & term(wts.t,mode) ? "\\s2":"\\s1", -1);
+}
+
+void state4cli(struct fdbuf *b, unsigned basegen)
+{
+	if (wts.allowtmstate)	tmstate4cli(b, basegen);
+	else			simpdump4cl(b);
+}
+
+/* Damage tracking: the rows the engine marks dirty are moved into rowseq after
+   each write to the terminal, tagged with the number of the write, so a client
+   which was last updated at write number N needs only the rows tagged after N.
+*/
+static struct {
+	uint32_t seq, *rowseq;
+	int rowcap;
+} dmgtk;
+
+/* What a client in damage mode was last sent. shd has the cells of each row,
+   laid out like the scr object. */
+struct dmgcli {
+	uint32_t seq;
+	int row, col, cx, cy, mode, cursor;
+	int32_t *shd, palt[PALETTESIZ];
+	long long due;
+};
+
+static void dmgsweep(void)
+{
+	int y, row = term(wts.t,row), any = 0, dirt = term(wts.t,dirty);
+
+	if (row > dmgtk.rowcap) {
+		dmgtk.rowseq = realloc(dmgtk.rowseq, row * sizeof(uint32_t));
+		if (!dmgtk.rowseq) err(1, "realloc rowseq");
+		for (y = dmgtk.rowcap; y < row; y++) dmgtk.rowseq[y] = 0;
+		dmgtk.rowcap = row;
+	}
+
+	for (y = 0; y < row; y++) {
+		if (!fld(dirt, y)) continue;
+		fld(dirt, y) = 0;
+		dmgtk.rowseq[y] = dmgtk.seq + 1;
+		any = 1;
+	}
+	dmgtk.seq += any;
+}
+
+long long nowms(void) { return nowns() / 1000000; }
+
+/* Appends a span of cells or palette entries to the update. */
+static void dmgspan(struct fdbuf *ub, int y, int x, int n, const int32_t *v,
+		    int vcnt)
+{
+	fdb_i32le(ub, y);
+	fdb_i32le(ub, x);
+	fdb_i32le(ub, n);
+	fdb_apnd(ub, v, vcnt * sizeof(*v));
+}
+
+/* An update is a list of little-endian int32 words:
+
+	0: rows
+	1: columns
+	2, 3: cursor column and row
+	4: term mode flags
+	5: cursor style
+
+   followed by spans, each of which is a row index, a starting column, a cell
+   count and then the cells, GLYPH_ELCNT words each. A row index of -1 means
+   the span is of palette entries, one word each. */
+static void dmgbuild(struct dmgcli *d, struct fdbuf *b, int full)
+{
+	struct fdbuf ub = {0};
+	int32_t *cel, *shd, *pal = &fld(term(wts.t,palt), 0);
+	int y, x1 = 0, x2 = PALETTESIZ, rowlen, row = d->row, col = d->col;
+
+	fdb_i32le(&ub, row);
+	fdb_i32le(&ub, col);
+	fdb_i32le(&ub, d->cx = curs_x(term(wts.t,curs)));
+	fdb_i32le(&ub, d->cy = curs_y(term(wts.t,curs)));
+	fdb_i32le(&ub, d->mode = term(wts.t,mode));
+	fdb_i32le(&ub, d->cursor = term(wts.t,cursor));
+
+	for (x1 = 0; x1 < PALETTESIZ && !full; x1++)
+		if (d->palt[x1] != pal[x1]) break;
+	for (x2 = PALETTESIZ; x2 > x1 && !full; x2--)
+		if (d->palt[x2-1] != pal[x2-1]) break;
+	if (x1 < x2) {
+		memcpy(d->palt, pal, sizeof(d->palt));
+		dmgspan(&ub, -1, x1, x2 - x1, pal + x1, x2 - x1);
+	}
+
+	rowlen = col * GLYPH_ELCNT;
+	for (y = 0; y < row; y++) {
+		if (!full && dmgtk.rowseq[y] <= d->seq) continue;
+
+		cel = &fld(term(wts.t,scr), term_cellf(wts.t, y, 0));
+		shd = d->shd + y * rowlen;
+
+		/* Narrow the row down to the cells that changed. A row that
+		   was changed and then put back is not sent at all. */
+		for (x1 = 0; x1 < col; x1++)
+			if (full || memcmp(cel + x1 * GLYPH_ELCNT,
+					   shd + x1 * GLYPH_ELCNT,
+					   GLYPH_ELCNT * sizeof(*cel)))
+				break;
+		if (x1 == col) continue;
+
+		for (x2 = col; !full && x2 > x1 + 1; x2--)
+			if (memcmp(cel + (x2-1) * GLYPH_ELCNT,
+				   shd + (x2-1) * GLYPH_ELCNT,
+				   GLYPH_ELCNT * sizeof(*cel)))
+				break;
+
+		memcpy(shd, cel, rowlen * sizeof(*cel));
+		dmgspan(&ub, y, x1, x2 - x1, cel + x1 * GLYPH_ELCNT,
+			(x2 - x1) * GLYPH_ELCNT);
+	}
+	d->seq = dmgtk.seq;
+
+	fdb_apnd(b, "\\@dmg:", -1);
+	fdb_b64(b, ub.bf, ub.len);
+	fdb_apnc(b, '\n');
+
+	fdb_finsh(&ub);
+}
+
+int dmgupdate(struct clistate *cls, struct fdbuf *b)
+{
+	struct dmgcli *d = cls->dmg;
+	int full = 0;
+	long long now;
+
+	if (!wts.t || !cls->dmgfps) return -1;
+
+	if (!d) d = cls->dmg = calloc(1, sizeof(*d));
+	if (!d) err(1, "calloc dmgcli");
+
+	if (d->row != term(wts.t,row) || d->col != term(wts.t,col)) {
+		d->row = term(wts.t,row);
+		d->col = term(wts.t,col);
+		free(d->shd);
+		d->shd = calloc(d->row * d->col * GLYPH_ELCNT, sizeof(*d->shd));
+		if (!d->shd) err(1, "calloc damage shadow");
+		full = 1;
+	}
+
+	if (	!full
+	&&	d->seq == dmgtk.seq
+	&&	d->cx == curs_x(term(wts.t,curs))
+	&&	d->cy == curs_y(term(wts.t,curs))
+	&&	d->mode == term(wts.t,mode)
+	&&	d->cursor == term(wts.t,cursor)
+	&&	!memcmp(d->palt, &fld(term(wts.t,palt), 0), sizeof(d->palt)))
+		return -1;
+
+	now = nowms();
+	if (now < d->due) return d->due - now;
+
+	dmgbuild(d, b, full);
+	d->due = now + 1000 / cls->dmgfps;
+
+	return -1;
+}
+
+void dmgfre(struct clistate *cls)
+{
+	if (cls->dmg) free(cls->dmg->shd);
+	free(cls->dmg);
+	cls->dmg = 0;
+}
+
+static void profinfo4cli(struct fdbuf *sigb)
+{
+	iterprofs(profpath(), &((struct iterprofspec){
+		.sigb = sigb,
+		.sendauxjs = 1,
+		.diaglog = 1,
+	}));
+}
+
+void send_pream(int fd)
+{
+	struct fdbuf ob = {&(struct wrides){fd}};
+
+	if (logview) {
+		fdb_apnd(&ob, ". $WERMSRCDIR/util/logview ", -1);
+		fdb_apnd(&ob, logview, -1);
+		fdb_apnd(&ob, "\r", -1);
+	}
+	else {
+		iterprofs(profpath(), &((struct iterprofspec){
+			.sigb = &ob,
+			.sendpream = 1,
+			.diaglog = 1,
+		}));
+	}
+
+	fdb_finsh(&ob);
+}
+
+static void linetitl(struct fdbuf *o)
+{
+	int td, y;
+
+	/* The subproc has not written anything yet. */
+	if (!wts.t) { fdb_json(o, "", 0); return; }
+
+	td = deqmk();
+	y = curs_y(term(wts.t,curs));
+
+	for (;;) {
+		td = tpushlinestr(wts.t, td, y);
+		if (--y < 0 || deqbytsiz(td)) break;
+	}
+	fdb_json(o, deqtostring(td, 0), deqbytsiz(td));
+	tmfree(td);
+}
+
+/* Array with elements:
+	0: print_atch_clis() array
+	1: termid string
+	2: title string
+   publish_state adds more:
+	3: when the session last had output, in seconds since the epoch
+	4: milliseconds spent in the engine and dumping state, from perfc */
+static void atchstatejson(Dtachctx dc, struct fdbuf *hbuf)
+{
+	fdb_apnc(hbuf, '[');
+
+	print_atch_clis(dc, hbuf);
+	fdb_apnc(hbuf, ',');
+	fdb_json(hbuf, termid ? termid : "", -1);
+	fdb_apnc(hbuf, ',');
+	if (wts.clnttl)	fdb_json(hbuf, wts.ttl, ttl_len());
+	else		linetitl(hbuf);
+
+	fdb_apnd(hbuf, "]\n", -1);
+}
+
+static void jsnum(struct fdbuf *b, const char *k, unsigned long long v)
+{
+	fdb_apnd(b, ",\"", -1);
+	fdb_apnd(b, k, -1);
+	fdb_apnd(b, "\":", -1);
+	fdb_itoa(b, v);
+}
+
+/* Object with the termid, each counter in perfc under its own name, the size
+   of the tm heap in slots (tmcapac) and bytes of live fields (tmfldbytes), and
+   the print_cli_stats() array (clis). */
+static void perfjson(Dtachctx dc, struct fdbuf *b)
+{
+	fdb_apnd(b, "{\"termid\":", -1);
+	fdb_json(b, termid ? termid : "", -1);
+	jsnum(b, "ptyrd", perfc.ptyrd);
+	jsnum(b, "twrns", perfc.twrns);
+	jsnum(b, "logb", perfc.logb);
+	jsnum(b, "dumps", perfc.dumps);
+	jsnum(b, "dumpns", perfc.dumpns);
+	jsnum(b, "dumpmaxns", perfc.dumpmaxns);
+	jsnum(b, "tmcapac", tmobjs.capac);
+	jsnum(b, "tmfldbytes", tmst.fldbytes);
+	fdb_apnd(b, ",\"clis\":", -1);
+	print_cli_stats(dc, b);
+	fdb_apnd(b, "}\n", -1);
+}
+
+/* Appends to ob what is read from fd up to the end of a line, waiting no longer
+   than ms for all of it. Returns 0 if the line is incomplete. */
+static int fwdlinetobuf(int fd, struct fdbuf *ob, int ms)
+{
+	struct pollfd pf = {fd, POLLIN};
+	long long due = nowms() + ms, left;
+	int rdn;
+	char buf[512];
+
+	for (;;) {
+		left = due - nowms();
+		if (left <= 0) {
+			fprintf(stderr, "timed out reading line from socket\n");
+			return 0;
+		}
+		rdn = poll(&pf, 1, left);
+		if (!rdn) continue;
+		if (rdn > 0) rdn = read(fd, buf, sizeof(buf));
+
+		if (rdn < 0) {
+			if (errno == EINTR) continue;
+			perror("read line from socket");
+			return 0;
+		}
+
+		if (!rdn) return 0;
+
+		fdb_apnd(ob, buf, rdn);
+		if (buf[rdn-1] == '\n') return 1;
+	}
+}
+
+/* Sessions publish the state /atchses lists for them in files under regdir,
+   named after their sockets, so listing them does not need a round-trip to
+   each one. A file holds the pid of the master on the first line, and the
+   JSON value of atchstatejson on the second. A session publishes at most once
+   per REGPUBMS. */
+#define REGPUBMS 1000
+
+/* Sessions with no registry file, such as one which just started, are asked
+   for their state directly, all at once, waiting no longer than this. */
+#define PROBEMS 500
+
+static const char *regdir(void)
+{
+	static char *rd;
+
+	if (rd) return rd;
+
+	xasprintf(&rd, "%s/reg", socksdir());
+	if (mkdir(rd, 0700) && errno != EEXIST) err(1, "cannot create %s", rd);
+
+	return rd;
+}
+
+static char *regpath;
+
+/* What was last published, and when */
+static struct fdbuf pubd;
+static long long pubat;
+
+static void unpublish(void) { if (regpath) unlink(regpath); }
+
+int publish_state(Dtachctx dc)
+{
+	struct fdbuf b = {0};
+	long long now = nowms();
+	char *tmp, *sp;
+	int fd;
+
+	if (pubat && now - pubat < REGPUBMS) return REGPUBMS - (now - pubat);
+
+	fdb_itoa(&b, getpid());
+	fdb_apnc(&b, '\n');
+	atchstatejson(dc, &b);
+
+	/* Add the activity time and cost to the end of the array. */
+	b.len -= 2;
+	fdb_apnc(&b, ',');
+	fdb_itoa(&b, dc->lastact);
+	fdb_apnc(&b, ',');
+	fdb_itoa(&b, (perfc.twrns + perfc.dumpns) / 1000000);
+	fdb_apnd(&b, "]\n", -1);
+
+	if (b.len == pubd.len && !memcmp(b.bf, pubd.bf, b.len)) goto cleanup;
+
+	if (!regpath) {
+		sp = strdup(dc->sockpath);
+		xasprintf(&regpath, "%s/%s", regdir(), basename(sp));
+		free(sp);
+		atexit(unpublish);
+	}
+
+	/* Replace the file in one step, so readers never see part of it. */
+	xasprintf(&tmp, "%s.new", regpath);
+	fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if (0 > fd) {
+		warn("open %s", tmp);
+	}
+	else {
+		full_write(&(struct wrides){fd}, b.bf, b.len);
+		close(fd);
+		if (0 > rename(tmp, regpath)) warn("rename %s", tmp);
+	}
+	free(tmp);
+
+	pubat = now;
+	fdb_finsh(&pubd);
+	pubd = b;
+	return -1;
+
+cleanup:
+	fdb_finsh(&b);
+	return -1;
+}
+
+/* Query args which apply to a single terminal */
+static char **const termflags[] = {
+	&termid, &logview, &sblvl, &dtachlog, &wsbin, &wsdefl, &wsdeflmin,
+	&stgen, &dmgfps, &histkb, &hfrom, &hcnt, &logsegkb, &logsegh, &logz,
+};
+#define TERMFLAGCNT (sizeof(termflags) / sizeof(*termflags))
+
+/* The globals which belong to the terminal a master serves, as saved while
+   another terminal's are in use. */
+struct termglobs {
+	Wts wts;
+	__typeof__(hist) hist;
+	__typeof__(stbase) stbase;
+	__typeof__(dmgtk) dmgtk;
+	__typeof__(tmobjs) tmobjs;
+	__typeof__(tmcls) tmcls;
+	__typeof__(tmst) tmst;
+	__typeof__(perfc) perfc;
+	void *tmslabs;
+	int ttyd;
+	char *regpath;
+	struct fdbuf pubd;
+	long long pubat;
+	struct logwctx lw;
+	char *flags[TERMFLAGCNT];
+};
+
+/* The terminal whose globals are in use, if termuse or termnew was called */
+static Dtachctx tgcur;
+
+static const struct termglobs tgempty = {.lw = {-1}};
+
+/* Saves the globals in sv and replaces them with those in ld. */
+static void tgswap(struct termglobs *sv, const struct termglobs *ld)
+{
+	size_t fi;
+
+#define TGSWAP(g) do {					\
+	memcpy(&sv->g, &g, sizeof(g));			\
+	memcpy(&g, &ld->g, sizeof(g));			\
+} while (0)
+	TGSWAP(wts);
+	TGSWAP(hist);
+	TGSWAP(stbase);
+	TGSWAP(dmgtk);
+	TGSWAP(tmobjs);
+	TGSWAP(tmcls);
+	TGSWAP(tmst);
+	TGSWAP(perfc);
+	TGSWAP(tmslabs);
+	TGSWAP(ttyd);
+	TGSWAP(regpath);
+	TGSWAP(pubd);
+	TGSWAP(pubat);
+#undef TGSWAP
+
+	logw_swap(&sv->lw, &ld->lw);
+
+	for (fi = 0; fi < TERMFLAGCNT; fi++) {
+		sv->flags[fi] = *termflags[fi];
+		*termflags[fi] = ld->flags[fi];
+	}
+}
+
+/* Makes ld the globals in use, saving the current ones in tgcur's slot. */
+static void tgload(const struct termglobs *ld)
+{
+	static struct termglobs discard;
+
+	if (!tgcur)
+		tgswap(&discard, ld);
+	else {
+		if (!tgcur->tg) tgcur->tg = malloc(sizeof(*tgcur->tg));
+		tgswap(tgcur->tg, ld);
+	}
+}
+
+void termuse(Dtachctx dc)
+{
+	if (dc == tgcur) return;
+
+	/* Without a slot, dc's globals are the ones in use already. */
+	if (dc->tg) tgload(dc->tg);
+	tgcur = dc;
+}
+
+void termnew(Dtachctx dc, const char *flags)
+{
+	tgload(&tgempty);
+	dc->tg = malloc(sizeof(*dc->tg));
+	tgcur = dc;
+
+	processquerystr(getenv("WERMFLAGS"));
+	processquerystr(flags);
+	wts.allowtmstate = 1;
+}
+
+void termend(Dtachctx dc)
+{
+	size_t fi;
+
+	termuse(dc);
+
+	unpublish();
+	free(regpath);
+	fdb_finsh(&pubd);
+	logw_stop();
+
+	tmheapfre();
+	free(hist.bf);
+	free(hist.ls);
+	free(stbase.hs);
+	free(dmgtk.rowseq);
+	for (fi = 0; fi < TERMFLAGCNT; fi++) free(*termflags[fi]);
+
+	tgcur = 0;
+	tgload(&tgempty);
+	free(dc->tg);
+	dc->tg = 0;
+}
+
+/* Appends the published state of the session with the socket named sname to
+   rb. Returns 0 if it has none, which can be because its master died without
+   removing it. */
+static int readreg(const char *sname, struct fdbuf *rb)
+{
+	struct fdbuf fb = {0};
+	char *rp, *js;
+	long pid;
+	int ok = 0;
+
+	xasprintf(&rp, "%s/%s", regdir(), sname);
+	if (0 > access(rp, F_OK) || apndfile(&fb, rp)) goto cleanup;
+	fdb_apnc(&fb, 0);
+
+	pid = strtol((char *) fb.bf, &js, 10);
+	if (*js++ != '\n' || !*js) goto cleanup;
+
+	if (0 > kill(pid, 0) && errno == ESRCH) {
+		unlink(rp);
+		goto cleanup;
+	}
+
+	fdb_apnd(rb, js, -1);
+	ok = 1;
+
+cleanup:
+	free(rp);
+	fdb_finsh(&fb);
+	return ok;
+}
+
+struct sesprobe {
+	int fd;
+	struct fdbuf b;
+};
+
+/* Sends the escape esc to each of the sessions, such as \A to ask for the
+   state it would publish, and appends the one-line replies to rb, each
+   preceded by a comma if *firs is not set. A session which does not reply
+   within PROBEMS is left out. */
+static void probesess(struct sesprobe *pr, size_t n, struct fdbuf *rb,
+		      int *firs, const char *esc)
+{
+	struct pollfd *pfd = calloc(n ? n : 1, sizeof(*pfd));
+	long long due = nowms() + PROBEMS, left;
+	char buf[512];
+	size_t i, wait;
+	ssize_t rdn;
+
+	for (i = 0; i < n; i++) {
+		pfd[i].fd = pr[i].fd;
+		pfd[i].events = POLLIN;
+		fcntl(pr[i].fd, F_SETFL, fcntl(pr[i].fd, F_GETFL) | O_NONBLOCK);
+		if (0 > write(pr[i].fd, esc, strlen(esc))) pfd[i].fd = -1;
+	}
+
+	for (;;) {
+		for (wait = i = 0; i < n; i++) wait += pfd[i].fd >= 0;
+		left = due - nowms();
+		if (!wait || left <= 0) break;
+
+		if (0 > poll(pfd, n, left)) {
+			if (errno == EINTR) continue;
+			perror("poll session probes");
+			break;
+		}
+
+		for (i = 0; i < n; i++) {
+			if (pfd[i].fd < 0 || !pfd[i].revents) continue;
+
+			rdn = read(pfd[i].fd, buf, sizeof(buf));
+			if (0 > rdn && (errno == EINTR || errno == EAGAIN))
+				continue;
+			if (0 < rdn) fdb_apnd(&pr[i].b, buf, rdn);
+			if (0 < rdn && buf[rdn-1] != '\n') continue;
+
+			pfd[i].fd = -1;
+			if (0 >= rdn) pr[i].b.len = 0;
+		}
+	}
+
+	for (i = 0; i < n; i++) {
+		if (pfd[i].fd < 0 && pr[i].b.len) {
+			if (!*firs) fdb_apnc(rb, ',');
+			*firs = 0;
+			fdb_apnd(rb, pr[i].b.bf, pr[i].b.len);
+		}
+		fdb_finsh(&pr[i].b);
+		close(pr[i].fd);
+	}
+
+	free(pfd);
+}
+
+/* Serves a JSON array with the reply of every session to the escape esc. If
+   usereg is set, the registry entry of a session is used instead where it has
+   one, which is only right for \A. */
+static void lissesns(struct wrides *de, const char *esc, int usereg)
+{
+	DIR *skd;
+	struct dirent *sken;
+	char *spth = 0;
+	int sc, firs = 1;
+	struct fdbuf rb, sb = {0};
+	struct sesprobe *pr = 0;
+	size_t prn = 0;
+
+	if (!(skd = opendir(socksdir()))) {
+		perror("opendir: socks");
+		puts("error opening socks directory");
+		exit(1);
+	}
+
+	resp_chunked(de, 'j', 200, &rb);
+	fdb_apnc(&rb, '[');
+	for (;;) {
+		errno = 0;
+		sken = readdir(skd);
+		if (!sken) {
+			if (errno) perror("readdir: socks");
+			break;
+		}
+
+		if (strncmp(sken->d_name, "prs%", 4) &&
+		    strncmp(sken->d_name, "eph%", 4))
+			continue;
+
+		sb.len = 0;
+		if (usereg && readreg(sken->d_name, &sb)) {
+			if (!firs) fdb_apnc(&rb, ',');
+			firs = 0;
+			fdb_apnd(&rb, sb.bf, sb.len);
+			continue;
+		}
+
+		xasprintf(&spth, "%s/%s", socksdir(), sken->d_name);
+		sc = connect_uds_as_client(spth);
+		free(spth);
+		if (sc < 0) continue;
+
+		pr = realloc(pr, sizeof(*pr) * (prn+1));
+		pr[prn++] = (struct sesprobe){sc};
+	}
+
+	probesess(pr, prn, &rb, &firs, esc);
+	free(pr);
+
+	fdb_apnc(&rb, ']');
+	fdb_finsh(&rb);
+	fdb_finsh(&sb);
+
+	closedir(skd);
+}
+
+/* How long to wait for a session to send the history lines asked for. A
+   session which takes longer is treated as not replying, so it does not hold up
+   the worker serving the request. */
+#define HISTREPLYMS 2000
+
+/* Serves history lines of session termid as JSON:
+	{"oldest":N,"end":N,"first":N,"lines":["...",...]}
+   Query args hfrom and hcnt pick the lines, by default the last 1000. */
+static void servehist(struct wrides *de, Httpreq *rq)
+{
+	char *spth = 0, *pl, req[32];
+	unsigned long long from, oldest, end, first;
+	unsigned cnt;
+	int sc, pln;
+	struct fdbuf rb = {0}, lb = {0}, jb = {0};
+	const char *ln, *le, *lend;
+
+	free(termid);	termid = 0;
+	free(hfrom);	hfrom = 0;
+	free(hcnt);	hcnt = 0;
+	processquerystr(rq->query);
+
+	if (!termid) {
+		resp_dynamc(de, 't', 400, "termid required\n", 16);
+		return;
+	}
+	checktid();
+
+	from = hfrom ? strtoull(hfrom, 0, 10) : HISTNEWEST;
+	cnt = hcnt ? MIN(strtoul(hcnt, 0, 10), 0xffff) : 1000;
+	if (from > HISTNEWEST) from = HISTNEWEST;
+
+	xasprintf(&spth, "%s/prs%%%s", socksdir(), termid);
+	sc = connect_uds_as_client(spth);
+	free(spth);
+	if (sc < 0) {
+		resp_dynamc(de, 't', 404, "no such session\n", 16);
+		return;
+	}
+
+	snprintf(req, sizeof(req), "\\y%012llx%04x", from, cnt);
+	full_write(&(struct wrides){sc}, req, -1);
+	if (!fwdlinetobuf(sc, &rb, HISTREPLYMS)) {
+		close(sc);
+		resp_dynamc(de, 't', 504, "session did not reply\n", 22);
+		fdb_finsh(&rb);
+		return;
+	}
+	close(sc);
+	fdb_apnc(&rb, 0);
+
+	if (3 != sscanf((char *) rb.bf, "\\@hist:%llu,%llu,%llu:%n",
+			&oldest, &end, &first, &pln)) {
+		resp_dynamc(de, 't', 502, "bad reply from session\n", 23);
+		fdb_finsh(&rb);
+		return;
+	}
+	pl = (char *) rb.bf + pln;
+	fdb_unb64(&lb, pl, strcspn(pl, "\n"));
+	fdb_finsh(&rb);
+
+	fdb_apnd(&jb, "{\"oldest\":", -1);	fdb_itoa(&jb, oldest);
+	fdb_apnd(&jb, ",\"end\":", -1);	fdb_itoa(&jb, end);
+	fdb_apnd(&jb, ",\"first\":", -1);	fdb_itoa(&jb, first);
+	fdb_apnd(&jb, ",\"lines\":[", -1);
+	lend = (char *) lb.bf + lb.len;
+	for (ln = (char *) lb.bf; ln < lend; ln = le + 1) {
+		le = memchr(ln, '\n', lend - ln);
+		if (!le) le = lend;
+		if (ln != (char *) lb.bf) fdb_apnc(&jb, ',');
+		fdb_json(&jb, ln, le - ln);
+	}
+	fdb_apnd(&jb, "]}\n", -1);
+
+	resp_dynamc(de, 'j', 200, jb.bf, jb.len);
+	fdb_finsh(&lb);
+	fdb_finsh(&jb);
+}
+
+/* Format of the arguments of the \W escape, which are: whether binary frames
+   are used, the permessage-deflate level, window bits and whether the context
+   is reset for each message, and the smallest message to compress. */
+#define WSPARMFMT "%1u%1u%02u%1u%05u"
+
+static void wsparms(struct clistate *cls, const char *arg)
+{
+	unsigned bin, lvl, bits, reset, minsz;
+	char a[sizeof(wts.wsparm) + 1];
+
+	memcpy(a, arg, sizeof(wts.wsparm));
+	a[sizeof(wts.wsparm)] = 0;
+
+	if (5 != sscanf(a, WSPARMFMT, &bin, &lvl, &bits, &reset, &minsz)
+	    || (lvl && (bits < 8 || bits > 15))) {
+		warnx("invalid websocket settings: %s", a);
+		return;
+	}
+
+	cls->wsbin = !!bin;
+	cls->wsdefllvl = lvl;
+	cls->wsdeflbits = bits;
+	cls->wsdeflreset = !!reset;
+	cls->wsdeflmin = minsz;
+}
+
+static void writetosubproccore(
+	/* Where to send output for the process; this is raw keyboard input. */
 	struct wrides *procde,
 
-	/* Where to send output for attached client. */
-	struct wrides *clioutde,
+	/* Where to queue output for attached client. */
+	struct fdbuf *cliob,
 
 	Dtachctx dc,
 	struct clistate *cls,
@@ -761,7 +2089,8 @@ static void writetosubproccore(
 	const unsigned char *buf,
 	unsigned bufsz)
 {
-	unsigned wi;
+	unsigned wi, histcnt;
+	unsigned long long histfrom;
 	unsigned char byte, cursmvbyte;
 	struct fdbuf kbdb = {procde};
 
@@ -797,6 +2126,12 @@ static void writetosubproccore(
 			case 'w':
 			case 't':
 			case 'i':
+			case 'g':
+			case 'f':
+			case 'y':
+			case 'W':
+			case 'L':
+			case 'l':
 				wts.altbufsz = 0;
 				wts.escp = byte;
 				break;
@@ -812,13 +2147,15 @@ static void writetosubproccore(
 			   the output. */
 			case 'N':
 				cls->wantsoutput=1;
-				if (wts.ttl[0])		recounttitl(clioutde);
-				if (wts.allowtmstate)	tmstate4cli(clioutde);
-				else			simpdump4cl(clioutde);
-				profinfo4cli(clioutde);
+				if (wts.ttl[0]) recounttitl(cliob);
+				/* Damage mode starts over with a full update */
+				if (cls->dmgfps)	dmgfre(cls);
+				else			state4cli(cliob, cls->stgen);
+				profinfo4cli(cliob);
 				break;
 
-			case 'A':	atchstatejson(dc, clioutde); break;
+			case 'A':	atchstatejson(dc, cliob); break;
+			case 'P':	perfjson(dc, cliob); break;
 
 			/* directions, home, end */
 			case '^':	cursmvbyte = 'A'; break;
@@ -854,14 +2191,85 @@ static void writetosubproccore(
 
 			break;
 
-		case 't':
+		case 't':
+			if (byte == '\n') {
+				wts.escp = 0;
+				byte = 0;
+				wts.clnttl = !!wts.altbufsz;
+			}
+			TMpokettl(wts.altbufsz++, byte);
+			if (!byte) recounttitl(cliob);
+
+			break;
+
+		case 'g':
+			wts.genhex[wts.altbufsz++] = byte;
+			if (wts.altbufsz != sizeof(wts.genhex)) break;
+
+			if (1 != sscanf(wts.genhex, "%8x", &cls->stgen))
+				warnx("invalid state generation: %.8s",
+				      wts.genhex);
+			wts.escp = 0;
+
+			break;
+
+		case 'f':
+			wts.fpsdig[wts.altbufsz++] = byte;
+			if (wts.altbufsz != sizeof(wts.fpsdig)) break;
+
+			if (1 != sscanf(wts.fpsdig, "%4u", &cls->dmgfps))
+				warnx("invalid update rate: %.4s", wts.fpsdig);
+			wts.escp = 0;
+
+			break;
+
+		case 'W':
+			wts.wsparm[wts.altbufsz++] = byte;
+			if (wts.altbufsz != sizeof(wts.wsparm)) break;
+
+			wsparms(cls, wts.wsparm);
+			wts.escp = 0;
+
+			break;
+
+		case 'y':
+			wts.histhex[wts.altbufsz++] = byte;
+			if (wts.altbufsz != sizeof(wts.histhex)) break;
+
+			if (2 == sscanf(wts.histhex, "%12llx%4x",
+					&histfrom, &histcnt))
+				hist4cli(cliob, histfrom, histcnt);
+			else
+				warnx("invalid history range: %.16s",
+				      wts.histhex);
+			wts.escp = 0;
+
+			break;
+
+		case 'L':
+			wts.lathex[wts.altbufsz++] = byte;
+			if (wts.altbufsz != sizeof(wts.lathex)) break;
+
+			if (1 != sscanf(wts.lathex, "%8x", &cls->latid))
+				warnx("invalid traced key: %.8s", wts.lathex);
+			else {
+				cls->latarr = nowns();
+				cls->latwr = cls->latech = 0;
+			}
+			wts.escp = 0;
+
+			break;
+
+		case 'l':
 			if (byte == '\n') {
 				wts.escp = 0;
-				byte = 0;
-				wts.clnttl = !!wts.altbufsz;
+				if (dtach_logging())
+					fprintf(stderr, "key latency %s: %.*s\n",
+						termid ? termid : "",
+						wts.altbufsz, wts.latrep);
 			}
-			TMpokettl(wts.altbufsz++, byte);
-			if (!byte) recounttitl(clioutde);
+			else if (wts.altbufsz < sizeof(wts.latrep))
+				wts.latrep[wts.altbufsz++] = byte;
 
 			break;
 
@@ -878,18 +2286,37 @@ static void writetosubproccore(
 	}
 
 	fdb_finsh(&kbdb);
+	if (cls->latarr && !cls->latwr) cls->latwr = nowns();
 
 	if (wts.t && wts.sendsigwin) tresize(wts.t, wts.swcol, wts.swrow);
 }
 
-void process_kbd(int clioutfd, Dtachctx dc, struct clistate *cls,
+void latpty(struct clistate *cls)
+{
+	if (cls->latwr && !cls->latech) cls->latech = nowns();
+}
+
+void lat4cli(struct clistate *cls, struct fdbuf *b)
+{
+	char msg[64];
+
+	if (!cls->latech) return;
+
+	snprintf(msg, sizeof(msg), "\\@lat:%08x,%lld,%lld\n", cls->latid,
+		 (cls->latwr - cls->latarr) / 1000,
+		 (cls->latech - cls->latwr) / 1000);
+	fdb_apnd(b, msg, -1);
+	cls->latarr = cls->latwr = cls->latech = 0;
+}
+
+void process_kbd(struct fdbuf *cliob, Dtachctx dc, struct clistate *cls,
 		 unsigned char *buf, size_t bufsz)
 {
-	struct wrides ptyde = { dc->the_pty.fd }, clide = { clioutfd };
+	struct wrides ptyde = { dc->the_pty.fd };
 
 	struct winsize ws = {0};
 
-	writetosubproccore(&ptyde, &clide, dc, cls, buf, bufsz);
+	writetosubproccore(&ptyde, cliob, dc, cls, buf, bufsz);
 
 	if (!wts.sendsigwin) return;
 
@@ -957,8 +2384,25 @@ static void testreset(void)
 	free(termid);	termid = 0;
 	free(logview);	logview = 0;
 	free(sblvl);	sblvl = 0;
+	free(wsbin);	wsbin = 0;
+	free(histkb);	histkb = 0;
+	free(logsegkb);	logsegkb = 0;
+	free(logsegh);	logsegh = 0;
+	free(logz);	logz = 0;
+	free(atchproc);	atchproc = 0;
+	free(onemaster);	onemaster = 0;
+
+	free(hist.bf);
+	free(hist.ls);
+	memset(&hist, 0, sizeof(hist));
+
+	memset(&perfc, 0, sizeof(perfc));
+
+	/* Make generation numbers predictable */
+	stbase.gen = 1000;
 
 	profpathsavd = "";
+	profcfre();
 	testclistate('r');
 	testdc('r');
 }
@@ -966,9 +2410,11 @@ static void testreset(void)
 static void writetosp0term(const void *s)
 {
 	struct wrides pty = {1, "pty"}, cli = {1, "cli"};
+	struct fdbuf clib = {&cli};
 
 	writetosubproccore(
-		&pty, &cli, testdc('g'), testclistate('g'), s, strlen(s));
+		&pty, &clib, testdc('g'), testclistate('g'), s, strlen(s));
+	fdb_finsh(&clib);
 
 	if (wts.sendsigwin)
 		printf("sigwin r=%d c=%d\n", wts.swrow, wts.swcol);
@@ -976,6 +2422,33 @@ static void writetosp0term(const void *s)
 
 static void tstdesc(const char *d) { printf("TEST: %s\n", d); }
 
+static void testlat(void)
+{
+	struct clistate *cls = testclistate('g');
+	struct fdbuf b = {0};
+	char *comma;
+
+	writetosp0term("x\\L0000002a");
+	printf("latid=%x arrived=%d written=%d\n",
+	       cls->latid, !!cls->latarr, !!cls->latwr);
+
+	lat4cli(cls, &b);
+	printf("before output: %u bytes\n", b.len);
+
+	latpty(cls);
+	lat4cli(cls, &b);
+	fdb_apnc(&b, 0);
+	comma = strchr((char *) b.bf, ',');
+	printf("%.*s, second comma=%d\n", (int) (comma - (char *) b.bf),
+	       b.bf, (int) (strchr(comma+1, ',') != 0));
+
+	b.len = 0;
+	lat4cli(cls, &b);
+	printf("sent once: %u bytes\n", b.len);
+
+	fdb_finsh(&b);
+}
+
 static void testqrystring(void)
 {
 	tstdesc("parse termid arg");
@@ -992,6 +2465,140 @@ static void testqrystring(void)
 	testreset();
 	processquerystr("sblvl=&termid=%21escapes%7eand%45");
 	printf("%zu,%s,%d\n", strlen(sblvl), termid, !logview);
+
+	tstdesc("binary websocket output");
+	testreset();
+	processquerystr("termid=bin&wsbin=1");
+	printf("%s,%s\n", termid, wsbin);
+
+	tstdesc("args of one request are not kept for the next");
+	testreset();
+	processquerystr("wsdefl=3");
+	qryreset();
+	processquerystr("wsdefl=0&atchproc=1&glcops=41&termid=x");
+	qryreset();
+	printf("wsdefl=%s atchproc=%d glcops=%d termid=%d\n",
+	       wsdefl, !!atchproc, !!glcops, !!termid);
+	free(wsdefl);
+	wsdefl = 0;
+}
+
+static int tstauxjscached(const char *spec)
+{
+	struct wrides nul = {open("/dev/null", O_WRONLY)};
+	struct fdbuf b = {0};
+	struct stat st;
+	char *key;
+	int r;
+
+	buildauxjs(&b, jspath(), spec, &st);
+	xasprintf(&key, "/aux.js?%s", spec);
+	r = resp_fromcache(&nul, &(Httpreq){0}, key, &st);
+
+	free(key);
+	fdb_finsh(&b);
+	close(nul.fd);
+	return r;
+}
+
+static void testauxjscache(void)
+{
+	struct wrides nul = {open("/dev/null", O_WRONLY)};
+	Httpreq rq = {0};
+	int i;
+
+	setenv("WERMJSPATH", "test/js1:test/js2", 1);
+	for (i = 0; i <= AUXJSCACHED; i++) {
+		snprintf(rq.query, sizeof(rq.query), "a,%d", i);
+		serveauxjs(&nul, &rq);
+	}
+	strcpy(rq.query, "nosuchjs");
+	serveauxjs(&nul, &rq);
+
+	printf("oldest: %d, second: %d, newest: %d, empty: %d\n",
+	       tstauxjscached("a,0"), tstauxjscached("a,1"),
+	       tstauxjscached("a,32"), tstauxjscached("nosuchjs"));
+
+	unsetenv("WERMJSPATH");
+	close(nul.fd);
+}
+
+static void testauxjs(void)
+{
+	struct fdbuf b = {0};
+	struct stat st, st2;
+	int dyn;
+
+	tstdesc("aux.js from two dirs, skipping missing files and empty names");
+	dyn = buildauxjs(&b, "test/js1:test/jsnoent:test/js2", "a,,b,c", &st);
+	printf("dyn: %d\n", dyn);
+	fwrite(b.bf, 1, b.len, stdout);
+	b.len = 0;
+
+	tstdesc("aux.js stamp is the same until a file changes");
+	buildauxjs(&b, "test/js1:test/jsnoent:test/js2", "a,,b,c", &st2);
+	printf("same: %d\n", !memcmp(&st, &st2, sizeof(st)));
+	b.len = 0;
+	buildauxjs(&b, "test/js1:test/jsnoent:test/js2", "a,b", &st2);
+	printf("other names: %d\n", !memcmp(&st, &st2, sizeof(st)));
+
+	tstdesc("aux.js cache keeps the last AUXJSCACHED bodies, none empty");
+	testauxjscache();
+
+	fdb_finsh(&b);
+}
+
+static void tstwrprof(const char *pth, const char *cont)
+{
+	FILE *f = fopen(pth, "w");
+
+	if (!f) err(1, "fopen %s", pth);
+	fputs(cont, f);
+	fclose(f);
+}
+
+static void testprofcache(void)
+{
+	char dir[] = "/tmp/wermprofXXXXXX", *p;
+	struct wrides sigde = {1, "profsig"};
+	struct fdbuf sigb = {&sigde, 512};
+	struct iterprofspec nsspc = {&sigb, .newsessin = 1};
+	int cwd = open(".", O_RDONLY | O_DIRECTORY);
+
+	/* Work in the dir so its random name is not in the output. */
+	if (!mkdtemp(dir) || chdir(dir)) err(1, "mkdtemp");
+	p = "grp";
+	tstwrprof(p, "one\techo one\n");
+
+	tstdesc("profiles are read once until they change");
+	testreset();
+	iterprofs(".", &nsspc);
+	fdb_finsh(&sigb);
+	iterprofs(".", &nsspc);
+	fdb_finsh(&sigb);
+
+	tstdesc("changed profile is read again after PROFCHECKMS");
+	tstwrprof(p, "one\techo one\ntwo\techo two\n");
+	iterprofs(".", &nsspc);
+	fdb_finsh(&sigb);
+	profc.checked = 0;
+	iterprofs(".", &nsspc);
+	fdb_finsh(&sigb);
+
+	tstdesc("preamble is kept for each termid");
+	termid = strdup("two");
+	iterprofs(".", &((struct iterprofspec) {&sigb, .sendpream = 1}));
+	fdb_finsh(&sigb);
+	free(termid);
+	termid = strdup("one");
+	iterprofs(".", &((struct iterprofspec) {&sigb, .sendpream = 1}));
+	fdb_finsh(&sigb);
+
+	unlink(p);
+	if (fchdir(cwd)) err(1, "fchdir");
+	close(cwd);
+	rmdir(dir);
+	testreset();
 }
 
 static void testiterprofs(void)
@@ -1101,88 +2708,657 @@ static void testiterprofs(void)
 	}));
 	fdb_finsh(&sigb);
 
-	tstdesc("empty js for match 2");
-	testreset();
-	termid = strdup("allempty");
-	iterprofs("test/profiles1", &((struct iterprofspec) {
-		&sigb,
-		.sendauxjs = 1,
-	}));
-	fdb_finsh(&sigb);
+	tstdesc("empty js for match 2");
+	testreset();
+	termid = strdup("allempty");
+	iterprofs("test/profiles1", &((struct iterprofspec) {
+		&sigb,
+		.sendauxjs = 1,
+	}));
+	fdb_finsh(&sigb);
+
+	tstdesc("empty js for match 3");
+	testreset();
+	termid = strdup("emptyjs1");
+	iterprofs("test/profiles1", &((struct iterprofspec) {
+		&sigb,
+		.sendauxjs = 1,
+	}));
+	fdb_finsh(&sigb);
+
+	tstdesc("empty js for match 4");
+	testreset();
+	termid = strdup("emptyjs2");
+	iterprofs("test/profiles1", &((struct iterprofspec) {
+		&sigb,
+		.sendauxjs = 1,
+	}));
+	fdb_finsh(&sigb);
+
+	tstdesc("url-encoding-related chars not allowed in termid");
+	testreset();
+	iterprofs("test/profiles3", &((struct iterprofspec) {
+		&sigb,
+	}));
+	fdb_finsh(&sigb);
+
+	tstdesc("bad names while outputting new session list");
+	testreset();
+	iterprofs("test/profiles3", &((struct iterprofspec) {
+		&sigb,
+		.newsessin = 1,
+	}));
+	fdb_finsh(&sigb);
+
+	tstdesc("dump newsessin list");
+	testreset();
+	iterprofs("test/profilesname", &((struct iterprofspec) {
+		&sigb,
+		.newsessin = 1,
+	}));
+	fdb_finsh(&sigb);
+
+	tstdesc("empty profile name");
+	testreset();
+	iterprofs("test/emptyprof", &((struct iterprofspec) {
+		&sigb,
+		.newsessin = 1,
+	}));
+	termid = strdup("");
+	iterprofs("test/emptyprof", &((struct iterprofspec) {
+		&sigb,
+		.sendpream = 1,
+	}));
+	iterprofs("test/emptyprof", &((struct iterprofspec) {
+		&sigb,
+		.sendauxjs = 1,
+	}));
+	fdb_finsh(&sigb);
+
+	tstdesc("ephemeral session uses basic profile config");
+	testreset();
+	iterprofs("test/emptyprof", &((struct iterprofspec) {
+		&sigb,
+		.sendpream = 1,
+		.sendauxjs = 1,
+	}));
+	fdb_finsh(&sigb);
+
+	testprofcache();
+}
+
+static void writelgon(void)
+{
+	wts.logde.fd = 1;
+	wts.writelg = 1;
+	wts.logde.escannot = "sblog";
+}
+
+/* Copy of the tmobjs heap rebuilt from tmstate4cli output, like main.js does. */
+static struct {
+	int32_t capac, fh, t, *fct, **fs;
+} tstst;
+
+static void tstapplyst(uint32_t basegen)
+{
+	struct fdbuf sb = {0}, raw = {0};
+	int32_t *w, *e, si;
+	unsigned nrec = 0;
+	char *pl;
+
+	tmstate4cli(&sb, basegen);
+	fdb_apnc(&sb, 0);
+	pl = strchr((char *) sb.bf, ':') + 1;
+	fdb_unb64(&raw, pl, strcspn(pl, "\n"));
+
+	w = (int32_t *) raw.bf;
+	e = w + raw.len / 4;
+	printf("ver=%d gen=%u base=%u capac=%d",
+	       w[0], w[1] - 1000, w[2] ? w[2] - 1000 : 0, w[3]);
+
+	tstst.fct = realloc(tstst.fct, w[3] * sizeof(*tstst.fct));
+	tstst.fs = realloc(tstst.fs, w[3] * sizeof(*tstst.fs));
+	for (si = tstst.capac; si < w[3]; si++) tstst.fs[si] = 0;
+	tstst.capac = w[3];
+	tstst.fh = w[4];
+	tstst.t = w[5];
+
+	for (w += 6; w < e; nrec++) {
+		si = *w++;
+		tstst.fct[si] = *w++;
+		free(tstst.fs[si]);
+		tstst.fs[si] = 0;
+		if (tstst.fct[si] < 0) continue;
+
+		tstst.fs[si] = malloc(tstst.fct[si] * sizeof(int32_t));
+		memcpy(tstst.fs[si], w, tstst.fct[si] * sizeof(int32_t));
+		w += tstst.fct[si];
+	}
+	printf(" records=%u\n", nrec);
+
+	fdb_finsh(&sb);
+	fdb_finsh(&raw);
+}
+
+static void tstcmpst(void)
+{
+	uint32_t si, same = tstst.capac == tmobjs.capac
+			 && tstst.fh == tmobjs.bufsfreehead
+			 && tstst.t == wts.t;
+
+	for (si = 0; same && si < tmobjs.capac; si++) {
+		same = tstst.fct[si] == tmobjs.objel[si].fct;
+		if (same && tstst.fs[si]) same = !memcmp(
+			tstst.fs[si], tmobjs.objel[si].fs,
+			tstst.fct[si] * sizeof(int32_t));
+	}
+
+	printf("copy matches heap: %u\n", same);
+}
+
+static void teststbin(void)
+{
+	tstdesc("binary state: full snapshot");
+	testreset();
+	wts.allowtmstate = 1;
+	process_tty_out("hello\r\n", -1); putrwout();
+	tstapplyst(0);
+	tstcmpst();
+
+	tstdesc("binary state: delta against the last generation");
+	process_tty_out("\033[31mred\033[0m\r\n", -1); putrwout();
+	tstapplyst(1001);
+	tstcmpst();
+
+	tstdesc("binary state: nothing changed");
+	tstapplyst(1002);
+	tstcmpst();
+
+	tstdesc("binary state: old generation gets a full snapshot");
+	process_tty_out("\033[2J", -1); putrwout();
+	tstapplyst(1001);
+	tstcmpst();
+
+	tstdesc("binary state: generation escape");
+	writetosp0term("\\g000003ea");
+	printf("stgen=%u\n", testclistate('g')->stgen);
+}
+
+/* Prints how the last CSI sequence written to the terminal was parsed. */
+static void tstcsiargs(char *seq)
+{
+	int32_t i;
+
+	process_tty_out(seq, -1);
+	printf("prv=%d mode0=%d mode1=%d args:", term(wts.t,csiescprv),
+	       term(wts.t,csiescmd0), term(wts.t,csiescmd1));
+	for (i = 0; i < csinarg(wts.t); i++) printf(" %d", csiarg(wts.t, i));
+	putchar('\n');
+}
+
+static void testcsiparse(void)
+{
+	tstdesc("csi parser: args, private marker and intermediate");
+	testreset();
+	tstcsiargs("\033[m");
+	tstcsiargs("\033[1;;38;5;196m");
+	tstcsiargs("\033[?1049h");
+	tstcsiargs("\033[2 q");
+	tstcsiargs("\033[-3;+4;-H");
+	tstcsiargs("\033[99999999999;2147483647;2147483646H");
+	tstcsiargs("\033[1;2;3;4;5;6;7;8;9;10;11;12;13;14;15;16;17m");
+	tstcsiargs("\033[>0c");
+
+	tstdesc("csi parser: osc args are split in place");
+	process_tty_out("\033]2;a;b\007", -1);
+	printf("narg=%d arg1=%d\n", term(wts.t,strescnar),
+	       fld(term(wts.t,strescdxs), 1));
+	putrwout();
+}
+
+/* Prints runes of row y from column x0 to before x1, and the cursor. */
+static void tstrow(int y, int x0, int x1)
+{
+	int32_t crs = term(wts.t,curs), scr = term(wts.t,scr), g;
+
+	printf("row %d:", y);
+	for (; x0 < x1; x0++) {
+		g = term_cellf(wts.t, y, x0);
+		printf(" %c%s", fld(scr, g+GLYPH_RUNE),
+		       fld(scr, g+GLYPH_MODE) & ATTR_WRAP ? "(w)" : "");
+	}
+	printf(" curs=%d,%d%s\n", curs_x(crs), curs_y(crs),
+	       curs_state(crs) & CURSOR_WRAPNEXT ? " wrapnext" : "");
+}
+
+static void testasciirun(void)
+{
+	char ln[100];
+
+	tstdesc("printable run wraps at the right margin");
+	testreset();
+	memset(ln, 'a', 78);
+	strcpy(ln + 78, "bcdef");
+	process_tty_out(ln, -1);
+	tstrow(0, 76, 80);
+	tstrow(1, 0, 4);
+
+	tstdesc("printable run fills the last column");
+	process_tty_out("\r\n", -1);
+	memset(ln, 'x', 80);
+	ln[80] = 0;
+	process_tty_out(ln, -1);
+	tstrow(2, 78, 80);
+
+	tstdesc("printable run without autowrap overwrites the last column");
+	process_tty_out("\033[?7lyz", -1);
+	tstrow(2, 78, 80);
+	tstrow(3, 0, 2);
+}
+
+/* Prints the history lines hist4cli sends for the given range. */
+static void tsthist(uint64_t from, unsigned cnt)
+{
+	struct fdbuf b = {0}, raw = {0};
+	char *pl;
+
+	hist4cli(&b, from, cnt);
+	fdb_apnc(&b, 0);
+	pl = strchr((char *) b.bf + 7, ':') + 1;
+	printf("%.*s ", (int) (pl - (char *) b.bf), b.bf);
+	fdb_unb64(&raw, pl, strcspn(pl, "\n"));
+	fdb_apnc(&raw, 0);
+	printf("[%s]\n", raw.bf);
+	fdb_finsh(&b);
+	fdb_finsh(&raw);
+}
+
+static void testhist(void)
+{
+	char ln[64];
+	int i;
+
+	tstdesc("history: lines are kept as they are finished");
+	testreset();
+	process_tty_out("one\r\ntwo\r\nthr", -1);
+	tsthist(HISTNEWEST, 10);
+	process_tty_out("ee\r\n", -1);
+	tsthist(1, 1);
+	tsthist(HISTNEWEST, 2);
+
+	tstdesc("history: oldest lines are dropped at the memory cap");
+	testreset();
+	histkb = strdup("1");
+	for (i = 0; i < 100; i++) {
+		sprintf(ln, "line %d of history\r\n", i);
+		process_tty_out(ln, -1);
+	}
+	therout.len = 0;
+	printf("oldest=%llu end=%llu bytes=%u\n",
+	       (unsigned long long) hist.first,
+	       (unsigned long long) (hist.first + hist.lcnt), hist.blen);
+	tsthist(0, 2);
+	tsthist(98, 5);
+
+	tstdesc("history: escape from client");
+	writetosp0term("\\y00000000005b0002");
+}
+
+static time_t tstnow = 1700000000;
+static time_t tstclock(time_t *t) { return tstnow; }
+
+static char *tstlogdir;
+
+static char *tstlogp(const char *nm)
+{
+	static char *p;
+
+	free(p);
+	xasprintf(&p, "%s/%s", tstlogdir, nm);
+	return p;
+}
+
+static void tstwrf(const char *nm, const char *s)
+{
+	int fd = open(tstlogp(nm), O_WRONLY | O_CREAT | O_TRUNC, 0600);
+
+	if (fd < 0) err(1, "open %s", tstlogp(nm));
+	full_write(&(struct wrides){fd}, s, -1);
+	close(fd);
+}
+
+/* Lists the files in the test log dir with their sizes, and removes them if
+   rm is set. */
+static void tstls(int rm)
+{
+	struct dirent **ents;
+	struct stat st;
+	int n, i;
+
+	n = scandir(tstlogdir, &ents, 0, alphasort);
+	for (i = 0; i < n; i++) {
+		if (*ents[i]->d_name != '.') {
+			stat(tstlogp(ents[i]->d_name), &st);
+			printf("  %s %lld\n",
+			       ents[i]->d_name, (long long) st.st_size);
+			if (rm) unlink(tstlogp(ents[i]->d_name));
+		}
+		free(ents[i]);
+	}
+	free(ents);
+}
+
+/* Prints a log file, decompressing it if needed. */
+static void tstcat(const char *nm)
+{
+	char bf[4096];
+	gzFile z = gzopen(tstlogp(nm), "r");
+	int got;
+
+	printf("%s: [", nm);
+	while (z && 0 < (got = gzread(z, bf, sizeof(bf))))
+		fwrite(bf, 1, got, stdout);
+	if (z) gzclose(z);
+	printf("]\n");
+}
+
+static void tstlogresume(const char *log, const char *idx)
+{
+	tstwrf("t", log);
+	tstwrf("t.idx", idx);
+	logw_open(LOGW_PLAIN, tstlogp("t"), &(struct logwcfg){0});
+	logw_dump(stdout);
+	logw_close();
+	tstls(1);
+}
+
+static void tstputreg(const char *nm, long pid)
+{
+	char *p;
+	FILE *f;
+
+	xasprintf(&p, "%s/%s", regdir(), nm);
+	if (!(f = fopen(p, "w"))) err(1, "fopen %s", p);
+	fprintf(f, "%ld\n[[],\"%s\",\"title\",0]\n", pid, nm);
+	fclose(f);
+	free(p);
+}
+
+static void testfwdline(void)
+{
+	struct fdbuf b = {0};
+	int sp[2];
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sp)) err(1, "socketpair");
+
+	tstdesc("line from socket arriving in pieces");
+	full_write(&(struct wrides){sp[1]}, "one ", -1);
+	full_write(&(struct wrides){sp[1]}, "line\n", -1);
+	printf("%d ", fwdlinetobuf(sp[0], &b, 100));
+	fwrite(b.bf, 1, b.len, stdout);
+
+	tstdesc("line from socket which never ends times out");
+	b.len = 0;
+	full_write(&(struct wrides){sp[1]}, "no end", -1);
+	printf("%d ", fwdlinetobuf(sp[0], &b, 20));
+	printf("%u\n", b.len);
+
+	tstdesc("line from closed socket");
+	b.len = 0;
+	close(sp[1]);
+	printf("%d ", fwdlinetobuf(sp[0], &b, 100));
+	printf("%u\n", b.len);
+
+	close(sp[0]);
+	fdb_finsh(&b);
+}
+
+static void testreg(void)
+{
+	char dir[] = "/tmp/wermregXXXXXX", *p;
+	struct fdbuf b = {0};
+	pid_t dead;
+
+	if (!mkdtemp(dir)) err(1, "mkdtemp");
+	setenv("WERMSOCKSDIR", dir, 1);
+
+	if (0 > (dead = fork())) err(1, "fork");
+	if (!dead) _exit(0);
+	waitpid(dead, 0, 0);
+
+	tstdesc("registry entry of live master");
+	tstputreg("prs%live", getpid());
+	printf("found: %d ", readreg("prs%live", &b));
+	fwrite(b.bf, 1, b.len, stdout);
+
+	tstdesc("registry entry of dead master is removed");
+	b.len = 0;
+	tstputreg("prs%dead", dead);
+	printf("found: %d\n", readreg("prs%dead", &b));
+	xasprintf(&p, "%s/prs%%dead", regdir());
+	printf("removed: %d\n", 0 > access(p, F_OK));
+	free(p);
+
+	tstdesc("no registry entry");
+	printf("found: %d\n", readreg("prs%none", &b));
+
+	xasprintf(&p, "%s/prs%%live", regdir());
+	unlink(p);
+	free(p);
+	rmdir(regdir());
+	rmdir(dir);
+	fdb_finsh(&b);
+}
+
+static void testlogidx(void)
+{
+	char dir[] = "/tmp/wermtest.XXXXXX", ln[80];
+	int i;
+
+	tstlogdir = mkdtemp(dir);
+	if (!tstlogdir) err(1, "mkdtemp");
+	logw_clock = tstclock;
+
+	tstdesc("log index: entry every LOGIDXGAP bytes");
+	logw_open(LOGW_PLAIN, tstlogp("t"), &(struct logwcfg){0});
+	for (i = 0; i < 2000; i++)
+		logw_put(LOGW_PLAIN, ln, sprintf(
+			ln, "%04d: some log line of moderate length\n", i));
+	logw_dump(stdout);
+	logw_close();
+	tstcat("t.idx");
+	tstls(1);
+
+	tstdesc("log index: resume from last entry");
+	tstlogresume("a\nb\nc\nd", "0 0 5\n4 2 6\n");
+
+	tstdesc("log index: resume log with no index");
+	tstlogresume("a\nb\nc\n", "");
+
+	tstdesc("log index: bad last entry counts whole log");
+	tstlogresume("a\nb\nc\n", "0 0 5\n99 7 6\n");
+
+	tstdesc("log index: index of empty log is cleared");
+	tstlogresume("", "0 0 5\n");
+
+	tstdesc("log writer: output is batched until flushed");
+	logw_open(LOGW_RAW, tstlogp("t.raw"), &(struct logwcfg){0});
+	logw_put(LOGW_RAW, "raw\033[m", 6);
+	tstls(0);
+	logw_flush();
+	tstls(0);
+	logw_close();
+	tstls(1);
+
+	tstdesc("log writer: rotate by size, uncompressed");
+	logw_open(LOGW_PLAIN, tstlogp("t"), &(struct logwcfg){.segsz = 20});
+	for (i = 0; i < 5; i++) {
+		sprintf(ln, "line %d is 13\n", i);
+		logw_put(LOGW_PLAIN, ln, 13);
+	}
+	logw_dump(stdout);
+	logw_close();
+	tstcat("t.3");
+	tstcat("t.3.idx");
+	tstls(1);
+
+	tstdesc("log writer: rotate by age, compressed, skipping used numbers");
+	tstwrf("t.1.gz", "");
+	logw_open(LOGW_PLAIN, tstlogp("t"), &(struct logwcfg){
+		.segsec = 3600, .zlvl = 1});
+	logw_put(LOGW_PLAIN, "first hour\n", 11);
+	tstnow += 1800;
+	logw_put(LOGW_PLAIN, "still first\n", 12);
+	tstnow += 1800;
+	logw_put(LOGW_PLAIN, "second hour\n", 12);
+	logw_close();
+	tstcat("t.2.gz");
+	tstcat("t.2.idx");
+	tstcat("t");
+	tstls(1);
+
+	logw_clock = time;
+	rmdir(tstlogdir);
+}
 
-	tstdesc("empty js for match 3");
-	testreset();
-	termid = strdup("emptyjs1");
-	iterprofs("test/profiles1", &((struct iterprofspec) {
-		&sigb,
-		.sendauxjs = 1,
-	}));
-	fdb_finsh(&sigb);
+static void testrowmap(void)
+{
+	char ln[16];
+	int i;
 
-	tstdesc("empty js for match 4");
+	tstdesc("full-screen scroll rotates the row map");
 	testreset();
-	termid = strdup("emptyjs2");
-	iterprofs("test/profiles1", &((struct iterprofspec) {
-		&sigb,
-		.sendauxjs = 1,
-	}));
-	fdb_finsh(&sigb);
+	for (i = 0; i < 30; i++) {
+		sprintf(ln, "r%02d\r\n", i);
+		process_tty_out(ln, -1);
+	}
+	for (i = 0; i < 3; i++) tstrow(i, 0, 3);
+	tstrow(24, 0, 3);
 
-	tstdesc("url-encoding-related chars not allowed in termid");
-	testreset();
-	iterprofs("test/profiles3", &((struct iterprofspec) {
-		&sigb,
-	}));
-	fdb_finsh(&sigb);
+	tstdesc("scrolling a region swaps rows of the map");
+	process_tty_out("\033[2;4r\033[2S\033[r", -1);
+	for (i = 0; i < 5; i++) tstrow(i, 0, 3);
 
-	tstdesc("bad names while outputting new session list");
-	testreset();
-	iterprofs("test/profiles3", &((struct iterprofspec) {
-		&sigb,
-		.newsessin = 1,
-	}));
-	fdb_finsh(&sigb);
+	tstdesc("resize keeps rows in screen order");
+	tresize(wts.t, 10, 4);
+	for (i = 0; i < 4; i++) tstrow(i, 0, 3);
+}
 
-	tstdesc("dump newsessin list");
-	testreset();
-	iterprofs("test/profilesname", &((struct iterprofspec) {
-		&sigb,
-		.newsessin = 1,
-	}));
-	fdb_finsh(&sigb);
+/* Prints a damage mode update with the spans' cells as runes. */
+static void tstdmg(struct clistate *cls)
+{
+	struct fdbuf b = {0}, raw = {0};
+	int32_t *w, *e, y, x, n;
+	int tmo;
+	char *pl;
+
+	if (cls->dmg) cls->dmg->due = 0;
+	tmo = dmgupdate(cls, &b);
+	if (!b.len) {
+		printf("no update, tmo=%d\n", tmo);
+		return;
+	}
 
-	tstdesc("empty profile name");
-	testreset();
-	iterprofs("test/emptyprof", &((struct iterprofspec) {
-		&sigb,
-		.newsessin = 1,
-	}));
-	termid = strdup("");
-	iterprofs("test/emptyprof", &((struct iterprofspec) {
-		&sigb,
-		.sendpream = 1,
-	}));
-	iterprofs("test/emptyprof", &((struct iterprofspec) {
-		&sigb,
-		.sendauxjs = 1,
-	}));
-	fdb_finsh(&sigb);
+	fdb_apnc(&b, 0);
+	pl = strchr((char *) b.bf, ':') + 1;
+	fdb_unb64(&raw, pl, strcspn(pl, "\n"));
+
+	w = (int32_t *) raw.bf;
+	e = w + raw.len / 4;
+	printf("%dx%d curs=%d,%d:", w[0], w[1], w[2], w[3]);
+	for (w += 6; w < e; ) {
+		y = *w++;
+		x = *w++;
+		n = *w++;
+		printf(" [%d,%d", y, x);
+		if (y < 0) { printf(" palette*%d]", n); w += n; continue; }
+
+		fputc(' ', stdout);
+		for (; n--; w += GLYPH_ELCNT) fputc(w[GLYPH_RUNE] ?: '_', stdout);
+		fputc(']', stdout);
+	}
+	fputc('\n', stdout);
 
-	tstdesc("ephemeral session uses basic profile config");
-	testreset();
-	iterprofs("test/emptyprof", &((struct iterprofspec) {
-		&sigb,
-		.sendpream = 1,
-		.sendauxjs = 1,
-	}));
-	fdb_finsh(&sigb);
+	fdb_finsh(&b);
+	fdb_finsh(&raw);
 }
 
-static void writelgon(void)
+static void testfontpgs(void)
 {
-	wts.logde.fd = 1;
-	wts.writelg = 1;
-	wts.logde.escannot = "sblog";
+	const unsigned char *h;
+	const struct fontpg *pgs;
+	struct fdbuf b = {0};
+	int fi, gi, gcnt, pgcnt, pi, cop, bad;
+	size_t sz, *pgsz;
+
+	tstdesc("font pages hold every glyph, and the header lists them");
+	for (fi = 0; fi < fontcnt(); fi++) {
+		pgs = fontpgs(fi, &pgcnt);
+		pgsz = calloc(0x1100, sizeof(*pgsz));
+		h = (const unsigned char *) fontdat(fi, &sz);
+		gcnt = h[2] << 8 | h[3];
+		for (gi = 0; gi < gcnt; gi++) {
+			cop = h[8+gi*3] << 16 | h[9+gi*3] << 8 | h[10+gi*3];
+			pgsz[(cop & 0x7fffff) >> 8] +=
+				(h[0] * (cop >> 23 ? 2 : 1) * h[1] + 7) / 8;
+		}
+
+		fonthdr(&b, fi);
+		h = b.bf + sz;
+		bad = b.len != sz + 2 + pgcnt * 18 || (h[0] << 8 | h[1]) != pgcnt;
+		for (pi = 0; pi < pgcnt && !bad; pi++) {
+			bad |= pgsz[pgs[pi].pgno] != pgs[pi].sz;
+			bad |= (h[2+pi*18] << 8 | h[3+pi*18]) != pgs[pi].pgno;
+			pgsz[pgs[pi].pgno] = 0;
+		}
+		for (pi = 0; pi < 0x1100; pi++) bad |= !!pgsz[pi];
+
+		printf("font %d: %d glyphs, %d pages%s\n",
+		       fi, gcnt, pgcnt, bad ? ", MISMATCH" : "");
+		free(pgsz);
+		b.len = 0;
+	}
+	fdb_finsh(&b);
+}
+
+static void testdmg(void)
+{
+	struct clistate cls = {.dmgfps = 1000};
+
+	tstdesc("damage mode: first update is full");
+	testreset();
+	process_tty_out("", -1);
+	tresize(wts.t, 6, 3);
+	process_tty_out("hi\r\nyou", -1);
+	tstdmg(&cls);
+
+	tstdesc("damage mode: no changes");
+	tstdmg(&cls);
+
+	tstdesc("damage mode: changed cells in the middle of a row");
+	process_tty_out("\r\033[1Cxy", -1);
+	tstdmg(&cls);
+
+	tstdesc("damage mode: row put back before the update");
+	process_tty_out("\033[1;1HX\033[1;1Hh", -1);
+	tstdmg(&cls);
+
+	tstdesc("damage mode: palette change");
+	process_tty_out("\033]4;1;tomato\007", -1);
+	tstdmg(&cls);
+
+	tstdesc("damage mode: late updates wait");
+	process_tty_out("!", -1);
+	cls.dmgfps = 1;
+	tstdmg(&cls);
+	process_tty_out("!", -1);
+	printf("waits: %d\n", dmgupdate(&cls, &therout) > 0);
+
+	tstdesc("damage mode: new size");
+	tresize(wts.t, 4, 2);
+	tstdmg(&cls);
+
+	dmgfre(&cls);
 }
 
 static void _Noreturn testmain(void)
@@ -1604,6 +3780,19 @@ static void _Noreturn testmain(void)
 	process_tty_out("again, ttl from line\r\n", -1);
 	writetosp0term("\\A");
 
+	tstdesc("\\P counters, with the times left out");
+	testreset();
+	termid = strdup("perftest");
+	writelgon();
+	process_tty_out("one\r\n", -1);
+	process_tty_out("two\r\nthr", -1);
+	perfc.twrns = perfc.dumpns = perfc.dumpmaxns = 0;
+	writetosp0term("\\P");
+
+	tstdesc("\\L stamps a key, and its timings follow the next output");
+	testreset();
+	testlat();
+
 	tstdesc("tab backwards");
 	testreset();
 	writelgon();
@@ -1615,10 +3804,250 @@ static void _Noreturn testmain(void)
 	process_tty_out("a\tb\tc\033[3Zxyz\r\n", -1);
 
 	testiterprofs();
+	testauxjs();
+	teststbin();
+	testfontpgs();
+	testdmg();
+	testcsiparse();
+	testasciirun();
+	testrowmap();
+	testhist();
+	testlogidx();
+	testreg();
+	testfwdline();
 	testqrystring();
 	test_outstreams();
+	test_inbound();
 	test_http();
+	test_ttf();
+
+	exit(0);
+}
+
+/* Benchmarks, run by ./build bench. A stream is written to the engine
+   BENCHCHUNK bytes at a time, as a master would read it from the pty, and each
+   benchmark repeats until it has run for at least BENCHMINNS. A line is
+   printed for each benchmark:
+	<what>.<stream> <bytes processed> <ns per byte> <MB/s> */
+#define BENCHCHUNK 4096
+#define BENCHMINNS 300000000LL
+
+/* Synthetic streams are about this many bytes. */
+#define BENCHSYNSZ (2 << 20)
+
+static unsigned benchrnd(void)
+{
+	static unsigned s = 12345;
+
+	s = s * 1103515245 + 12345;
+	return s >> 16;
+}
+
+static void synascii(struct fdbuf *b)
+{
+	int x;
+
+	while (b->len < BENCHSYNSZ) {
+		for (x = 0; x < 79; x++) fdb_apnc(b, ' ' + benchrnd() % 95);
+		fdb_apnd(b, "\r\n", -1);
+	}
+}
+
+static void synsgr(struct fdbuf *b)
+{
+	char sq[32];
+	int w;
+
+	while (b->len < BENCHSYNSZ) {
+		for (w = 0; w < 16; w++) {
+			switch (benchrnd() % 3) {
+			case 0:
+				snprintf(sq, sizeof(sq), "\033[%u;%um",
+					 benchrnd() % 8, 30 + benchrnd() % 8);
+			break;	case 1:
+				snprintf(sq, sizeof(sq), "\033[38;5;%um",
+					 benchrnd() % 256);
+			break;	default:
+				snprintf(sq, sizeof(sq), "\033[48;2;%u;%u;%um",
+					 benchrnd() % 256, benchrnd() % 256,
+					 benchrnd() % 256);
+			}
+			fdb_apnd(b, sq, -1);
+			fdb_apnd(b, "text", -1);
+		}
+		fdb_apnd(b, "\033[0m\r\n", -1);
+	}
+}
+
+static void syncjk(struct fdbuf *b)
+{
+	unsigned cp;
+	int x;
+
+	while (b->len < BENCHSYNSZ) {
+		for (x = 0; x < 39; x++) {
+			cp = 0x4e00 + benchrnd() % 0x5000;
+			fdb_apnc(b, 0xe0 | cp >> 12);
+			fdb_apnc(b, 0x80 | (cp >> 6 & 0x3f));
+			fdb_apnc(b, 0x80 | (cp & 0x3f));
+		}
+		fdb_apnd(b, "\r\n", -1);
+	}
+}
+
+static void synscroll(struct fdbuf *b)
+{
+	static const char *const ops[] = {"\033[2S", "\033[T", "\033[3L",
+					  "\033[M", "\n"};
+	char sq[16];
+	int l;
+
+	while (b->len < BENCHSYNSZ) {
+		snprintf(sq, sizeof(sq), "\033[%u;%ur",
+			 2 + benchrnd() % 5, 18 + benchrnd() % 6);
+		fdb_apnd(b, sq, -1);
+		for (l = 0; l < 30; l++) {
+			fdb_apnd(b, ops[benchrnd() % 5], -1);
+			fdb_apnd(b, "\rscroll region churn\n", -1);
+		}
+	}
+	fdb_apnd(b, "\033[r", -1);
+}
 
+static void synaltscr(struct fdbuf *b)
+{
+	char sq[16];
+	int y, x;
+
+	fdb_apnd(b, "\033[?1049h", -1);
+	while (b->len < BENCHSYNSZ) {
+		fdb_apnd(b, "\033[H\033[2J", -1);
+		for (y = 1; y <= 25; y++) {
+			snprintf(sq, sizeof(sq), "\033[%d;1H", y);
+			fdb_apnd(b, sq, -1);
+			for (x = 0; x < 80; x++)
+				fdb_apnc(b, 'a' + benchrnd() % 26);
+		}
+	}
+	fdb_apnd(b, "\033[?1049l", -1);
+}
+
+static const struct {
+	const char *name;
+	void (*gen)(struct fdbuf *);
+} synstreams[] = {
+	{"ascii", synascii},
+	{"sgr", synsgr},
+	{"cjk", syncjk},
+	{"scroll", synscroll},
+	{"altscr", synaltscr},
+};
+
+static void benchline(const char *what, const char *stream, size_t byts,
+		      long long ns)
+{
+	printf("%s.%s %zu %.3f %.1f\n", what, stream, byts,
+	       (double) ns / byts, byts * 1e3 / ns);
+}
+
+static void benchterm(void)
+{
+	if (wts.t) {
+		term_fre(wts.t);
+		tmfree(wts.t);
+	}
+	wts.t = term_new();
+	tnew(wts.t, 80, 25);
+	term(wts.t,sbbuf) = deqmk();
+}
+
+/* Benchmarks twrite and fdb_routs on the n bytes in s, and then state dumps of
+   the terminal that results. */
+static void benchstream(const char *stream, const char *s, size_t n)
+{
+	size_t ci, cn = 0, of, chn, byts;
+	int *dqs = calloc(n / (BENCHCHUNK / 2) + 1, sizeof(*dqs));
+	struct fdbuf b = {0};
+	long long ns, st;
+
+	if (!n) errx(1, "empty benchmark stream: %s", stream);
+
+	/* Chunks end on a character boundary, so each decodes on its own. */
+	for (of = 0; of < n; of += chn) {
+		chn = MIN(BENCHCHUNK, n - of);
+		while (chn > BENCHCHUNK / 2 && of + chn < n
+		       && 0x80 == (s[of + chn] & 0xc0))
+			chn--;
+		dqs[cn++] = deqsetutf8(0, (char *) s + of, chn);
+	}
+
+	for (ns = byts = 0; ns < BENCHMINNS; byts += n) {
+		benchterm();
+		st = nowns();
+		for (ci = 0; ci < cn; ci++) {
+			twrite(wts.t, dqs[ci], -1, 0);
+			deqclear(term(wts.t,sbbuf));
+		}
+		ns += nowns() - st;
+	}
+	benchline("c.twrite", stream, byts, ns);
+
+	for (ns = byts = 0; ns < BENCHMINNS; byts += n) {
+		st = nowns();
+		for (ci = 0; ci < n; ci += BENCHCHUNK) {
+			therout.len = 0;
+			fdb_routs(&therout, s + ci, MIN(BENCHCHUNK, n - ci));
+		}
+		ns += nowns() - st;
+	}
+	benchline("c.routs", stream, byts, ns);
+
+	for (ns = byts = 0; ns < BENCHMINNS; byts += b.len) {
+		b.len = 0;
+		st = nowns();
+		state4cli(&b, 0);
+		ns += nowns() - st;
+	}
+	benchline("c.state", stream, byts, ns);
+
+	for (ci = 0; ci < cn; ci++) tmfree(dqs[ci]);
+	free(dqs);
+	fdb_finsh(&b);
+	therout.len = 0;
+}
+
+/* Writes the synthetic streams to files in dir, so other benchmarks can use
+   them, then benchmarks them and the streams in the files at paths. */
+static void _Noreturn benchmain(const char *dir, char **paths)
+{
+	struct fdbuf b = {0};
+	char *pth;
+	size_t si;
+	int fd;
+
+	wts.allowtmstate = 1;
+
+	for (si = 0; si < sizeof(synstreams) / sizeof(*synstreams); si++) {
+		b.len = 0;
+		synstreams[si].gen(&b);
+
+		xasprintf(&pth, "%s/%s", dir, synstreams[si].name);
+		fd = open(pth, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if (0 > fd) err(1, "open %s", pth);
+		full_write(&(struct wrides){fd}, b.bf, b.len);
+		close(fd);
+		free(pth);
+
+		benchstream(synstreams[si].name, (char *) b.bf, b.len);
+	}
+
+	for (; *paths; paths++) {
+		b.len = 0;
+		if (apndfile(&b, *paths)) exit(1);
+		benchstream(basename(*paths), (char *) b.bf, b.len);
+	}
+
+	fdb_finsh(&b);
 	exit(0);
 }
 
@@ -1639,7 +4068,7 @@ static void appendunqid(void)
 	fdb_apnd(&buf, "\\@appendid:.", -1);
 	fdb_apnd(&buf, sfix, -1);
 	fdb_apnc(&buf, '\n');
-	write_wbsoc_frame(buf.bf, buf.len);
+	write_wbsoc_rout(buf.bf, buf.len);
 
 	buf.len = 0;
 	fdb_apnd(&buf, termid, -1);
@@ -1658,7 +4087,7 @@ static void m4hout(const MD_CHAR *buf, MD_SIZE sz, void *ud)
 	fdb_apnd(ud, buf, sz);
 }
 
-static void servereadme(struct wrides *de)
+static void servereadme(struct wrides *de, const Httpreq *rq)
 {
 	struct fdbuf d = {0};
 	char *path, *mdsrc, *mdc, *mdend;
@@ -1672,6 +4101,11 @@ static void servereadme(struct wrides *de)
 	if (0 > fstat(sfd, &sb))	{ perror("fstat md"); exit(1); }
 	free(path);
 
+	if (resp_fromcache(de, rq, "/readme", &sb)) {
+		close(sfd);
+		return;
+	}
+
 	mdc = mdsrc = malloc(sb.st_size);
 	mdend = mdsrc + sb.st_size;
 
@@ -1690,95 +4124,321 @@ static void servereadme(struct wrides *de)
 	md_html(mdsrc, sb.st_size, m4hout, &d, MD_FLAG_TABLES, 0);
 	fdb_apnd(&d, "</body></html>", -1);
 
-	resp_dynamc(de, 'h', 200, d.bf, d.len);
+	resp_cached(de, rq, 'h', "/readme", &sb, d.bf, d.len);
 	fdb_finsh(&d);
+	free(mdsrc);
+	close(sfd);
+}
+
+/* Makes the font header sent for /<fi>.wermfont, which is fontdat followed by
+   the page list:
+	page count			2 bytes
+	each page, with fields:
+		page number		2 bytes
+		ETag of its pixels	16 hex digits
+   so the client can fetch each page from /<fi>.<page in hex>.wermfont?h=<ETag>
+   and keep it for good. */
+static void fonthdr(struct fdbuf *b, int fni)
+{
+	const struct fontpg *pgs;
+	const char *fdat;
+	char etag[17];
+	int pgcnt, pi;
+	size_t fsz;
+
+	pgs = fontpgs(fni, &pgcnt);
+	fdat = fontdat(fni, &fsz);
+	fdb_apnd(b, fdat, fsz);
+
+	fdb_apnc(b, pgcnt >> 8);
+	fdb_apnc(b, pgcnt);
+	for (pi = 0; pi < pgcnt; pi++) {
+		fdb_apnc(b, pgs[pi].pgno >> 8);
+		fdb_apnc(b, pgs[pi].pgno);
+		resp_etag(etag, pgs[pi].dat, pgs[pi].sz);
+		fdb_apnd(b, etag, 16);
+	}
+}
+
+/* Most glyphs and pixels of a cell side that /glyphs serves */
+#define GLYPHBATCH 256
+#define GLYPHMAXPX 256
+
+/* Serves the glyphs of the TrueType font (see ttf.c) for code points the
+   client's bitmap font lacks, in cells glw pixels wide and glh tall. glcops is
+   a comma-separated list of up to GLYPHBATCH code points in hex, each with bit
+   23 set if it is wide. For each, the response has:
+	code point, as in glcops, with bit 22 set if the
+	font has no glyph for it			3 bytes
+	the glyph, as from ttf_glyph, unless bit 22 is set
+   There is a 404 if no font is set with $WERMTTF. */
+static void serveglyphs(struct wrides *de, Httpreq *rq)
+{
+	struct fdbuf b = {0};
+	const char *c;
+	char *ce;
+	unsigned long cop;
+	int w, h, gi, r;
+
+	free(glw);	glw = 0;
+	free(glh);	glh = 0;
+	free(glcops);	glcops = 0;
+	processquerystr(rq->query);
+
+	w = glw ? atoi(glw) : 0;
+	h = glh ? atoi(glh) : 0;
+	if (!glcops || w < 1 || h < 1 || w > GLYPHMAXPX || h > GLYPHMAXPX) {
+		resp_dynamc(de, 't', 400, "glw, glh and glcops required\n", 29);
+		return;
+	}
+
+	for (c = glcops, gi = 0; *c && gi < GLYPHBATCH; gi++) {
+		cop = strtoul(c, &ce, 16);
+		if (ce == c) break;
+		c = ce + (*ce == ',');
+
+		fdb_apnc(&b, cop >> 16 & 0x80 | cop >> 16 & 0x1f);
+		fdb_apnc(&b, cop >> 8);
+		fdb_apnc(&b, cop);
+		r = ttf_glyph(&b, w, h, cop & 0x1fffff, !!(cop & 0x800000));
+		if (r < 0) {
+			resp_dynamc(de, 't', 404, 0, 0);
+			goto cleanup;
+		}
+		if (!r) b.bf[b.len - 3] |= 0x40;
+	}
+
+	resp_dynamc(de, 'f', 200, b.bf, b.len);
+
+cleanup:
+	fdb_finsh(&b);
 }
 
-static int maybeservefont(struct wrides *de, const char *resource)
+static int maybeservefont(struct wrides *de, const Httpreq *rq)
 {
-	int fni, scann;
+	const char *resource = rq->resource;
+	const struct fontpg *pgs;
+	struct fdbuf b = {0};
+	int fni, scann, pgcnt, pi;
+	unsigned pgno = -1;
 
 	scann = -1;
 	sscanf(resource, "/%d.wermfont%n", &fni, &scann);
+	if (strlen(resource) != scann)
+		sscanf(resource, "/%d.%x.wermfont%n", &fni, &pgno, &scann);
 	if (strlen(resource) != scann)		return 0;
 	if (fni < 0 || fni >= fontcnt())	return 0;
-	servefnt(de, fni);
-	return 1;
+	if (resp_fromcache(de, rq, resource, 0)) return 1;
+
+	if (pgno == -1) {
+		fonthdr(&b, fni);
+		resp_cached(de, rq, 'f', resource, 0, b.bf, b.len);
+		fdb_finsh(&b);
+		return 1;
+	}
+
+	pgs = fontpgs(fni, &pgcnt);
+	for (pi = 0; pi < pgcnt; pi++) {
+		if (pgs[pi].pgno != pgno) continue;
+		resp_cached(de, rq, 'f', resource, 0, pgs[pi].dat, pgs[pi].sz);
+		return 1;
+	}
+
+	return 0;
 }
 
-static _Noreturn void becomewebsocket(const char *quer)
+static _Noreturn void becomewebsocket(Httpreq *rq)
 {
+	Dtachctx dc;
+	int dlvl, dmin;
+
 	/* These query args settings do not get inherited from the spawner to
 	   children. */
 	free(dtachlog);
 	dtachlog = 0;
 	free(termid);
 	termid = 0;
-
-	processquerystr(quer);
+	free(wsbin);
+	wsbin = 0;
+	free(stgen);
+	stgen = 0;
+	free(dmgfps);
+	dmgfps = 0;
+
+	processquerystr(rq->query);
+	wbsoc_setbin(!!wsbin);
+
+	/* The deflate settings come from the page URL, so keep them to what
+	   zlib and the \W escape can take. */
+	dlvl = rq->wsdeflbits ? MAX(0, MIN(wsdefl ? atoi(wsdefl) : 6, 9)) : 0;
+	dmin = MAX(0, MIN(wsdeflmin ? atoi(wsdeflmin) : 64, 99999));
+	if (rq->wsdeflbits)
+		wbsoc_deflate(dlvl, dmin, rq->wsdeflbits, rq->wsdeflreset);
 	if (termid) {
 		checktid();
 		if (!strchr(termid, '.')) appendunqid();
 	}
 
-	dtach_main(prepfordtach());
+	dc = prepfordtach();
+
+	/* Unless told otherwise, the master serves the websocket itself and
+	   this process exits as soon as it has passed it on. */
+	if (!atchproc)
+		xasprintf(&dc->wshandoff, "\\W" WSPARMFMT,
+			  !!wsbin, dlvl, rq->wsdeflbits, rq->wsdeflreset,
+			  dmin);
+
+	/* Only persistent terminals are served by the host, as an ephemeral
+	   one ends with its last client anyway. */
+	if (onemaster && termid) {
+		xasprintf(&dc->hostpath, "%s/host", socksdir());
+		xasprintf(&dc->hostflags, "%s&termid=%s", rq->query, termid);
+	}
+
+	dtach_main(dc);
 }
 
 static void begnsesnlis(struct wrides *de)
 {
-	struct fdbuf b = {0};
+	struct fdbuf b;
 
+	resp_chunked(de, 'h', 200, &b);
 	iterprofs(profpath(), &((struct iterprofspec){
 		.sigb = &b,
 		.newsessin = 1,
 		.diaglog = 1,
 	}));
-
-	resp_dynamc(de, 'h', 200, b.bf, b.len);
+	fdb_finsh(&b);
 }
 
 static void externalcgi(struct wrides *de, char hdr, Httpreq *rq)
 {
 	char *binp;
+	struct fdbuf b;
+
+	xasprintf(&binp, "%s/cgi%s", getenv("WERMSRCDIR"), rq->resource);
+
+	/* Stream the output, as it can be as large as a whole log. A failure
+	   can only be reported once the status is already sent. */
+	resp_chunked(de, hdr, 200, &b);
+	if (runcgi(&b, (char *[]){binp, 0}, rq->query))
+		fprintf(stderr, "external cgi failed: %s\n", binp);
+
+	free(binp);
+	fdb_finsh(&b);
+}
+
+static void serveauxjs(struct wrides *de, const Httpreq *rq)
+{
+	struct auxjsgen g = {0};
 	struct fdbuf b = {0};
-	int p[2];
-	pid_t cpid;
-	ssize_t redn;
-	unsigned char inb[4096];
+	char *key;
 
-	if (0>pipe(p))			{ perror("pipe cgi"	); exit(1); }
-	if (0>(cpid=fork()))		{ perror("fork cgi"	); exit(1); }
-	if (!cpid && 0>dup2(p[1], 1))	{ perror("dup p1"	); exit(1); }
-	if (0>close(p[1]))		{ perror("close p1"	); exit(1); }
+	xasprintf(&key, "/aux.js?%s", rq->query);
 
-	if (!cpid) {
-		close(p[0]);
+	iterauxjs(jspath(), rq->query, auxjsstamp, &g);
+	if (!g.dyn && resp_fromcache(de, rq, key, &g.stamp)) goto cleanup;
 
-		xasprintf(&binp, "%s/cgi%s",
-			  getenv("WERMSRCDIR"), rq->resource);
-		setenv("QUERY_STRING", rq->query, 1);
-		execl(binp, binp, NULL);
-		perror("execl for external cgi");
-		exit(1);
+	/* An empty body is not kept, as any query naming no files makes one. */
+	if (buildauxjs(&b, jspath(), rq->query, &g.stamp) || !b.len)
+		resp_dynamc(de, 'j', 200, b.bf, b.len);
+	else {
+		auxjskeep(key);
+		resp_cached(de, rq, 'j', key, &g.stamp, b.bf, b.len);
 	}
 
-	for (;;) {
-		redn = read(p[0], inb, sizeof(inb));
-		if (!redn)	break;
-		if (0<redn)	fdb_apnd(&b, inb, redn);
-		if (0>redn && errno != EINTR)	{ perror("read"); goto er; }
+cleanup:
+	free(key);
+	fdb_finsh(&b);
+}
+
+/* A script served after running it through cpp, and the files it includes,
+   directly or not, as found by the last call to stdeps. */
+struct stscript {
+	const char *src, *rsrc;
+	char **depv;
+	size_t depc;
+};
+static struct stscript	stmain = {"main.js", "/st"},
+			stwrkr = {"wrkr.js", "/wrkr"};
+
+/* Adds path and whatever it includes to the deps of ss. Like cpp -I$WERMSRCDIR,
+   local includes are looked for beside the including file first. */
+static void stdeps(struct stscript *ss, const char *path)
+{
+	FILE *f;
+	char ln[512], *inc, *ince, *dir, *full;
+	size_t i;
+
+	for (i = 0; i < ss->depc; i++) if (!strcmp(ss->depv[i], path)) return;
+
+	ss->depv = realloc(ss->depv, sizeof(*ss->depv) * (ss->depc+1));
+	ss->depv[ss->depc++] = strdup(path);
+
+	f = fopen(path, "r");
+	if (!f) return;
+
+	while (fgets(ln, sizeof(ln), f)) {
+		if (strncmp(ln, "#include \"", 10)) continue;
+		inc = ln + 10;
+		ince = strchr(inc, '"');
+		if (!ince) continue;
+		*ince = 0;
+
+		dir = strdup(path);
+		xasprintf(&full, "%s/%s", dirname(dir), inc);
+		free(dir);
+		if (0>access(full, F_OK)) {
+			free(full);
+			xasprintf(&full, "%s/%s", getenv("WERMSRCDIR"), inc);
+		}
+		stdeps(ss, full);
+		free(full);
 	}
 
-	resp_dynamc(de, hdr, 200, b.bf, b.len);
+	fclose(f);
+}
+
+static void servest(struct wrides *de, const Httpreq *rq, struct stscript *ss)
+{
+	struct fdbuf b = {0};
+	struct stat stamp = {0};
+	char *incarg, *srcp;
+	size_t i;
 
-	if (0>waitpid(cpid, 0, 0)) { perror("waitpid"); goto er; }
+	for (i = 0; i < ss->depc; i++) foldstat(&stamp, ss->depv[i]);
+	if (ss->depc && resp_fromcache(de, rq, ss->rsrc, &stamp)) return;
 
-	goto cleanup;
+	xasprintf(&srcp, "%s/%s", getenv("WERMSRCDIR"), ss->src);
+	xasprintf(&incarg, "-I%s", getenv("WERMSRCDIR"));
 
-er:
-	resp_dynamc(de, 't', 403, 0, 0);
+	while (ss->depc) free(ss->depv[--ss->depc]);
+	stdeps(ss, srcp);
+	memset(&stamp, 0, sizeof(stamp));
+	for (i = 0; i < ss->depc; i++) foldstat(&stamp, ss->depv[i]);
 
-cleanup:
+	if (runcgi(&b, (char *[]){"cpp", "-P", incarg, srcp, 0}, rq->query))
+		resp_dynamc(de, 't', 500, b.bf, b.len);
+	else
+		resp_cached(de, rq, 'j', ss->rsrc, &stamp, b.bf, b.len);
+
+	free(incarg);
+	free(srcp);
+	fdb_finsh(&b);
+}
+
+static void serveenv(struct wrides *de)
+{
+	extern char **environ;
+	struct fdbuf b = {0};
+	char **e;
+
+	for (e = environ; *e; e++) {
+		fdb_apnd(&b, *e, -1);
+		fdb_apnc(&b, '\n');
+	}
+
+	resp_dynamc(de, 't', 200, b.bf, b.len);
 	fdb_finsh(&b);
 }
 
@@ -1787,35 +4447,51 @@ static void httphandlers(struct wrides *out, Httpreq *rq)
 	const char *rs = rq->resource;
 
 	fprintf(stderr, "serving: %s\n", rs);
-	if (maybeservefont(out, rs))	return;
+	if (maybeservefont(out, rq))	return;
 
-	if (!strcmp(rs, "/"))		{ resp_static(out, 'h', "/index.html");
+	if (!strcmp(rs, "/"))	{ resp_static(out, rq, 'h', "/index.html");
 									return;}
-	if (!strcmp(rs, "/attach"))	{ resp_static(out, 'h', rs);	return;}
-	if (!strcmp(rs, "/common.css"))	{ resp_static(out, 'c', rs);	return;}
-	if (!strcmp(rs, "/readme.css"))	{ resp_static(out, 'c', rs);	return;}
-	if (!strcmp(rs, "/endptid.js"))	{ resp_static(out, 'j', rs);	return;}
-	if (!strcmp(rs, "/aux.js"))	{ externalcgi(out, 'j', rq);	return;}
+	if (!strcmp(rs, "/attach"))	{ resp_static(out, rq, 'h', rs);return;}
+	if (!strcmp(rs, "/common.css"))	{ resp_static(out, rq, 'c', rs);return;}
+	if (!strcmp(rs, "/readme.css"))	{ resp_static(out, rq, 'c', rs);return;}
+	if (!strcmp(rs, "/endptid.js"))	{ resp_static(out, rq, 'j', rs);return;}
+	if (!strcmp(rs, "/aux.js"))	{ serveauxjs(out, rq);		return;}
 	if (!strcmp(rs, "/scrollback"))	{ externalcgi(out, 'h', rq);	return;}
-	if (!strcmp(rs, "/st"))		{ externalcgi(out, 'j', rq);	return;}
-	if (!strcmp(rs, "/showenv"))	{ externalcgi(out, 't', rq);	return;}
-	if (!strcmp(rs, "/atchses"))	{ atchsesnlis(out);		return;}
-	if (!strcmp(rs, "/readme"))	{ servereadme(out);		return;}
+	if (!strcmp(rs, "/history"))	{ servehist(out, rq);		return;}
+	if (!strcmp(rs, "/glyphs"))	{ serveglyphs(out, rq);		return;}
+	if (!strcmp(rs, "/st"))		{ servest(out, rq, &stmain);	return;}
+	if (!strcmp(rs, "/wrkr"))	{ servest(out, rq, &stwrkr);	return;}
+	if (!strcmp(rs, "/tm.wasm"))	{ resp_static(out, rq, 'w', rs);return;}
+	if (!strcmp(rs, "/showenv"))	{ serveenv(out);		return;}
+	if (!strcmp(rs, "/atchses"))	{ lissesns(out, "\\A", 1);	return;}
+	if (!strcmp(rs, "/stats"))	{ lissesns(out, "\\P", 0);	return;}
+	if (!strcmp(rs, "/readme"))	{ servereadme(out, rq);		return;}
 	if (!strcmp(rs, "/newsess"))	{ begnsesnlis(out);		return;}
 
 	resp_dynamc(out, 't', 404, 0, 0);
 }
 
-int http_serv(void)
+int http_serv(FILE *in, int (*forkconn)(void))
 {
 	struct fdbuf b = {0};
 	struct wrides out = {1};
 	Httpreq rq = {0};
 	const char *rs = rq.resource;
 
-	http_read_req(stdin, &rq, &out);
+	qryreset();
+	rq.wsdeflok = !wsdefl || atoi(wsdefl) > 0;
+	http_read_req(in, &rq, &out);
 	if (rq.error) return 0;
-	if (rq.validws) becomewebsocket(rq.query);
+	if (rq.validws) {
+		if (forkconn && forkconn()) return 0;
+		if (0 > dup2(fileno(in), 0)) { perror("dup2 stdin"); exit(1); }
+
+		/* Only 0 and 1 may refer to the connection, so it closes when
+		   whatever serves the websocket does, not when the terminal
+		   does. */
+		if (fileno(in) > 1) close(fileno(in));
+		becomewebsocket(&rq);
+	}
 
 	/* TODO(github.com/google/werm/issues/1) will it be more secure to also
 	   verify Origin/Host are consistent? */
@@ -1832,7 +4508,7 @@ int http_serv(void)
 	else
 		httphandlers(&out, &rq);
 
-	return rq.keepaliv;
+	return rq.keepaliv && !out.broken;
 }
 
 static void addsrcdirenv(void)
@@ -1876,6 +4552,7 @@ int main(int argc, char **argv)
 	argc--;
 	argv++;
 	if (1 == argc && !strcmp(*argv, "test"))	testmain();
+	if (2 <= argc && !strcmp(*argv, "bench"))	benchmain(argv[1], argv+2);
 
 	wts.allowtmstate = 1;
 
@@ -1887,6 +4564,8 @@ int main(int argc, char **argv)
 		appendunqid();
 		dc = prepfordtach();
 		dc->spargs = parse_spawner_ports(argv + 1);
+		set_http_workers(dc->spargs,
+				 httpwrk ? MAX(0, MIN(atoi(httpwrk), 256)) : 8);
 
 		fprintf(stderr,
 "--- WARNING ---\n"
@@ -1895,7 +4574,8 @@ int main(int argc, char **argv)
 "All persistent sessions are saved here until you remove them. Be aware of\n"
 "what you save here and how fast it grows.\n"
 "\n"
-"This inconvenience will eventually be automated.\n"
+"Logs can be split into compressed segments with logsegkb= or logsegh= in\n"
+"$WERMFLAGS, but old segments are still kept until you remove them.\n"
 "\n"
 "--- STARTING DAEMONIZED SPAWNER PROCESS ---\n"
 "Access http://<host>/attach to get started\n"
@@ -28,6 +28,33 @@ struct clistate {
 	/* Whether the client wants to receive terminal output and state
 	   updates. */
 	unsigned wantsoutput : 1;
+
+	/* Generation of the terminal state the client already holds, sent with
+	   the \g escape, or 0. */
+	unsigned stgen;
+
+	/* Maximum updates per second if the client is in damage mode, or 0. A
+	   client in damage mode is sent the cells which changed on the screen
+	   rather than terminal output, set with the \f escape. */
+	unsigned dmgfps;
+
+	/* What was last sent to the client in damage mode. */
+	struct dmgcli *dmg;
+
+	/* Settings of the websocket of a client which hands it to the master
+	   rather than relaying the websocket data itself, sent with the \W
+	   escape. The websocket frames are like those wbsoc_setbin and
+	   wbsoc_deflate set up. */
+	unsigned wsbin : 1, wsdeflreset : 1;
+	unsigned char wsdefllvl, wsdeflbits;
+	unsigned wsdeflmin;
+
+	/* The last key the client stamped with the \L escape to trace its
+	   latency, and when it arrived, was written to the pty, and the subproc
+	   next wrote output, in ns of CLOCK_MONOTONIC. Each time is 0 until it
+	   happens, and latarr goes back to 0 once the timings are sent. */
+	unsigned latid;
+	long long latarr, latwr, latech;
 };
 
 /* Whether the dtach component is logging. */
@@ -40,13 +67,36 @@ void _Noreturn subproc_main(Dtachctx dc);
 extern struct fdbuf therout;
 void process_tty_out(void *buf, ssize_t len);
 
-/* ptyfd is the pseudo-terminal that controls the terminal-enabled process.
- * There is only one per master. vt100 keyboard input data is sent to this fd.
- * clioutfd is where output is sent to the attached client. This is used for
- * status updates (like the title) if needed. */
-void process_kbd(int clioutfd, Dtachctx dc, struct clistate *cls,
+/* vt100 keyboard input data is sent to the pty of dc. cliob is where output for
+ * the attached client is queued. This is used for status updates (like the
+ * title) if needed. */
+void process_kbd(struct fdbuf *cliob, Dtachctx dc, struct clistate *cls,
 		 unsigned char *buf, size_t bufsz);
 
+/* Appends a snapshot of the terminal state to b, which lets a client render the
+ * terminal without having seen the output that produced it. If basegen is the
+ * generation of the last state sent, only the changes since then are sent. */
+void state4cli(struct fdbuf *b, unsigned basegen);
+
+/* Appends an update to b for a client in damage mode, if one is due. Returns
+ * the number of milliseconds until an update will be due, or -1 if there is
+ * nothing to send. */
+int dmgupdate(struct clistate *cls, struct fdbuf *b);
+
+/* Frees the damage mode state of a client, so its next update is full. */
+void dmgfre(struct clistate *cls);
+
+/* Traces the latency of a key the client stamped. latpty is called when the
+ * subproc writes output, and lat4cli when that output has been queued for the
+ * client in b, to which it appends \@lat:<ID>,<us>,<us> with the microseconds
+ * from the key arriving to its pty write, and from then to the output. */
+void latpty(struct clistate *cls);
+void lat4cli(struct clistate *cls, struct fdbuf *b);
+
+/* Prints counters of the terminal object heap, such as how many bytes are in
+ * use or reserved, to f. */
+void tmheapstats(FILE *f);
+
 /* role is a single character that identifies the role (e.g. master or
  * attacher). */
 void set_argv0(Dtachctx dc, char role);
@@ -59,6 +109,26 @@ void send_pream(int fd);
  * and thus create a new log file that doesn't get written to. */
 void open_logs(void);
 
+/* Called by master process each time it may have changed the state listed by
+ * /atchses. Publishes the state to the session registry if it is different.
+ * Returns the number of milliseconds after which it should be called again
+ * even if nothing else happens, or -1. */
+int publish_state(Dtachctx dc);
+
+/* A master can serve several terminals, each with its own engine heap and
+ * other globals of the session code. termuse makes the globals those of dc's
+ * terminal. A master which serves one terminal need not call it. termnew sets
+ * up empty globals for a new terminal, with the settings in $WERMFLAGS and then
+ * flags, which is a query string, and makes them the ones in use. termend
+ * removes the terminal's registry entry, stops its log writer and frees the
+ * globals. */
+void termuse(Dtachctx dc);
+void termnew(Dtachctx dc, const char *flags);
+void termend(Dtachctx dc);
+
+/* Returns the time of a monotonic clock in milliseconds. */
+long long nowms(void);
+
 /* Allocates a new string of sufficient size and prints a formatted string to
  * it. Returns the length of the new string. */
 int xasprintf(char **strp, const char *format, ...)
@@ -72,8 +142,12 @@ const char *state_dir(void);
  * dot, e.g. "abc" */
 char *next_uniqid(void);
 
-/* Serves http over stdin/stdout. Returns 1 if the connection can be used to
-   continue serving requests. */
-int http_serv(void);
+/* Serves an http request read from in, writing the response to stdout. Returns
+   1 if the connection can be used to continue serving requests.
+
+   If forkconn is set, it is called to fork before a websocket is served, so
+   the caller can go on to other connections. It returns 0 in the child, which
+   serves the websocket over in and stdout. */
+int http_serv(FILE *in, int (*forkconn)(void));
 
 #endif
@@ -5,18 +5,25 @@
  * https://developers.google.com/open-source/licenses/bsd */
 
 #include "spawner.h"
+#include "evloop.h"
 #include "shared.h"
 
 #include <sys/stat.h>
 #include <unistd.h>
 #include <errno.h>
-#include <sys/select.h>
 #include <netinet/in.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/un.h>
 #include <arpa/inet.h>
 #include <sys/wait.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <signal.h>
+
+/* A worker closes a connection after waiting this long for a request on it,
+   so idle keep-alive connections do not hold up the pool. */
+#define HTTPIDLESEC 5
 
 struct sock {
 	void *a;
@@ -30,9 +37,25 @@ struct sock {
 
 struct subproc_args {
 	struct sock sk[FD_SETSIZE];
-	unsigned nr, maxsfd;
+	unsigned nr;
+
+	Evloop el;
+
+	/* Processes which accept connections and serve them in-process, or
+	   none to fork for each connection. The read end of lifeln is held by
+	   each worker, so it sees EOF when the spawner is gone. */
+	pid_t *wrk;
+	unsigned wrkn;
+	int lifeln[2];
 };
 
+/* Event dats for child processes changing state, and the spawner going away.
+   Only the addresses are meaningful. */
+static char chldev, lifeev;
+
+/* Set in HTTP workers. */
+static Ports wrkports;
+
 static int setreuse(struct sock *s)
 {
 	int radr = 1;
@@ -51,13 +74,7 @@ static int prepsock(struct sock *s)
 	if (0>s->fd)			{ perror("open socket"	); goto er; }
 	if (0>setreuse(s))		{ perror("set REUSEADDR"); }
 	if (0>bind(s->fd, sad, s->sz))	{ perror("bind socket"	); goto er; }
-	if (0>listen(s->fd, 4))		{ perror("listen socket"); goto er; }
-
-	if (s->fd >= FD_SETSIZE) {
-		fprintf(stderr, "too many addresses (FD_SETSIZE=%llu)\n",
-			(unsigned long long) FD_SETSIZE);
-		goto er;
-	}
+	if (0>listen(s->fd, 64))		{ perror("listen socket"); goto er; }
 
 	return 1;
 
@@ -176,12 +193,14 @@ static void handlreq(Ports ps, struct sock *s)
 	   which is usually done for debugging and development. */
 	setsid();
 
+	evl_fre(ps->el);
 	closeports(ps);
 
 	if (0 > dup2(fd, 0))		{ perror("dup2 stdin"	); goto er; }
 	if (0 > dup2(fd, 1))		{ perror("dup2 stdout"	); goto er; }
+	if (fd > 1) close(fd);
 
-	while (http_serv()) {}
+	while (http_serv(stdin, 0)) {}
 	delaystreamclose();
 
 	exit(0);
@@ -191,31 +210,147 @@ er:
 	exit(1);
 }
 
-static void acceptnext(Ports ps)
+/* Closes what a worker holds for accepting connections, in a child that
+   serves a single connection. */
+static void leavepool(Ports ps)
 {
-	fd_set fds;
-	int seln;
+	evl_fre(ps->el);
+	closeports(ps);
+	close(ps->lifeln[0]);
+}
+
+static int forkconn(void)
+{
+	pid_t cpid = fork();
+
+	if (0 > cpid) perror("fork for connection");
+	if (cpid) return cpid;
+
+	setsid();
+	leavepool(wrkports);
+	return 0;
+}
+
+/* Waits for the next request on a connection, returning 0 if it is closed or
+   idle for too long. */
+static int waitreq(int fd)
+{
+	struct pollfd pf = {fd, POLLIN};
+	int r;
+
+	do r = poll(&pf, 1, HTTPIDLESEC * 1000);
+	while (r < 0 && errno == EINTR);
+
+	return r > 0;
+}
+
+/* Serves a connection in a worker, with fd 1 as the output, until it closes
+   or is upgraded to a websocket, which is served by a child. */
+static void servconn(int fd, int nullfd)
+{
+	FILE *in;
+
+	if (0 > dup2(fd, 1))		{ perror("dup2 stdout"	); goto done; }
+	if (!(in = fdopen(fd, "r")))	{ perror("fdopen"	); goto done; }
+
+	/* Browsers do not pipeline requests, so nothing is left in the buffer
+	   of in when waiting for the next one. */
+	while (waitreq(fd) && http_serv(in, forkconn)) {}
+	delaystreamclose();
+	fclose(in);
+	fd = -1;
+
+done:
+	if (fd >= 0) close(fd);
+	dup2(nullfd, 1);
+}
+
+static _Noreturn void workermain(Ports ps)
+{
+	struct evlev evs[16];
 	struct sock *sk;
+	int evn, evi, fd, nullfd;
+
+	wrkports = ps;
+	close(ps->lifeln[1]);
+	evl_fre(ps->el);
+	ps->el = evl_new();
+	evl_watchchld(ps->el, &chldev);
+	evl_want(ps->el, ps->lifeln[0], EVL_R, &lifeev);
+	for (sk = ps->sk; sk != ps->sk + ps->nr; sk++)
+		if (sk->fd >= 0) evl_want(ps->el, sk->fd, EVL_R, sk);
+
+	nullfd = open("/dev/null", O_RDWR);
+	if (0 > nullfd) { perror("open /dev/null"); exit(1); }
+
+	for (;;) {
+		evn = evl_wait(ps->el, evs, sizeof(evs) / sizeof(*evs), -1);
+		if (0 > evn) {
+			if (errno == EINTR) continue;
+			perror("evl_wait");
+			exit(1);
+		}
+
+		for (evi = 0; evi < evn; evi++) {
+			if (evs[evi].dat == &lifeev) exit(0);
+			if (evs[evi].dat == &chldev) {
+				while (0 < waitpid(-1, 0, WNOHANG)) {}
+				continue;
+			}
+
+			/* Every worker is woken, and only one gets it. */
+			sk = evs[evi].dat;
+			fd = accept(sk->fd, 0, 0);
+			if (0 > fd) {
+				if (errno != EAGAIN && errno != EWOULDBLOCK
+				    && errno != EINTR && errno != ECONNABORTED)
+					perror("accept");
+				continue;
+			}
+			servconn(fd, nullfd);
+		}
+	}
+}
 
-	FD_ZERO(&fds);
+/* Starts worker i of the pool, or replaces it if it exited. */
+static void startwrk(Ports ps, unsigned i)
+{
+	pid_t cpid = fork();
 
-	sk = ps->sk + ps->nr;
-	while (sk-- != ps->sk) {
-		if (sk->fd >= 0) FD_SET(sk->fd, &fds);
+	if (0 > cpid)	perror("fork http worker");
+	if (!cpid)	workermain(ps);
+	ps->wrk[i] = cpid;
+}
+
+static void reapchldn(Ports ps)
+{
+	pid_t cpid;
+	unsigned i;
+
+	while (0 < (cpid = waitpid(-1, 0, WNOHANG))) {
+		for (i = 0; i < ps->wrkn; i++)
+			if (ps->wrk[i] == cpid) startwrk(ps, i);
 	}
+}
 
-	seln = select(ps->maxsfd + 1, &fds, 0, 0, &(struct timeval){1,0});
+static void acceptnext(Ports ps)
+{
+	struct evlev evs[16];
+	int evn, evi;
 
-	if (0 > seln) {
+	evn = evl_wait(ps->el, evs, sizeof(evs) / sizeof(*evs), -1);
+
+	if (0 > evn) {
 		if (errno == EINTR) return;
-		perror("select");
+		perror("evl_wait");
 		exit(1);
 	}
-	waitpid(-1, 0, WNOHANG);
 
-	sk = ps->sk + ps->nr;
-	while (sk-- != ps->sk) {
-		if (FD_ISSET(sk->fd, &fds)) handlreq(ps, sk);
+	for (evi = 0; evi < evn; evi++) {
+		if (evs[evi].dat == &chldev)
+			reapchldn(ps);
+		else
+			handlreq(ps, evs[evi].dat);
 	}
 }
 
@@ -240,13 +375,30 @@ Ports parse_spawner_ports(char **argv)
 	return ps;
 }
 
+void set_http_workers(Ports ps, unsigned n)
+{
+	ps->wrkn = n;
+}
+
 void _Noreturn spawner(Ports ps)
 {
 	struct sock *sk;
+	unsigned i;
+
+	ps->el = evl_new();
+	evl_watchchld(ps->el, &chldev);
 
 	sk = ps->sk + ps->nr;
 	while (sk-- != ps->sk) {
-		if (prepsock(sk) && ps->maxsfd < sk->fd) ps->maxsfd = sk->fd;
+		if (prepsock(sk) && !ps->wrkn)
+			evl_want(ps->el, sk->fd, EVL_R, sk);
+	}
+
+	if (ps->wrkn) {
+		if (0 > pipe(ps->lifeln)) { perror("pipe for workers"); exit(1); }
+		fcntl(ps->lifeln[1], F_SETFD, FD_CLOEXEC);
+		ps->wrk = calloc(ps->wrkn, sizeof(*ps->wrk));
+		for (i = 0; i < ps->wrkn; i++) startwrk(ps, i);
 	}
 
 	for (;;) acceptnext(ps);
@@ -11,5 +11,9 @@ typedef struct subproc_args *Ports;
    process on error. */
 Ports parse_spawner_ports(char **argv);
 
+/* Sets how many worker processes accept and serve HTTP connections, forking
+   only to serve websockets. If 0, a process is forked for every connection. */
+void set_http_workers(Ports ps, unsigned n);
+
 /* Serves requests on given ports and doesn't return. */
 void _Noreturn spawner(Ports ps);
@@ -0,0 +1 @@
+js1 a
@@ -0,0 +1 @@
+js2 a
@@ -18,6 +18,18 @@
 
 /* WERM-SPECIFIC MODIFICATIONS
 
+ OCT 2026
+
+ - if Dtachctx has wshandoff set, pass the websocket to the master with
+   SCM_RIGHTS and exit rather than relaying data
+
+ - wait on an Evloop rather than select
+
+ - send output with write_wbsoc_rout so it can be converted to binary frames
+
+ - send the generation of the terminal state the client holds, and the
+   damage mode update rate, before \N
+
  JAN 2024
 
  - attach_main takes Dtachctx as an argument
@@ -52,6 +64,7 @@
  - rename sockname and allow werm code to modify it */
 
 #include "third_party/dtach/dtach.h"
+#include "evloop.h"
 #include "outstreams.h"
 #include "inbound.h"
 #include "shared.h"
@@ -158,11 +171,49 @@ die(int sig)
 		exit_msg("e", "unexpected signal: ", sig);
 }
 
+/* Sends the n bytes in buf to the master on s, along with the websocket on
+   stdin, and exits, since the master serves the websocket from then on. */
+static _Noreturn void
+handoff(int s, const void *buf, size_t n)
+{
+	union {
+		struct cmsghdr h;
+		char b[CMSG_SPACE(sizeof(int))];
+	} cb;
+	struct iovec iv = {(void *) buf, n};
+	struct msghdr mh = {0};
+	struct cmsghdr *cm;
+	int wsfd = 0;
+	ssize_t sent;
+
+	memset(&cb, 0, sizeof(cb));
+	mh.msg_iov = &iv;
+	mh.msg_iovlen = 1;
+	mh.msg_control = cb.b;
+	mh.msg_controllen = sizeof(cb.b);
+
+	cm = CMSG_FIRSTHDR(&mh);
+	cm->cmsg_level = SOL_SOCKET;
+	cm->cmsg_type = SCM_RIGHTS;
+	cm->cmsg_len = CMSG_LEN(sizeof(int));
+	memcpy(CMSG_DATA(cm), &wsfd, sizeof(int));
+
+	do sent = sendmsg(s, &mh, 0);
+	while (sent < 0 && errno == EINTR);
+
+	if (sent != (ssize_t) n)
+		exit_msg("e", "handing websocket to master failed, errno: ",
+			 sent < 0 ? errno : 0);
+	exit(0);
+}
+
 void attach_main(Dtachctx dc, int noerror)
 {
 	unsigned char buf[BUFSIZE];
-	fd_set readfds;
-	int s;
+	static char sockev, stdinev;
+	struct evlev evs[2];
+	Evloop el;
+	int s, bufn;
 
 	set_argv0(dc, 'a');
 
@@ -180,40 +231,55 @@ void attach_main(Dtachctx dc, int noerror)
 	signal(SIGINT, die);
 	signal(SIGQUIT, die);
 
-	/* Tell the master that we want to attach by sending a no-op signal. */
-	write(s, "\\N", 2);
+	/* Tell the master that we want to attach by sending a no-op signal,
+	   after the generation of the terminal state we already have and the
+	   damage mode rate. */
+	bufn = snprintf((char *) buf, sizeof(buf), "%s",
+			dc->wshandoff ? dc->wshandoff : "");
+	if (dc->stgen)
+		bufn += snprintf((char *) buf + bufn, sizeof(buf) - bufn,
+				 "\\g%08x", dc->stgen);
+	if (dc->dmgfps)
+		bufn += snprintf((char *) buf + bufn, sizeof(buf) - bufn,
+				 "\\f%04u", dc->dmgfps);
+	bufn += snprintf((char *) buf + bufn, sizeof(buf) - bufn, "\\N");
+
+	if (dc->wshandoff) handoff(s, buf, bufn);
+	write(s, buf, bufn);
+
+	el = evl_new();
+	evl_want(el, s, EVL_R, &sockev);
+	evl_want(el, 0, EVL_R, &stdinev);
 
 	/* Wait for things to happen */
 	while (1)
 	{
 		int n;
 
-		FD_ZERO(&readfds);
-		FD_SET(0, &readfds);
-		FD_SET(s, &readfds);
-		n = select(s + 1, &readfds, NULL, NULL, NULL);
+		n = evl_wait(el, evs, 2, -1);
 		if (n < 0 && errno != EINTR && errno != EAGAIN)
-			exit_msg("e", "select syscall failed: ", errno);
-
-		/* Pty activity */
-		if (n > 0 && FD_ISSET(s, &readfds))
-		{
-			ssize_t len = read(s, buf, sizeof(buf));
-
-			if (len == 0)
-				exit_msg("", "EOF - dtach terminating", -1);
-			if (len < 0)
-				exit_msg("e", "read syscall failed: ", errno);
+			exit_msg("e", "evl_wait syscall failed: ", errno);
 
-			/* Send the data to the terminal. */
-			write_wbsoc_frame(buf, len);
-			n--;
-		}
-		/* stdin activity */
-		if (n > 0 && FD_ISSET(0, &readfds))
+		while (n-- > 0)
 		{
-			fwrd_inbound_frames(s);
-			n--;
+			/* Pty activity */
+			if (evs[n].dat == &sockev)
+			{
+				ssize_t len = read(s, buf, sizeof(buf));
+
+				if (len == 0)
+					exit_msg("", "EOF - dtach terminating",
+						 -1);
+				if (len < 0)
+					exit_msg("e", "read syscall failed: ",
+						 errno);
+
+				/* Send the data to the terminal. */
+				write_wbsoc_rout(buf, len);
+			}
+			/* stdin activity */
+			else
+				fwrd_inbound_frames(s);
 		}
 	}
 }
@@ -18,6 +18,10 @@
 
 /* WERM-SPECIFIC MODIFICATIONS
 
+ OCT 2026
+
+ - add CLIENT_HIWAT
+
  JAV 2023
 
  - move |struct pty| here to share it with Werm
@@ -113,6 +117,11 @@
 */
 #define BUFSIZE 4096
 
+/* Default number of bytes of output that may be waiting to be written to a
+** single client before it is brought up to date with a state snapshot
+** instead. */
+#define CLIENT_HIWAT (1 << 20)
+
 struct dtach_ctx;
 void attach_main(struct dtach_ctx *dc, int noerror);
 void _Noreturn dtach_main(struct dtach_ctx *dc);
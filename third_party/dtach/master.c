@@ -18,6 +18,36 @@
 
 /* WERM-SPECIFIC MODIFICATIONS
 
+ OCT 2026
+
+ - optionally serve many terminals in one process. A new master hands its pty
+   and control socket to a host master over a unix socket with SCM_RIGHTS and
+   exits, and the first to find no host becomes it. Each terminal keeps its own
+   Werm globals, swapped in with termuse while its events are handled.
+
+ - accept a websocket fd from a client over the socket with SCM_RIGHTS, and
+   serve the websocket directly from then on, framing output and parsing
+   input here rather than in an attach process.
+
+ - wait on an Evloop rather than rebuilding an fd_set for select on every
+   iteration. Client write interest is only changed when its queue becomes
+   empty or non-empty. Learn of the pty process exiting through a SIGCHLD
+   self-pipe rather than relying on EINTR.
+
+ - give each client its own output queue which is drained when the socket is
+   writable, rather than blocking in pty_activity until every client has taken
+   all of therout. A client whose queue passes its high-water mark has its
+   pending output replaced with a terminal state snapshot, so a slow client
+   cannot stall the pty or the other clients.
+
+ - queue replies to client escapes from process_kbd in the same buffer so they
+   are ordered with terminal output.
+
+ - send a full state snapshot, not a delta, to a client whose queue overflowed
+
+ - send clients in damage mode updates of changed cells at a limited rate
+   rather than terminal output
+
  JAN 2024
 
  - move ownership of clients linked list to Dtachctx and refactor references to
@@ -90,13 +120,30 @@
    file */
 
 #include "third_party/dtach/dtach.h"
+#include "evloop.h"
 #include "outstreams.h"
 #include "shared.h"
+#include "logwriter.h"
+#include "inbound.h"
 #include <sys/wait.h>
+#include <sys/uio.h>
+#include <sys/param.h>
+#include <poll.h>
+
+/* What an event is for: 'k' a client, 'c' the control socket of a terminal,
+   'p' its pty, 'l' the pipe to its log writer, 'x' a child exiting and 'h' the
+   host socket. */
+struct evtag {
+	char k;
+	struct term *t;
+};
 
 /* A connected client */
 struct client
 {
+	/* Must be first, as the client is the event dat value of its fd */
+	struct evtag ev;
+
 	/* The next client in the linked list. */
 	struct client *next;
 	/* The previous client in the linked list. */
@@ -105,6 +152,70 @@ struct client
 	int fd;
 
 	struct clistate cls;
+
+	/* Output waiting for fd to become writable. The bytes before outqof
+	   have already been written. */
+	struct fdbuf outq;
+	unsigned outqof;
+
+	/* Maximum number of unwritten bytes in outq before the client is
+	   considered too far behind to be sent the output it missed. */
+	unsigned hiwat;
+
+	/* Bytes written to fd, for the \P escape */
+	unsigned long long wrn;
+
+	/* Whether fd is registered in evl for writability. */
+	unsigned watchw : 1;
+
+	/* If fd is a websocket handed over by the client, the state of its
+	   frames in each direction. Output in outq is framed onto wsq once wsq
+	   has been written, and the frames refer to outq where they can, so
+	   outq is only cleared once wsq is empty. */
+	struct wbsoc *wso;
+	struct wsin *wsi;
+	struct iovq wsq;
+};
+
+/* A terminal served by this process */
+struct term {
+	Dtachctx dc;
+	struct term *next;
+
+	/* Control socket */
+	int s;
+
+	/* Log writer pipe being waited on, or -1 */
+	int lgwatchd;
+
+	/* When senddmg or publish_state should next be called in ms, or -1 */
+	long long due;
+
+	unsigned ptywatchd	: 1;
+
+	/* Set if events were handled since the things to wait for were last
+	   updated, and if the terminal is to be removed after this batch of
+	   events. */
+	unsigned dirty		: 1;
+	unsigned gone		: 1;
+
+	struct evtag ctlev, ptyev, logwev;
+};
+
+static Evloop evl;
+static struct term *terms;
+
+/* Socket that other masters hand their terminals to, if this is the host */
+static int hostfd = -1;
+static char *hostpath;
+
+static struct evtag chldev = {.k = 'x'}, hostev = {.k = 'h'};
+
+/* Connection from a master handing over its terminal, until its message
+   arrives. */
+struct hostconn {
+	struct evtag ev;
+	int fd;
 };
 
 /* Signal */
@@ -187,115 +298,193 @@ create_socket(char *name)
 	return s;
 }
 
+static int cliqpending(struct client *p)
+{
+	return p->outq.len > p->outqof || iovq_pending(&p->wsq);
+}
+
+/* Waits for the client to become writable iff there is queued output. */
+static void cliwatch(struct client *p)
+{
+	unsigned w = cliqpending(p);
+
+	if (w == p->watchw) return;
+	p->watchw = w;
+	evl_want(evl, p->fd, EVL_R | (w ? EVL_W : 0), p);
+}
+
 /* Returns:
    'b' if writing would block
    'e' if unexpected error
    'o' if all written OK */
-static int cliwrite(int fd, const unsigned char *b, size_t sz)
+static int cliwrite(struct client *p)
 {
 	ssize_t writn;
 
-	while (sz) {
-		writn = write(fd, b, sz);
+	while (cliqpending(p)) {
+		if (p->wso && !iovq_pending(&p->wsq)) {
+			iovq_reset(&p->wsq);
+			wbsoc_qrout(p->wso, &p->wsq, &p->outq, p->outqof,
+				    p->outq.len - p->outqof);
+			p->outqof = p->outq.len;
+			continue;
+		}
+
+		if (p->wso)
+			writn = iovq_write(&p->wsq, p->fd);
+		else
+			writn = write(p->fd, p->outq.bf + p->outqof,
+				      p->outq.len - p->outqof);
 
 		if (writn > 0) {
-			sz -= writn;
-			b += writn;
+			p->wrn += writn;
+			if (!p->wso) p->outqof += writn;
 		}
-		else if (errno == EAGAIN || errno == EWOULDBLOCK)
+		else if (errno == EINTR)
+			continue;
+		else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+			cliwatch(p);
 			return 'b';
+		}
 		else {
 			perror("writing to client");
-			fprintf(stderr, "  fd: %d\n", fd);
-			fprintf(stderr, "  size: %zu\n", sz);
+			fprintf(stderr, "  fd: %d\n", p->fd);
+			p->outq.len = p->outqof = 0;
+			iovq_reset(&p->wsq);
+			cliwatch(p);
 			return 'e';
 		}
 	}
 
+	/* Release the memory if a burst of output made the buffer grow
+	   large. */
+	if (p->outq.cap > BUFSIZE * 16)	fdb_finsh(&p->outq);
+	else				p->outq.len = 0;
+	if (p->wsq.own.cap > BUFSIZE * 16)	iovq_fre(&p->wsq);
+	else					iovq_reset(&p->wsq);
+	p->outqof = 0;
+	cliwatch(p);
+
 	return 'o';
 }
 
-static int sendrout(Dtachctx dc, fd_set *writabl)
+/* Adds therout to the queue of a client. */
+static void cliqueue(struct client *p)
+{
+	unsigned char *nl;
+
+	if (p->outq.len - p->outqof + therout.len <= p->hiwat) {
+		fdb_apnd(&p->outq, therout.bf, therout.len);
+		return;
+	}
+
+	/* The client is too far behind. Drop everything that has not been
+	   written, except for the remainder of a partially-written line, and
+	   bring it up to date with a snapshot instead. The snapshot already
+	   reflects therout, since process_tty_out has consumed it. */
+	if (p->outqof && p->outq.bf[p->outqof-1] != '\n') {
+		nl = memchr(p->outq.bf + p->outqof, '\n',
+			    p->outq.len - p->outqof);
+		if (nl) p->outq.len = nl - p->outq.bf + 1;
+	}
+	else
+		p->outq.len = p->outqof;
+
+	/* The dropped output may have held a state delta, so the client's
+	   generation is no longer known. */
+	p->cls.stgen = 0;
+	state4cli(&p->outq, 0);
+}
+
+static void sendrout(Dtachctx dc)
 {
 	struct client *p;
-	int nclients;
 
-	/* Send the data out to the clients. */
-	for (p = dc->cls, nclients = 0; p; p = p->next) {
-		if (!FD_ISSET(p->fd, writabl)) continue;
+	/* Queue the data for the clients and send what can be sent without
+	   blocking. */
+	for (p = dc->cls; p; p = p->next) {
+		if (!p->cls.wantsoutput || p->cls.dmgfps) continue;
+
+		cliqueue(p);
+		lat4cli(&p->cls, &p->outq);
+		cliwrite(p);
+	}
+}
+
+/* Sends updates to clients in damage mode that are due and not still sending
+   the last one. Returns how long to wait for the next one in ms, or -1. */
+static int senddmg(Dtachctx dc)
+{
+	struct client *p;
+	int tmo = -1, ctmo;
 
-		switch (cliwrite(p->fd, therout.bf, therout.len)) {
-		default: abort();
-		case 'b': break;
-		case 'e': nclients = -1;
-		case 'o': if (nclients != -1) nclients++;
+	for (p = dc->cls; p; p = p->next) {
+		if (!p->cls.wantsoutput || !p->cls.dmgfps) continue;
+		if (cliqpending(p)) continue;
+
+		ctmo = dmgupdate(&p->cls, &p->outq);
+		if (cliqpending(p)) {
+			lat4cli(&p->cls, &p->outq);
+			cliwrite(p);
 		}
+		if (ctmo >= 0 && (tmo < 0 || ctmo < tmo)) tmo = ctmo;
 	}
 
-	return nclients;
+	return tmo;
+}
+
+/* Ends a terminal whose subproc has exited. The process exits with it unless it
+   is the host, which takes the terminal out after the current batch of events.
+ */
+static void
+termgone(struct term *t)
+{
+	if (hostfd < 0) exit(0);
+	t->gone = 1;
 }
 
-/* Process activity on the pty - Input and terminal changes are sent out to
+/* Process activity on the pty - Input and terminal changes are queued for
 ** the attached clients. If the pty goes away, we die. */
 static void
-pty_activity(Dtachctx dc, int s)
+pty_activity(struct term *t)
 {
-	unsigned char preprocb[BUFSIZE];
+	Dtachctx dc = t->dc;
 	struct client *p;
-	fd_set readfds, writefds;
-	int highest_fd, nclients, preproclen;
+	unsigned char preprocb[BUFSIZE];
+	int preproclen;
 
 	/* Read the pty activity */
 	preproclen = read(dc->the_pty.fd, preprocb, sizeof(preprocb));
 
-	/* Error -> die */
+	/* Error -> die, by way of exit so the websockets get the EOF message.
+	   The host only learns that the subproc of a terminal handed to it
+	   exited this way, as it is not the parent. */
 	if (preproclen <= 0) {
 		perror("read pty");
-		abort();
+		termgone(t);
+		return;
 	}
 
+	dc->lastact = time(0);
+	for (p = dc->cls; p; p = p->next) latpty(&p->cls);
+
 	therout.len = 0;
 	if (!therout.cap) therout.cap = 1024;
 	process_tty_out(preprocb, preproclen);
 
-	do {
-		/*
-		** Wait until at least one client is writable. Also wait on the
-		** control socket in case a new client tries to connect.
-		*/
-		FD_ZERO(&readfds);
-		FD_ZERO(&writefds);
-		FD_SET(s, &readfds);
-		highest_fd = s;
-		for (p = dc->cls, nclients = 0; p; p = p->next)
-		{
-			if (!p->cls.wantsoutput)
-				continue;
-			FD_SET(p->fd, &writefds);
-			if (p->fd > highest_fd)
-				highest_fd = p->fd;
-			nclients++;
-		}
-		if (nclients == 0)
-			break;
-		if (select(highest_fd + 1, &readfds, &writefds, NULL, NULL) < 0)
-			break;
-
-		nclients = sendrout(dc, &writefds);
-
-		/* Try again if nothing happened. */
-	} while (!FD_ISSET(s, &readfds) && nclients == 0);
+	sendrout(dc);
 }
 
 /* Process activity on the control socket */
 static void
-control_activity(Dtachctx dc, int s)
+control_activity(struct term *t)
 {
+	Dtachctx dc = t->dc;
 	int fd;
 	struct client *p;
 
 	/* Accept the new client and link it in. */
-	fd = accept(s, NULL, NULL);
+	fd = accept(t->s, NULL, NULL);
 	if (fd < 0)
 		return;
 	else if (setnonblocking(fd) < 0)
@@ -306,7 +495,10 @@ control_activity(Dtachctx dc, int s)
 
 	/* Link it in. */
 	p = calloc(1, sizeof(struct client));
+	p->ev = (struct evtag){'k', t};
 	p->fd = fd;
+	p->hiwat = CLIENT_HIWAT;
+	evl_want(evl, fd, EVL_R, p);
 	p->pprev = &dc->cls;
 	p->next = *(p->pprev);
 	if (p->next)
@@ -330,56 +522,536 @@ void print_atch_clis(Dtachctx dc, struct fdbuf *b)
 	fdb_apnc(b, ']');
 }
 
+void print_cli_stats(Dtachctx dc, struct fdbuf *b)
+{
+	struct client *q;
+	const char *pref = "";
+
+	fdb_apnc(b, '[');
+	for (q = dc->cls; q; q = q->next) {
+		if (!q->cls.wantsoutput) continue;
+
+		fdb_apnd(b, pref, -1);
+		pref = ",";
+		fdb_apnd(b, "{\"endpnt\":", -1);
+		fdb_json(b, q->cls.endpnt, sizeof q->cls.endpnt);
+		fdb_apnd(b, ",\"wrote\":", -1);
+		fdb_itoa(b, q->wrn);
+		fdb_apnd(b, ",\"queued\":", -1);
+		fdb_itoa(b, q->outq.len - q->outqof + iovq_left(&q->wsq));
+		fdb_apnc(b, '}');
+	}
+	fdb_apnc(b, ']');
+}
+
+static void
+clidrop(struct client *p)
+{
+	evl_want(evl, p->fd, 0, 0);
+	close(p->fd);
+	if (p->next)
+		p->next->pprev = p->pprev;
+	*(p->pprev) = p->next;
+	fdb_finsh(&p->outq);
+	iovq_fre(&p->wsq);
+	wbsoc_fre(p->wso);
+	wsin_fre(p->wsi);
+	dmgfre(&p->cls);
+	free(p);
+}
+
+/* Reads from a client like read, also receiving a file descriptor passed with
+   SCM_RIGHTS into *rfd, or setting it to -1. */
+static ssize_t
+readcli(int fd, void *buf, size_t sz, int *rfd)
+{
+	union {
+		struct cmsghdr h;
+		char b[CMSG_SPACE(sizeof(int))];
+	} cb;
+	struct iovec iv = {buf, sz};
+	struct msghdr mh = {0};
+	struct cmsghdr *cm;
+	ssize_t len;
+
+	mh.msg_iov = &iv;
+	mh.msg_iovlen = 1;
+	mh.msg_control = cb.b;
+	mh.msg_controllen = sizeof(cb.b);
+
+	*rfd = -1;
+	len = recvmsg(fd, &mh, 0);
+	if (len < 0) return len;
+
+	for (cm = CMSG_FIRSTHDR(&mh); cm; cm = CMSG_NXTHDR(&mh, cm)) {
+		if (cm->cmsg_level != SOL_SOCKET || cm->cmsg_type != SCM_RIGHTS)
+			continue;
+		memcpy(rfd, CMSG_DATA(cm), sizeof(int));
+	}
+
+	return len;
+}
+
+/* Serves the client over the websocket at wsfd from now on, with the settings
+   it sent with the \W escape. The connection it was handed over is closed. */
+static void
+takews(struct client *p, int wsfd)
+{
+	const struct clistate *c = &p->cls;
+
+	if (p->wso || setnonblocking(wsfd) < 0) {
+		close(wsfd);
+		return;
+	}
+
+	evl_want(evl, p->fd, 0, 0);
+	close(p->fd);
+	p->fd = wsfd;
+	p->watchw = 0;
+	evl_want(evl, p->fd, EVL_R, p);
+
+	p->wso = wbsoc_new(c->wsbin, c->wsdefllvl, c->wsdeflmin, c->wsdeflbits,
+			   c->wsdeflreset);
+	p->wsi = wsin_new();
+}
+
 /* Process activity from a client. */
 static void
 client_activity(Dtachctx dc, struct client *p)
 {
 	ssize_t len;
-	unsigned char buf[512];
+	unsigned char buf[BUFSIZE * 4];
+	struct fdbuf in = {0}, pongs = {0};
+	int wsfd, wsr = 0;
 
 	/* Read the activity. */
-	len = read(p->fd, buf, sizeof(buf));
+	len = readcli(p->fd, buf, sizeof(buf), &wsfd);
 	if (len < 0 && (errno == EAGAIN || errno == EINTR))
 		return;
 
 	/* Close the client on an error. */
 	if (len <= 0)
 	{
-		close(p->fd);
-		if (p->next)
-			p->next->pprev = p->pprev;
-		*(p->pprev) = p->next;
-		free(p);
+		if (wsfd >= 0) close(wsfd);
+		clidrop(p);
 		return;
 	}
-	process_kbd(p->fd, dc, &p->cls, buf, len);
+
+	if (!p->wsi)
+		process_kbd(&p->outq, dc, &p->cls, buf, len);
+	else if (0 > (wsr = wsin_feed(p->wsi, buf, len, &in, &pongs))) {
+		fprintf(stderr, "bad websocket data from client\n");
+		pongs.len = 0;
+		wsin_closefr(&pongs, 1002);
+	}
+	else if (in.len)
+		process_kbd(&p->outq, dc, &p->cls, in.bf, in.len);
+	iovq_cpy(&p->wsq, pongs.bf, pongs.len);
+	fdb_finsh(&in);
+	fdb_finsh(&pongs);
+
+	if (wsfd >= 0) takews(p, wsfd);
+
+	/* After a close frame, only the answer to it is sent, if that can be
+	   done without waiting. */
+	if (wsr) {
+		p->outq.len = p->outqof = 0;
+		cliwrite(p);
+		clidrop(p);
+		return;
+	}
+	cliwrite(p);
 }
 
-static void handleselecterr(pid_t pty)
+/* How long byews waits for all the clients of a terminal to take the last of
+   their output, so a stalled one cannot hold up exiting. */
+#define BYEWSMS 500
+
+/* Tells clients of a terminal served over a websocket by this process that it
+   is going away, as their attach process would have. */
+static void
+byews(Dtachctx dc)
 {
-	int ern = errno;
+	struct client *p;
+	struct fdbuf b = {0};
+	struct pollfd pf;
+	long long due = nowms() + BYEWSMS, left;
+	int fl;
+
+	for (p = dc->cls; p; p = p->next) {
+		if (!p->wso) continue;
 
-	/* This seems to be needed in order for the master proc to terminate
-	   after the spawner is terminated. errno is EINTR in that case.
+		fl = fcntl(p->fd, F_GETFL);
+		if (fl >= 0) fcntl(p->fd, F_SETFL, fl | O_NONBLOCK);
 
-	   For other child processes, such as /bin/bash, EIO seems to be
-	   given. */
-	if (0 <= waitpid(pty, 0, WNOHANG)) exit(0);
+		b.len = 0;
+		fmt_exit_msg(&b, "", "EOF - dtach terminating", -1);
+		fdb_apnd(&p->outq, b.bf, b.len);
+
+		while (cliwrite(p) == 'b' && (left = due - nowms()) > 0) {
+			pf = (struct pollfd){p->fd, POLLOUT};
+			poll(&pf, 1, left);
+		}
+	}
+
+	fdb_finsh(&b);
+}
+
+static void handlewaiterr(void)
+{
+	int ern = errno;
 
 	if (ern == EINTR || ern == EAGAIN) return;
 
-	fprintf(stderr, "FATAL: select gave errno %d\n", ern);
+	fprintf(stderr, "FATAL: evl_wait gave errno %d\n", ern);
 	exit(1);
 }
 
+static void reapchld(void)
+{
+	struct term *t;
+	pid_t pid;
+
+	/* This is needed in order for the master proc to terminate after the
+	   spawner is terminated, and for other child processes, such as
+	   /bin/bash, where we may not see EIO from the pty first. Other
+	   children, such as log writers of terminals which have ended, are just
+	   reaped. */
+	while (0 < (pid = waitpid(-1, 0, WNOHANG)))
+		for (t = terms; t; t = t->next)
+			if (t->dc->the_pty.pid == pid) termgone(t);
+
+	if (pid < 0 && errno == ECHILD && hostfd < 0) exit(0);
+}
+
+/* Starts serving the terminal of dc, whose control socket is s and whose
+   Werm globals are in use. */
+static void
+addterm(Dtachctx dc, int s)
+{
+	struct term *t = calloc(1, sizeof(*t));
+
+	t->dc = dc;
+	t->s = s;
+	t->lgwatchd = -1;
+	t->due = -1;
+	t->dirty = 1;
+	t->ctlev = (struct evtag){'c', t};
+	t->ptyev = (struct evtag){'p', t};
+	t->logwev = (struct evtag){'l', t};
+	evl_want(evl, s, EVL_R, &t->ctlev);
+
+	/* Do not save scrollbacks for ephemeral terminals, as these are
+	   used for grepping scrollback logs, so they can be very large
+	   and included redundant data that will be confusing to see in
+	   some recursive analysis of scrollbacks. */
+	if (!dc->isephem) open_logs();
+
+	t->next = terms;
+	terms = t;
+}
+
+/* Stops serving a terminal and frees it. Closing the pty hangs up its
+   subproc if it is still running. */
+static void
+endterm(struct term *t)
+{
+	Dtachctx dc = t->dc;
+	struct term **tp;
+
+	termuse(dc);
+	byews(dc);
+	while (dc->cls) clidrop(dc->cls);
+
+	evl_want(evl, t->s, 0, 0);
+	close(t->s);
+	unlink(dc->sockpath);
+	if (t->ptywatchd) evl_want(evl, dc->the_pty.fd, 0, 0);
+	if (t->lgwatchd >= 0) evl_want(evl, t->lgwatchd, 0, 0);
+	close(dc->the_pty.fd);
+
+	termend(dc);
+
+	for (tp = &terms; *tp != t; tp = &(*tp)->next) {}
+	*tp = t->next;
+
+	free(dc->sockpath);
+	free(dc->hostpath);
+	free(dc->hostflags);
+	free(dc);
+	free(t);
+}
+
+/* Runs at exit, so each terminal's clients and registry entry are cleaned up,
+   and its log writer gets everything. */
+static void
+byeall(void)
+{
+	struct term *t;
+
+	for (t = terms; t; t = t->next) {
+		termuse(t->dc);
+		byews(t->dc);
+		termend(t->dc);
+	}
+	if (hostfd >= 0) unlink(hostpath);
+}
+
+/* Hands the terminal to the host, which then serves it. Returns 0 if it did, or
+   -1 if it could not be sent, in which case this process is to serve it. */
+static int
+tohost(Dtachctx dc, int s)
+{
+	union {
+		struct cmsghdr h;
+		char b[CMSG_SPACE(2 * sizeof(int))];
+	} cb;
+	struct sockaddr_un sa = {AF_UNIX};
+	struct msghdr mh = {0};
+	struct iovec iv;
+	struct cmsghdr *cm;
+	struct pollfd pf;
+	int fd, fds[2] = {s, dc->the_pty.fd}, sent;
+	char *msg, ack = 0;
+
+	if (strlen(dc->hostpath) >= sizeof(sa.sun_path)) return -1;
+	strcpy(sa.sun_path, dc->hostpath);
+
+	fd = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+	if (fd < 0) return -1;
+	if (connect(fd, (struct sockaddr *) &sa, sizeof(sa))) {
+		if (errno == ECONNREFUSED) unlink(dc->hostpath);
+		close(fd);
+		return -1;
+	}
+
+	iv.iov_len = xasprintf(&msg, "%d\n%lld\n%s\n%s", dc->isephem,
+			       (long long) dc->the_pty.pid, dc->sockpath,
+			       dc->hostflags ? dc->hostflags : "");
+	iv.iov_base = msg;
+
+	memset(&cb, 0, sizeof(cb));
+	mh.msg_iov = &iv;
+	mh.msg_iovlen = 1;
+	mh.msg_control = cb.b;
+	mh.msg_controllen = sizeof(cb.b);
+	cm = CMSG_FIRSTHDR(&mh);
+	cm->cmsg_level = SOL_SOCKET;
+	cm->cmsg_type = SCM_RIGHTS;
+	cm->cmsg_len = CMSG_LEN(sizeof(fds));
+	memcpy(CMSG_DATA(cm), fds, sizeof(fds));
+
+	/* Once sent, the message stays queued for the host even if this gives
+	   up on it, so serving the terminal here as well could have two
+	   masters on one pty. Wait for the host to take it or go away, and
+	   leave it to the host either way. */
+	sent = sendmsg(fd, &mh, 0) == (ssize_t) iv.iov_len;
+	pf = (struct pollfd){fd, POLLIN};
+	while (sent && 0 > poll(&pf, 1, -1) && errno == EINTR) {}
+	if (sent && (1 != read(fd, &ack, 1) || ack != 'k'))
+		fprintf(stderr, "host did not take terminal\n");
+
+	free(msg);
+	close(fd);
+	return sent ? 0 : -1;
+}
+
+/* Listens for terminals handed over by other masters at path. Does nothing if
+   another process got there first. */
+static void
+becomehost(const char *path)
+{
+	struct sockaddr_un sa = {AF_UNIX};
+
+	if (strlen(path) >= sizeof(sa.sun_path)) return;
+	strcpy(sa.sun_path, path);
+
+	hostfd = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+	if (hostfd < 0) return;
+	if (	bind(hostfd, (struct sockaddr *) &sa, sizeof(sa))
+	||	listen(hostfd, 128)
+	||	setnonblocking(hostfd)) {
+		close(hostfd);
+		hostfd = -1;
+		return;
+	}
+	hostpath = strdup(path);
+}
+
+/* Accepts a master which is to hand over its terminal, and waits for its
+   message along with the other events. */
+static void
+host_activity(void)
+{
+	struct hostconn *hc;
+	int fd;
+
+	fd = accept(hostfd, 0, 0);
+	if (fd < 0) return;
+	if (setnonblocking(fd)) {
+		close(fd);
+		return;
+	}
+
+	hc = calloc(1, sizeof(*hc));
+	hc->ev.k = 'g';
+	hc->fd = fd;
+	evl_want(evl, fd, EVL_R, &hc->ev);
+}
+
+/* Takes a terminal handed over by a new master. The sender gives up and
+   closes after a while, so a connection which never delivers is dropped
+   when that reads as end of file. */
+static void
+host_recv(struct hostconn *hc)
+{
+	union {
+		struct cmsghdr h;
+		char b[CMSG_SPACE(2 * sizeof(int))];
+	} cb;
+	char buf[8192], *pidl, *pathl, *flagl;
+	struct iovec iv = {buf, sizeof(buf) - 1};
+	struct msghdr mh = {0};
+	struct cmsghdr *cm;
+	int fd = hc->fd, fds[2] = {-1, -1};
+	ssize_t len;
+	Dtachctx dc;
+
+	mh.msg_iov = &iv;
+	mh.msg_iovlen = 1;
+	mh.msg_control = cb.b;
+	mh.msg_controllen = sizeof(cb.b);
+	len = recvmsg(fd, &mh, MSG_DONTWAIT);
+	if (len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+		return;
+	evl_want(evl, fd, 0, 0);
+	free(hc);
+
+	for (cm = CMSG_FIRSTHDR(&mh); len > 0 && cm; cm = CMSG_NXTHDR(&mh, cm))
+		if (	cm->cmsg_level == SOL_SOCKET
+		&&	cm->cmsg_type == SCM_RIGHTS
+		&&	cm->cmsg_len == CMSG_LEN(sizeof(fds)))
+			memcpy(fds, CMSG_DATA(cm), sizeof(fds));
+
+	if (len > 0) buf[len] = 0;
+	pidl	= len > 0	? strchr(buf, '\n')		: 0;
+	pathl	= pidl		? strchr(pidl + 1, '\n')	: 0;
+	flagl	= pathl		? strchr(pathl + 1, '\n')	: 0;
+
+	if (!flagl || fds[0] < 0 || fds[1] < 0) {
+		fprintf(stderr, "bad terminal handed to host\n");
+		if (fds[0] >= 0) close(fds[0]);
+		if (fds[1] >= 0) close(fds[1]);
+		close(fd);
+		return;
+	}
+	*pidl++ = *pathl++ = *flagl++ = 0;
+
+	/* The sender leaves the terminal to us once it reads this, so without
+	   it the terminal is not ours to serve. */
+	if (1 != write(fd, "k", 1)) {
+		perror("ack handed over terminal");
+		close(fds[0]);
+		close(fds[1]);
+		close(fd);
+		return;
+	}
+	close(fd);
+
+	fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+	fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+
+	dc = calloc(1, sizeof(*dc));
+	dc->isephem = !!atoi(buf);
+	dc->the_pty.pid = strtoll(pidl, 0, 10);
+	dc->the_pty.fd = fds[1];
+	dc->sockpath = strdup(pathl);
+
+	termnew(dc, flagl);
+	addterm(dc, fds[0]);
+}
+
+/* Brings what evl waits for up to date for a terminal that had events or whose
+   timer is due. */
+static void
+prepwait(struct term *t, long long now)
+{
+	Dtachctx dc = t->dc;
+	int lgfd, tmo, ptmo;
+
+	termuse(dc);
+
+	/*
+	** When first_attach is unset, wait until the client attaches
+	** before trying to read from the pty.
+	*/
+	if (!dc->firstatch && dc->cls && dc->cls->cls.wantsoutput) {
+		dc->firstatch = 1;
+		send_pream(dc->the_pty.fd);
+	}
+
+	if (dc->firstatch && !t->ptywatchd) {
+		t->ptywatchd = 1;
+		evl_want(evl, dc->the_pty.fd, EVL_R, &t->ptyev);
+	}
+
+	/* Wait for the log writer to take queued output. */
+	lgfd = logw_pending();
+	if (lgfd != t->lgwatchd) {
+		if (t->lgwatchd >= 0) evl_want(evl, t->lgwatchd, 0, 0);
+		if (lgfd >= 0) evl_want(evl, lgfd, EVL_W, &t->logwev);
+		t->lgwatchd = lgfd;
+	}
+
+	/* Wait for the next damage mode update or registry update to be
+	   due. */
+	tmo = senddmg(dc);
+	ptmo = publish_state(dc);
+	if (ptmo >= 0 && (tmo < 0 || ptmo < tmo)) tmo = ptmo;
+	t->due = tmo < 0 ? -1 : now + tmo;
+	t->dirty = 0;
+}
+
+/* Handles an event for a terminal. */
+static void
+termevent(struct evlev *ev)
+{
+	struct evtag *tg = ev->dat;
+	struct term *t = tg->t;
+	struct client *p;
+
+	if (t->gone) return;
+	termuse(t->dc);
+	t->dirty = 1;
+
+	switch (tg->k) {
+	/* New client? */
+	case 'c':	control_activity(t);
+	/* pty activity? */
+	break; case 'p':	pty_activity(t);
+	/* Log writer can take more output? */
+	break; case 'l':	logw_pump();
+	/* Activity on a client? */
+	break; case 'k':
+		p = (struct client *) tg;
+		if (ev->fl & EVL_W)
+			cliwrite(p);
+		if (ev->fl & EVL_R)
+			client_activity(t->dc, p);
+	}
+
+	if (!t->dc->cls && t->dc->firstatch && t->dc->isephem) termgone(t);
+}
+
 /* The master process - It watches over the pty process and the attached */
 /* clients. */
 static _Noreturn void
 masterprocess(Dtachctx dc, int s)
 {
-	struct client *p, *next;
-	fd_set readfds;
-	int highest_fd, nullfd;
+	struct term *t, *tn;
+	struct evlev evs[64], *ev;
+	int evn, evi, nullfd, tmo;
+	long long now;
 
 	/* Okay, disassociate ourselves from the original terminal, as we
 	** don't care what happens to it. */
@@ -400,11 +1072,20 @@ masterprocess(Dtachctx dc, int s)
 	}
 	set_argv0(dc, 'm');
 
-	/* Do not save scrollbacks for ephemeral terminals, as these are
-	   used for grepping scrollback logs, so they can be very large
-	   and included redundant data that will be confusing to see in
-	   some recursive analysis of scrollbacks. */
-	if (!dc->isephem) open_logs();
+	/* The subproc is left to be reparented, and the host sees it exit as
+	   EIO on the pty. */
+	if (dc->hostpath) {
+		if (!tohost(dc, s)) _exit(0);
+		becomehost(dc->hostpath);
+	}
+
+	/* Created after forking the subproc so it is not inherited. */
+	evl = evl_new();
+	evl_watchchld(evl, &chldev);
+	if (hostfd >= 0) evl_want(evl, hostfd, EVL_R, &hostev);
+
+	addterm(dc, s);
+	atexit(byeall);
 
 	/* Set up some signals. */
 	signal(SIGPIPE, SIG_IGN);
@@ -428,53 +1109,43 @@ masterprocess(Dtachctx dc, int s)
 	/* Loop forever. */
 	while (1)
 	{
-		/* Re-initialize the file descriptor set for select. */
-		FD_ZERO(&readfds);
-		FD_SET(s, &readfds);
-		highest_fd = s;
-
-		/*
-		** When first_attach is unset, wait until the client attaches
-		** before trying to read from the pty.
-		*/
-		if (!dc->firstatch && dc->cls && dc->cls->cls.wantsoutput) {
-			dc->firstatch = 1;
-			send_pream(dc->the_pty.fd);
-		}
-
-		if (dc->firstatch) {
-			FD_SET(dc->the_pty.fd, &readfds);
-			if (dc->the_pty.fd > highest_fd)
-				highest_fd = dc->the_pty.fd;
-		}
-
-		for (p = dc->cls; p; p = p->next)
-		{
-			FD_SET(p->fd, &readfds);
-			if (p->fd > highest_fd)
-				highest_fd = p->fd;
+		/* Take out terminals which ended, and update what to wait for
+		   for the ones which had events or are due, leaving the rest
+		   alone, as there can be many. */
+		now = nowms();
+		tmo = -1;
+		for (t = terms; t; t = tn) {
+			tn = t->next;
+			if (t->gone) {
+				endterm(t);
+				continue;
+			}
+			if (t->dirty || (t->due >= 0 && t->due <= now))
+				prepwait(t, now);
+			if (t->due >= 0 && (tmo < 0 || t->due - now < tmo))
+				tmo = MAX(0, t->due - now);
 		}
+		if (!terms) exit(0);
 
-		/* Wait for something to happen. */
-		if (select(highest_fd + 1, &readfds, NULL, NULL, NULL) < 0) {
-			handleselecterr(dc->the_pty.pid);
+		evn = evl_wait(evl, evs, sizeof(evs) / sizeof(*evs), tmo);
+		if (evn < 0) {
+			handlewaiterr();
 			continue;
 		}
 
-		/* New client? */
-		if (FD_ISSET(s, &readfds))
-			control_activity(dc, s);
-		/* Activity on a client? */
-		for (p = dc->cls; p; p = next)
-		{
-			next = p->next;
-			if (FD_ISSET(p->fd, &readfds))
-				client_activity(dc, p);
+		for (evi = 0; evi < evn; evi++) {
+			ev = evs + evi;
+
+			if (ev->dat == &chldev)
+				reapchld();
+			/* Terminal handed over by another master? */
+			else if (ev->dat == &hostev)
+				host_activity();
+			else if (((struct evtag *) ev->dat)->k == 'g')
+				host_recv(ev->dat);
+			else
+				termevent(ev);
 		}
-		if (!dc->cls && dc->firstatch && dc->isephem) exit(0);
-		/* pty activity? */
-		if (FD_ISSET(dc->the_pty.fd, &readfds))
-			pty_activity(dc, s);
 	}
 }
 
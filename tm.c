@@ -9,20 +9,26 @@
 #include <stdlib.h>
 #include <string.h>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 typedef int32_t		TMint;
 typedef void	*	TMany;
 typedef char	*	TMutf8;
 
-#define fn0(name)			static int32_t name(void)
-#define fn1(name, a0)			static int32_t name( \
+#define TMFN static int32_t
+
+#define fn0(name)			TMFN name(void)
+#define fn1(name, a0)			TMFN name( \
 	int32_t a0)
-#define fn2(name, a0, a1)		static int32_t name( \
+#define fn2(name, a0, a1)		TMFN name( \
 	int32_t a0, int32_t a1)
-#define fn3(name, a0, a1, a2)		static int32_t name( \
+#define fn3(name, a0, a1, a2)		TMFN name( \
 	int32_t a0, int32_t a1, int32_t a2)
-#define fn4(name, a0, a1, a2, a3)	static int32_t name( \
+#define fn4(name, a0, a1, a2, a3)	TMFN name( \
 	int32_t a0, int32_t a1, int32_t a2, int32_t a3)
-#define fn5(name, a0, a1, a2, a3, a4)	static int32_t name( \
+#define fn5(name, a0, a1, a2, a3, a4)	TMFN name( \
 	int32_t a0, int32_t a1, int32_t a2, int32_t a3, int32_t a4)
 
 #define argx(type, name) type name
@@ -50,6 +56,7 @@ int32_t *fld_ptr(int32_t id, int32_t fdx);
 int32_t tmalloc(int32_t nfct);
 int32_t tmlen(int32_t id);
 void tmfree(int32_t id);
+void tmresize(int32_t id, int32_t nfct);
 
 #define tmlog(...) do {				\
 	fflush(stdout);				\
@@ -95,6 +102,35 @@ static inline char *deqtostring(TMint deq, TMint byti)
 	return ((char *)&fld(deq, deqhd(deq))) + byti;
 }
 
+/* Number of bytes starting at byti, up to n, that are printable ASCII. */
+static inline TMint deqprintrun(TMint deq, TMint byti, TMint n)
+{
+	const unsigned char *s;
+	TMint i = 0;
+
+	if (!n) return 0;
+	s = (unsigned char *) deqtostring(deq, byti);
+
+#ifdef __SSE2__
+	{
+		__m128i sp = _mm_set1_epi8(0x20), de = _mm_set1_epi8(0x7f), v;
+		unsigned m;
+
+		/* bytes >= 0x80 are negative, so a signed compare catches them
+		   along with C0 controls */
+		for (; i + 16 <= n; i += 16) {
+			v = _mm_loadu_si128((const __m128i *) (s + i));
+			m = _mm_movemask_epi8(_mm_or_si128(
+				_mm_cmplt_epi8(v, sp), _mm_cmpeq_epi8(v, de)));
+			if (m) return i + __builtin_ctz(m);
+		}
+	}
+#endif
+
+	while (i < n && s[i] >= 0x20 && s[i] < 0x7f) i++;
+	return i;
+}
+
 #define FN0PROTO(name) static TMint name(void);
 #define FN1PROTO(name) static TMint name(TMint);
 #define FN2PROTO(name) static TMint name(TMint, TMint);
@@ -142,12 +178,99 @@ int32_t *fld_ptr(int32_t id, int32_t fdx)
 	return o->fs + fdx;
 }
 
+/* Field storage for objects of up to the largest size class comes from slabs,
+ * which are carved into blocks of a single class. A freed block is put on the
+ * free list of its class, with the next pointer stored in the block. Slabs are
+ * only returned to the system when the whole heap is freed, and each begins
+ * with a pointer to the slab allocated before it. Larger objects use malloc
+ * directly. */
+static const int32_t tmszcls[] = {
+	2, 4, 6, 8, 12, 16, 24, 32, 48, 64, 96, 128, 192, 256, 384, 512,
+};
+#define TMSZCLSCNT (sizeof(tmszcls) / sizeof(*tmszcls))
+#define TMSLABSZ (64 * 1024)
+#define TMSLABHD 16
+
+static struct {
+	void *freel;
+	char *slab;
+	size_t slabrem;
+} tmcls[TMSZCLSCNT];
+
+static void *tmslabs;
+
+/* Counters to see how much memory the heap uses */
+static struct {
+	uint64_t allocs, frees, resizes, inplace;
+	size_t objs, fldbytes, slabbytes, largebytes;
+} tmst;
+
+/* Returns the size class for an object with nfct fields, or -1 if it is too
+   large for one. */
+static int tmclsfor(int32_t nfct)
+{
+	int c;
+
+	for (c = 0; c < TMSZCLSCNT; c++) if (nfct <= tmszcls[c]) return c;
+	return -1;
+}
+
+static int32_t *tmblkget(int32_t nfct)
+{
+	int c = tmclsfor(nfct);
+	size_t bsz;
+	void *b;
+
+	if (c < 0) {
+		b = malloc(nfct * sizeof(int32_t));
+		if (b) tmst.largebytes += nfct * sizeof(int32_t);
+		return b;
+	}
+
+	if ((b = tmcls[c].freel)) {
+		tmcls[c].freel = *(void **) b;
+		return b;
+	}
+
+	bsz = tmszcls[c] * sizeof(int32_t);
+	if (tmcls[c].slabrem < bsz) {
+		if (!(b = malloc(TMSLABSZ))) return NULL;
+		*(void **) b = tmslabs;
+		tmslabs = b;
+		tmcls[c].slab = (char *) b + TMSLABHD;
+		tmcls[c].slabrem = TMSLABSZ - TMSLABHD;
+		tmst.slabbytes += TMSLABSZ;
+	}
+
+	b = tmcls[c].slab;
+	tmcls[c].slab += bsz;
+	tmcls[c].slabrem -= bsz;
+
+	return b;
+}
+
+static void tmblkput(int32_t *b, int32_t nfct)
+{
+	int c = tmclsfor(nfct);
+
+	if (c < 0) {
+		free(b);
+		tmst.largebytes -= nfct * sizeof(int32_t);
+		return;
+	}
+
+	*(void **) b = tmcls[c].freel;
+	tmcls[c].freel = b;
+}
+
 int32_t tmalloc(int32_t nfct)
 {
 	int32_t newid;
 	uint32_t newcap;
 	struct tmobj *newo;
 
+	if (nfct < 0) sriously("negative field count: %"PRId32"\n", nfct);
+
 	if (tmobjs.bufsfreehead == tmobjs.capac) {
 		newcap = 3 * tmobjs.capac / 2;
 		if (newcap == tmobjs.capac) newcap = tmobjs.capac + 16;
@@ -171,11 +294,16 @@ int32_t tmalloc(int32_t nfct)
 	tmobjs.bufsfreehead = ~newo->fct;
 
 	newo->fct = nfct;
-	newo->fs = calloc(nfct, sizeof(int32_t));
+	newo->fs = tmblkget(nfct);
 	if (!newo->fs) {
-		perror("calloc");
-		sriously("calloc for new obj of field cnt %"PRId32"\n", nfct);
+		perror("malloc");
+		sriously("alloc for new obj of field cnt %"PRId32"\n", nfct);
 	}
+	memset(newo->fs, 0, nfct * sizeof(int32_t));
+
+	tmst.allocs++;
+	tmst.objs++;
+	tmst.fldbytes += nfct * sizeof(int32_t);
 
 	return newid;
 }
@@ -194,9 +322,86 @@ void tmfree(int32_t id)
 
 	fro = id2obj(id);
 
-	free(fro->fs);
+	tmst.frees++;
+	tmst.objs--;
+	tmst.fldbytes -= fro->fct * sizeof(int32_t);
+
+	tmblkput(fro->fs, fro->fct);
 	fro->fs = NULL;
 	fro->fct = ~tmobjs.bufsfreehead;
 
 	tmobjs.bufsfreehead = ~id;
 }
+
+/* Changes the field count of an object, keeping its ID. New fields are 0. The
+   fields stay where they are if the size class does not change. */
+void tmresize(int32_t id, int32_t nfct)
+{
+	struct tmobj *o = id2obj(id);
+	int32_t *nfs;
+	int c = tmclsfor(nfct);
+
+	if (nfct < 0) sriously("negative field count: %"PRId32"\n", nfct);
+
+	tmst.resizes++;
+	tmst.fldbytes += (nfct - o->fct) * sizeof(int32_t);
+
+	if (c >= 0 && c == tmclsfor(o->fct)) {
+		tmst.inplace++;
+	}
+	else if (c < 0 && tmclsfor(o->fct) < 0) {
+		nfs = realloc(o->fs, nfct * sizeof(int32_t));
+		if (!nfs) {
+			perror("realloc");
+			sriously("resize obj to field cnt %"PRId32"\n", nfct);
+		}
+		tmst.largebytes += (nfct - o->fct) * sizeof(int32_t);
+		o->fs = nfs;
+	}
+	else {
+		nfs = tmblkget(nfct);
+		if (!nfs) {
+			perror("malloc");
+			sriously("resize obj to field cnt %"PRId32"\n", nfct);
+		}
+		memcpy(nfs, o->fs,
+		       (nfct < o->fct ? nfct : o->fct) * sizeof(int32_t));
+		tmblkput(o->fs, o->fct);
+		o->fs = nfs;
+	}
+
+	if (nfct > o->fct)
+		memset(o->fs + o->fct, 0, (nfct - o->fct) * sizeof(int32_t));
+	o->fct = nfct;
+}
+
+void tmheapstats(FILE *f)
+{
+	fprintf(f,	"tmobjs: %zu objs in %"PRIu32" slots, "
+			"%zu field bytes, %zu slab bytes, %zu large bytes\n",
+			tmst.objs, tmobjs.capac, tmst.fldbytes,
+			tmst.slabbytes, tmst.largebytes);
+	fprintf(f,	"tmobjs: %"PRIu64" allocs, %"PRIu64" frees, "
+			"%"PRIu64" resizes (%"PRIu64" in place)\n",
+			tmst.allocs, tmst.frees, tmst.resizes, tmst.inplace);
+}
+
+/* Frees every object, leaving the heap as it was before the first tmalloc. */
+static void tmheapfre(void)
+{
+	struct tmobj *o;
+	void *sl;
+
+	for (o = tmobjs.objel; o < tmobjs.objel + tmobjs.capac; o++)
+		if (o->fct >= 0 && tmclsfor(o->fct) < 0) free(o->fs);
+	free(tmobjs.objel);
+
+	while ((sl = tmslabs)) {
+		tmslabs = *(void **) sl;
+		free(sl);
+	}
+
+	memset(&tmobjs, 0, sizeof(tmobjs));
+	memset(tmcls, 0, sizeof(tmcls));
+	memset(&tmst, 0, sizeof(tmst));
+}
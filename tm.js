@@ -47,6 +47,14 @@ function tmalloc(size) { return jsobj_alloc(new Int32Array(size)); }
 
 function tmlen(bref) { return bref ? bufsa[~bref].length : 0; }
 
+function tmresize(bref, size)
+{
+	var o = bufsa[~bref], n = new Int32Array(size);
+
+	n.set(size < o.length ? o.subarray(0, size) : o);
+	bufsa[~bref] = n;
+}
+
 function tmfree(bref)
 {
 	bufsa[~bref] = ~bufsfreehead;
@@ -70,6 +78,18 @@ function deqtostring(deq, byti)
 
 #define ORD(chr) (chr).charCodeAt(0)
 
+function deqprintrun(deq, byti, n)
+{
+	var i, b;
+
+	for (i = 0; i < n; i++) {
+		b = deqbytat(deq, byti + i, -1);
+		if (b < 0x20 || b >= 0x7f) break;
+	}
+
+	return i;
+}
+
 #define TMutf8	var
 #define TMany	var
 
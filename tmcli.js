@@ -0,0 +1,149 @@
+/* Copyright 2023 Google LLC
+ *
+ * Use of this source code is governed by a BSD-style
+ * license that can be found in the LICENSE file or at
+ * https://developers.google.com/open-source/licenses/bsd */
+
+/* Feeds the terminal t with what the server sends, for main.js and for wrkr.js
+ * when the terminal runs in a worker. Both define t and topr, and term4cli to
+ * set up a terminal made from a state the server sent. */
+
+var stgen = 0, stbase;
+
+/* Output from the server is queued in the ring inq, and written to the terminal
+   later in slices of up to INQSLICE bytes, for at most INQFRAMEMS at a time, so
+   a flood does not block input and a burst of messages is drawn once. inqhd is
+   the index of the first byte, and inqn the number queued. */
+#define INQSLICE	0x4000
+#define INQFRAMEMS	8
+
+var inq = new Uint8Array(0x10000), inqhd = 0, inqn = 0;
+
+function inqgrow(need)
+{
+	var n, cap = inq.length, tl;
+
+	if (inqn + need <= cap) return;
+	while (cap < inqn + need) cap *= 2;
+
+	n = new Uint8Array(cap);
+	tl = Math.min(inqn, inq.length - inqhd);
+	n.set(inq.subarray(inqhd, inqhd + tl));
+	n.set(inq.subarray(0, inqn - tl), tl);
+	inq = n;
+	inqhd = 0;
+}
+
+function inqput(b)
+{
+	var i, tl;
+
+	inqgrow(b.length);
+	i = (inqhd + inqn) & (inq.length - 1);
+	tl = Math.min(b.length, inq.length - i);
+	inq.set(b.subarray(0, tl), i);
+	inq.set(b.subarray(tl), 0);
+	inqn += b.length;
+}
+
+function inqputbyt(c)
+{
+	inqgrow(1);
+	inq[(inqhd + inqn++) & (inq.length - 1)] = c;
+}
+
+function inqat(i) { return inq[(inqhd + i) & (inq.length - 1)]; }
+
+/* Returns how many of the first max queued bytes can be written, stopping short
+   of a UTF-8 sequence that is cut off, which twrite would drop. */
+function inqcut(max)
+{
+	var n = Math.min(max, inqn), i, lead, need;
+
+	if (n < inqn) {
+		for (i = 0; i < 3 && 0x80 == (inqat(n) & 0xc0); i++) n--;
+		return n;
+	}
+
+	for (i = 1; i <= 3 && i <= n; i++) {
+		lead = inqat(n - i);
+		if (0x80 == (lead & 0xc0)) continue;
+
+		need =	lead >= 0xf0 ? 4 :
+			lead >= 0xe0 ? 3 :
+			lead >= 0xc0 ? 2 : 1;
+		if (need > i) n -= i;
+		break;
+	}
+
+	return n;
+}
+
+/* Moves the first n queued bytes to the Uint8Array dst. */
+function inqtake(dst, n)
+{
+	var tl = Math.min(n, inq.length - inqhd);
+
+	dst.set(inq.subarray(inqhd, inqhd + tl));
+	dst.set(inq.subarray(0, n - tl), tl);
+	inqhd = (inqhd + n) & (inq.length - 1);
+	inqn -= n;
+}
+
+/* Writes up to max queued bytes to the terminal, as inqcut allows. Returns the
+   number of bytes written. */
+function inqshow(max)
+{
+	var n = inqcut(max), i;
+
+	for (i = 0; i < n; i++) topr = deqpushbyt(topr, inqat(i));
+	inqhd = (inqhd + n) & (inq.length - 1);
+	inqn -= n;
+
+	if (n) {
+		twrite(t, topr, -1, 0);
+		deqclear(topr);
+	}
+
+	return n;
+}
+
+/* Loads the terminal state sent by tmstate4cli in session.c, which is a snapshot
+   or a delta against stbase, the unmodified copy of the last state loaded. */
+function loadstate(b)
+{
+	var w = new Int32Array(b.slice().buffer), i, si, fct;
+
+	if (w[0] != 1) {
+		console.warn('unknown state format', w[0]);
+		return;
+	}
+	if (w[2] && (w[2] >>> 0 != stgen || !stbase)) {
+		console.warn('state delta against unknown generation', w[2]);
+		return;
+	}
+
+	if (!w[2]) stbase = [];
+	stbase.length = w[3];
+	for (i = 6; i < w.length; ) {
+		si	= w[i++];
+		fct	= w[i++];
+		if (fct < 0) { stbase[si] = fct; continue; }
+
+		stbase[si] = w.slice(i, i + fct);
+		i += fct;
+	}
+
+	stgen		= w[1] >>> 0;
+	bufsa		= stbase.map(function(a)
+	{
+		return typeof a == 'object' ? a.slice() : a;
+	});
+	bufsfreehead	= w[4];
+	t		= w[5];
+	term4cli();
+	topr		= deqmk();
+
+	/* The server does not keep dirty flags for us */
+	tfulldirt(t);
+}
@@ -0,0 +1,222 @@
+/* Copyright 2023 Google LLC
+ *
+ * Use of this source code is governed by a BSD-style
+ * license that can be found in the LICENSE file or at
+ * https://developers.google.com/open-source/licenses/bsd */
+
+/* The C build of the terminal engine for wasm32-wasi, which ./build makes into
+ * tm.wasm if it finds a compiler for it. wrkr.js runs it in place of tm.js,
+ * so tmobjs lives in linear memory and a state from the server is loaded with
+ * a memcpy for each object. wrkr.js calls the wt_* exports, and gives the X*
+ * callbacks that matter to the worker as imports of the "werm" module. */
+
+#include "tm.c"
+#include "third_party/st/plat.h"
+#include "third_party/st/tmeng"
+
+#include <time.h>
+
+#define WTEXPORT(nm) __attribute__((export_name(#nm)))
+#define WTIMPORT(nm) __attribute__((import_module("werm"), import_name(#nm)))
+
+/* Copies the base-64 text at b64, which is null terminated, to the clipboard */
+WTIMPORT(osc52copy) void wtosc52copy(const char *b64);
+
+void Xosc52copy(TMint trm, TMint deq, TMint byti)
+{
+	wtosc52copy(deqtostring(deq, byti));
+}
+
+/* The worker does not draw */
+void Xsetcolor(int trm, int pi, int rgb)				{}
+void Xicontitl(TMint deq, TMint off)					{}
+void Xsettitle(TMint deq, TMint off)					{}
+void Xbell(int trm)							{}
+void Xsetpointermotion(int set)						{}
+void Xdrawglyph(int trm, int gf, int x, int y)				{}
+void Xdrawrect(TMint clor, TMint x0, TMint y0, TMint w, TMint h)	{}
+void Xdrawline(TMint trm, int x1, int y1, int x2)			{}
+void Xfinishdraw(TMint trm)						{}
+void Xximspot(TMint trm, int cx, int cy)				{}
+void Xprint(TMint deq)							{}
+void Ttywriteraw(int trm, int dq, int of, int sz)			{}
+
+void Now(int ms)
+{
+	struct timespec ts;
+	long long n;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	n = ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+	fld(ms,0) = n >> 31;
+	fld(ms,1) = n & 0x7fffffff;
+}
+
+static TMint wtt, wtdeq;
+
+/* Bytes passed in by wrkr.js, for wt_write and wt_loadstate */
+static struct {
+	char *b;
+	size_t cap;
+} wtin;
+
+/* Returns where wrkr.js should put the n bytes it passes next. */
+WTEXPORT(wt_inbuf) char *wt_inbuf(size_t n)
+{
+	if (n > wtin.cap) {
+		wtin.b = realloc(wtin.b, n);
+		if (!wtin.b) sriously("cannot grow input to %zu bytes", n);
+		wtin.cap = n;
+	}
+
+	return wtin.b;
+}
+
+static void wtterm4cli(void) { term(wtt,noresponse) = 1; }
+
+WTEXPORT(wt_init) void wt_init(int col, int row)
+{
+	wtt = term_new();
+	tnew(wtt, col, row);
+	wtterm4cli();
+}
+
+WTEXPORT(wt_resize) void wt_resize(int col, int row)
+{
+	tresize(wtt, col, row);
+	tfulldirt(wtt);
+}
+
+/* Writes the first n bytes of the input to the terminal. They must not end in
+   the middle of a UTF-8 sequence. */
+WTEXPORT(wt_write) void wt_write(size_t n)
+{
+	wtdeq = deqsetutf8(wtdeq, wtin.b, n);
+	twrite(wtt, wtdeq, -1, 0);
+
+	/* Nothing here keeps the scrollback, but a state from the server might
+	   have a buffer for it. */
+	if (term(wtt,sbbuf)) deqclear(term(wtt,sbbuf));
+}
+
+/* Objects of the last state loaded, as sent, so deltas can be applied to it. */
+static struct {
+	uint32_t gen;
+	int32_t capac, fh, t, *fct, **fs;
+} wtst;
+
+/* Loads the state in the first n bytes of the input, which is a snapshot or a
+   delta against the last state loaded, as made by tmstate4cli in session.c.
+   Returns the generation of the state, or 0 if it could not be loaded. */
+WTEXPORT(wt_loadstate) uint32_t wt_loadstate(size_t n)
+{
+	int32_t *w = (int32_t *) wtin.b, *e = w + n / 4, si;
+	struct tmobj *o;
+
+	if (n < 24 || w[0] != 1) {
+		tmlog("unknown state format %d", n < 4 ? -1 : w[0]);
+		return 0;
+	}
+	if (w[2] && (uint32_t) w[2] != wtst.gen) {
+		tmlog("state delta against unknown generation %u", w[2]);
+		return 0;
+	}
+
+	wtst.fct = realloc(wtst.fct, w[3] * sizeof(*wtst.fct));
+	wtst.fs = realloc(wtst.fs, w[3] * sizeof(*wtst.fs));
+	if (!wtst.fct || !wtst.fs) sriously("cannot grow state to %d", w[3]);
+	for (si = wtst.capac; si < w[3]; si++) wtst.fs[si] = 0;
+	wtst.capac = w[3];
+	wtst.gen = w[1];
+	wtst.fh = w[4];
+	wtst.t = w[5];
+
+	for (w += 6; w < e; ) {
+		si = *w++;
+		wtst.fct[si] = *w++;
+		free(wtst.fs[si]);
+		wtst.fs[si] = 0;
+		if (wtst.fct[si] < 0) continue;
+
+		wtst.fs[si] = malloc(wtst.fct[si] * sizeof(int32_t));
+		memcpy(wtst.fs[si], w, wtst.fct[si] * sizeof(int32_t));
+		w += wtst.fct[si];
+	}
+
+	tmheapfre();
+	tmobjs.objel = calloc(wtst.capac, sizeof(*tmobjs.objel));
+	tmobjs.capac = wtst.capac;
+	tmobjs.bufsfreehead = wtst.fh;
+	for (si = 0; si < wtst.capac; si++) {
+		o = tmobjs.objel + si;
+		o->fct = wtst.fct[si];
+		if (o->fct < 0) continue;
+
+		o->fs = tmblkget(o->fct);
+		memcpy(o->fs, wtst.fs[si], o->fct * sizeof(int32_t));
+		tmst.objs++;
+		tmst.fldbytes += o->fct * sizeof(int32_t);
+	}
+
+	wtt = wtst.t;
+	wtdeq = 0;
+	wtterm4cli();
+	tfulldirt(wtt);
+
+	return wtst.gen;
+}
+
+/* The last update made by wt_dmg */
+static struct {
+	int32_t *w;
+	size_t n, cap;
+	int32_t palt[PALETTESIZ];
+	int paltsent;
+} wtdmg;
+
+static void wtdmgput(const int32_t *v, size_t n)
+{
+	if (wtdmg.n + n > wtdmg.cap) {
+		while (wtdmg.n + n > wtdmg.cap)
+			wtdmg.cap = wtdmg.cap ? wtdmg.cap * 2 : 1024;
+		wtdmg.w = realloc(wtdmg.w, wtdmg.cap * sizeof(*wtdmg.w));
+		if (!wtdmg.w) sriously("cannot grow update to %zu", wtdmg.cap);
+	}
+
+	memcpy(wtdmg.w + wtdmg.n, v, n * sizeof(*v));
+	wtdmg.n += n;
+}
+
+/* Makes a damage mode update, as loaddmg in main.js reads it, with the rows
+   and palette entries changed since the last one. Returns where it is, and
+   wt_dmglen its length in words. */
+WTEXPORT(wt_dmg) int32_t *wt_dmg(void)
+{
+	int32_t *pal = &fld(term(wtt,palt), 0), y, row = term(wtt,row),
+		col = term(wtt,col);
+
+	wtdmg.n = 0;
+	wtdmgput((int32_t[]){	row, col,
+				curs_x(term(wtt,curs)), curs_y(term(wtt,curs)),
+				term(wtt,mode), term(wtt,cursor)}, 6);
+
+	if (!wtdmg.paltsent || memcmp(wtdmg.palt, pal, sizeof(wtdmg.palt))) {
+		memcpy(wtdmg.palt, pal, sizeof(wtdmg.palt));
+		wtdmg.paltsent = 1;
+		wtdmgput((int32_t[]){-1, 0, PALETTESIZ}, 3);
+		wtdmgput(pal, PALETTESIZ);
+	}
+
+	for (y = 0; y < row; y++) {
+		if (!fld(term(wtt,dirty), y)) continue;
+		fld(term(wtt,dirty), y) = 0;
+
+		wtdmgput((int32_t[]){y, 0, col}, 3);
+		wtdmgput(&fld(term(wtt,scr), term_cellf(wtt, y, 0)),
+			 col * GLYPH_ELCNT);
+	}
+
+	return wtdmg.w;
+}
+
+WTEXPORT(wt_dmglen) size_t wt_dmglen(void) { return wtdmg.n; }
@@ -0,0 +1,358 @@
+/* Copyright 2024 Google LLC
+ *
+ * Use of this source code is governed by a BSD-style
+ * license that can be found in the LICENSE file or at
+ * https://developers.google.com/open-source/licenses/bsd */
+
+/* Glyphs rasterised with libschrift from the TrueType font at $WERMTTF, which
+ * the client draws for code points its bitmap font lacks. Each glyph is made
+ * for the size of the client's cells, and kept in an LRU cache in this process
+ * and in a file under state_dir()/glyphs, so other processes and later runs
+ * need not rasterise it again. */
+
+#include <dirent.h>
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "http.h"
+#include "shared.h"
+#include "ttf.h"
+#include "third_party/libschrift/schrift.h"
+
+/* Glyphs kept in memory */
+#define TTFCACHEMAX 4096
+
+#define TTFHASHSZ 1024
+
+struct ttfgl {
+	struct ttfgl *hnext, *newer, *older;
+
+	/* cop has the wide bit at 1 << 23, as in the glyph list of a
+	   .wermfont. */
+	int w, h, cop;
+
+	/* Bytes of the bitmap at b, or -1 if the font has no glyph for cop. */
+	int sz;
+	unsigned char b[];
+};
+
+static int sftrender(unsigned char *bits, int cw, int h, int cop);
+
+static struct {
+	/* Whether $WERMTTF was read yet, and if it loaded */
+	unsigned tried : 1, ok : 1;
+
+	void *fdat;
+	SFT_Font *font;
+
+	/* Writes the bits of cop to bits, which is zeroed, and returns 1, or
+	   returns 0 if the font has no glyph for it. */
+	int (*render)(unsigned char *bits, int cw, int h, int cop);
+
+	/* Where the glyphs are kept on disk, which is named after the hash of
+	   the font so changing it does not reuse its old glyphs. */
+	char *dir;
+
+	struct ttfgl *hash[TTFHASHSZ], *newest, *oldest;
+	int cnt, max;
+} ttf = {.render = sftrender, .max = TTFCACHEMAX};
+
+static int ttfload(void)
+{
+	const char *pth = getenv("WERMTTF");
+	struct stat sb;
+	char etag[17], *gd;
+	ssize_t got = -1;
+	int fd;
+
+	if (ttf.tried) return ttf.ok;
+	ttf.tried = 1;
+	if (!pth || !*pth) return 0;
+
+	fd = open(pth, O_RDONLY);
+	if (0 <= fd && !fstat(fd, &sb)) {
+		ttf.fdat = malloc(sb.st_size ? sb.st_size : 1);
+		got = read(fd, ttf.fdat, sb.st_size);
+	}
+	if (0 <= fd) close(fd);
+	if (got < 0 || got != sb.st_size) {
+		warn("cannot read TrueType font %s", pth);
+		return 0;
+	}
+
+	ttf.font = sft_loadmem(ttf.fdat, got);
+	if (!ttf.font) {
+		warnx("cannot load TrueType font %s", pth);
+		return 0;
+	}
+
+	xasprintf(&gd, "%s/glyphs", state_dir());
+	if (mkdir(gd, 0700) && errno != EEXIST) warn("cannot create %s", gd);
+	resp_etag(etag, ttf.fdat, got);
+	xasprintf(&ttf.dir, "%s/%s", gd, etag);
+	free(gd);
+
+	ttf.ok = 1;
+	return 1;
+}
+
+static int sftrender(unsigned char *bits, int cw, int h, int cop)
+{
+	SFT sf = {ttf.font, h, h, 0, 0, SFT_DOWNWARD_Y};
+	SFT_LMetrics lm;
+	SFT_GMetrics gm;
+	SFT_Glyph g;
+	SFT_Image im;
+	unsigned char *px;
+	int x, y, x0, y0, bit;
+
+	if (0 > sft_lookup(&sf, cop, &g) || !g)	return 0;
+	if (0 > sft_lmetrics(&sf, &lm))		return 0;
+
+	/* Scale the font so a line is as tall as the cell, then the glyph so it
+	   is no wider than the cell. */
+	sf.xScale = sf.yScale = h * h / (lm.ascender - lm.descender);
+	if (0 > sft_lmetrics(&sf, &lm))		return 0;
+	if (0 > sft_gmetrics(&sf, g, &gm))	return 0;
+	if (gm.advanceWidth > cw) {
+		sf.xScale *= cw / gm.advanceWidth;
+		if (0 > sft_gmetrics(&sf, g, &gm)) return 0;
+	}
+
+	if (!gm.minWidth || !gm.minHeight) return 1;
+
+	im.width = gm.minWidth;
+	im.height = gm.minHeight;
+	im.pixels = px = calloc(im.width, im.height);
+	if (0 > sft_render(&sf, g, im)) {
+		free(px);
+		return 0;
+	}
+
+	/* The font has shades of gray, but the atlas has only one bit. */
+	x0 = lround((cw - gm.advanceWidth) / 2 + gm.leftSideBearing);
+	y0 = lround(lm.ascender) + gm.yOffset;
+	for (y = 0; y < im.height; y++) {
+		if (y0 + y < 0 || y0 + y >= h) continue;
+		for (x = 0; x < im.width; x++) {
+			if (x0 + x < 0 || x0 + x >= cw)		continue;
+			if (px[y * im.width + x] < 0x60)	continue;
+
+			bit = (y0 + y) * cw + x0 + x;
+			bits[bit >> 3] |= 0x80 >> (bit & 7);
+		}
+	}
+
+	free(px);
+	return 1;
+}
+
+static struct ttfgl **ttfslot(int w, int h, int cop)
+{
+	return ttf.hash + ((unsigned) cop * 31 + w * 7 + h) % TTFHASHSZ;
+}
+
+static struct ttfgl *ttffind(int w, int h, int cop)
+{
+	struct ttfgl *g = *ttfslot(w, h, cop);
+
+	while (g && (g->w != w || g->h != h || g->cop != cop)) g = g->hnext;
+	return g;
+}
+
+static void ttfunlink(struct ttfgl *g)
+{
+	if (g->newer)	g->newer->older = g->older;
+	else		ttf.newest = g->older;
+	if (g->older)	g->older->newer = g->newer;
+	else		ttf.oldest = g->newer;
+}
+
+static void ttfmknewest(struct ttfgl *g)
+{
+	g->newer = 0;
+	g->older = ttf.newest;
+	if (ttf.newest)	ttf.newest->newer = g;
+	else		ttf.oldest = g;
+	ttf.newest = g;
+}
+
+static void ttfevict(void)
+{
+	struct ttfgl *g = ttf.oldest, **s = ttfslot(g->w, g->h, g->cop);
+
+	while (*s != g) s = &(*s)->hnext;
+	*s = g->hnext;
+	ttfunlink(g);
+	free(g);
+	ttf.cnt--;
+}
+
+static char *ttfpath(const struct ttfgl *g)
+{
+	char *p;
+
+	xasprintf(&p, "%s/%dx%d/%x", ttf.dir, g->w, g->h, g->cop);
+	return p;
+}
+
+/* Reads the glyph from disk, where an empty file means the font has none.
+   Returns 0 if it is not there. */
+static int ttfread(struct ttfgl *g, int sz)
+{
+	char *p = ttfpath(g);
+	int fd = open(p, O_RDONLY), got;
+
+	free(p);
+	if (0 > fd) return 0;
+	got = read(fd, g->b, sz + 1);
+	close(fd);
+
+	if (got == sz)	g->sz = sz;
+	else if (!got)	g->sz = -1;
+	else		return 0;
+
+	return 1;
+}
+
+/* Writes the glyph to disk, replacing any file which is there so a reader
+   never sees half of one. */
+static void ttfsave(const struct ttfgl *g)
+{
+	char *d, *p, *tp;
+	int fd;
+
+	xasprintf(&d, "%s/%dx%d", ttf.dir, g->w, g->h);
+	if (mkdir(ttf.dir, 0700) && errno != EEXIST) goto cleanup;
+	if (mkdir(d, 0700) && errno != EEXIST) goto cleanup;
+
+	p = ttfpath(g);
+	xasprintf(&tp, "%s.%lld", p, (long long) getpid());
+	fd = open(tp, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if (	0 > fd
+	||	(g->sz > 0 && g->sz != write(fd, g->b, g->sz))
+	||	close(fd)
+	||	rename(tp, p)
+	) {
+		warn("cannot save glyph to %s", tp);
+		unlink(tp);
+	}
+	free(tp);
+	free(p);
+
+cleanup:
+	free(d);
+}
+
+int ttf_glyph(struct fdbuf *b, int w, int h, int cop, int wide)
+{
+	struct ttfgl *g, **s;
+	int sz;
+
+	if (!ttfload()) return -1;
+
+	cop |= wide << 23;
+	g = ttffind(w, h, cop);
+	if (g) {
+		ttfunlink(g);
+		goto found;
+	}
+
+	sz = ((w << wide) * h + 7) / 8;
+	g = calloc(1, sizeof(*g) + sz + 1);
+	g->w = w;
+	g->h = h;
+	g->cop = cop;
+	if (!ttfread(g, sz)) {
+		memset(g->b, 0, sz);
+		g->sz = ttf.render(g->b, w << wide, h, cop & 0x7fffff) ? sz : -1;
+		ttfsave(g);
+	}
+
+	if (ttf.cnt >= ttf.max) ttfevict();
+	s = ttfslot(w, h, cop);
+	g->hnext = *s;
+	*s = g;
+	ttf.cnt++;
+
+found:
+	ttfmknewest(g);
+	if (g->sz < 0) return 0;
+	fdb_apnd(b, g->b, g->sz);
+	return 1;
+}
+
+static int tstrenders;
+
+static int tstrender(unsigned char *bits, int cw, int h, int cop)
+{
+	tstrenders++;
+	if (!(cop % 3)) return 0;
+
+	bits[0] = cop;
+	bits[(cw * h - 1) / 8] |= 1;
+	return 1;
+}
+
+void test_ttf(void)
+{
+	static const int cops[][2] = {
+		{'A', 0}, {0x4e01, 1}, {0x3000, 0}, {'A', 0}, {0x3000, 0},
+		{0x4e01, 1}, {'A', 1},
+	};
+	char dir[] = "/tmp/wermttf.XXXXXX", *p, *sd;
+	struct fdbuf b = {0};
+	struct dirent *de;
+	DIR *dd;
+	int i, r;
+
+	printf("TEST TTF\n");
+
+	ttf.tried = 1;
+	printf("no font: %d\n", ttf_glyph(&b, 8, 16, 'A', 0));
+
+	if (!mkdtemp(dir)) err(1, "mkdtemp");
+	ttf.ok = 1;
+	ttf.render = tstrender;
+	ttf.dir = dir;
+	ttf.max = 2;
+
+	for (i = 0; i < sizeof(cops) / sizeof(*cops); i++) {
+		tstrenders = 0;
+		b.len = 0;
+		r = ttf_glyph(&b, 8, 16, cops[i][0], cops[i][1]);
+		printf("%x wide=%d: %d, %u bytes, first=%02x last=%02x, "
+		       "rendered=%d, cached=%d\n",
+		       cops[i][0], cops[i][1], r, b.len,
+		       b.len ? b.bf[0] : 0, b.len ? b.bf[b.len - 1] : 0,
+		       tstrenders, ttf.cnt);
+	}
+
+	while (ttf.oldest) ttfevict();
+
+	xasprintf(&sd, "%s/8x16", dir);
+	dd = opendir(sd);
+	while (dd && (de = readdir(dd))) {
+		if (*de->d_name == '.') continue;
+		xasprintf(&p, "%s/%s", sd, de->d_name);
+		unlink(p);
+		free(p);
+	}
+	if (dd) closedir(dd);
+	rmdir(sd);
+	free(sd);
+	rmdir(dir);
+
+	ttf.tried = ttf.ok = 0;
+	ttf.render = sftrender;
+	ttf.dir = 0;
+	ttf.max = TTFCACHEMAX;
+	fdb_finsh(&b);
+}
@@ -0,0 +1,17 @@
+/* Copyright 2024 Google LLC
+ *
+ * Use of this source code is governed by a BSD-style
+ * license that can be found in the LICENSE file or at
+ * https://developers.google.com/open-source/licenses/bsd */
+
+#include "outstreams.h"
+
+/* Appends to b the glyph of code point cop rasterised from the TrueType font at
+   $WERMTTF, to fill a cell w pixels wide, or twice that if wide is set, and h
+   pixels tall. This is the cell's rows of bits, most significant first, padded
+   to a whole byte at the end, like the pages of a .wermfont (see procfnt in
+   ./build). Returns 1 if it appended the glyph, 0 if the font has no glyph for
+   cop, or -1 if there is no font. */
+int ttf_glyph(struct fdbuf *b, int w, int h, int cop, int wide);
+
+void test_ttf(void);
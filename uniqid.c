@@ -5,15 +5,24 @@
  * https://developers.google.com/open-source/licenses/bsd */
 
 #include <errno.h>
+#include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <sys/file.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <dirent.h>
 #include <string.h>
+#include <unistd.h>
 
 #include "shared.h"
 
+/* The last ID handed out is kept in this file under state_dir(), which is
+   locked while it is incremented. */
+#define IDFILE "nextterid"
+
+/* It used to be the name of a file after this prefix, which meant listing
+   state_dir() for each ID. */
 #define STATEPREF "nextterid."
 #define PREFLEN (sizeof(STATEPREF) - 1)
 
@@ -49,24 +58,22 @@ static char *increm(const char *cnm)
 	}
 }
 
-struct pckd {
-	char *next, *oldpath;
-};
-
-static void pickcand(struct pckd *c)
+/* Returns the next ID after the one in the name of a file of the old scheme,
+   and removes the file, or returns 0 if there is none. This is only done when
+   IDFILE is empty, so the IDs carry on from where they were. */
+static char *nextofold(void)
 {
 	DIR *sdfd;
 	struct dirent *sdde;
+	char *next = 0, *oldpath;
 
 	sdfd = opendir(state_dir());
 	if (!sdfd) { perror("opendir"); abort(); }
 
-	c->next = 0;
-	c->oldpath = 0;
 	while (errno = 0, sdde = readdir(sdfd)) {
 		if (strncmp(sdde->d_name, STATEPREF, PREFLEN)) continue;
 
-		if (c->oldpath) {
+		if (next) {
 			fprintf(stderr,
 				"There is more than one file named %s/%s*!"
 				" Delete the extra ones.\n",
@@ -74,47 +81,53 @@ static void pickcand(struct pckd *c)
 			abort();
 		}
 
-		xasprintf(&c->oldpath, "%s/%s", state_dir(), sdde->d_name);
-		c->next = increm(sdde->d_name + PREFLEN);
+		next = increm(sdde->d_name + PREFLEN);
+		xasprintf(&oldpath, "%s/%s", state_dir(), sdde->d_name);
+		if (0 > unlink(oldpath)) perror("unlink old ID file");
+		free(oldpath);
 	}
 	if (errno) { perror("readdir"); abort(); }
 
-	if (!c->oldpath) {
-		fprintf(stderr,
-			"did not find curr ID file %s/%s*; will create\n",
-			state_dir(), STATEPREF);
-		c->next = strdup("a");
-	}
-
 	closedir(sdfd);
+	return next;
 }
 
 char *next_uniqid(void)
 {
-	char *newpath;
-	struct pckd c;
-	char er;
-	int raceno;
-
-	pickcand(&c);
-
-	asprintf(&newpath, "%s/%s%s", state_dir(), STATEPREF, c.next);
-	if (c.oldpath) {
-		er = 0 > rename(c.oldpath, newpath);
-		raceno = ENOENT;
-	}
-	else {
-		er = 0 > mknod(newpath, S_IFREG | 0644, 0);
-		raceno = EEXIST;
+	char *path, *next, last[64];
+	ssize_t got;
+	size_t len;
+	int fd;
+
+	xasprintf(&path, "%s/%s", state_dir(), IDFILE);
+	fd = open(path, O_RDWR | O_CREAT, 0644);
+	if (0 > fd) { perror("open ID file"); abort(); }
+
+	/* Concurrent spawners wait here, so each reads the ID the last one
+	   wrote. */
+	if (0 > flock(fd, LOCK_EX)) { perror("flock ID file"); abort(); }
+
+	got = pread(fd, last, sizeof(last) - 1, 0);
+	if (0 > got) { perror("read ID file"); abort(); }
+	last[got] = 0;
+	last[strcspn(last, "\n")] = 0;
+
+	if (*last)			next = increm(last);
+	else if (!(next = nextofold())) {
+		fprintf(stderr, "did not find ID in %s; starting over\n", path);
+		next = strdup("a");
 	}
 
-	if (er) {
-		if (raceno != errno) { perror("mknod/rename"); abort(); }
-		free(c.next);
-		c.next = 0;
+	len = strlen(next);
+	next[len] = '\n';
+	if (	len + 1 != pwrite(fd, next, len + 1, 0)
+	||	0 > ftruncate(fd, len + 1)) {
+		perror("write ID file");
+		abort();
 	}
+	next[len] = 0;
 
-	free(c.oldpath);
-	free(newpath);
-	return c.next;
+	close(fd);
+	free(path);
+	return next;
 }
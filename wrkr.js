@@ -0,0 +1,272 @@
+/* Copyright 2023 Google LLC
+ *
+ * Use of this source code is governed by a BSD-style
+ * license that can be found in the LICENSE file or at
+ * https://developers.google.com/open-source/licenses/bsd */
+
+/* The terminal emulator of main.js when it runs in a worker, which it does if
+ * the page's URL has wrkr=1. main.js posts what the server sends to the worker,
+ * and the worker posts back damage mode updates (see loaddmg in main.js) with
+ * the rows that changed, so a flood of output never holds up typing. Messages
+ * from main.js are objects with one of these fields:
+ *
+ *	o	Uint8Array of terminal output
+ *	s	Uint8Array of a terminal state
+ *	rsz	[columns, rows] to resize the terminal to
+ *
+ * and those posted back have one of:
+ *
+ *	dmg	ArrayBuffer of a damage mode update
+ *	stgen	generation of the state last loaded, to reconnect with
+ *	osc52	base64 text an application copied
+ *
+ * If ./build made tm.wasm, the worker runs that C build of the engine (see
+ * tmwasm.c) rather than this copy of tm.js. */
+
+#include "tm.js"
+#include "third_party/st/tmeng"
+#include "tmcli.js"
+
+/* The engine calls these, but only the page draws or has a clipboard. */
+function Xsetcolor(trm, pi, rgb)		{}
+function Xicontitl(deq, off)			{}
+function Xsettitle(deq, off)			{}
+function Xbell(trm)				{}
+function Xsetpointermotion(set)			{}
+function Xprint(deq)				{}
+function Ttywriteraw(trm, dq, of, sz)		{}
+function Now(ms) { var n = Date.now(); fld(ms,0) = n / 0x80000000;
+				       fld(ms,1) = n & 0x7fffffff; }
+
+function Xosc52copy(trm, deq, byti)
+{
+	postMessage({osc52: deqtostring(deq, byti)});
+}
+
+var t, topr = deqmk(), sentpalt = new Int32Array(PALETTESIZ), passched = 0;
+
+function term4cli() { term(t,noresponse) = 1; }
+
+t = term_new();
+tnew(t, 80, 25);
+term4cli();
+
+/* Exports of tm.wasm, if it loaded */
+var wasm;
+
+/* Lines written by tm.wasm to stdout and stderr, until they are complete */
+var wasmlns = ['', '', ''];
+
+/* Makes the imports of tm.wasm: the X* callbacks that matter to the worker, and
+   what wasi-libc needs of WASI, with the calls it should never make failing
+   with ENOSYS. */
+function wasmimports(mod)
+{
+	var im = {werm: {}, wasi_snapshot_preview1: {}};
+
+	function mem() { return new DataView(wasm.memory.buffer); }
+
+	function wasmstr(p, n)
+	{
+		var b = new Uint8Array(wasm.memory.buffer, p);
+
+		if (n === undefined) n = b.indexOf(0);
+		return new TextDecoder().decode(b.slice(0, n));
+	}
+
+	im.werm.osc52copy = function(p) { postMessage({osc52: wasmstr(p)}); };
+
+	WebAssembly.Module.imports(mod).forEach(function(d)
+	{
+		if (d.module == 'wasi_snapshot_preview1')
+			im[d.module][d.name] = function() { return 52; };
+	});
+
+	Object.assign(im.wasi_snapshot_preview1, {
+	fd_write: function(fd, iovs, iovcnt, nwrp)
+	{
+		var i, p, n, tot = 0, lns;
+
+		for (i = 0; i < iovcnt; i++) {
+			p = mem().getUint32(iovs + i*8, true);
+			n = mem().getUint32(iovs + i*8 + 4, true);
+			if (fd == 1 || fd == 2) wasmlns[fd] += wasmstr(p, n);
+			tot += n;
+		}
+		mem().setUint32(nwrp, tot, true);
+
+		lns = wasmlns[fd].split('\n');
+		wasmlns[fd] = lns.pop();
+		lns.forEach(function(ln) { console.log('tm.wasm:', ln); });
+
+		return 0;
+	},
+	proc_exit: function(code) { throw new Error('tm.wasm exited: ' + code); },
+	clock_time_get: function(id, prec, tsp)
+	{
+		mem().setBigUint64(tsp, BigInt(Math.round(performance.now() * 1e6)),
+				   true);
+		return 0;
+	},
+	environ_sizes_get: function(cntp, szp)
+	{
+		mem().setUint32(cntp, 0, true);
+		mem().setUint32(szp, 0, true);
+		return 0;
+	},
+	environ_get: function() { return 0; },
+	});
+
+	return im;
+}
+
+/* Writes up to max queued bytes with tm.wasm, as inqshow does with tm.js. */
+function wasmshow(max)
+{
+	var n = inqcut(max);
+
+	if (!n) return 0;
+	inqtake(new Uint8Array(wasm.memory.buffer, wasm.wt_inbuf(n), n), n);
+	wasm.wt_write(n);
+
+	return n;
+}
+
+function show(max) { return wasm ? wasmshow(max) : inqshow(max); }
+
+/* Posts the cursor, mode and the rows and palette entries changed since the
+   last update. */
+function postdmg()
+{
+	var	row = term(t,row), col = term(t,col), dirt = term(t,dirty),
+		scr = jsobj(term(t,scr)), pal = jsobj(term(t,palt)),
+		rowlen = col * GLYPH_ELCNT, paltchg = 0, n = 6, y, i, i0, w;
+
+	if (wasm) {
+		w = new Int32Array(wasm.memory.buffer, wasm.wt_dmg(),
+				   wasm.wt_dmglen()).slice();
+		postMessage({dmg: w.buffer}, [w.buffer]);
+		return;
+	}
+
+	for (i = 0; i < PALETTESIZ; i++) if (pal[i] != sentpalt[i]) paltchg = 1;
+	if (paltchg) n += 3 + PALETTESIZ;
+	for (y = 0; y < row; y++) if (fld(dirt, y)) n += 3 + rowlen;
+
+	w = new Int32Array(n);
+	w[0] = row;
+	w[1] = col;
+	w[2] = curs_x(term(t,curs));
+	w[3] = curs_y(term(t,curs));
+	w[4] = term(t,mode);
+	w[5] = term(t,cursor);
+	i = 6;
+
+	if (paltchg) {
+		sentpalt.set(pal);
+		w[i++] = -1;
+		w[i++] = 0;
+		w[i++] = PALETTESIZ;
+		w.set(pal, i);
+		i += PALETTESIZ;
+	}
+
+	for (y = 0; y < row; y++) {
+		if (!fld(dirt, y)) continue;
+		fld(dirt, y) = 0;
+
+		w[i++] = y;
+		w[i++] = 0;
+		w[i++] = col;
+		i0 = term_cellf(t, y, 0);
+		w.set(scr.subarray(i0, i0 + rowlen), i);
+		i += rowlen;
+	}
+
+	postMessage({dmg: w.buffer}, [w.buffer]);
+}
+
+/* Writes output for up to INQFRAMEMS and posts the update, leaving the rest for
+   a timeout so resizes and states are not held up behind a flood. */
+function pass()
+{
+	var st = performance.now();
+
+	passched = 0;
+	while (show(INQSLICE)) {
+		if (performance.now() - st < INQFRAMEMS) continue;
+
+		if (inqn) passoon();
+		break;
+	}
+
+	postdmg();
+}
+
+function passoon()
+{
+	if (passched) return;
+	passched = 1;
+	setTimeout(pass, 0);
+}
+
+function gotmsg(m)
+{
+	var b;
+
+	if (m.o) {
+		inqput(m.o);
+		passoon();
+		return;
+	}
+
+	/* Apply the output which came before the message first. */
+	while (show(inqn)) {}
+
+	if (m.s && wasm) {
+		b = new Uint8Array(wasm.memory.buffer,
+				   wasm.wt_inbuf(m.s.length), m.s.length);
+		b.set(m.s);
+		postMessage({stgen: wasm.wt_loadstate(m.s.length) >>> 0});
+	} else if (m.s) {
+		loadstate(m.s);
+		postMessage({stgen: stgen});
+	} else if (m.rsz && wasm) {
+		wasm.wt_resize(m.rsz[0], m.rsz[1]);
+	} else if (m.rsz) {
+		tresize(t, m.rsz[0], m.rsz[1]);
+		tfulldirt(t);
+	}
+
+	postdmg();
+}
+
+/* Messages which come while tm.wasm loads wait for it. */
+var early = [];
+onmessage = function(e) { early.push(e.data); };
+
+fetch('/tm.wasm').then(function(r)
+{
+	if (!r.ok) throw 'HTTP status ' + r.status;
+	return r.arrayBuffer();
+}).then(function(ab)
+{
+	return WebAssembly.compile(ab);
+}).then(function(mod)
+{
+	return WebAssembly.instantiate(mod, wasmimports(mod));
+}).then(function(inst)
+{
+	wasm = inst.exports;
+	if (wasm._initialize) wasm._initialize();
+	wasm.wt_init(term(t,col), term(t,row));
+}).catch(function(er)
+{
+	wasm = null;
+	console.log('using tm.js, as tm.wasm did not load:', er);
+}).then(function()
+{
+	onmessage = function(e) { gotmsg(e.data); };
+	early.forEach(gotmsg);
+	early = null;
+});
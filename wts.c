@@ -46,6 +46,7 @@ void dump_wts(void)
 	fprintf(f, "ttl: (sz=%u)\n", ttl_len());
 	fprintf(f, "allowtmstate: %u\n", wts.allowtmstate);
 	logescaped(f, wts.ttl, ttl_len());
+	tmheapstats(f);
 
 	fclose(f);
 }
@@ -13,6 +13,12 @@ typedef struct {
 	   depending on value of escp */
 	unsigned altbufsz;
 	char winsize[8];
+	char genhex[8];
+	char fpsdig[4];
+	char wsparm[10];
+	char histhex[16];
+	char lathex[8];
+	char latrep[512];
 
 	int t;
 
@@ -21,6 +27,12 @@ typedef struct {
 	 * 'w': reading window size
 	 * 't': reading title into ttl
 	 * 'i': reading endpoint ID int client_state's endpnt
+	 * 'g': reading state generation into genhex
+	 * 'f': reading damage mode update rate into fpsdig
+	 * 'W': reading websocket settings into wsparm
+	 * 'y': reading a range of history lines into histhex
+	 * 'L': reading the ID of a traced key into lathex
+	 * 'l': reading a key latency report into latrep
 	 */
 	char escp;
 
@@ -37,7 +49,8 @@ typedef struct {
 	unsigned clnttl		: 1;
 
 	/* Logs (either text only, or raw subproc output) are written to these
-	 * fd's if writelg,writerawlg are 1. */
+	 * fd's if writelg,writerawlg are 1 and there is no log writer process,
+	 * as in tests. */
 	struct wrides logde, rawlogde;
 } Wts;
 